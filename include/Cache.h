@@ -1,106 +1,386 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
-#include <list>
-#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include "Assert.h"
 
 namespace Thorn {
-	template <typename K, typename V, template <typename...> typename M, typename E>
+	enum class Replacement {
+		/** Evicts the least recently used entry. */
+		LRU,
+		/** Adaptive Replacement Cache (Megiddo and Modha). Entries used once and entries used again are kept in
+		 *  separate LRU lists, and the keys most recently evicted from each list are remembered in a ghost list of
+		 *  their own. A miss on a ghost key shifts the balance between the lists towards the one it was evicted
+		 *  from, so the cache adapts to the workload, and a long scan only cycles through the list of entries used
+		 *  once while the ones used repeatedly stay put. */
+		ARC,
+	};
+
+	/** A fixed-capacity map that evicts entries to make room according to a replacement policy. Entries live in
+	 *  slabs and are linked into both a chained hash table and intrusive recency lists, so lookups, insertions,
+	 *  touches and evictions are all O(1). The cache itself allocates nothing once it has filled up, since evicted
+	 *  and erased nodes are reused, but a value type that owns heap memory still allocates whenever a value is
+	 *  assigned. Iteration only covers entries that hold values, from the most recently used to the least of each
+	 *  list in turn. */
+	template <typename K, typename V, typename H = std::hash<K>, Replacement R = Replacement::LRU>
 	class Cache {
-		private:
-			size_t maxSize{};
+		public:
+			using Key = K;
+			using Value = V;
+
+			struct Node {
+				K key {};
+				V value {};
+
+				private:
+					/** The next node in the same bucket, or in the free list. */
+					Node *next = nullptr;
+					Node *newer = nullptr;
+					Node *older = nullptr;
+					uint8_t list = 0;
+					/** Whether the entry has been used since it was inserted. */
+					bool referenced = false;
+					friend class Cache;
+			};
+
+			class Iterator {
+				public:
+					Iterator(Node *node_, Node *then_): node(node_? node_ : then_), then(node_? then_ : nullptr) {}
+					Node & operator*() const { return *node; }
+					Node * operator->() const { return node; }
+					Iterator & operator++() {
+						node = node->older;
+						if (!node) {
+							node = then;
+							then = nullptr;
+						}
+						return *this;
+					}
+					bool operator==(const Iterator &other) const { return node == other.node; }
+					bool operator!=(const Iterator &other) const { return node != other.node; }
 
-			// The void pointer here is actually a list iterator...
-			// I'm sorry.
-			M<K, std::pair<void *, V>, E> map;
-			using MapIterator = decltype(map)::iterator;
+				private:
+					Node *node;
+					/** Where to go once the current list runs out. */
+					Node *then;
+			};
 
-			std::list<MapIterator> list;
-			using ListIterator = decltype(list)::iterator;
+			/** Nodes are allocated this many at a time. */
+			constexpr static size_t SLAB_SIZE = 256;
 
-			static_assert(sizeof(void *) == sizeof(ListIterator));
+			Cache(size_t max_size): maxSize(max_size) {
+				assert(max_size != 0);
+				// Ghost keys are in the table too, and ARC remembers as many of them as it holds entries.
+				const size_t max_nodes = R == Replacement::ARC? 2 * maxSize : maxSize;
+				while ((size_t(1) << maxBucketBits) < max_nodes)
+					++maxBucketBits;
+				resize(maxBucketBits < INITIAL_BUCKET_BITS? maxBucketBits : INITIAL_BUCKET_BITS);
+			}
+
+			Cache(const Cache &) = delete;
+			Cache & operator=(const Cache &) = delete;
+
+			/** Returns the entry for a key, creating it if needed, and marks it used. The bool in the returned pair
+			 *  indicates whether a new entry was created. If the cache is full, the entry leastRecent() returns is
+			 *  evicted to make room, so callers that have to do something with evicted values should evict() it
+			 *  themselves first. */
+			std::pair<std::reference_wrapper<V>, bool> operator[](const K &key) {
+				Node *node = lookup(key);
+				if (node && isResident(*node)) {
+					touch(*node);
+					return {std::ref(node->value), false};
+				}
+
+				if (node) {
+					// A ghost key coming back means its list was evicted from too soon.
+					const bool frequent = node->list == FREQUENT_GHOSTS;
+					adapt(frequent);
+					if (full())
+						replace(frequent);
+					unlinkList(*node);
+					pushNewest(*node, FREQUENT);
+					node->referenced = true;
+					return {std::ref(node->value), true};
+				}
 
-			void ensureSpace(size_t count) {
-				while (map.size() + count > maxSize) {
-					map.erase(list.back());
-					list.pop_back();
+				if constexpr (R == Replacement::ARC) {
+					// Keeps the recent side to one cache's worth of keys and everything to two.
+					List &recent = lists[RECENT];
+					List &recent_ghosts = lists[RECENT_GHOSTS];
+					if (maxSize <= recent.count + recent_ghosts.count) {
+						if (recent_ghosts.count != 0)
+							release(*recent_ghosts.oldest);
+						else
+							release(*recent.oldest);
+					} else if (2 * maxSize <= nodeCount() && lists[FREQUENT_GHOSTS].count != 0) {
+						release(*lists[FREQUENT_GHOSTS].oldest);
+					}
 				}
+
+				if (full())
+					replace(false);
+
+				Node &new_node = allocate();
+				new_node.key = key;
+				link(new_node);
+				return {std::ref(new_node.value), true};
 			}
 
-			void moveFront(auto map_iter) {
-				auto &list_iter = *reinterpret_cast<ListIterator *>(&map_iter->second.first);
-				list.erase(list_iter);
-				list.push_front(map_iter);
-				list_iter = list.begin();
+			/** Returns the entry for a key without changing its recency, or nullptr if it isn't cached. */
+			Node * find(const K &key) const {
+				Node *node = lookup(key);
+				return node && isResident(*node)? node : nullptr;
 			}
 
-		public:
-			using Key = K;
-			using Value = V;
+			/** Marks an entry used. Under ARC, using an entry again after it's been used since it was inserted moves
+			 *  it to the list of entries used more than once. Using the most recently used entry of a list again
+			 *  changes nothing, so reading an entry piece by piece counts as one use. */
+			void touch(Node &node) {
+				if (!node.referenced) {
+					node.referenced = true;
+					refresh(node);
+					return;
+				}
 
-			Cache(size_t max_size): maxSize(max_size) {
-				assert(max_size != 0);
+				if (&node == lists[node.list].newest)
+					return;
+
+				unlinkList(node);
+				pushNewest(node, R == Replacement::ARC? FREQUENT : RECENT);
+			}
+
+			/** Moves an entry to the most recently used end of its list without counting it as a use. */
+			void refresh(Node &node) {
+				if (&node == lists[node.list].newest)
+					return;
+				const uint8_t list = node.list;
+				unlinkList(node);
+				pushNewest(node, list);
+			}
+
+			/** Drops an entry's value because it's being evicted. Under ARC, the key is remembered as a ghost. */
+			void evict(Node &node) {
+				if constexpr (R == Replacement::ARC) {
+					const uint8_t ghosts = node.list == RECENT? RECENT_GHOSTS : FREQUENT_GHOSTS;
+					unlinkList(node);
+					node.value = V();
+					pushNewest(node, ghosts);
+				} else {
+					release(node);
+				}
+			}
+
+			/** Forgets a key entirely, ghost or not. */
+			void erase(const K &key) {
+				if (Node *node = lookup(key))
+					release(*node);
 			}
 
-			std::pair<MapIterator, bool> emplace(const K &key, V value) {
-				if (auto iter = map.find(key); iter != map.end()) {
-					moveFront(iter);
-					iter->second.second = std::move(value);
-					return {iter, false};
+			/** Erases every key in [first, last). Only works with integral keys. */
+			void erase(const K &first, const K &last) {
+				if (last <= first)
+					return;
+
+				// Looking up every key in a huge range would take longer than checking every entry.
+				if (last - first <= nodeCount()) {
+					for (K key = first; key < last; ++key)
+						erase(key);
+					return;
 				}
 
-				ensureSpace(1);
-				auto [iter, inserted] = map.try_emplace(key, nullptr, std::move(value));
-				assert(inserted);
-				list.push_front(iter);
-				iter->second.first = std::bit_cast<void *>(list.begin());
-				return {iter, true};
+				for (List &list: lists)
+					for (Node *node = list.newest; node;) {
+						Node *older = node->older;
+						if (first <= node->key && node->key < last)
+							release(*node);
+						node = older;
+					}
+			}
+
+			void clear() {
+				for (List &list: lists)
+					while (list.newest)
+						release(*list.newest);
+				target = 0;
+			}
+
+			/** How many entries hold values. */
+			inline size_t size() const { return lists[RECENT].count + lists[FREQUENT].count; }
+			/** How many evicted keys are remembered. */
+			inline size_t ghosts() const { return lists[RECENT_GHOSTS].count + lists[FREQUENT_GHOSTS].count; }
+			/** How many entries ARC currently aims to keep among those used only once. */
+			inline size_t recentTarget() const { return target; }
+			inline size_t capacity() const { return maxSize; }
+			inline bool full() const { return maxSize <= size(); }
+			/** The entry that the next insertion into a full cache evicts. */
+			inline Node * leastRecent() const { return lists[victimList(false)].oldest; }
+			/** Bytes allocated for nodes and buckets, in use or not. */
+			inline size_t footprint() const {
+				return slabs.size() * SLAB_SIZE * sizeof(Node) + slabs.capacity() * sizeof(slabs[0])
+					+ buckets.capacity() * sizeof(Node *);
+			}
+
+			Iterator begin() const { return Iterator(lists[RECENT].newest, lists[FREQUENT].newest); }
+			Iterator end() const { return Iterator(nullptr, nullptr); }
+
+		private:
+			/** Entries used no more than once since they were inserted. LRU keeps everything here. */
+			constexpr static uint8_t RECENT = 0;
+			/** Entries used more than once. */
+			constexpr static uint8_t FREQUENT = 1;
+			constexpr static uint8_t RECENT_GHOSTS = 2;
+			constexpr static uint8_t FREQUENT_GHOSTS = 3;
+
+			constexpr static size_t INITIAL_BUCKET_BITS = 6;
+
+			struct List {
+				Node *newest = nullptr;
+				Node *oldest = nullptr;
+				size_t count = 0;
+			};
+
+			size_t maxSize;
+			std::vector<std::unique_ptr<Node[]>> slabs;
+			/** How many nodes of the last slab have been handed out. */
+			size_t slabUsed = SLAB_SIZE;
+			Node *freeList = nullptr;
+			std::vector<Node *> buckets;
+			size_t bucketBits = 0;
+			/** The table stops growing once it has at least as many buckets as the cache can have nodes. */
+			size_t maxBucketBits = 0;
+			List lists[4];
+			/** ARC's target for the size of the recent list. */
+			size_t target = 0;
+
+			static inline bool isResident(const Node &node) { return node.list == RECENT || node.list == FREQUENT; }
+
+			inline size_t nodeCount() const { return size() + ghosts(); }
+
+			inline size_t bucket(const K &key) const {
+				// Fibonacci hashing spreads out runs and strides of block numbers.
+				const uint64_t hash = static_cast<uint64_t>(H{}(key)) * 0x9e3779b97f4a7c15ul;
+				return bucketBits == 0? 0 : hash >> (64 - bucketBits);
+			}
+
+			/** Finds a key's node, ghost or not. */
+			Node * lookup(const K &key) const {
+				for (Node *node = buckets[bucket(key)]; node; node = node->next)
+					if (node->key == key)
+						return node;
+				return nullptr;
 			}
 
-			V & at(const K &key) {
-				if (auto iter = map.find(key); iter != map.end()) {
-					moveFront(iter);
-					return iter->second.second;
+			/** The list the next eviction takes from. */
+			inline uint8_t victimList(bool frequent_ghost_hit) const {
+				if constexpr (R == Replacement::ARC) {
+					const size_t recent = lists[RECENT].count;
+					if (recent != 0 && (target < recent || (frequent_ghost_hit && target == recent)
+					    || lists[FREQUENT].count == 0))
+						return RECENT;
+					return FREQUENT;
+				} else {
+					return RECENT;
 				}
+			}
 
-				assert(!"Key is present in Cache");
+			/** Evicts an entry to make room for another. */
+			void replace(bool frequent_ghost_hit) {
+				if (Node *node = lists[victimList(frequent_ghost_hit)].oldest)
+					evict(*node);
 			}
 
-			const V & at(const K &key) const {
-				return map.at(key);
+			/** Moves ARC's target towards the list a returning ghost key was evicted from. */
+			void adapt(bool frequent) {
+				const size_t recent_ghosts = lists[RECENT_GHOSTS].count;
+				const size_t frequent_ghosts = lists[FREQUENT_GHOSTS].count;
+				if (frequent) {
+					const size_t step = recent_ghosts <= frequent_ghosts? 1 : recent_ghosts / frequent_ghosts;
+					target -= target < step? target : step;
+				} else {
+					const size_t step = frequent_ghosts <= recent_ghosts? 1 : frequent_ghosts / recent_ghosts;
+					target = maxSize - target < step? maxSize : target + step;
+				}
 			}
 
-			/** The bool in the returned pair indicates whether a new entry was created. */
-			std::pair<std::reference_wrapper<V>, bool> operator[](const K &key) {
-				if (auto iter = map.find(key); iter != map.end()) {
-					moveFront(iter);
-					return {std::ref(iter->second.second), false};
+			/** Takes a node off the free list or a slab. The node's value is always default-constructed. */
+			Node & allocate() {
+				if (freeList) {
+					Node &node = *freeList;
+					freeList = node.next;
+					return node;
+				}
+
+				if (slabUsed == SLAB_SIZE) {
+					slabs.emplace_back(new Node[SLAB_SIZE]);
+					slabUsed = 0;
 				}
 
-				auto [iter, inserted] = emplace(key, V());
-				return {std::ref(iter->second.second), true};
+				return slabs.back()[slabUsed++];
 			}
 
-			void erase(const K &key) {
-				auto iter = map.find(key);
-				if (iter == map.end())
-					return;
+			/** Unlinks an entry and puts it on the free list. */
+			void release(Node &node) {
+				unlinkHash(node);
+				unlinkList(node);
+				node.value = V();
+				node.next = freeList;
+				freeList = &node;
+			}
 
-				list.erase(iter->second.first);
-				map.erase(iter);
+			void link(Node &node) {
+				if (bucketBits < maxBucketBits && (size_t(1) << bucketBits) <= nodeCount())
+					resize(bucketBits + 1);
+				Node *&head = buckets[bucket(node.key)];
+				node.next = head;
+				head = &node;
+				node.referenced = false;
+				pushNewest(node, RECENT);
 			}
 
-			auto begin() { return map.begin(); }
-			auto end() { return map.end(); }
-			auto begin() const { return map.begin(); }
-			auto end() const { return map.end(); }
-	};
+			void unlinkHash(Node &node) {
+				for (Node **link = &buckets[bucket(node.key)]; *link; link = &(*link)->next)
+					if (*link == &node) {
+						*link = node.next;
+						node.next = nullptr;
+						return;
+					}
+			}
 
-	template <typename K, typename V, typename C = std::less<K>>
-	using TreeCache = Cache<K, V, std::map, C>;
+			void pushNewest(Node &node, uint8_t list_index) {
+				List &list = lists[list_index];
+				node.list = list_index;
+				node.newer = nullptr;
+				node.older = list.newest;
+				if (list.newest)
+					list.newest->newer = &node;
+				list.newest = &node;
+				if (!list.oldest)
+					list.oldest = &node;
+				++list.count;
+			}
 
-	template <typename K, typename V, typename H = std::hash<K>>
-	using HashCache = Cache<K, V, std::unordered_map, H>;
+			void unlinkList(Node &node) {
+				List &list = lists[node.list];
+				(node.newer? node.newer->older : list.newest) = node.older;
+				(node.older? node.older->newer : list.oldest) = node.newer;
+				node.newer = node.older = nullptr;
+				--list.count;
+			}
+
+			void resize(size_t bits) {
+				bucketBits = bits;
+				buckets.assign(size_t(1) << bits, nullptr);
+				for (List &list: lists)
+					for (Node *node = list.newest; node; node = node->older) {
+						Node *&head = buckets[bucket(node->key)];
+						node->next = head;
+						head = node;
+					}
+			}
+	};
 }
@@ -22,6 +22,15 @@ namespace Thorn::AHCI {
 
 namespace Thorn {
 	struct AHCIDevice;
+	class StripeDevice;
+}
+
+namespace Thorn::Virtio {
+	class Block;
+}
+
+namespace Thorn::NVMe {
+	class Namespace;
 }
 
 namespace Thorn {
@@ -32,12 +41,18 @@ namespace Thorn {
 	void testPS2Keyboard();
 	void handleInput(std::string);
 
+	enum class DiskMode {AHCI, IDE, Virtio, NVMe};
+
 	struct InputContext {
 		AHCI::Controller *controller = nullptr;
 		AHCI::Port *port = nullptr;
-		bool ahci = true;
+		DiskMode diskMode = DiskMode::AHCI;
 		int idePort = -1;
+		Virtio::Block *virtio = nullptr;
+		NVMe::Namespace *nvme = nullptr;
 		StorageDeviceBase *device = nullptr;
+		/** The same as device when a RAID array is selected, and null otherwise. */
+		StripeDevice *stripe = nullptr;
 		FS::Partition *partition = nullptr;
 		FS::ThornFAT::ThornFATDriver *driver = nullptr;
 		std::string path = "/";
@@ -73,4 +88,10 @@ namespace Thorn {
 	void listGPT(InputContext &);
 	void listAHCI(InputContext &);
 	void make(const std::vector<std::string> &, InputContext &);
+	void fstrim(const std::vector<std::string> &, InputContext &);
+	void ramdisk(const std::vector<std::string> &, InputContext &);
+	void raid(const std::vector<std::string> &, InputContext &);
+	void cache(const std::vector<std::string> &, InputContext &);
+	void bench(const std::vector<std::string> &, InputContext &);
+	void check(const std::vector<std::string> &, InputContext &);
 }
@@ -5,8 +5,6 @@
 #include <cstddef>
 #include <cstdint>
 
-extern void (*timer_addr)();
-extern uint64_t timer_max;
 extern uint64_t ticks;
 
 namespace Thorn {
@@ -45,7 +43,10 @@ namespace x86_64::APIC {
 	constexpr uint32_t REGISTER_TIMER_CURRCNT = 0x390 >> 2;
 	constexpr uint32_t REGISTER_TIMER_DIV = 0x3e0 >> 2;
 	constexpr uint32_t REGISTER_TIMER_INITCNT = 0x380 >> 2;
+	constexpr uint32_t SELECT_TMR_ONE_SHOT = 0;
 	constexpr uint32_t SELECT_TMR_PERIODIC = 0x20000;
+	constexpr uint32_t SELECT_TMR_TSC_DEADLINE = 0x40000;
+	constexpr uint32_t MSR_TSC_DEADLINE = 0x6e0;
 	constexpr uint32_t SPURIOUS_ENABLE = 0x100;
 	constexpr uint32_t TIMER_DIVIDE_VALUE = 16;
 	constexpr uint32_t TIMER_NUM_CALIBRATIONS = 5;
@@ -61,8 +62,15 @@ namespace x86_64::APIC {
 	constexpr uint16_t ICR_MESSAGE_TYPE_EXTERNAL = 7 << 8;
 
 	void init(Thorn::Kernel &);
-	void initTimer(uint32_t frequency);
-	void reloadTimer(uint32_t initcnt);
+	/** Returns the APIC timer's rate in ticks per second, calibrating it against the PIT on first use. */
+	uint32_t ticksPerSecond();
+	/** Starts a one-shot countdown that raises BSP_VECTOR_APIC_TIMER when it reaches zero. */
+	void oneShot(uint32_t initcnt);
+	uint32_t currentCount();
+	/** Returns whether CPUID reports support for TSC-deadline mode. */
+	bool hasTSCDeadline();
+	/** Arms the timer to fire once the TSC reaches the given value. Requires TSC-deadline mode. */
+	void tscDeadline(uint64_t tsc);
 	uint32_t calibrateTimer();
 	void disableTimer();
 
@@ -49,6 +49,10 @@ namespace x86_64 {
 		uint64_t id; // APIC/CPU id
 		void *gdt;
 		GDTPointer gdtPointer;
+		/** Top of the stack the SYSCALL entry point switches to. */
+		uint64_t syscallStack;
+		/** Scratch space for the caller's stack pointer while the SYSCALL entry point switches stacks. */
+		uint64_t userStack;
 		// thread_t* currentThread = nullptr;
 		// process* idleProcess = nullptr;
 		// volatile int runQueueLock = 0;
@@ -56,6 +60,12 @@ namespace x86_64 {
 		// tss_t tss __attribute__((aligned(16)));
 	};
 
+	extern CPU bootProcessor;
+
+	/** Points the kernel GS base at the given CPU-local structure. The kernel runs with the structure in the inactive
+	 *  GS base and uses swapgs to reach it. */
+	void initCPULocal(CPU &, uint64_t id);
+
 	__attribute__((always_inline)) inline CPU * getCPULocal() {
 		CPU *out;
 		bool interrupts = checkInterrupts();
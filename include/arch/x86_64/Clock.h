@@ -0,0 +1,65 @@
+#pragma once
+
+// A clocksource built on the timestamp counter. The TSC is calibrated once against the PIT at boot, after which
+// timestamps cost a single rdtsc and a multiply.
+
+#include <cstdint>
+
+namespace x86_64::Clock {
+	constexpr uint32_t CALIBRATIONS = 3;
+	/** Cycle/nanosecond conversions are done in 32.32 fixed point. */
+	constexpr unsigned SCALE_SHIFT = 32;
+
+	/** Returns whether CPUID reports an invariant TSC (one that ticks at a constant rate in every P-, C- and T-state). */
+	bool invariantTSC();
+
+	/** Calibrates the TSC and seeds the wall clock from the RTC. Safe to call more than once. */
+	void init();
+	bool ready();
+
+	inline uint64_t cycles() {
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		return (static_cast<uint64_t>(high) << 32) | low;
+	}
+
+	uint64_t cyclesPerSecond();
+	uint64_t cyclesToNanos(uint64_t);
+	uint64_t nanosToCycles(uint64_t);
+
+	/** Returns the number of nanoseconds elapsed since init(). */
+	uint64_t monotonicNanos();
+
+	/** Returns the number of nanoseconds since the Unix epoch. */
+	uint64_t realtimeNanos();
+
+	/** Returns the number of seconds since the Unix epoch. */
+	int64_t realtime();
+
+	inline void pause() {
+		asm volatile("pause");
+	}
+
+	/** Busy-waits for at least the given number of nanoseconds. Requires init(). */
+	void ndelay(uint64_t nanos);
+
+	/** Busy-waits for at least the given number of microseconds. Requires init(). */
+	void udelay(uint64_t micros);
+
+	/** Spins until the predicate returns true or the timeout (in microseconds) expires. The predicate is checked once
+	 *  more after the deadline passes, so being descheduled while spinning can't cause a spurious timeout.
+	 *  @return Whether the predicate was satisfied. */
+	template <typename P>
+	bool pollUntil(P predicate, uint64_t timeout_micros) {
+		if (predicate())
+			return true;
+		const uint64_t deadline = cycles() + nanosToCycles(timeout_micros * 1'000);
+		for (;;) {
+			pause();
+			if (predicate())
+				return true;
+			if (deadline <= cycles())
+				return predicate();
+		}
+	}
+}
@@ -4,6 +4,12 @@
 
 namespace x86_64::IDT {
 	constexpr int SIZE = 256;
+	/** Vectors from here up are handed out by reserveUnusedInterrupt. */
+	constexpr int FIRST_DYNAMIC_VECTOR = 48;
+	constexpr int DYNAMIC_STUB_SIZE = 16;
+
+	/** Handlers for dynamic vectors run with interrupts disabled. The local APIC is acknowledged after they return. */
+	using Handler = void (*)(void *);
 
 	struct Header {
 		uint16_t size;
@@ -20,9 +26,12 @@ namespace x86_64::IDT {
 		uint32_t zero;
 	} __attribute__((packed));
 
-	void add(int index, void (*fn)());
+	/** 0x8e is a ring-0 interrupt gate; 0xee is the same gate made reachable from ring 3. */
+	void add(int index, void (*fn)(), uint8_t type_attr = 0x8e);
 	void init();
 	uint8_t reserveUnusedInterrupt();
+	/** Sets the handler for a vector returned by reserveUnusedInterrupt. */
+	void setHandler(uint8_t vector, Handler, void *data = nullptr);
 }
 
 struct interrupt_frame {
@@ -47,16 +56,19 @@ extern "C" {
 	extern void isr_46();
 	extern void isr_47();
 	extern void isr_0x69();
+	extern char dynamic_isr_stubs[];
 
 	void div0();
 	void double_fault();
 	void general_protection_fault();
 	void page_interrupt();
+	void timer_interrupt();
 	void irq1();
 	void spurious_interrupt();
 	void irq11();
 	void irq14();
 	void irq15();
+	void dynamic_interrupt(uint64_t vector);
 }
 
 extern bool abouttodie;
@@ -25,6 +25,8 @@ namespace x86_64 {
 			virtual int findFree(size_t start = 0) const = 0;
 			virtual uintptr_t allocateFreePhysicalAddress(size_t consecutive_count = 1);
 			uintptr_t allocateFreePhysicalFrame(size_t consecutive_count = 1);
+			/** Returns a single page from allocateFreePhysicalAddress to the pool. Unmapping it is up to the caller. */
+			void freePhysicalAddress(uintptr_t);
 			virtual void mark(int index, bool used) = 0;
 			virtual uintptr_t assign(PageTableWrapper &, uint16_t pml4_index, uint16_t pdpt_index, uint16_t pdt_index, uint16_t pt_index,
 			                         uintptr_t physical_address = 0, uint64_t extra_meta = 0) = 0;
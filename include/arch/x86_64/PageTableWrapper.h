@@ -30,6 +30,10 @@ namespace x86_64 {
 			uint16_t getPDTMeta(uint16_t pml4_index, uint16_t pdpt_index, uint16_t pdt_index) const;
 			uint16_t getPTMeta(uint16_t pml4_index, uint16_t pdpt_index, uint16_t pdt_index, uint16_t pt_index) const;
 
+			/** Returns the physical address a virtual address is mapped to, or 0 if it isn't mapped. Doesn't take the
+			 *  pager lock, so it's safe to use from interrupt context as long as the mapping isn't changing. */
+			uintptr_t translate(uintptr_t virtual_address) const;
+
 			static inline uint16_t getPML4Index(uint64_t       addr) { return (addr >> 39) & 0x1ff;          }
 			static inline uint16_t getPML4Index(volatile void *addr) { return getPML4Index((uint64_t) addr); }
 
@@ -46,6 +50,9 @@ namespace x86_64 {
 			static inline uint16_t getOffset(volatile void *addr) { return getOffset((uint64_t) addr); }
 
 		private:
+			/** Bits 51:12 of a page table entry. */
+			constexpr static uint64_t ADDRESS_MASK = 0x000ffffffffff000ul;
+
 			void printMeta(uint64_t);
 			void printPDPT(bool indirect, size_t i_shift, uint64_t pml4e, bool show_pdt, PTDisplay);
 			void printPDT(bool indirect, size_t j_shift, uint64_t pdpe, PTDisplay);
@@ -0,0 +1,59 @@
+#pragma once
+
+// System calls can enter the kernel via SYSCALL or, more slowly, via int $0x80. Both use the same register ABI:
+// %rax holds the call number and %rdi, %rsi, %rdx, %r10, %r8 and %r9 hold up to six arguments. The result comes back
+// in %rax, with negative values being errno codes. SYSCALL clobbers %rcx and %r11; everything else except %rax and the
+// vector registers is preserved.
+
+// Offsets into x86_64::CPU, for use by the entry point.
+#define CPU_SYSCALL_STACK 40
+#define CPU_USER_STACK 48
+
+#define SYSCALL_VECTOR 0x80
+#define SYSCALL_STACK_SIZE 0x4000
+
+#ifndef __ASSEMBLER__
+#include <cstddef>
+#include <cstdint>
+
+namespace x86_64::Syscall {
+	/** 1 is kept for exit, which progs already use but which can't be implemented until there are user processes
+	 *  to end. Until then it fails with -ENOSYS like any other unassigned number. */
+	enum class Number: uint64_t {Null = 0, Print = 2};
+
+	using Handler = long (*)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+	constexpr size_t MAX_SYSCALLS = 64;
+
+	/** Sets up the SYSCALL MSRs and the CPU-local syscall stack and registers the built-in handlers. Requires the
+	 *  CPU-local structure to be initialized. */
+	void init();
+
+	/** Installs a handler for a call number. Returns false if the number is out of range. */
+	bool set(Number, Handler);
+
+	/** Issues a system call with the SYSCALL instruction. */
+	inline long invoke(Number number, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0) {
+		long out;
+		asm volatile("syscall" : "=a"(out) : "a"(number), "D"(arg0), "S"(arg1), "d"(arg2) : "rcx", "r11", "memory",
+			"xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12",
+			"xmm13", "xmm14", "xmm15");
+		return out;
+	}
+
+	/** Issues a system call through the int $0x80 gate. */
+	inline long invokeInterrupt(Number number, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0) {
+		long out;
+		asm volatile("int $0x80" : "=a"(out) : "a"(number), "D"(arg0), "S"(arg1), "d"(arg2) : "memory",
+			"xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12",
+			"xmm13", "xmm14", "xmm15");
+		return out;
+	}
+}
+
+extern "C" {
+	void syscall_entry();
+	void isr_0x80();
+	long syscall_dispatch(uint64_t number, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+}
+#endif
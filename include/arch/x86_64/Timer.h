@@ -0,0 +1,80 @@
+#pragma once
+
+// A hierarchical timer wheel driven by the local APIC timer in TSC-deadline or one-shot mode. Instead of taking a
+// periodic tick, the APIC is programmed to fire at the next pending deadline, so an idle CPU stays halted until there's
+// work to do.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "arch/x86_64/Clock.h"
+#include "arch/x86_64/CPU.h"
+
+namespace x86_64::Timer {
+	/** Timer callbacks run in interrupt context with interrupts disabled. */
+	using Callback = void (*)(void *);
+
+	/** Identifies a pending timer. 0 is never a valid ID. */
+	using ID = uint64_t;
+
+	constexpr size_t MAX_TIMERS = 256;
+	constexpr unsigned LEVEL_BITS = 6;
+	constexpr size_t SLOTS = 1 << LEVEL_BITS;
+	/** With microsecond granularity, four levels cover deadlines up to 2^24 µs (~16.7 s) away. Anything further out is
+	 *  parked on an overflow list that's redistributed whenever the top level wraps. */
+	constexpr unsigned LEVELS = 4;
+
+	/** Initializes the clocksource, calibrates the APIC timer if TSC-deadline mode isn't available and starts the wheel.
+	 *  Safe to call more than once. */
+	void init();
+	bool ready();
+
+	/** Returns the number of microseconds elapsed since the clocksource was initialized. */
+	uint64_t now();
+
+	/** Schedules a callback to run once now() reaches the given deadline (in microseconds).
+	 *  Returns 0 if there are no free timer slots. */
+	ID addTimer(uint64_t deadline, Callback, void *data = nullptr);
+
+	/** Cancels a pending timer. Returns false if the timer has already fired or was already cancelled. */
+	bool cancel(ID);
+
+	/** Runs expired timers and reprograms the APIC for the next deadline. Called from the timer interrupt. */
+	void interrupt();
+
+	/** Halts until the next interrupt. Unlike a bare hlt, this doesn't rely on a periodic tick to wake up. */
+	void idle();
+
+	/** Halts until the predicate holds or the timeout (in microseconds) passes, and returns whether it holds. The
+	 *  predicate is checked with interrupts disabled right before each halt, so an interrupt that satisfies it can't
+	 *  slip in between. Polls instead if interrupts are off or there's no timer to end the wait. Cycles spent halted
+	 *  are added to halted_cycles if it isn't null. */
+	template <typename P>
+	bool sleepUntil(P predicate, uint64_t timeout, uint64_t *halted_cycles = nullptr) {
+		if (!checkInterrupts() || !ready())
+			return Clock::pollUntil(predicate, timeout);
+
+		volatile bool timed_out = false;
+		const ID timer = addTimer(now() + timeout, +[](void *flag) {
+			*static_cast<volatile bool *>(flag) = true;
+		}, (void *) &timed_out);
+
+		if (timer == 0)
+			return Clock::pollUntil(predicate, timeout);
+
+		bool out;
+		for (;;) {
+			disableInterrupts();
+			if ((out = predicate()) || timed_out)
+				break;
+			const uint64_t halted = Clock::cycles();
+			idle();
+			if (halted_cycles)
+				*halted_cycles += Clock::cycles() - halted;
+		}
+
+		enableInterrupts();
+		cancel(timer);
+		return out || predicate();
+	}
+}
@@ -38,6 +38,23 @@
                     GDT_FLAG_64BIT_MODE,                             \
                     GDT_ACCESS_PRESENT | GDT_ACCESS_PRIVILEGE_RING0)
 
+// SYSRET derives the user segments from a single base selector: SS is base + 8 and CS is base + 16. That fixes the
+// order of the user entries as data, then code.
+#define GDT_USER_DATA_ENTRY                                          \
+  DECLARE_GDT_ENTRY(0, 0xffffffff,                                   \
+                    GDT_FLAG_64BIT_MODE,                             \
+                    GDT_ACCESS_PRESENT | GDT_ACCESS_PRIVILEGE_RING3 | GDT_ACCESS_READABLE_WRITABLE)
+
+#define GDT_USER_CODE_ENTRY                                                                  \
+  DECLARE_GDT_ENTRY(0, 0xffffffff,                                                           \
+                    GDT_FLAG_64BIT_MODE,                                                     \
+                    GDT_ACCESS_PRESENT | GDT_ACCESS_PRIVILEGE_RING3 | GDT_ACCESS_EXECUTABLE)
+
+#define GDT_KERNEL_CODE_SELECTOR 0x08
+#define GDT_KERNEL_DATA_SELECTOR 0x10
+#define GDT_USER_DATA_SELECTOR   0x18
+#define GDT_USER_CODE_SELECTOR   0x20
+
 #define GDT_TABLE_ALIGNMENT 0x1000
 #define GDT_TABLE_SIZE 0x800
 
@@ -3,5 +3,11 @@
 
 #define MSR_EFER 0xC0000080
 #define MSR_EFER_LME (1 << 8)
+#define MSR_EFER_SCE (1 << 0)
+
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_SFMASK 0xC0000084
+#define MSR_KERNEL_GS_BASE 0xC0000102
 
 #endif
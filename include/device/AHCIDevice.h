@@ -4,22 +4,77 @@
 #include "hardware/AHCI.h"
 
 namespace Thorn {
-	class AHCIDevice: public StorageDevice<AHCI::Port::BLOCKSIZE> {
+	class AHCIDevice: public StorageDevice {
 		public:
+			/** Physical blocks bigger than a page are cached in logical blocks instead. */
+			constexpr static size_t MAX_BLOCKSIZE = PageCache::PAGE_SIZE;
+			/** The readahead window a sequential stream starts with, in bytes. */
+			constexpr static size_t MIN_READAHEAD = 16 << 10;
+			/** How far the readahead window can grow, in bytes. Zero turns readahead off. */
+			static inline size_t maxReadahead = 512 << 10;
+
 			AHCI::Port *port;
+			/** Blocks read ahead of what was asked for. */
+			uint64_t readaheadBlocks = 0;
 
-			AHCIDevice(AHCI::Port *port_):
-				port(port_) {}
+			AHCIDevice(AHCI::Port *port_);
 
 			int read(void *buffer, size_t size, size_t offset) final;
 			int write(const void *buffer, size_t size, size_t offset) final;
 			int clear(size_t offset, size_t size) final;
+			int discard(size_t offset, size_t size) final;
 			void flush() final;
-			void flush(StorageCacheEntry<BlockSize> &, uint64_t block) final;
+			int sync() final;
+			int writeFUA(const void *buffer, size_t size, size_t offset) final;
+			int readDirect(void *buffer, size_t size, size_t offset) final;
+			int writeDirect(const void *buffer, size_t size, size_t offset) final;
 			std::string getName() const final;
+			size_t physicalBlockSize() const final;
+			void dispatch(RequestQueue &, BlockRequest &) final;
+			size_t maxBlocks() const final;
+			/** With NCQ, as many requests as the port has queued tags; otherwise one at a time. */
+			size_t queueDepth() const final;
+			void poll(RequestQueue &) final;
 
 		private:
+			/** A request issued as a queued command. The port's completion runs in its interrupt handler, so it only
+			 *  records the result; the request is completed from poll(). */
+			struct InFlight {
+				BlockRequest *request = nullptr;
+				volatile bool done = false;
+				AHCI::Port::AccessStatus status = AHCI::Port::AccessStatus::Success;
+			};
+
+			InFlight inFlight[32];
+
+			/** The block a sequential reader would read next. */
+			uint64_t streamNext = UINT64_MAX;
+			/** How many blocks to read past the end of a sequential read that misses. Doubles with each sequential
+			 *  read and collapses to nothing on a random one. */
+			size_t readaheadWindow = 0;
+
+			/** Discarded ranges waiting to be sent as one batch. */
+			std::vector<AHCI::Port::TrimRange> pendingTrims;
+			/** How many ranges to collect before sending them. */
+			constexpr static size_t TRIM_BATCH = 256;
+
+			inline uint64_t sectorsPerBlock() const { return blockSize / sectorSize; }
+			void flushTrims();
+			/** Issues a request as a queued command. Returns false if it has to be done synchronously instead. */
+			bool dispatchQueued(BlockRequest &);
+			/** Completes the queued requests whose commands have finished. */
+			void completeQueued(RequestQueue &);
+			static void finished(void *, AHCI::Port::AccessStatus);
+			/** Updates the readahead window for a read of blocks [first, last). */
+			void updateStream(uint64_t first, uint64_t last);
+			/** Reads the run of uncached blocks starting at `block` into the cache with one command. The run goes up to
+			 *  `needed` plus the readahead window, but stops early at a cached block. */
+			int fill(uint64_t block, uint64_t needed);
 			int readCache(void *buffer, size_t size, size_t offset);
 			int writeCache(const void *buffer, size_t size, size_t offset);
+			/** Read and write part of a single block for a direct transfer. The block's cached copy is used if there
+			 *  is one; otherwise the queue goes through a bounce buffer. */
+			int readEdge(void *buffer, size_t size, size_t offset);
+			int writeEdge(const void *buffer, size_t size, size_t offset);
 	};
 }
@@ -4,16 +4,17 @@
 #include "hardware/IDE.h"
 
 namespace Thorn {
-	struct IDEDevice: StorageDevice<IDE::SECTOR_SIZE> {
+	struct IDEDevice: StorageDevice {
 		uint8_t ideID;
 		IDEDevice() = delete;
-		IDEDevice(uint8_t ide_id): ideID(ide_id) {}
+		IDEDevice(uint8_t ide_id): StorageDevice(IDE::SECTOR_SIZE, IDE::SECTOR_SIZE), ideID(ide_id) {}
 
 		int read(void *buffer, size_t size, size_t offset) final;
 		int write(const void *buffer, size_t size, size_t offset) final;
-		int clear(size_t offset, size_t size) final;
 		void flush() final {}
-		void flush(StorageCacheEntry<BlockSize> &, uint64_t) final {}
+		int sync() final;
 		std::string getName() const final;
+		void dispatch(RequestQueue &, BlockRequest &) final;
+		size_t maxBlocks() const final;
 	};
 }
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "device/Storage.h"
+#include "hardware/NVMe.h"
+
+namespace Thorn {
+	/** An NVMe namespace. Everything goes through the request queue and nothing is cached; a burst of dispatched
+	 *  requests is submitted with a single doorbell write. */
+	class NVMeDevice: public StorageDevice {
+		public:
+			NVMe::Namespace *ns;
+
+			NVMeDevice(NVMe::Namespace *);
+
+			int read(void *buffer, size_t size, size_t offset) final;
+			int write(const void *buffer, size_t size, size_t offset) final;
+			int discard(size_t offset, size_t size) final;
+			void flush() final {}
+			int sync() final;
+			std::string getName() const final;
+			void dispatch(RequestQueue &, BlockRequest &) final;
+			size_t maxBlocks() const final;
+			size_t queueDepth() const final;
+			void poll(RequestQueue &) final;
+			void commit(RequestQueue &) final;
+
+		private:
+			InFlight inFlight[NVMe::QueuePair::MAX_SIZE];
+	};
+}
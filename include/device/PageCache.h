@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Cache.h"
+#include "memory/Shrinker.h"
+
+namespace Thorn {
+	struct StorageDevice;
+
+	/** The PAGE_SIZE bytes of a device starting at index * PAGE_SIZE. */
+	struct PageKey {
+		StorageDevice *device = nullptr;
+		uint64_t index = 0;
+
+		bool operator==(const PageKey &other) const { return device == other.device && index == other.index; }
+	};
+
+	struct PageKeyHash {
+		size_t operator()(const PageKey &key) const {
+			return key.index + reinterpret_cast<uintptr_t>(key.device) * 0xff51afd7ed558ccdul;
+		}
+	};
+
+	/** A cached page. Its blocks are tracked separately, so a page can be partly read in or partly dirty. */
+	struct CachedPage {
+		/** The identity-mapped frame holding the page's data. */
+		uintptr_t frame = 0;
+		/** Which of the page's blocks hold data, one bit each. */
+		uint8_t valid = 0;
+		/** Which of the page's blocks are newer than what's on the device. */
+		uint8_t dirty = 0;
+
+		inline uint8_t * data() const { return reinterpret_cast<uint8_t *>(frame); }
+	};
+
+	/** The cache shared by every StorageDevice. Data lives in whole physical frames keyed by device and page, so the
+	 *  bookkeeping per cached byte is small and a cached page could be mapped somewhere as it is. Instead of a fixed
+	 *  number of entries, the cache is bounded by memory: it takes frames until it reaches a share of what was free
+	 *  when it was created, and gives clean pages back from its cold end whenever the frame allocator runs out. */
+	class PageCache: public Shrinker {
+		public:
+			constexpr static size_t PAGE_SIZE = 4096;
+			/** How many blocks a page can hold, which is the width of CachedPage's masks. */
+			constexpr static size_t MAX_BLOCKS = 8;
+			/** The percentage of free frames the cache may grow into without being asked to shrink. */
+			constexpr static size_t MEMORY_PERCENT = 75;
+
+			/** ARC keeps a long sequential read from flushing out metadata that's read over and over. */
+			using Map = Cache<PageKey, CachedPage, PageKeyHash, Replacement::ARC>;
+
+			/** Totals over every device. Each device's own numbers are in its CacheStats. */
+			struct Stats {
+				/** Pages dropped to make room for others. */
+				uint64_t evictions = 0;
+				/** Pages given back to the frame allocator under memory pressure. */
+				uint64_t shrunk = 0;
+			};
+
+			Stats stats;
+
+			PageCache(const PageCache &) = delete;
+			PageCache & operator=(const PageCache &) = delete;
+
+			/** Creates the cache the first time it's needed. */
+			static PageCache & get();
+
+			/** Returns a page without changing its recency, or nullptr if it isn't cached. */
+			CachedPage * find(const StorageDevice &, uint64_t index) const;
+			/** Returns a page and marks it most recently used, or returns nullptr if it isn't cached. */
+			CachedPage * lookup(StorageDevice &, uint64_t index);
+			/** Like lookup(), but a missing page is added with a frame and no valid blocks. Making room can mean
+			 *  writing back a dirty page. Returns nullptr if there's no memory for it. */
+			CachedPage * obtain(StorageDevice &, uint64_t index);
+			/** Forgets a device's blocks in [first, last), dirty or not. Pages left without valid blocks are freed. */
+			void invalidate(StorageDevice &, uint64_t first, uint64_t last);
+			/** Frees every page of a device that has nothing dirty. */
+			void dropClean(StorageDevice &);
+			/** Frees every page of a device. */
+			void purge(StorageDevice &);
+
+			size_t shrink(x86_64::PageMeta &, size_t frames) override;
+
+			inline size_t size() const { return map.size(); }
+			inline size_t capacity() const { return map.capacity(); }
+			/** Bytes used to keep track of the cached pages, not counting their frames. */
+			inline size_t overhead() const { return map.footprint(); }
+
+		private:
+			Map map;
+			/** Set while the map is being changed, so that a shrink() started by an allocation partway through the
+			 *  change leaves the map alone. */
+			bool busy = false;
+
+			PageCache(size_t capacity);
+
+			/** Whether a page can be dropped without losing data or pulling it out from under its device. */
+			static bool evictable(const Map::Node &);
+			/** Frees every page for which the predicate returns true. */
+			template <typename P>
+			void dropIf(P &&);
+			/** Takes the least recently used page that can be dropped and returns its frame for reuse. Returns 0 if
+			 *  nothing can go. */
+			uintptr_t reclaim();
+			static uintptr_t allocateFrame();
+	};
+}
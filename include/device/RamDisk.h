@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+
+#include "device/Storage.h"
+
+namespace Thorn {
+	/** A block device kept in physical frames from the pager. Frames are only allocated once something is written to
+	 *  them, and clearing or discarding a whole frame gives it back, so an empty RAM disk costs almost nothing. */
+	class RamDisk: public StorageDeviceBase {
+		public:
+			constexpr static size_t FRAME_SIZE = 4096;
+
+			const size_t size;
+			const size_t blockSize;
+
+			RamDisk(size_t size_, size_t block_size = 512);
+			RamDisk(const RamDisk &) = delete;
+			~RamDisk();
+
+			RamDisk & operator=(const RamDisk &) = delete;
+
+			int read(void *buffer, size_t size, size_t offset) final;
+			int write(const void *buffer, size_t size, size_t offset) final;
+			int clear(size_t offset, size_t size) final;
+			int discard(size_t offset, size_t size) final;
+			void flush() final {}
+			std::string getName() const final;
+			size_t logicalBlockSize() const final { return blockSize; }
+
+			/** Works for any range within one frame. Unwritten ranges point at a shared page of zeroes. */
+			const void * view(size_t offset, size_t size) const final;
+
+			/** How many frames are currently allocated. */
+			inline size_t framesUsed() const { return used; }
+
+			/** Whether the pager has enough free frames for a RAM disk of the given size to be filled. */
+			static bool fits(size_t size);
+
+		private:
+			/** Physical (and identity-mapped) addresses of the frames, with 0 for frames that read as zeroes. */
+			std::vector<uintptr_t> frames;
+			size_t used = 0;
+
+			/** Returns the frame for an index, allocating it if needed. Returns 0 if memory ran out. */
+			uintptr_t allocate(size_t index);
+			void release(size_t index);
+			int check(size_t size, size_t offset) const;
+	};
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace Thorn {
+	class RequestQueue;
+
+	/** A pending transfer of whole blocks. Requests for adjacent ranges are merged into one while they wait. */
+	struct BlockRequest {
+		using Completion = void (*)(void *data, int status);
+
+		/** Someone waiting on part of a request. For reads, the bytes at `offset` are copied to `target` first. */
+		struct Waiter {
+			Completion completion = nullptr;
+			void *data = nullptr;
+			void *target = nullptr;
+			size_t offset = 0;
+			size_t size = 0;
+		};
+
+		bool write = false;
+		uint64_t block = 0;
+		size_t blocks = 0;
+		/** Written data, or read data when the request can't go straight into a waiter's buffer. */
+		std::vector<uint8_t> data;
+		/** What the backend should transfer to or from. Set when the request is dispatched. */
+		void *buffer = nullptr;
+		std::vector<Waiter> waiters;
+		/** Monotonic time in nanoseconds after which the request is dispatched ahead of the elevator order. */
+		uint64_t deadline = 0;
+		std::list<BlockRequest *>::iterator fifoPosition;
+
+		inline uint64_t end() const { return block + blocks; }
+	};
+
+	/** Something that carries out whole-block transfers on behalf of a RequestQueue. */
+	struct BlockBackend {
+		virtual ~BlockBackend() = default;
+
+		/** Starts a request. The backend has to call RequestQueue::complete for it, possibly before returning. */
+		virtual void dispatch(RequestQueue &, BlockRequest &) = 0;
+
+		/** The largest number of blocks one request may cover. */
+		virtual size_t maxBlocks() const = 0;
+
+		/** How many requests the backend can have in flight at once. */
+		virtual size_t queueDepth() const { return 1; }
+
+		/** Called while the queue waits on requests in flight. Backends that finish requests asynchronously complete
+		 *  whatever has finished here, in the queue's context rather than an interrupt handler's. */
+		virtual void poll(RequestQueue &) {}
+
+		/** Called after a burst of dispatches. Backends that hold back doorbells until then ring them here. */
+		virtual void commit(RequestQueue &) {}
+	};
+
+	/** A per-device queue that merges adjacent requests and dispatches them in a deadline-bounded elevator order.
+	 *  Reads are preferred over writes, but writes are never passed over more than WRITES_STARVED times in a row.
+	 *  Requests are dispatched as soon as they're submitted unless the queue is plugged; plugging lets a burst of
+	 *  small writes pile up and merge before any of them go to the device. Not safe for concurrent use. */
+	class RequestQueue {
+		public:
+			using Completion = BlockRequest::Completion;
+
+			struct Stats {
+				/** Requests handed to the queue, after splitting anything larger than the backend's limit. */
+				uint64_t submitted = 0;
+				uint64_t backMerges = 0;
+				uint64_t frontMerges = 0;
+				/** Writes that landed entirely inside a pending write and just overwrote part of its data. */
+				uint64_t absorbed = 0;
+				/** Reads satisfied from the data of a pending write. */
+				uint64_t forwarded = 0;
+				uint64_t dispatched = 0;
+				uint64_t blocksRead = 0;
+				uint64_t blocksWritten = 0;
+				uint64_t errors = 0;
+			};
+
+			const size_t blockSize;
+			Stats stats;
+
+			constexpr static uint64_t READ_EXPIRY  = 500'000'000;
+			constexpr static uint64_t WRITE_EXPIRY = 5'000'000'000;
+			constexpr static int WRITES_STARVED = 2;
+
+			RequestQueue(BlockBackend &, size_t block_size);
+			RequestQueue(const RequestQueue &) = delete;
+			~RequestQueue();
+
+			RequestQueue & operator=(const RequestQueue &) = delete;
+
+			/** Queues a read of whole blocks into the buffer. The completion runs once the data is there. */
+			void submitRead(uint64_t block, size_t count, void *buffer, Completion = nullptr, void *data = nullptr);
+
+			/** Queues a write of whole blocks. The data is copied, so the buffer can be reused right away. */
+			void submitWrite(uint64_t block, size_t count, const void *buffer, Completion = nullptr,
+			                 void *data = nullptr);
+
+			/** Reads bytes, waiting for the result. Unaligned edges are handled by reading whole blocks. */
+			int read(void *buffer, size_t size, size_t offset);
+
+			/** Writes bytes, with a read-modify-write for unaligned edges. While the queue is plugged, this returns
+			 *  once the write is queued, and an error is kept for takeWriteError() instead. */
+			int write(const void *buffer, size_t size, size_t offset);
+
+			/** Like write(), but waits for the result even while the queue is plugged. Whatever is pending is
+			 *  dispatched along with it. */
+			int writeAndWait(const void *buffer, size_t size, size_t offset);
+
+			/** Returns the first error of a write that nobody was waiting on since the last call, and forgets it. */
+			int takeWriteError();
+
+			/** Holds back dispatching until the matching unplug(). Plugs nest. */
+			void plug();
+			void unplug();
+
+			/** Dispatches requests until the queue is empty and nothing is in flight. */
+			void drain();
+
+			/** Dispatches whatever the backend has room for, or waits for a request in flight to finish if it has no
+			 *  room. Lets a caller driving several queues keep all of them busy instead of draining them in turn. */
+			void step();
+
+			/** Called by the backend when a dispatched request has finished. Frees the request. */
+			void complete(BlockRequest &, int status);
+
+			inline size_t pending() const { return fifo[0].size() + fifo[1].size(); }
+			inline bool plugged() const { return plugDepth != 0; }
+			inline bool busy() const { return pending() != 0 || inFlight != 0; }
+
+		private:
+			/** Tracks requests that someone is blocked on. */
+			struct Waiting {
+				volatile size_t remaining = 0;
+				int status = 0;
+			};
+
+			BlockBackend &backend;
+			int plugDepth = 0;
+			size_t inFlight = 0;
+			int writesStarved = 0;
+			/** The first error of a write without a completion, such as one queued while plugged. */
+			int writeError = 0;
+			/** Pending requests by starting block and by ending block, for each direction (0 = read, 1 = write). */
+			std::multimap<uint64_t, BlockRequest *> sorted[2];
+			std::multimap<uint64_t, BlockRequest *> byEnd[2];
+			/** Pending requests in arrival order, for deadline checks. */
+			std::list<BlockRequest *> fifo[2];
+			/** Where the elevator resumes in each direction. */
+			uint64_t nextBlock[2] = {0, 0};
+			/** Requests in flight by starting block. The backend may finish them in any order. */
+			std::multimap<uint64_t, BlockRequest *> active;
+
+			void submit(bool write, uint64_t block, size_t count, std::vector<uint8_t> &&data,
+			            const BlockRequest::Waiter &);
+			/** Splits a request that's too big for the backend into pieces with one shared completion. */
+			void submitSplit(bool write, uint64_t block, size_t count, const uint8_t *source, void *target,
+			                 Completion, void *data);
+			int writeBytes(const void *buffer, size_t size, size_t offset, bool wait);
+			bool tryMerge(bool write, uint64_t block, size_t count, std::vector<uint8_t> &,
+			              const BlockRequest::Waiter &);
+			/** Merges the request with whatever pending request starts where it ends, if that still fits. */
+			void mergeNext(BlockRequest &);
+			/** Returns a pending request in the given direction that overlaps the block range, if any. */
+			BlockRequest * findOverlap(bool write, uint64_t block, size_t count);
+			/** Whether a request overlaps one in flight and either of them is a write. */
+			bool conflictsInFlight(const BlockRequest &) const;
+			void insert(BlockRequest &);
+			void remove(BlockRequest &);
+			/** Dispatches one request if there's one and the backend has room. Returns false otherwise, or if the
+			 *  next request has to wait for one in flight that it overlaps. */
+			bool dispatchNext();
+			void run();
+			/** Lets the backend finish requests in flight, if there are any. */
+			void idle();
+			/** Dispatches requests, plugged or not, until everything being waited on has completed. */
+			void waitFor(Waiting &);
+			static void finished(void *waiting, int status);
+	};
+}
@@ -1,24 +1,69 @@
 #pragma once
 
+#include <cerrno>
 #include <cstdint>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 
-#include "Cache.h"
 #include "Defs.h"
+#include "device/PageCache.h"
+#include "device/RequestQueue.h"
 
 namespace Thorn {
-	template <size_t Size>
-	struct StorageCacheEntry {
-		uint8_t data[Size];
-		bool flushed = false;
+	/** How one device has used the page cache. Every counter is bumped on a path that already touches the cache, so
+	 *  they're cheap enough to leave on. */
+	struct CacheStats {
+		/** Counts latencies in power-of-two buckets: bucket i holds those in [2^i, 2^(i+1)) nanoseconds. */
+		struct Histogram {
+			constexpr static size_t BUCKETS = 40;
 
-		StorageCacheEntry() = default;
-	};
+			uint64_t counts[BUCKETS] {};
+			uint64_t totalNanos = 0;
+
+			inline void add(uint64_t nanos) {
+				const size_t bucket = 63 - __builtin_clzl(nanos | 1);
+				++counts[bucket < BUCKETS? bucket : BUCKETS - 1];
+				totalNanos += nanos;
+			}
+
+			inline uint64_t count() const {
+				uint64_t out = 0;
+				for (const uint64_t bucket_count: counts)
+					out += bucket_count;
+				return out;
+			}
 
-	template <size_t CacheLength, size_t BlockSize>
-	struct StorageCache: TreeCache<uint64_t, StorageCacheEntry<BlockSize>> {
-		StorageCache():
-			TreeCache<uint64_t, StorageCacheEntry<BlockSize>>(CacheLength) {}
+			/** Returns the upper end of the bucket holding the given percentile, or 0 if nothing was counted. */
+			inline uint64_t percentile(unsigned percent) const {
+				const uint64_t total = count();
+				uint64_t seen = 0;
+				for (size_t i = 0; i < BUCKETS; ++i)
+					if (total != 0 && total * percent <= (seen += counts[i]) * 100)
+						return uint64_t(2) << i;
+				return 0;
+			}
+		};
+
+		/** Block lookups that found the block cached. */
+		uint64_t hits = 0;
+		/** Block lookups that had to go to the device. */
+		uint64_t misses = 0;
+		/** Pages dropped to make room or given back to the frame allocator. */
+		uint64_t evictions = 0;
+		/** Dirty blocks written back. */
+		uint64_t writebacks = 0;
+		/** Bytes read and written through the cache. */
+		uint64_t bytesRead = 0;
+		uint64_t bytesWritten = 0;
+		/** Bytes read and written around the cache with readDirect() and writeDirect(). */
+		uint64_t bytesReadDirect = 0;
+		uint64_t bytesWrittenDirect = 0;
+		/** Reads served entirely from the cache. */
+		Histogram hitLatency;
+		/** Reads that had to wait for the device. */
+		Histogram missLatency;
 	};
 
 	struct StorageDeviceBase {
@@ -27,20 +72,152 @@ namespace Thorn {
 		virtual int read(void *buffer, size_t size, size_t offset) = 0;
 		virtual int write(const void *buffer, size_t size, size_t offset) = 0;
 		virtual int clear(size_t offset, size_t size) = 0;
+		/** Tells the device that a byte range no longer holds anything useful. Only whole blocks inside the range are
+		 *  affected, and they read back as unspecified data afterwards. Returns -EOPNOTSUPP if the device can't. */
+		virtual int discard(size_t, size_t) { return -EOPNOTSUPP; }
 		virtual void flush() = 0;
+		/** Writes back anything cached in software and waits until the device has made everything written so far
+		 *  durable. A write that starts after this returns can't reach the medium before anything written before. */
+		virtual int sync() {
+			flush();
+			return 0;
+		}
+		/** Writes a byte range and waits until that range is durable. Unlike sync(), this doesn't cover earlier
+		 *  writes, so callers that need ordering sync first. Devices without FUA writes fall back to a full sync. */
+		virtual int writeFUA(const void *buffer, size_t size, size_t offset) {
+			const int status = write(buffer, size, offset);
+			return status != 0? status : sync();
+		}
+		/** Reads without going through the device's cache, so that a large transfer doesn't evict everything else.
+		 *  Devices that don't cache anything just read. */
+		virtual int readDirect(void *buffer, size_t size, size_t offset) { return read(buffer, size, offset); }
+		/** Writes without leaving anything in the device's cache. Cached copies of the range are kept coherent.
+		 *  Devices that don't cache anything just write. */
+		virtual int writeDirect(const void *buffer, size_t size, size_t offset) { return write(buffer, size, offset); }
 		virtual std::string getName() const = 0;
+		/** Returns the size in bytes of the unit the device addresses. Offsets and sizes that aren't multiples of it
+		 *  have to be read-modify-written. */
+		virtual size_t logicalBlockSize() const = 0;
+		/** Returns the size in bytes of the unit the device writes internally. Writes that don't cover whole
+		 *  physical blocks make the device read-modify-write on its own. */
+		virtual size_t physicalBlockSize() const { return logicalBlockSize(); }
+		/** Returns the device's request queue, or nullptr if it doesn't have one. */
+		virtual RequestQueue * getQueue() { return nullptr; }
+		/** Returns a pointer to the stored bytes if the device can expose them without copying, or nullptr if the
+		 *  caller has to read() them. The pointer is only good until the range is next modified. */
+		virtual const void * view(size_t, size_t) const { return nullptr; }
+		/** Forgets whatever cached data the device itself still has a copy of. */
+		virtual void dropCache() {}
+		/** Returns the device's cache statistics, or nullptr if it doesn't cache anything. */
+		virtual CacheStats * getCacheStats() { return nullptr; }
 	};
 
-	template <size_t BS>
-	struct StorageDevice: StorageDeviceBase {
-		constexpr static size_t BlockSize = BS;
+	struct StorageDevice: StorageDeviceBase, BlockBackend {
+		/** Writeback starts once more than this percentage of the page cache is dirty with one device's blocks. */
+		static inline unsigned dirtyRatio = 10;
+		/** Writeback starts once a block has been dirty for this long, in nanoseconds. */
+		static inline uint64_t dirtyExpireNanos = 5'000'000'000;
+
+		/** The device's logical block size. */
+		const size_t sectorSize;
+		/** The unit of the cache and request queue. Devices make it their physical block size when LBA 0 is
+		 *  aligned to a physical block, so that nothing smaller than a physical block is ever written. It can't be
+		 *  bigger than a page. */
+		const size_t blockSize;
+
+		RequestQueue queue;
+		CacheStats cacheStats;
+
+		StorageDevice(size_t sector_size, size_t block_size);
+		~StorageDevice() override;
+
+		size_t logicalBlockSize() const override { return sectorSize; }
+		RequestQueue * getQueue() override { return &queue; }
+		CacheStats * getCacheStats() override { return &cacheStats; }
+		/** Zeroes a byte range by queueing writes from a block of zeroes. Plugged, they go out as a few large ones. */
+		int clear(size_t offset, size_t size) override;
+
+		inline size_t blocksPerPage() const { return PageCache::PAGE_SIZE / blockSize; }
+
+		/** Returns a cached block's data and marks its page most recently used, or returns nullptr if the block
+		 *  isn't cached. */
+		uint8_t * cachedBlock(uint64_t block);
+		/** Whether a block is cached. Doesn't change its page's recency. */
+		bool isCached(uint64_t block) const;
+		/** Returns a block's data in the cache. The bool is whether the block wasn't cached before, in which case the
+		 *  caller has to fill it in and then mark it dirty or clean. Until then, the block doesn't count as cached,
+		 *  so a fill that fails leaves nothing behind. The data is null if there was no memory for it. */
+		std::pair<uint8_t *, bool> cacheEntry(uint64_t block);
+
+		/** Marks a cached block as modified so that it's written back before it's evicted. The block's data has to
+		 *  be complete by the time anything else looks it up. */
+		void markDirty(uint64_t block);
+		/** Marks a cached block as filled in and matching what's on the device. A block with a writeback in flight
+		 *  stays dirty in its page until the write has finished. */
+		void markClean(uint64_t block);
+		/** Drops the cached blocks in [first, last), dirty or not. */
+		void dropCached(uint64_t first, uint64_t last);
+		/** Drops every cached block that isn't dirty. */
+		void dropCache() override;
+
+		/** Queues writes for every dirty block in LBA order, with runs of adjacent blocks coalesced into single
+		 *  writes. The writes are dispatched right away but not waited for. */
+		void writeBack();
+		/** Queues writes for the dirty blocks in [first, last), along with the rest of the runs they start. */
+		void writeBack(uint64_t first, uint64_t last);
+		/** Queues writes for the dirty blocks of a page, along with the rest of the runs they're part of. */
+		void writeBackPage(uint64_t index);
+		/** Writes back everything dirty if more than dirtyRatio percent of the cache is dirty or the oldest dirty
+		 *  block has been waiting longer than dirtyExpireNanos. Called after writes, so writes return once they're
+		 *  in the cache while the device gets large sequential writes in the background. */
+		void balanceDirty();
+
+		inline size_t dirtyBlocks() const { return dirty.size(); }
+
+		/** Returns the first error a writeback has run into since the last call, and forgets it. */
+		int takeWriteBackError();
+
+		/** Waits for everything queued and returns the first write error nobody has been told about yet, from
+		 *  writeback or from a write queued while the queue was plugged. sync() has to report these, since the
+		 *  writes themselves returned before they'd finished. */
+		int finishWrites();
+
+		/** Returns the whole blocks inside a byte range as [first, last), the only ones a discard may touch. If there
+		 *  are any, waits for the queue first, since queued writes to them are older than the discard. */
+		std::pair<uint64_t, uint64_t> discardRange(size_t offset, size_t size);
+
+		/** Ties a dispatched request to its device, for hardware completion callbacks that only pass a pointer back. */
+		struct InFlight {
+			StorageDevice *device = nullptr;
+			BlockRequest *request = nullptr;
+		};
 
-		StorageCache<(1 << 20 >> 3), BlockSize> cache;
+		/** Claims a free entry in a driver's table of requests in flight. If there isn't one, which can't happen while
+		 *  the table has queueDepth() entries, completes the request with -EBUSY and returns nullptr. */
+		InFlight * claimInFlight(InFlight *table, size_t count, BlockRequest &);
+		/** A completion callback for a claimed InFlight entry. Frees the entry and completes its request. */
+		static void finishInFlight(void *, int status);
 
-		StorageDevice() = default;
+		/** The page whose data was handed out last. The page cache leaves it alone, so the pointer stays good until
+		 *  the device looks up another block. */
+		uint64_t pinned = UINT64_MAX;
+		/** Dirty blocks in LBA order that haven't been queued for writing yet. */
+		std::set<uint64_t> dirty;
+		/** Blocks with writebacks in flight, and how many each has. Their pages stay dirty until the writes finish,
+		 *  so they can't be evicted and read back from the device before the data has reached it. */
+		std::map<uint64_t, unsigned> writing;
+		/** The first error a writeback ran into, kept until takeWriteBackError() so that sync() can report it even
+		 *  if the write was started and failed long before. */
+		int writeBackError = 0;
+		/** When the oldest block in the dirty set was dirtied, in monotonic nanoseconds. */
+		uint64_t oldestDirty = 0;
 
-		using StorageDeviceBase::flush;
-		virtual void flush(StorageCacheEntry<BlockSize> &, uint64_t block) = 0;
+		/** Queues one write for the run of adjacent dirty blocks starting at the iterator, up to the backend's
+		 *  request size limit. Returns where the next run starts. */
+		std::set<uint64_t>::iterator writeBackRun(std::set<uint64_t>::iterator);
+		/** Called once a writeback of blocks [first, first + count) has finished. If it failed, the blocks that are
+		 *  still cached are dirty again. */
+		void finishWriteBack(uint64_t first, size_t count, int status);
 	};
 
 	struct StorageController {
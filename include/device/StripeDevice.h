@@ -0,0 +1,89 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "device/Storage.h"
+
+namespace Thorn {
+	/** RAID-0 across several devices. The array's bytes are dealt out to the members a chunk at a time, so a transfer
+	 *  covering several chunks keeps every member busy at once. Members are only accessed through their request
+	 *  queues, never their caches. Each member holds a superblock naming the array and its place in it, which is all
+	 *  assemble() needs to put the array back together. */
+	class StripeDevice: public StorageDeviceBase {
+		public:
+			/** "ThornRD0" */
+			constexpr static uint64_t MAGIC = 0x3044526e726f6854;
+			constexpr static uint32_t VERSION = 1;
+			/** Where each member's superblock is. The first sector is left alone. */
+			constexpr static size_t SUPERBLOCK_OFFSET = 4096;
+			/** Where striped data starts on each member. */
+			constexpr static size_t DATA_OFFSET = 1 << 20;
+			constexpr static size_t MAX_MEMBERS = 32;
+
+			struct Superblock {
+				uint64_t magic;
+				uint32_t version;
+				uint32_t memberCount;
+				uint32_t index;
+				uint32_t chunkSize;
+				uint64_t arrayID;
+				/** How many bytes of each member hold data, starting at DATA_OFFSET. */
+				uint64_t memberSize;
+				uint32_t checksum;
+
+				/** FNV-1a over everything before the checksum. */
+				uint32_t computeChecksum() const;
+				bool valid() const;
+			} __attribute__((packed));
+
+			using Members = std::vector<std::unique_ptr<StorageDevice>>;
+
+			const uint64_t arrayID;
+			const size_t chunkSize;
+			/** Bytes of data on each member. */
+			const size_t memberSize;
+			/** The array's capacity in bytes. */
+			const size_t size;
+
+			StripeDevice(const StripeDevice &) = delete;
+			StripeDevice & operator=(const StripeDevice &) = delete;
+
+			/** Writes new superblocks to the members, which have to be able to hold at least member_size bytes.
+			 *  Returns nullptr if they can't form an array with the given chunk size. */
+			static std::unique_ptr<StripeDevice> create(Members &&, size_t chunk_size, uint64_t member_size);
+
+			/** Puts together every complete array with members among the candidates. Members of the arrays are moved
+			 *  out of the vector, leaving null pointers behind. */
+			static std::vector<std::unique_ptr<StripeDevice>> assemble(Members &candidates);
+
+			int read(void *buffer, size_t size, size_t offset) final;
+			int write(const void *buffer, size_t size, size_t offset) final;
+			int clear(size_t offset, size_t size) final;
+			int discard(size_t offset, size_t size) final;
+			void flush() final;
+			int sync() final;
+			std::string getName() const final;
+			size_t logicalBlockSize() const final;
+			size_t physicalBlockSize() const final;
+
+			inline size_t memberCount() const { return members.size(); }
+			inline StorageDevice & member(size_t index) const { return *members[index]; }
+
+		private:
+			Members members;
+
+			StripeDevice(Members &&, uint64_t array_id, size_t chunk_size, size_t member_size);
+
+			int check(size_t size, size_t offset) const;
+			/** Calls the function with the member, member byte offset, length and array-relative progress of each
+			 *  piece of a range, in array order. No piece crosses a chunk boundary. */
+			template <typename F>
+			void forEachPiece(size_t offset, size_t size, F &&);
+			void plug();
+			void unplug();
+			/** Keeps every member's queue moving until all of them are idle. */
+			void wait();
+			uint64_t errors() const;
+	};
+}
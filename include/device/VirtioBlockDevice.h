@@ -0,0 +1,29 @@
+#pragma once
+
+#include "device/Storage.h"
+#include "hardware/VirtioBlock.h"
+
+namespace Thorn {
+	/** A virtio block device. Like IDEDevice, everything goes through the request queue and nothing is cached. */
+	class VirtioBlockDevice: public StorageDevice {
+		public:
+			Virtio::Block *block;
+
+			VirtioBlockDevice(Virtio::Block *);
+
+			int read(void *buffer, size_t size, size_t offset) final;
+			int write(const void *buffer, size_t size, size_t offset) final;
+			int discard(size_t offset, size_t size) final;
+			void flush() final {}
+			int sync() final;
+			std::string getName() const final;
+			size_t physicalBlockSize() const final;
+			void dispatch(RequestQueue &, BlockRequest &) final;
+			size_t maxBlocks() const final;
+			size_t queueDepth() const final;
+			void poll(RequestQueue &) final;
+
+		private:
+			InFlight inFlight[Virtio::Block::MAX_REQUESTS];
+	};
+}
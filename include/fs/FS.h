@@ -63,14 +63,14 @@ namespace Thorn::FS {
 			virtual int statfs(const char *, DriverStats &) = 0;
 			virtual int utimens(const char *path, const timespec &) = 0;
 			virtual int create(const char *path, mode_t mode) = 0;
-			virtual int write(const char *path, const char *buffer, size_t size, off_t offset) = 0;
+			virtual int write(const char *path, const char *buffer, size_t size, off_t offset, int flags = 0) = 0;
 			virtual int mkdir(const char *path, mode_t mode) = 0;
 			virtual int truncate(const char *path, off_t size) = 0;
 			virtual int ftruncate(const char *path, off_t size) = 0;
 			virtual int rmdir(const char *path) = 0;
 			virtual int unlink(const char *path) = 0;
 			virtual int open(const char *path) = 0;
-			virtual int read(const char *path, void *buffer, size_t size, off_t offset) = 0;
+			virtual int read(const char *path, void *buffer, size_t size, off_t offset, int flags = 0) = 0;
 			virtual int readdir(const char *path, DirFiller filler) = 0;
 			virtual int getattr(const char *path, FileStats &) = 0;
 			virtual int getsize(const char *path, size_t &out) = 0;
@@ -78,6 +78,10 @@ namespace Thorn::FS {
 			virtual int isfile(const char *path) = 0;
 			/** Returns 0 if the file exists or a negative error code otherwise. */
 			virtual int exists(const char *path) = 0;
+			/** Waits until the file's data and metadata are durable. */
+			virtual int fsync(const char *path) = 0;
+			/** Waits until everything written to the filesystem is durable. */
+			virtual int sync() = 0;
 			/** Does this partition contain a valid instance of the filesystem? */
 			virtual bool verify() = 0;
 			virtual void cleanup() = 0;
@@ -9,6 +9,13 @@ namespace Thorn {
 
 namespace Thorn::FS {
 
+	/** Flags for Partition::read and write and the filesystem calls that lead to them. */
+	enum IOFlags: int {
+		/** Moves data between the caller's buffer and the device without keeping it in the page cache, so that a
+		 *  large transfer doesn't push out everything else. Filesystems still cache their metadata. */
+		IO_DIRECT = 1,
+	};
+
 	struct Record {
 		size_t size;
 		size_t offset;
@@ -27,8 +34,29 @@ namespace Thorn::FS {
 		Partition(StorageDeviceBase *parent_, size_t offset_, size_t length_):
 			parent(parent_), offset(offset_), length(length_) {}
 
-		int read(void *buffer, size_t size, size_t byte_offset);
-		int write(const void *buffer, size_t size, size_t byte_offset);
+		/** Returns the parent device's logical block size. The offset and length are multiples of it. */
+		size_t blockSize() const;
+
+		int read(void *buffer, size_t size, size_t byte_offset, int flags = 0);
+		int write(const void *buffer, size_t size, size_t byte_offset, int flags = 0);
 		int clear();
+		int discard(size_t byte_offset, size_t size);
+		/** See StorageDeviceBase::view. */
+		const void * view(size_t byte_offset, size_t size) const;
+		/** Makes everything written to the parent device so far durable. */
+		int sync();
+		/** Writes a range and waits until it's durable. See StorageDeviceBase::writeFUA. */
+		int writeFUA(const void *buffer, size_t size, size_t byte_offset);
+
+		/** Plugs the parent device's request queue, if it has one, so that a burst of writes can merge. */
+		void plug();
+		void unplug();
+
+		/** Keeps the partition plugged for as long as it exists. */
+		struct Plug {
+			Partition &partition;
+			Plug(Partition &partition_): partition(partition_) { partition.plug(); }
+			~Plug() { partition.unplug(); }
+		};
 	};
 }
\ No newline at end of file
@@ -20,6 +20,12 @@ namespace Thorn::FS::ThornFAT {
 			ssize_t blocksFree = -1;
 			DirEntry root;
 			size_t writeOffset = 0;
+			/** Blocks freed since the last discardFreed(), as (first block, count) extents. */
+			std::vector<std::pair<block_t, size_t>> freedExtents;
+			/** Cleared once the partition turns down a discard, so that freed blocks stop being tracked. */
+			bool canDiscard = true;
+			/** Whether the partition's device can expose its bytes with view(), as RAM disks can. */
+			bool canView = false;
 			/** Ugly hack to avoid allocating memory on the heap because I'm too lazy to deal with freeing it. */
 			DirEntry overflow[OVERFLOW_MAX];
 			size_t overflowIndex = 0;
@@ -47,6 +53,13 @@ namespace Thorn::FS::ThornFAT {
 			 *  Returns the number of blocks that were freed. */
 			size_t forget(block_t start);
 
+			/** Notes that a block has been freed so that it can be discarded later. */
+			void freed(block_t);
+
+			/** Discards the blocks freed since the last call that are still free, coalesced into extents. Called by
+			 *  sync() once the FAT updates that freed them are on the disk. */
+			void discardFreed();
+
 			/** Returns the length of a chain of blocks. Returns the length of the chain (including the first block). */
 			size_t chainLength(block_t start);
 
@@ -197,24 +210,31 @@ namespace Thorn::FS::ThornFAT {
 			virtual int statfs(const char *, DriverStats &) override;
 			virtual int utimens(const char *path, const timespec &) override;
 			virtual int create(const char *path, mode_t modes) override;
-			virtual int write(const char *path, const char *buffer, size_t size, off_t offset) override;
+			virtual int write(const char *path, const char *buffer, size_t size, off_t offset, int flags = 0)
+				override;
 			virtual int mkdir(const char *path, mode_t mode) override;
 			virtual int truncate(const char *path, off_t size) override;
 			virtual int ftruncate(const char *path, off_t size) override;
 			virtual int rmdir(const char *path) override;
 			virtual int unlink(const char *path) override;
 			virtual int open(const char *path) override;
-			virtual int read(const char *path, void *buffer, size_t size, off_t offset) override;
+			virtual int read(const char *path, void *buffer, size_t size, off_t offset, int flags = 0) override;
 			virtual int readdir(const char *path, DirFiller filler) override;
 			virtual int getattr(const char *path, FileStats &) override;
 			virtual int getsize(const char *path, size_t &out) override;
 			virtual int isdir(const char *path) override;
 			virtual int isfile(const char *path) override;
 			virtual int exists(const char *path) override;
+			virtual int fsync(const char *path) override;
+			virtual int sync() override;
 			virtual bool verify() override;
 			virtual void cleanup() override {}
 			bool make(uint32_t block_size);
 
+			/** Discards every free block in the filesystem. Returns the number of bytes discarded or a negative error
+			 *  code. */
+			ssize_t trim();
+
 			ThornFATDriver(Partition *);
 	};
 }
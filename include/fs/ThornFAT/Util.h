@@ -39,6 +39,9 @@ namespace Thorn::FS::ThornFAT::Util {
 
 	std::optional<std::string> pathParent(const char *);
 
+	/** Returns the current time in seconds since the Unix epoch, or CONSTANT_TIME if it's defined. */
+	long now();
+
 	inline size_t blocks2count(const size_t blocks, const size_t block_size) {
 		// The blocksize is in bytes, so we divide it by sizeof(block) to get the number of words.
 		// Multiply that by the number of blocks to get how many block_t's would take up that many blocks.
@@ -27,6 +27,7 @@ namespace Thorn::AHCI {
 	constexpr uint32_t HBA_PxCMD_ST  = 0x0001; // Start
 	constexpr uint32_t HBA_PxCMD_SUD = 0x0002;
 	constexpr uint32_t HBA_PxCMD_POD = 0x0004;
+	constexpr uint32_t HBA_PxCMD_CLO = 0x0008; // Command List Override
 	constexpr uint32_t HBA_PxCMD_FRE = 0x0010; // FIS Receive Enable
 	constexpr uint32_t HBA_PxCMD_FR  = 0x4000; // FIS Receive Running
 	constexpr uint32_t HBA_PxCMD_CR  = 0x8000; // Command List Running
@@ -34,7 +35,18 @@ namespace Thorn::AHCI {
 	constexpr uint32_t HBA_PxCMD_ICC = 0xf << 28;
 	constexpr uint32_t HBA_PxCMD_ICC_ACTIVE = 1 << 28;
 
-	constexpr uint32_t HBA_PxIS_TFES = 1 << 30;
+	constexpr uint32_t HBA_PxIS_DHRS = 1 << 0;  // Device to host register FIS
+	constexpr uint32_t HBA_PxIS_PSS  = 1 << 1;  // PIO setup FIS
+	constexpr uint32_t HBA_PxIS_DSS  = 1 << 2;  // DMA setup FIS
+	constexpr uint32_t HBA_PxIS_SDBS = 1 << 3;  // Set device bits FIS
+	constexpr uint32_t HBA_PxIS_IFS  = 1 << 27; // Interface fatal error
+	constexpr uint32_t HBA_PxIS_HBDS = 1 << 28; // Host bus data error
+	constexpr uint32_t HBA_PxIS_HBFS = 1 << 29; // Host bus fatal error
+	constexpr uint32_t HBA_PxIS_TFES = 1 << 30; // Task file error
+
+	/** The port interrupts needed to notice command completion and errors. */
+	constexpr uint32_t HBA_PxIE_DEFAULT = HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | HBA_PxIS_SDBS | HBA_PxIS_IFS
+		| HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES;
 
 	constexpr uint8_t HBA_PxSSTS_DET = 0xfULL;
 	constexpr uint8_t HBA_PxSSTS_DET_PRESENT = 3;
@@ -42,6 +54,8 @@ namespace Thorn::AHCI {
 	constexpr uint8_t ATA_DEV_BUSY = 0x80;
 	constexpr uint8_t ATA_DEV_DRQ  = 0x08;
 
+	constexpr uint32_t CCC_CTL_EN = 1 << 0; // Command completion coalescing enable
+
 	constexpr uint32_t GHC_ENABLE = 1 << 31;
 	constexpr uint32_t GHC_IE = 1 << 1; // Interrupts Enable
 	constexpr uint32_t GHC_HR = 1 << 0; // HBA Reset
@@ -49,9 +63,11 @@ namespace Thorn::AHCI {
 	constexpr uint32_t CAP_S64A = 1 << 31; // 64-bit addressing
 	constexpr uint32_t CAP_NCQ  = 1 << 30; // Support for Native Command Queueing
 	constexpr uint32_t CAP_SSS  = 1 << 27; // Supports staggered spin-up
+	constexpr uint32_t CAP_SCLO = 1 << 24; // Supports command list override
 	constexpr uint32_t CAP_FBSS = 1 << 16; // FIS-based switching supported
 	constexpr uint32_t CAP_SSC  = 1 << 14; // Slumber state capable
 	constexpr uint32_t CAP_PSC  = 1 << 13; // Partial state capable
+	constexpr uint32_t CAP_CCCS = 1 << 7;  // Supports command completion coalescing
 	constexpr uint32_t CAP_SALP = 1 << 26; // Supports aggressive link power management
 
 	enum {
@@ -358,45 +374,191 @@ namespace Thorn::AHCI {
 	class Controller;
 
 	class Port {
+		public:
+			/** BadBuffer means the buffer isn't mapped or the pieces of it that can't be used for DMA directly don't
+			 *  fit in a bounce buffer. */
+			enum class AccessStatus: uint8_t {Success = 0, DiskError = 1, BadSlot = 2, Hung = 3, BadBuffer = 4,
+				Unsupported = 5};
+			/** Called when a queued command finishes. Runs in interrupt context if the port is interrupt-driven. */
+			using Completion = void (*)(void *data, AccessStatus);
+
+			/** A run of sectors for trim(). */
+			struct TrimRange {
+				uint64_t lba;
+				uint64_t count;
+			};
+
 		private:
 			ATA::DeviceInfo info;
-			bool identified;
+			bool identified = false;
+			/** The logical sector size, which is what LBAs and sector counts are in. Set by getInfo(). */
+			uint32_t sectorSize = ATA_BLOCKSIZE;
+
+			struct QueuedCommand {
+				Completion completion = nullptr;
+				void *data = nullptr;
+				/** How many times the command has been reissued after another command's error aborted it. */
+				uint8_t retries = 0;
+			};
+
+			QueuedCommand queued[32];
+			/** NCQ tags that have been issued and not yet reaped. */
+			volatile uint32_t activeTags = 0;
+			/** Incremented whenever queued commands are reaped, so waiters can tell that progress was made. */
+			volatile uint64_t reaped = 0;
+			/** Set while reap() recovers from an error and completes the tags it failed, so the interrupt handler
+			 *  doesn't reap them first as if they'd succeeded. */
+			volatile bool recovering = false;
+
+			/** Waits for the device to clear BSY and DRQ. Returns false if it doesn't do so in time. */
+			bool waitIdle();
+
+			/** Waits for the commands in the given slot mask to leave PxCI or for a task file error. If the controller
+			 *  has an interrupt vector and interrupts are enabled, the CPU halts between interrupts instead of spinning.
+			 *  Returns false on timeout. */
+			bool waitForCompletion(uint32_t mask);
+			uint32_t interruptStatus() const;
+
+			/** Halts between interrupts (or spins if the port is polled) until the predicate holds or the timeout
+			 *  expires. With hybrid polling, spins for a while first if recent waits were short. */
+			template <typename P>
+			bool sleepUntil(P predicate);
+
+			/** Fills in the command header and FIS for a read or write in the given slot. A FUA write isn't complete
+			 *  until the data is on the medium, rather than in the device's write cache. */
+			void prepare(int slot, uint64_t lba, uint32_t count, bool write, bool queued, bool fua = false);
+
+			/** A piece of a caller's buffer that a command moves through its slot's bounce buffer instead. */
+			struct Fragment {
+				char *data;
+				size_t offset;
+				size_t bytes;
+			};
+
+			/** Builds the slot's PRDT from the physical pages behind a buffer, merging physically contiguous pages.
+			 *  If bounced isn't null, pieces that aren't word-aligned are mapped to the slot's bounce buffer and listed
+			 *  there. Returns false if part of the buffer isn't mapped, can't be used or needs too many entries. */
+			bool mapBuffer(int slot, const void *buffer, size_t bytes, std::vector<Fragment> *bounced = nullptr);
+
+			/** Issues the non-queued command prepared in the slot and waits for it, recovering the port on failure. */
+			AccessStatus issue(int slot);
+
+			/** Waits for every queued command to finish, since non-queued commands can't be issued alongside them.
+			 *  Returns false if they hang. */
+			bool drainQueued();
+
+			/** Recovers the port after an error: stops the command list, clears the error, unsticks the device with
+			 *  CLO or a COMRESET if it's still busy and restarts the engine. Queued commands that the error aborted are
+			 *  reissued; returns the tags that failed for good. */
+			uint32_t recover();
+
+			/** Reads the NCQ error log after an NCQ error, which also lets the device accept commands again. Returns
+			 *  the failed tag, or -1 if it can't be determined. Requires the engine to be running. */
+			int readNCQError();
+
+			/** Issues a COMRESET and waits for the device to come back. Returns false if it doesn't. */
+			bool resetDevice();
 
 		public:
-			constexpr static size_t BLOCKSIZE = 512;
+			/** IDENTIFY data, log pages and DATA SET MANAGEMENT payloads are in 512-byte blocks whatever the sector
+			 *  size is. */
+			constexpr static size_t ATA_BLOCKSIZE = 512;
 
 			Controller *parent = nullptr;
 			volatile HBAPort *registers = nullptr;
 			volatile HBAMemory *abar = nullptr;
 			volatile HBACommandHeader *commandList = nullptr;
 			volatile HBAFIS *fis = nullptr;
-			volatile HBACommandTable *commandTables[8];
-			void *physicalBuffers[8];
+			constexpr static size_t MAX_SLOTS = 32;
+			/** Each command table gets one page, which leaves room for this many PRDT entries after the header. */
+			constexpr static size_t PRDT_ENTRIES = (4096 - 0x80) / sizeof(HBAPRDTEntry);
+			constexpr static uint32_t PRDT_MAX_BYTES = 4 << 20;
+			/** The largest transfer that's guaranteed to fit in the PRDT however fragmented the buffer is. */
+			constexpr static uint32_t MAX_TRANSFER = (PRDT_ENTRIES - 1) * 4096;
+			/** Bounce buffers are one page each. */
+			constexpr static uint32_t BOUNCE_SIZE = 4096;
+
+			volatile HBACommandTable *commandTables[MAX_SLOTS];
+			void *physicalBuffers[MAX_SLOTS];
 			Status status = Status::Uninitialized;
 			DeviceType type = DeviceType::Null;
+			/** PxIS bits collected and cleared by the interrupt handler since the last command was issued. */
+			volatile uint32_t pendingStatus = 0;
+			/** Whether to sleep until the completion interrupt rather than polling PxCI. */
+			bool interruptDriven = false;
+			/** Cycles spent halted while waiting for completion interrupts. */
+			uint64_t idleCycles = 0;
+			/** Whether the port's completions are reported through command completion coalescing. If so, the port
+			 *  itself only interrupts for errors. Set by Controller::setCoalescing. */
+			bool coalesced = false;
+			/** Waits whose running average is at most this many nanoseconds start by spinning for up to this long
+			 *  before the CPU halts. Zero turns hybrid polling off. */
+			uint64_t hybridPollNanos = 0;
+			/** Exponentially weighted average of how long waits for completion took, in nanoseconds. */
+			uint64_t averageWait = 0;
+			/** How many waits ended while spinning and how many had to halt. */
+			uint64_t polledWaits = 0;
+			uint64_t sleptWaits = 0;
 
 			Port(Controller *, volatile HBAPort *, volatile HBAMemory *);
 
-			enum class AccessStatus: uint8_t {Success = 0, DiskError = 1, BadSlot = 2, Hung = 3};
-
 			inline bool valid() const { return registers && abar; }
 			void init();
 			DeviceType identifyDevice();
 			void identify(ATA::DeviceInfo &);
 			int getCommandSlot();
+			/** Returns the number of command slots the HBA supports (CAP.NCS + 1). */
+			int slotCount() const;
+			/** Returns the number of NCQ commands that can be in flight at once, or 0 if the HBA or device lacks NCQ.
+			 *  The last command slot is kept back so that the error log can be read during recovery. */
+			int queueDepth();
+			inline uint32_t outstanding() const { return activeTags; }
 			void rebase();
+			/** Starts the command engine. It's started once when the port is set up and left running; stop() is only
+			 *  for error recovery and shutdown. */
 			void start();
 			void stop();
+			inline bool running() const { return registers->cmd & HBA_PxCMD_ST; }
 			void setCLB(uintptr_t);
 			uintptr_t getCLB() const;
 			void setFB(uintptr_t);
 			uintptr_t getFB() const;
-			AccessStatus access(uint64_t lba, uint32_t count, void *buffer, bool write);
+			AccessStatus access(uint64_t lba, uint32_t count, void *buffer, bool write, bool fua = false);
 			AccessStatus read(uint64_t lba, uint32_t count, void *buffer);
 			AccessStatus readBytes(size_t count, size_t offset, void *buffer);
-			AccessStatus write(uint64_t lba, uint32_t count, const void *buffer);
+			/** Writes sectors. With fua set, the write bypasses the device's write cache; the caller has to check
+			 *  ATA::DeviceInfo::fua() first. */
+			AccessStatus write(uint64_t lba, uint32_t count, const void *buffer, bool fua = false);
+			/** Makes the device persist everything in its write cache with FLUSH CACHE EXT, or FLUSH CACHE if it's
+			 *  limited to 28-bit commands. */
+			AccessStatus flushCache();
+			/** Tells the device the sectors no longer hold anything useful, using DATA SET MANAGEMENT with as many
+			 *  ranges per command as the device accepts. */
+			AccessStatus trim(const TrimRange *, size_t count);
 			AccessStatus writeBytes(size_t count, size_t offset, const void *buffer);
+			/** Issues a READ/WRITE FPDMA QUEUED command without waiting for it. The buffer must be physically
+			 *  contiguous and identity-mapped; if it's null, the tag's bounce buffer is used. Returns the tag or -1 if
+			 *  all tags are busy. */
+			int issueQueued(uint64_t lba, uint32_t count, void *buffer, bool write, Completion, void *data);
+			/** Runs the callbacks of queued commands that have finished, recovering from an error first if there was
+			 *  one. Recovery can take a second, so the interrupt handler leaves errors for this to handle in thread
+			 *  context. */
+			void reap();
+			/** Waits until at least one queued command has finished and been reaped. Returns false on timeout. */
+			bool waitQueued();
 			ATA::DeviceInfo & getInfo();
+			/** Returns the logical sector size in bytes. Identifies the device if it hasn't been yet. */
+			size_t blockSize();
+			/** Returns the physical sector size in bytes. */
+			size_t physicalBlockSize();
+			/** The most sectors a single command can move, however fragmented the buffer is. */
+			uint32_t maxSectors();
+			/** How many sectors fit in a bounce buffer. Zero if a sector is bigger than a page. */
+			uint32_t bounceSectors();
+			/** Collects and acknowledges the port's interrupt status. Called from the controller's interrupt handler. */
+			void handleInterrupt();
+			/** The PxIE value for the port's current completion mode. */
+			uint32_t interruptEnables() const;
 	};
 
 	class Controller {
@@ -404,10 +566,22 @@ namespace Thorn::AHCI {
 			PCI::Device *device;
 			HBAMemory *abar;
 			Port *ports[32];
+			/** The controller's MSI vector, or 0xff if it has none and ports have to be polled. */
+			uint8_t irq = 0xff;
+			/** The bit in the HBA's IS register that command completion coalescing sets, or -1 if it's off. */
+			int cccInterrupt = -1;
+			/** How many times the interrupt handler has run. */
+			volatile uint64_t interrupts = 0;
 
 			Controller(PCI::Device *);
 
 			void init(Kernel &);
+			/** Turns on command completion coalescing for the ports in the mask: one interrupt once `completions`
+			 *  commands have finished, or `timeout_ms` milliseconds after the first of them if fewer do. Returns
+			 *  false if the HBA doesn't support it or the controller has no interrupt vector. */
+			bool setCoalescing(uint32_t port_mask, uint8_t completions, uint16_t timeout_ms);
+			void disableCoalescing();
+			static void interrupt(void *controller);
 	};
 
 	extern std::vector<Controller> controllers;
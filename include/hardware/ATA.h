@@ -23,6 +23,7 @@ namespace Thorn::ATA {
 	enum class Command: uint8_t {
 		NOP = 0x00,
 		CFARequestExtendedError = 0x03,
+		DataSetManagement = 0x06,
 		DeviceReset = 0x08,
 		ReadSectors = 0x20,
 		ReadSectorsExt = 0x24,
@@ -55,6 +56,8 @@ namespace Thorn::ATA {
 		TrustedReceiveDMA = 0x5d,
 		TrustedSend = 0x5e,
 		TrustedSendDMA = 0x5f,
+		ReadFPDMAQueued = 0x60,
+		WriteFPDMAQueued = 0x61,
 		CFATranslateSector = 0x87,
 		ExecuteDeviceDiagnostic = 0x90,
 		DownloadMicrocode = 0x92,
@@ -143,7 +146,8 @@ namespace Thorn::ATA {
 		uint16_t word69_70[2];
 		uint16_t word71_74[4];
 		uint16_t queueDepth;
-		uint16_t word76_79[4];
+		uint16_t sataCapabilities;
+		uint16_t word77_79[3];
 		uint16_t majorVersion;
 		uint16_t minorVersion;
 		uint16_t commandSets[2];
@@ -161,7 +165,7 @@ namespace Thorn::ATA {
 		uint16_t streamPerfGran[2];
 		uint16_t sectors48[4];
 		uint16_t streamTransferTimePio;
-		uint16_t word105;
+		uint16_t maxDSMBlocks;
 		uint16_t logSectsPerPhys;
 		uint16_t interSeekDelay;
 		uint16_t naaIeeeOui;
@@ -174,7 +178,9 @@ namespace Thorn::ATA {
 		uint16_t secStatus;
 		uint16_t word129_159[31];
 		uint16_t cfaPowerMode;
-		uint16_t word161_175[15];
+		uint16_t word161_168[8];
+		uint16_t dataSetManagement;
+		uint16_t word170_175[6];
 		uint16_t mediaSerial[30];
 		uint16_t sctCommandTransport;
 		uint16_t word207_208[2];
@@ -198,5 +204,25 @@ namespace Thorn::ATA {
 
 		/** The destination string should have a capacity of at least 41 bytes. */
 		void copyModel(char *);
+		uint64_t sectorCount() const;
+		/** Returns whether the device supports native command queueing. */
+		bool ncq() const;
+		/** Returns whether the device supports the TRIM function of DATA SET MANAGEMENT. */
+		bool trim() const;
+		/** Returns how many 512-byte blocks of LBA range entries a DATA SET MANAGEMENT command may carry. */
+		uint16_t dsmBlocks() const;
+		/** Returns whether the device supports WRITE DMA FUA EXT and the FUA bit of WRITE FPDMA QUEUED. */
+		bool fua() const;
+		/** Returns whether the device supports FLUSH CACHE EXT. */
+		bool flushCacheExt() const;
+		/** Returns whether the device has a volatile write cache that's currently enabled. */
+		bool writeCache() const;
+		/** Returns the size in bytes of the unit LBAs count, from words 106 and 117-118. */
+		uint32_t logicalSectorSize() const;
+		/** Returns the size in bytes of the unit the medium is written in, which is a power-of-two multiple of the
+		 *  logical sector size. Writes that don't cover whole physical sectors make the device read-modify-write. */
+		uint32_t physicalSectorSize() const;
+		/** Returns which logical sector within the first physical sector LBA 0 is, from word 209. */
+		uint16_t alignmentOffset() const;
 	};
 }
\ No newline at end of file
@@ -3,10 +3,14 @@
 #include <cstddef>
 #include <cstdint>
 
-extern volatile bool irqInvoked;
-
 namespace Thorn::IDE {
 	constexpr size_t SECTOR_SIZE = 512;
+	/** How long to wait for BSY to clear before giving up, in microseconds. */
+	constexpr uint64_t TIMEOUT = 1'000'000;
+	/** Each channel's PRD table takes up one page. */
+	constexpr size_t PRDT_ENTRIES = 4096 / 8;
+	/** Enough for the largest transfer a single command can make. */
+	constexpr size_t DMA_BUFFER_SIZE = 256 * SECTOR_SIZE;
 
 	// Status codes
 	constexpr uint8_t ATA_SR_BSY = 0x80;
@@ -37,6 +41,11 @@ namespace Thorn::IDE {
 	constexpr uint8_t ATA_CMD_WRITE_PIO_EXT = 0x34;
 	constexpr uint8_t ATA_CMD_WRITE_DMA = 0xca;
 	constexpr uint8_t ATA_CMD_WRITE_DMA_EXT = 0x35;
+	constexpr uint8_t ATA_CMD_READ_MULTIPLE = 0xc4;
+	constexpr uint8_t ATA_CMD_READ_MULTIPLE_EXT = 0x29;
+	constexpr uint8_t ATA_CMD_WRITE_MULTIPLE = 0xc5;
+	constexpr uint8_t ATA_CMD_WRITE_MULTIPLE_EXT = 0x39;
+	constexpr uint8_t ATA_CMD_SET_MULTIPLE = 0xc6;
 	constexpr uint8_t ATA_CMD_CACHE_FLUSH = 0xe7;
 	constexpr uint8_t ATA_CMD_CACHE_FLUSH_EXT = 0xea;
 	constexpr uint8_t ATA_CMD_PACKET = 0xa0;
@@ -53,6 +62,7 @@ namespace Thorn::IDE {
 	constexpr uint8_t ATA_IDENT_SECTORS = 12;
 	constexpr uint8_t ATA_IDENT_SERIAL = 20;
 	constexpr uint8_t ATA_IDENT_MODEL = 54;
+	constexpr uint8_t ATA_IDENT_MAX_MULTIPLE = 94;
 	constexpr uint8_t ATA_IDENT_CAPABILITIES = 98;
 	constexpr uint8_t ATA_IDENT_FIELDVALID = 106;
 	constexpr uint8_t ATA_IDENT_MAX_LBA = 120;
@@ -77,6 +87,21 @@ namespace Thorn::IDE {
 	constexpr uint8_t ATA_REG_CONTROL = 0x0c;
 	constexpr uint8_t ATA_REG_ALTSTATUS = 0x0c;
 	constexpr uint8_t ATA_REG_DEVADDRESS = 0x0d;
+	constexpr uint8_t ATA_REG_BMCOMMAND = 0x0e;
+	constexpr uint8_t ATA_REG_BMSTATUS = 0x10;
+	/** The PRD table address is 32 bits wide, so it's written with outl rather than write(). */
+	constexpr uint8_t ATA_REG_BMPRDT = 0x12;
+
+	// Bus master command and status bits
+	constexpr uint8_t BM_CMD_START = 0x01;
+	/** Set when the controller writes to memory, i.e. for reads from the drive. */
+	constexpr uint8_t BM_CMD_READ = 0x08;
+	constexpr uint8_t BM_SR_ACTIVE = 0x01;
+	constexpr uint8_t BM_SR_ERR = 0x02;
+	constexpr uint8_t BM_SR_IRQ = 0x04;
+
+	/** Marks the last entry in a PRD table. */
+	constexpr uint16_t PRD_EOT = 0x8000;
 
 	// Channels
 	constexpr uint8_t ATA_PRIMARY = 0x00;
@@ -101,25 +126,47 @@ namespace Thorn::IDE {
 		uint16_t capabilities; // Features
 		uint32_t commandSets;  // Command sets supported
 		uint32_t size;         // Size in sectors
+		uint8_t  multiple;     // Sectors per DRQ block for READ/WRITE MULTIPLE, or 0 if not enabled
+		bool     dma;          // Whether bus-master DMA can be used
 		char     model[41];    // Model string
 	};
 
+	/** A physical region descriptor: one piece of a bus-master transfer. It may not cross a 64 KiB boundary. */
+	struct PRDEntry {
+		uint32_t address;
+		/** 0 means 64 KiB. */
+		uint16_t bytes;
+		uint16_t flags;
+	} __attribute__((packed));
+
 	struct ChannelRegisters {
 		uint16_t base;  // I/O Base.
 		uint16_t ctrl;  // Control Base
 		uint16_t bmide; // Bus Master IDE
 		uint8_t  nIEN;  // nIEN (No Interrupt);
+		volatile PRDEntry *prdt;
+		uintptr_t prdtPhysical;
+		/** Used for DMA when the caller's buffer can't be handed to the controller. */
+		char *dmaBuffer;
+		/** Set by the channel's IRQ handler. */
+		volatile bool irq;
 	};
 
 	extern Device devices[4];
+	/** Lets bus-master DMA be turned off to compare it against PIO. */
+	extern bool dmaEnabled;
 
 	int init();
 	int readSectors(uint8_t drive, uint8_t numsects, uint32_t lba, char *buffer);
 	int writeSectors(uint8_t drive, uint8_t numsects, uint32_t lba, const void *buffer);
 	int readBytes(uint8_t drive, size_t bytes, size_t offset, void *buffer);
 	int writeBytes(uint8_t drive, size_t bytes, size_t offset, const void *buffer);
+	/** Makes the drive persist its write cache. Returns 0 or a negative error code. */
+	int flushCache(uint8_t drive);
 
 	int init(uint32_t bar0, uint32_t bar1, uint32_t bar2, uint32_t bar3, uint32_t bar4);
+	/** Called from IRQ14 and IRQ15. */
+	void handleIRQ(uint8_t channel);
 	uint8_t read(uint8_t channel, uint8_t reg);
 	void write(uint8_t channel, uint8_t reg, uint8_t data);
 	void readBuffer(uint8_t channel, uint8_t reg, void *buffer, uint32_t quads);
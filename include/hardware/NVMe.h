@@ -0,0 +1,278 @@
+#pragma once
+
+// Based on the NVM Express Base Specification, Revision 1.4.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "hardware/PCI.h"
+
+namespace Thorn::NVMe {
+	constexpr uint32_t PCI_SUBCLASS = 8;
+
+	// Controller registers
+	constexpr size_t REG_CAP   = 0x00;
+	constexpr size_t REG_VS    = 0x08;
+	constexpr size_t REG_INTMS = 0x0c;
+	constexpr size_t REG_CC    = 0x14;
+	constexpr size_t REG_CSTS  = 0x1c;
+	constexpr size_t REG_AQA   = 0x24;
+	constexpr size_t REG_ASQ   = 0x28;
+	constexpr size_t REG_ACQ   = 0x30;
+	constexpr size_t REG_DOORBELLS = 0x1000;
+
+	constexpr uint32_t CC_ENABLE = 1;
+	constexpr uint32_t CC_IOSQES = 6 << 16; // 64-byte submission entries
+	constexpr uint32_t CC_IOCQES = 4 << 20; // 16-byte completion entries
+	constexpr uint32_t CSTS_READY = 1;
+	constexpr uint32_t CSTS_FATAL = 2;
+
+	// Admin commands
+	constexpr uint8_t ADMIN_CREATE_SQ = 0x01;
+	constexpr uint8_t ADMIN_DELETE_CQ = 0x04;
+	constexpr uint8_t ADMIN_CREATE_CQ = 0x05;
+	constexpr uint8_t ADMIN_IDENTIFY = 0x06;
+	constexpr uint8_t ADMIN_SET_FEATURES = 0x09;
+
+	constexpr uint32_t IDENTIFY_NAMESPACE = 0;
+	constexpr uint32_t IDENTIFY_CONTROLLER = 1;
+	constexpr uint32_t IDENTIFY_ACTIVE_NAMESPACES = 2;
+	constexpr uint32_t FEATURE_NUMBER_OF_QUEUES = 0x07;
+
+	// NVM commands
+	constexpr uint8_t CMD_FLUSH = 0x00;
+	constexpr uint8_t CMD_WRITE = 0x01;
+	constexpr uint8_t CMD_READ = 0x02;
+	constexpr uint8_t CMD_DATASET_MANAGEMENT = 0x09;
+
+	constexpr uint32_t RW_FUA = 1u << 30;
+	constexpr uint32_t DSM_DEALLOCATE = 1u << 2;
+	constexpr uint16_t ONCS_DSM = 1u << 2;
+
+	/** PSDT values in command dword 0. */
+	constexpr uint32_t PSDT_PRP = 0;
+	constexpr uint32_t PSDT_SGL = 1u << 14;
+
+	constexpr uint8_t SGL_DATA_BLOCK = 0x00;
+	constexpr uint8_t SGL_LAST_SEGMENT = 0x30;
+
+	constexpr size_t PAGE_SIZE = 4096;
+	/** The most I/O queue pairs to create, whatever the CPU count. */
+	constexpr uint16_t MAX_IO_QUEUES = 16;
+	constexpr uint16_t NO_VECTOR = 0xffff;
+
+	/** How long to wait for a command before giving up, in microseconds. */
+	constexpr uint64_t TIMEOUT = 1'000'000;
+
+	struct SubmissionEntry {
+		uint32_t cdw0;
+		uint32_t nsid;
+		uint32_t cdw2;
+		uint32_t cdw3;
+		uint64_t metadata;
+		uint64_t dptr1;
+		uint64_t dptr2;
+		uint32_t cdw10;
+		uint32_t cdw11;
+		uint32_t cdw12;
+		uint32_t cdw13;
+		uint32_t cdw14;
+		uint32_t cdw15;
+	} __attribute__((packed));
+
+	struct CompletionEntry {
+		uint32_t result;
+		uint32_t reserved;
+		uint16_t sqHead;
+		uint16_t sqID;
+		uint16_t commandID;
+		/** Bit 0 is the phase tag; the rest is the status field. */
+		uint16_t status;
+	} __attribute__((packed));
+
+	struct SGLDescriptor {
+		uint64_t address;
+		uint32_t length;
+		uint8_t  reserved[3];
+		uint8_t  type;
+	} __attribute__((packed));
+
+	struct DSMRange {
+		uint32_t attributes;
+		uint32_t blocks;
+		uint64_t lba;
+	} __attribute__((packed));
+
+	static_assert(sizeof(SubmissionEntry) == 64);
+	static_assert(sizeof(CompletionEntry) == 16);
+	static_assert(sizeof(SGLDescriptor) == 16);
+
+	/** Every transfer has to fit in one page of PRP entries or SGL descriptors, even if it's unaligned. */
+	constexpr size_t MAX_TRANSFER = (PAGE_SIZE / sizeof(SGLDescriptor) - 1) * PAGE_SIZE;
+
+	class Controller;
+
+	/** A submission queue and the completion queue it posts to. Each queue gets one page, so it holds at most 64
+	 *  commands. Commands are queued with issue() and only reach the controller once the doorbell is rung, so a
+	 *  burst of them costs one MMIO write. Completions run from reap(), never in an interrupt handler. */
+	class QueuePair {
+		public:
+			using Completion = void (*)(void *data, int status);
+
+			constexpr static uint16_t MAX_SIZE = PAGE_SIZE / sizeof(SubmissionEntry);
+
+			struct Stats {
+				uint64_t commands = 0;
+				uint64_t doorbells = 0;
+				uint64_t interrupts = 0;
+				/** Waits that ended without needing an interrupt. */
+				uint64_t polledWaits = 0;
+				uint64_t sleptWaits = 0;
+			};
+
+			Controller &controller;
+			const uint16_t id;
+			uint16_t size = 0;
+			uint8_t irq = 0xff;
+			Stats stats;
+
+			QueuePair(Controller &, uint16_t id_);
+			QueuePair(const QueuePair &) = delete;
+			QueuePair & operator=(const QueuePair &) = delete;
+
+			/** Allocates the queues and a scratch page per command. Returns false if there wasn't memory. */
+			bool init(uint16_t size_);
+			inline uintptr_t submissionAddress() const { return reinterpret_cast<uintptr_t>(submissions); }
+			inline uintptr_t completionAddress() const { return reinterpret_cast<uintptr_t>(completions); }
+
+			/** Queues a command after pointing it at the buffer. The command ID is filled in here, and the command's
+			 *  result dword is stored in `result` if it isn't null. Returns false if the queue is full, in which case
+			 *  nothing was queued and the caller can wait() and try again. */
+			bool issue(SubmissionEntry &, void *buffer, size_t bytes, Completion, void *data,
+			           uint32_t *result = nullptr);
+			/** Tells the controller about the commands queued since the last ring. */
+			void ring();
+			/** Runs the completions of whatever the controller has finished. */
+			void reap();
+			/** Rings the doorbell if needed, waits until something finishes and reaps it. Returns false on timeout. */
+			bool wait();
+			/** Issues a command and waits for it to finish. */
+			int access(SubmissionEntry &, void *buffer, size_t bytes, uint32_t *result = nullptr);
+			/** Whether the controller has posted a completion that reap() hasn't handled yet. */
+			bool hasCompletion() const;
+
+			inline size_t outstanding() const { return __builtin_popcountl(busy); }
+			/** How many commands can be outstanding at once. A full queue keeps one entry empty. */
+			inline size_t slots() const { return size - 1; }
+
+		private:
+			struct Pending {
+				Completion completion = nullptr;
+				void *data = nullptr;
+				uint32_t *result = nullptr;
+			};
+
+			volatile SubmissionEntry *submissions = nullptr;
+			volatile CompletionEntry *completions = nullptr;
+			volatile uint32_t *submissionDoorbell = nullptr;
+			volatile uint32_t *completionDoorbell = nullptr;
+			uint16_t tail = 0;
+			/** The tail as of the last ring. */
+			uint16_t rungTail = 0;
+			uint16_t head = 0;
+			uint16_t phase = 1;
+			uint64_t busy = 0;
+			/** A page per command ID for its PRP or SGL list. */
+			uintptr_t lists[MAX_SIZE] {};
+			Pending pending[MAX_SIZE];
+
+			static void interrupt(void *);
+			friend class Controller;
+			/** Fills in the command's data pointer with PRPs or an SGL. Returns false if the buffer can't be mapped. */
+			bool mapData(SubmissionEntry &, uintptr_t list, void *buffer, size_t bytes);
+			bool mapPRP(SubmissionEntry &, uintptr_t list, uintptr_t buffer, size_t bytes);
+			bool mapSGL(SubmissionEntry &, uintptr_t list, uintptr_t buffer, size_t bytes);
+	};
+
+	class Namespace {
+		public:
+			Controller &controller;
+			const uint32_t id;
+			uint64_t blocks = 0;
+			size_t blockSize = 512;
+
+			Namespace(Controller &, uint32_t id_);
+
+			/** Starts a read or write on the current CPU's queue. The doorbell is left for ring() or wait(). */
+			bool issue(bool write, uint64_t lba, uint32_t count, void *buffer, bool fua, QueuePair::Completion,
+			           void *data);
+			int access(bool write, uint64_t lba, uint32_t count, void *buffer, bool fua = false);
+			int flush();
+			int discard(uint64_t lba, uint32_t count);
+			/** The most blocks one command can transfer. */
+			size_t maxBlocks() const;
+			QueuePair & queue() const;
+	};
+
+	class Controller {
+		public:
+			PCI::Device *pci;
+			volatile uint8_t *registers = nullptr;
+			std::string serial;
+			std::string model;
+			/** The largest transfer the controller allows, in bytes. */
+			size_t maxTransfer = 0;
+			bool sglSupported = false;
+			/** Whether to describe data with SGLs rather than PRPs when the controller supports both. */
+			bool preferSGL = true;
+			bool volatileWriteCache = false;
+			uint16_t oncs = 0;
+			/** How long waiters spin before sleeping on an interrupt, in nanoseconds. */
+			uint64_t spinNanos = 20'000;
+			QueuePair admin;
+			/** One I/O queue pair per CPU, as far as the controller allows. */
+			std::vector<QueuePair *> ioQueues;
+			std::vector<Namespace *> namespaces;
+
+			Controller(PCI::Device *);
+			Controller(const Controller &) = delete;
+			Controller & operator=(const Controller &) = delete;
+			~Controller();
+
+			/** Resets and enables the controller, then creates the I/O queues and finds the namespaces. */
+			bool init();
+			/** Runs an admin command to completion. */
+			int adminCommand(SubmissionEntry &, void *buffer = nullptr, size_t bytes = 0, uint32_t *result = nullptr);
+			/** The I/O queue pair for the current CPU. */
+			QueuePair & queueForCPU();
+
+			volatile uint32_t * doorbell(uint16_t queue, bool completion) const;
+
+			template <typename T>
+			inline volatile T & reg(size_t offset) const {
+				return *reinterpret_cast<volatile T *>(registers + offset);
+			}
+
+		private:
+			uint32_t doorbellStride = 4;
+			uint64_t cap = 0;
+			/** The MSI vector shared by every I/O queue when MSI-X isn't available. */
+			uint8_t sharedIRQ = 0xff;
+
+			bool waitReady(bool ready);
+			bool identify();
+			bool createQueues();
+			/** Reserves an interrupt for an I/O queue and returns the vector its completion queue should use, or
+			 *  NO_VECTOR if it has to be polled. MSI-X gives each queue its own; with MSI they share one. */
+			uint16_t reserveInterrupt(QueuePair &);
+	};
+
+	extern std::vector<Controller *> controllers;
+	/** Every namespace of every controller, in order. */
+	extern std::vector<Namespace *> namespaces;
+
+	/** Finds and initializes every NVMe controller. Returns how many namespaces were found. */
+	size_t init();
+}
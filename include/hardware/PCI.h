@@ -208,6 +208,10 @@ namespace Thorn::PCI {
 		uint8_t getInterruptPin();
 		uint8_t allocateVector(Vector);
 		uint8_t allocateVector(uint8_t);
+		/** Points an MSI-X table entry at a newly reserved vector and enables MSI-X. Returns 0xff on failure. */
+		uint8_t allocateMSIX(uint16_t entry);
+		/** Returns the offset of the first capability with the given ID after the one at `after`, or 0 if none. */
+		uint8_t findCapability(uint8_t id, uint8_t after = 0);
 		uint8_t  readByte(uint32_t offset);
 		uint16_t readWord(uint32_t offset);
 		uint32_t readInt (uint32_t offset);
@@ -593,5 +597,9 @@ namespace Thorn::PCI {
 	constexpr uint16_t INVALID_VENDOR = 0xffff;
 	constexpr uint8_t MSI_CONTROL_MME_MASK = 7 << 4;
 	constexpr uint16_t MSI_CONTROL_VECTOR_MASKING = 1 << 8;
+	constexpr uint16_t MSIX_CONTROL_TABLE_SIZE = 0x7ff;
+	constexpr uint16_t MSIX_CONTROL_MASK = 1 << 14;
+	constexpr uint16_t MSIX_CONTROL_ENABLE = 1 << 15;
+	constexpr uint32_t MSIX_ENTRY_MASKED = 1;
 	#define PCI_MSI_CONTROL_SET_MME(x) ((x & 0x7) << 4)
 }
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+
+#include "hardware/Ports.h"
+
+namespace Thorn::RTC {
+	using Thorn::Ports::port_t;
+
+	constexpr port_t CMOS_ADDRESS = 0x70;
+	constexpr port_t CMOS_DATA    = 0x71;
+
+	constexpr uint8_t REGISTER_SECONDS  = 0x00;
+	constexpr uint8_t REGISTER_MINUTES  = 0x02;
+	constexpr uint8_t REGISTER_HOURS    = 0x04;
+	constexpr uint8_t REGISTER_DAY      = 0x07;
+	constexpr uint8_t REGISTER_MONTH    = 0x08;
+	constexpr uint8_t REGISTER_YEAR     = 0x09;
+	constexpr uint8_t REGISTER_STATUS_A = 0x0a;
+	constexpr uint8_t REGISTER_STATUS_B = 0x0b;
+	constexpr uint8_t REGISTER_CENTURY  = 0x32;
+
+	constexpr uint8_t STATUS_A_UPDATING = 0x80;
+	constexpr uint8_t STATUS_B_24HOUR   = 0x02;
+	constexpr uint8_t STATUS_B_BINARY   = 0x04;
+	constexpr uint8_t HOURS_PM          = 0x80;
+
+	struct DateTime {
+		unsigned year = 0;
+		unsigned month = 0;
+		unsigned day = 0;
+		unsigned hour = 0;
+		unsigned minute = 0;
+		unsigned second = 0;
+	};
+
+	/** Reads the current date and time from the CMOS real-time clock. The RTC is assumed to be set to UTC. */
+	DateTime read();
+
+	/** Converts a UTC date and time to seconds since the Unix epoch. */
+	int64_t toUnix(const DateTime &);
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+// Based on the Virtual I/O Device (VIRTIO) Version 1.1 specification.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "hardware/PCI.h"
+
+namespace Thorn::Virtio {
+	constexpr uint16_t VENDOR_ID = 0x1af4;
+
+	// Device status bits
+	constexpr uint8_t STATUS_ACKNOWLEDGE = 1;
+	constexpr uint8_t STATUS_DRIVER = 2;
+	constexpr uint8_t STATUS_DRIVER_OK = 4;
+	constexpr uint8_t STATUS_FEATURES_OK = 8;
+	constexpr uint8_t STATUS_NEEDS_RESET = 64;
+	constexpr uint8_t STATUS_FAILED = 128;
+
+	// Feature bits that aren't specific to a device type
+	constexpr uint64_t F_INDIRECT_DESC = 1ul << 28;
+	constexpr uint64_t F_EVENT_IDX = 1ul << 29;
+	constexpr uint64_t F_VERSION_1 = 1ul << 32;
+
+	// Types of the vendor-specific PCI capabilities that locate the configuration structures
+	constexpr uint8_t PCI_CAP_COMMON_CFG = 1;
+	constexpr uint8_t PCI_CAP_NOTIFY_CFG = 2;
+	constexpr uint8_t PCI_CAP_ISR_CFG = 3;
+	constexpr uint8_t PCI_CAP_DEVICE_CFG = 4;
+
+	constexpr uint16_t DESC_F_NEXT = 1;
+	/** The device writes to the buffer rather than reading it. */
+	constexpr uint16_t DESC_F_WRITE = 2;
+	constexpr uint16_t DESC_F_INDIRECT = 4;
+	constexpr uint16_t AVAIL_F_NO_INTERRUPT = 1;
+	constexpr uint16_t USED_F_NO_NOTIFY = 1;
+	constexpr uint16_t NO_VECTOR = 0xffff;
+
+	/** How long to wait for the device to respond before giving up, in microseconds. */
+	constexpr uint64_t TIMEOUT = 1'000'000;
+
+	struct CommonConfig {
+		uint32_t deviceFeatureSelect;
+		uint32_t deviceFeature;
+		uint32_t driverFeatureSelect;
+		uint32_t driverFeature;
+		uint16_t msixConfig;
+		uint16_t numQueues;
+		uint8_t  deviceStatus;
+		uint8_t  configGeneration;
+		uint16_t queueSelect;
+		uint16_t queueSize;
+		uint16_t queueMSIXVector;
+		uint16_t queueEnable;
+		uint16_t queueNotifyOff;
+		uint64_t queueDesc;
+		uint64_t queueDriver;
+		uint64_t queueDevice;
+	} __attribute__((packed));
+
+	struct Descriptor {
+		uint64_t address;
+		uint32_t length;
+		uint16_t flags;
+		uint16_t next;
+	} __attribute__((packed));
+
+	struct UsedElement {
+		/** The head of the descriptor chain the device is done with. */
+		uint32_t id;
+		/** How many bytes the device wrote. */
+		uint32_t length;
+	} __attribute__((packed));
+
+	/** A split virtqueue. The descriptor table and both rings get a page each, which limits it to 256 entries. */
+	class Queue {
+		public:
+			constexpr static uint16_t MAX_SIZE = 4096 / sizeof(Descriptor);
+
+			uint16_t index = 0;
+			uint16_t size = 0;
+			volatile Descriptor *descriptors = nullptr;
+			/** How many times the device has actually been notified. */
+			uint64_t notifications = 0;
+
+			Queue() = default;
+			Queue(const Queue &) = delete;
+			Queue & operator=(const Queue &) = delete;
+
+			/** Allocates and clears the rings. Returns false if there wasn't memory for them. */
+			bool init(uint16_t index_, uint16_t size_, bool event_index, volatile uint16_t *notify_address);
+
+			inline uintptr_t descriptorAddress() const { return reinterpret_cast<uintptr_t>(descriptors); }
+			inline uintptr_t availableAddress() const { return reinterpret_cast<uintptr_t>(available); }
+			inline uintptr_t usedAddress() const { return reinterpret_cast<uintptr_t>(used); }
+			inline uint16_t freeDescriptors() const { return freeCount; }
+
+			/** Takes a chain of free descriptors linked through their next fields. Returns its head, or -1 if there
+			 *  aren't enough free descriptors. The caller fills in everything but the links. */
+			int allocate(uint16_t count);
+			/** Returns a chain to the free list. */
+			void free(uint16_t head);
+			/** Makes a chain available to the device without notifying it. */
+			void submit(uint16_t head);
+			/** Notifies the device of the chains submitted since the last kick, unless it asked not to be. */
+			void kick();
+			/** Takes the next chain the device is done with. Returns false if there isn't one. */
+			bool nextUsed(UsedElement &);
+			/** Whether the device has finished a chain that nextUsed hasn't returned yet. */
+			bool hasUsed() const;
+			/** Asks for an interrupt when the device next uses a chain. Returns false if it already has, in which case
+			 *  there may be no interrupt for it. */
+			bool enableInterrupts();
+			void disableInterrupts();
+
+		private:
+			volatile uint16_t *available = nullptr;
+			volatile uint16_t *used = nullptr;
+			volatile uint16_t *notifyAddress = nullptr;
+			bool eventIndex = false;
+			uint16_t freeHead = 0;
+			uint16_t freeCount = 0;
+			uint16_t lastUsed = 0;
+			/** The available index as of the last notification. */
+			uint16_t lastKicked = 0;
+
+			// The available ring is flags, index, ring[size], used_event. The used ring is flags, index, then pairs
+			// of 32-bit words, then avail_event.
+			inline volatile uint16_t & availableIndex() { return available[1]; }
+			inline volatile uint16_t & usedEvent() { return available[2 + size]; }
+			inline volatile uint16_t & usedIndex() const { return used[1]; }
+			inline volatile uint16_t & availableEvent() { return used[2 + size * 4]; }
+			inline volatile UsedElement & usedElement(uint16_t slot) {
+				return reinterpret_cast<volatile UsedElement *>(used + 2)[slot];
+			}
+	};
+
+	/** A virtio device using the modern PCI transport, which finds its configuration structures through
+	 *  vendor-specific capabilities rather than an I/O BAR. */
+	class Device {
+		public:
+			PCI::Device *pci;
+			volatile CommonConfig *common = nullptr;
+			volatile uint8_t *isr = nullptr;
+			volatile uint8_t *deviceConfig = nullptr;
+			/** The features both sides agreed on. */
+			uint64_t features = 0;
+
+			Device(PCI::Device *);
+			virtual ~Device() = default;
+
+			inline bool hasFeature(uint64_t feature) const { return (features & feature) == feature; }
+
+			/** Resets the device, maps its configuration and accepts whichever of the wanted features it offers.
+			 *  VERSION_1 is always required. Returns false if the device can't be driven. */
+			bool init(uint64_t wanted);
+			/** Sets up and enables a queue. Sizes above the device's maximum are reduced to it. The queue's
+			 *  interrupts go to the given MSI-X table entry. */
+			bool setupQueue(Queue &, uint16_t index, uint16_t size, uint16_t msix_entry = NO_VECTOR);
+			/** Tells the device the driver is ready. Queues have to be set up before this. */
+			void ready();
+			void fail();
+
+		private:
+			uintptr_t notifyBase = 0;
+			uint32_t notifyMultiplier = 0;
+
+			/** Maps the region a configuration capability points to. Returns 0 if it isn't a memory region. */
+			uintptr_t mapCapability(uint8_t pointer, size_t &length);
+	};
+}
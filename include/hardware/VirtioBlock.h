@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "hardware/Virtio.h"
+
+namespace Thorn::Virtio {
+	constexpr uint16_t BLOCK_DEVICE_ID = 0x1042;
+	constexpr uint16_t BLOCK_DEVICE_ID_TRANSITIONAL = 0x1001;
+
+	// Block device feature bits
+	constexpr uint64_t BLK_F_SIZE_MAX = 1ul << 1;
+	constexpr uint64_t BLK_F_SEG_MAX = 1ul << 2;
+	constexpr uint64_t BLK_F_RO = 1ul << 5;
+	constexpr uint64_t BLK_F_BLK_SIZE = 1ul << 6;
+	constexpr uint64_t BLK_F_FLUSH = 1ul << 9;
+	constexpr uint64_t BLK_F_TOPOLOGY = 1ul << 10;
+	constexpr uint64_t BLK_F_DISCARD = 1ul << 13;
+
+	/** Request sectors are always 512 bytes, whatever the device's block size. */
+	constexpr size_t BLK_SECTOR_SIZE = 512;
+
+	struct BlockConfig {
+		uint64_t capacity;
+		uint32_t sizeMax;
+		uint32_t segMax;
+		uint16_t cylinders;
+		uint8_t  heads;
+		uint8_t  sectors;
+		uint32_t blkSize;
+		uint8_t  physicalBlockExp;
+		uint8_t  alignmentOffset;
+		uint16_t minIOSize;
+		uint32_t optIOSize;
+		uint8_t  writeback;
+		uint8_t  unused0[3];
+		uint32_t maxDiscardSectors;
+		uint32_t maxDiscardSeg;
+		uint32_t discardSectorAlignment;
+	} __attribute__((packed));
+
+	class Block: public Device {
+		public:
+			enum class Type: uint32_t {In = 0, Out = 1, Flush = 4, GetID = 8, Discard = 11};
+
+			/** Called from reap() with 0 or a negative error code. reap() never runs in an interrupt handler. */
+			using Completion = void (*)(void *data, int status);
+
+			/** Requests that can be in flight at once. Each has a page for its header, status and indirect table. */
+			constexpr static size_t MAX_REQUESTS = 64;
+			/** Descriptors in one request's indirect table: a header, the data segments and a status byte. */
+			constexpr static size_t INDIRECT_DESCRIPTORS = 128;
+			constexpr static uint16_t QUEUE_SIZE = 128;
+
+			struct Stats {
+				uint64_t requests = 0;
+				uint64_t interrupts = 0;
+				/** Waits that ended without needing an interrupt. */
+				uint64_t polledWaits = 0;
+				uint64_t sleptWaits = 0;
+			};
+
+			/** Capacity in 512-byte sectors. */
+			uint64_t capacity = 0;
+			size_t blockSize = BLK_SECTOR_SIZE;
+			size_t physicalBlockSize = BLK_SECTOR_SIZE;
+			/** The most data segments one request may have. */
+			size_t maxSegments = 1;
+			/** The largest data segment the device accepts. */
+			size_t maxSegmentSize = 0xffffffff;
+			/** The most sectors one discard may cover. */
+			uint32_t maxDiscardSectors = UINT32_MAX;
+			/** Discards are split on multiples of this many sectors. */
+			uint32_t discardAlignment = 1;
+			uint8_t irq = 0xff;
+			std::string serial;
+			Stats stats;
+			/** Spin this long before sleeping on the interrupt, in nanoseconds. */
+			uint64_t spinNanos = 20'000;
+			Queue queue;
+
+			Block(PCI::Device *);
+			Block(const Block &) = delete;
+			Block & operator=(const Block &) = delete;
+
+			/** Negotiates features and sets up the request queue. Returns false if the device can't be used. */
+			bool init();
+
+			/** Starts a request for the given buffer. Returns false if there's no room for it yet, in which case
+			 *  nothing was started and the caller can wait() and try again. */
+			bool issue(Type, uint64_t sector, void *buffer, size_t bytes, Completion, void *data);
+			/** Issues a request and waits for it to finish. */
+			int access(Type, uint64_t sector, void *buffer, size_t bytes);
+			/** Runs the completions of whatever the device has finished. */
+			void reap();
+			/** Waits until something finishes, then reaps it. Returns false if nothing finished before the timeout. */
+			bool wait();
+			/** Makes completed writes durable. */
+			int flush();
+			/** Discards the aligned sectors inside a range, split into as many requests as the device needs. */
+			int discard(uint64_t sector, uint64_t count);
+			/** The largest number of bytes one request can cover, whatever its alignment. */
+			size_t maxTransfer() const;
+
+			inline size_t outstanding() const { return __builtin_popcountl(busySlots); }
+			inline bool readOnly() const { return hasFeature(BLK_F_RO); }
+
+		private:
+			struct RequestHeader {
+				uint32_t type;
+				uint32_t reserved;
+				uint64_t sector;
+			} __attribute__((packed));
+
+			struct DiscardSegment {
+				uint64_t sector;
+				uint32_t sectors;
+				uint32_t flags;
+			} __attribute__((packed));
+
+			/** Occupies one page. */
+			struct Slot {
+				Descriptor table[INDIRECT_DESCRIPTORS];
+				RequestHeader header;
+				DiscardSegment discard;
+				volatile uint8_t status;
+			} __attribute__((packed));
+
+			static_assert(sizeof(Slot) <= 4096);
+
+			struct Pending {
+				Completion completion = nullptr;
+				void *data = nullptr;
+				int head = -1;
+			};
+
+			volatile Slot *slots[MAX_REQUESTS] {};
+			Pending pending[MAX_REQUESTS];
+			uint64_t busySlots = 0;
+			/** The slot for each descriptor chain head. */
+			uint8_t slotForHead[QUEUE_SIZE] {};
+
+			static void interrupt(void *);
+			/** Fills in descriptors for a buffer, merging physically contiguous pages. Returns how many were used, or
+			 *  0 if the buffer couldn't be mapped in at most `limit` segments. */
+			size_t mapSegments(volatile Descriptor *, size_t limit, const void *buffer, size_t bytes, bool device_writes);
+			/** Whether reads write into the buffer. */
+			static bool deviceWrites(Type);
+	};
+
+	extern std::vector<Block *> blocks;
+
+	/** Finds and initializes every virtio block device. Returns how many were found. */
+	size_t initBlocks();
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+
+namespace x86_64 {
+	class PageMeta;
+}
+
+namespace Thorn {
+	/** Something that holds on to memory it can give back when asked, like a cache. The frame allocator asks every
+	 *  registered shrinker in turn whenever it runs out of frames, and the heap gets its frames from the same place. */
+	struct Shrinker {
+		/** How many frames the frame allocator asks for at once, so that a run of allocations doesn't shrink for
+		 *  every single frame. */
+		constexpr static size_t BATCH = 32;
+
+		virtual ~Shrinker() = default;
+
+		/** Gives up to `frames` frames back to the pager and returns how many it gave. The pager is already locked by
+		 *  the caller, so frames have to be freed through it rather than by locking it again, and nothing here may
+		 *  allocate. A shrinker that's in the middle of changing its own state should just return 0. */
+		virtual size_t shrink(x86_64::PageMeta &, size_t frames) = 0;
+
+		static void add(Shrinker &);
+		static void remove(Shrinker &);
+		/** Asks shrinkers until `frames` frames have been freed or every shrinker has been asked. Returns how many
+		 *  frames were freed. */
+		static size_t run(x86_64::PageMeta &, size_t frames);
+
+		private:
+			Shrinker *nextShrinker = nullptr;
+	};
+}
@@ -35,6 +35,8 @@
 #include "arch/x86_64/CPU.h"
 #include "arch/x86_64/Interrupts.h"
 #include "arch/x86_64/PIC.h"
+#include "arch/x86_64/Syscall.h"
+#include "arch/x86_64/Timer.h"
 
 extern volatile uint32_t multiboot_magic;
 extern volatile uint64_t multiboot_data;
@@ -74,6 +76,8 @@ namespace Thorn {
 		if (Serial::init())
 			Serial::write("\n\n\n");
 		x86_64::IDT::init();
+		x86_64::initCPULocal(x86_64::bootProcessor, 0);
+		x86_64::Syscall::init();
 		detectMemory();
 		HELLO;
 		arrangeMemory();
@@ -111,12 +115,13 @@ namespace Thorn {
 			_ctors_start[i]();
 
 		x86_64::PIC::clearIRQ(1);
+		// The slave PIC's lines only reach the CPU through the cascade on the master's IRQ2.
+		x86_64::PIC::clearIRQ(2);
 		x86_64::PIC::clearIRQ(11);
 		x86_64::PIC::clearIRQ(14);
 		x86_64::PIC::clearIRQ(15);
 
-		x86_64::APIC::initTimer(2);
-		// x86_64::APIC::disableTimer();
+		x86_64::Timer::init();
 
 		// std::string str(10000, 'a');
 
@@ -4,6 +4,10 @@
 #include "ThornUtil.h"
 #include "device/AHCIDevice.h"
 #include "device/IDEDevice.h"
+#include "device/NVMeDevice.h"
+#include "device/RamDisk.h"
+#include "device/StripeDevice.h"
+#include "device/VirtioBlockDevice.h"
 #include "fs/ThornFAT/ThornFAT.h"
 #include "fs/Partition.h"
 #include "fs/Util.h"
@@ -11,6 +15,7 @@
 #include "hardware/IDE.h"
 #include "hardware/GPT.h"
 #include "hardware/MBR.h"
+#include "hardware/NVMe.h"
 #include "hardware/PCI.h"
 #include "hardware/PCIIDs.h"
 #include "hardware/Ports.h"
@@ -18,13 +23,18 @@
 #include "hardware/SATA.h"
 #include "hardware/Serial.h"
 #include "hardware/UHCI.h"
+#include "hardware/VirtioBlock.h"
+#include "memory/Memory.h"
 #include "memory/memset.h"
 #include "multiboot2.h"
 #include "arch/x86_64/APIC.h"
+#include "arch/x86_64/Clock.h"
 #include "arch/x86_64/control_register.h"
 #include "arch/x86_64/CPU.h"
 #include "arch/x86_64/Interrupts.h"
 #include "arch/x86_64/PIC.h"
+#include "arch/x86_64/Syscall.h"
+#include "arch/x86_64/Timer.h"
 #include "lib/ElfParser.h"
 #include "lib/printf.h"
 #include "lib/SHA1.h"
@@ -137,7 +147,7 @@ namespace Thorn {
 			port->read(0, 512, &mbr);
 			if (mbr.indicatesGPT()) {
 				GPT::Header gpt;
-				port->readBytes(sizeof(GPT::Header), AHCI::Port::BLOCKSIZE, &gpt);
+				port->readBytes(sizeof(GPT::Header), port->blockSize(), &gpt);
 				printf("Signature:   0x%lx\n", gpt.signature);
 				printf("Revision:    %d\n", gpt.revision);
 				printf("Header size: %d\n", gpt.headerSize);
@@ -148,7 +158,7 @@ namespace Thorn {
 				printf("Start LBA:   %ld\n", gpt.startLBA);
 				printf("Partitions:  %d\n", gpt.partitionCount);
 				printf("Entry size:  %d\n", gpt.partitionEntrySize);
-				size_t offset = AHCI::Port::BLOCKSIZE * gpt.startLBA;
+				size_t offset = port->blockSize() * gpt.startLBA;
 				gpt.guid.print(true);
 				if (gpt.partitionEntrySize != sizeof(GPT::PartitionEntry)) {
 					printf("Unsupported partition entry size.\n");
@@ -172,8 +182,8 @@ namespace Thorn {
 					if (first_entry.typeGUID) {
 						printf("Using partition \"%s\".\n", std::string(first_entry).c_str());
 						AHCIDevice device(port);
-						FS::Partition partition(&device, first_entry.firstLBA * AHCI::Port::BLOCKSIZE,
-							(first_entry.lastLBA - first_entry.firstLBA + 1) * AHCI::Port::BLOCKSIZE);
+						FS::Partition partition(&device, first_entry.firstLBA * device.logicalBlockSize(),
+							(first_entry.lastLBA - first_entry.firstLBA + 1) * device.logicalBlockSize());
 						using namespace FS::ThornFAT;
 						auto driver = std::make_unique<ThornFATDriver>(&partition);
 						driver->make(sizeof(DirEntry) * 5);
@@ -220,7 +230,7 @@ namespace Thorn {
 		Terminal::color = Terminal::vgaEntryColor(Terminal::VGAColor::LightGray, Terminal::VGAColor::Black);
 
 		for (;;) {
-			asm volatile("hlt");
+			x86_64::Timer::idle();
 			// Let's hope a keyboard interrupt doesn't occur here.
 			while (!scancodes_fifo.empty()) {
 				uint8_t scancode = scancodes_fifo.front();
@@ -384,6 +394,18 @@ namespace Thorn {
 			parseElf(pieces, mainContext);
 		} else if (pieces[0] == "sha1") {
 			sha1(pieces, mainContext);
+		} else if (pieces[0] == "bench") {
+			bench(pieces, mainContext);
+		} else if (pieces[0] == "check") {
+			check(pieces, mainContext);
+		} else if (pieces[0] == "fstrim") {
+			fstrim(pieces, mainContext);
+		} else if (pieces[0] == "ramdisk") {
+			ramdisk(pieces, mainContext);
+		} else if (pieces[0] == "raid") {
+			raid(pieces, mainContext);
+		} else if (pieces[0] == "cache") {
+			cache(pieces, mainContext);
 		} else if (pieces[0] == "clear") {
 			Terminal::clear();
 		} else if (pieces[0] == "loader") {
@@ -407,6 +429,22 @@ namespace Thorn {
 			handleInput("sel port 0");
 			handleInput("sel part 0");
 			handleInput("init tfat");
+		} else if (pieces[0] == "0n") {
+			handleInput("mode nvme");
+			handleInput("init nvme");
+			handleInput("sel port 0");
+			handleInput("sel part 0");
+			handleInput("init tfat");
+		} else if (pieces[0] == "0r") {
+			handleInput("ramdisk create 64M");
+			handleInput("init tfat");
+			handleInput("make");
+		} else if (pieces[0] == "0v") {
+			handleInput("mode virtio");
+			handleInput("init virtio");
+			handleInput("sel port 0");
+			handleInput("sel part 0");
+			handleInput("init tfat");
 		} else if (pieces[0] == "printfat") {
 			if (!mainContext.driver) {
 				printf("Driver isn't ready.\n");
@@ -452,8 +490,9 @@ namespace Thorn {
 				return;
 			}
 
+			// Hashing reads the file once, so there's no point caching it.
 			char *buffer = new char[size];
-			status = context.driver->read(path.c_str(), buffer, size, 0);
+			status = context.driver->read(path.c_str(), buffer, size, 0, FS::IO_DIRECT);
 			if (status < 0) {
 				tprintf("Couldn't read file: %s (%d)\n", strerror(-status), status);
 				return;
@@ -491,7 +530,7 @@ namespace Thorn {
 			}
 
 			char *buffer = new char[size];
-			status = context.driver->read(path.c_str(), buffer, size, 0);
+			status = context.driver->read(path.c_str(), buffer, size, 0, FS::IO_DIRECT);
 			if (status < 0) {
 				tprintf("Couldn't read file: %s (%d)\n", strerror(-status), status);
 				return;
@@ -510,29 +549,34 @@ namespace Thorn {
 	}
 
 	void mode(const std::vector<std::string> &pieces, InputContext &context) {
-		auto usage = [] { tprintf("Usage:\n- mode ahci\n- mode ide\n"); };
+		auto usage = [] { tprintf("Usage:\n- mode ahci\n- mode ide\n- mode virtio\n- mode nvme\n"); };
 		if (pieces.size() != 2) {
 			usage();
-		} else if (pieces[1] == "ahci") {
-			if (context.ahci) {
-				tprintf("Already in AHCI mode.\n");
-				return;
-			}
-
-			context.ahci = true;
+			return;
+		}
 
+		DiskMode new_mode;
+		if (pieces[1] == "ahci") {
+			new_mode = DiskMode::AHCI;
 		} else if (pieces[1] == "ide") {
-			if (!context.ahci) {
-				tprintf("Already in IDE mode.\n");
-				return;
-			}
-
-			context.ahci = false;
+			new_mode = DiskMode::IDE;
+		} else if (pieces[1] == "virtio") {
+			new_mode = DiskMode::Virtio;
+		} else if (pieces[1] == "nvme") {
+			new_mode = DiskMode::NVMe;
 		} else {
 			usage();
 			return;
 		}
 
+		static const char *mode_names[] {"AHCI", "IDE", "virtio", "NVMe"};
+		if (context.diskMode == new_mode) {
+			tprintf("Already in %s mode.\n", mode_names[static_cast<int>(new_mode)]);
+			return;
+		}
+
+		context.diskMode = new_mode;
+
 		if (context.driver) {
 			delete context.driver;
 			context.driver = nullptr;
@@ -555,8 +599,10 @@ namespace Thorn {
 
 		context.path = "/";
 		context.idePort = -1;
+		context.virtio = nullptr;
+		context.nvme = nullptr;
 
-		tprintf("Switched to %s mode.\n", context.ahci? "AHCI" : "IDE");
+		tprintf("Switched to %s mode.\n", mode_names[static_cast<int>(new_mode)]);
 	}
 
 	void records(const std::vector<std::string> &pieces, InputContext &context) {
@@ -656,7 +702,11 @@ namespace Thorn {
 	}
 
 	void set(const std::vector<std::string> &pieces, InputContext &context) {
-		auto usage = [] { tprintf("Usage:\n- set baseport <baseport>\n"); };
+		auto usage = [] {
+			tprintf("Usage:\n- set baseport <baseport>\n- set coalesce <completions> <ms> | off\n"
+				"- set hybridpoll <ns> | off\n- set sgl on | off\n- set dirty <percent> <expire ms>\n"
+				"- set readahead <KiB>\n");
+		};
 		if (pieces.size() < 2) {
 			usage();
 		} else if (pieces[1] == "baseport") {
@@ -677,6 +727,85 @@ namespace Thorn {
 				context.portBase = baseport;
 				tprintf("baseport set to 0x%x.\n", static_cast<Ports::port_t>(baseport));
 			}
+		} else if (pieces[1] == "coalesce") {
+			if (context.diskMode != DiskMode::AHCI || !context.port || !context.port->parent) {
+				tprintf("No AHCI port selected.\n");
+				return;
+			}
+
+			AHCI::Controller &controller = *context.port->parent;
+			if (pieces.size() == 3 && pieces[2] == "off") {
+				controller.disableCoalescing();
+				tprintf("Command completion coalescing disabled.\n");
+				return;
+			}
+
+			unsigned long completions, timeout;
+			if (pieces.size() != 4 || !Util::parseUlong(pieces[2], completions) || !Util::parseUlong(pieces[3], timeout)
+			    || completions == 0 || 0xff < completions || timeout == 0 || 0xffff < timeout) {
+				usage();
+			} else if (!controller.setCoalescing(controller.abar->pi, completions, timeout)) {
+				tprintf("The controller can't coalesce command completions.\n");
+			} else {
+				tprintf("Interrupting every %lu completions or after %lu ms.\n", completions, timeout);
+			}
+		} else if (pieces[1] == "hybridpoll") {
+			uint64_t *spin_nanos = nullptr;
+			if (context.diskMode == DiskMode::AHCI && context.port)
+				spin_nanos = &context.port->hybridPollNanos;
+			else if (context.diskMode == DiskMode::Virtio && context.virtio)
+				spin_nanos = &context.virtio->spinNanos;
+			else if (context.diskMode == DiskMode::NVMe && context.nvme)
+				spin_nanos = &context.nvme->controller.spinNanos;
+
+			if (!spin_nanos) {
+				tprintf("No AHCI port, virtio device or NVMe namespace selected.\n");
+				return;
+			}
+
+			unsigned long nanos = 0;
+			if (pieces.size() != 3 || (pieces[2] != "off" && !Util::parseUlong(pieces[2], nanos))) {
+				usage();
+				return;
+			}
+
+			*spin_nanos = nanos;
+			if (context.diskMode == DiskMode::AHCI)
+				context.port->averageWait = 0;
+			if (nanos == 0)
+				tprintf("Hybrid polling disabled.\n");
+			else
+				tprintf("Spinning for up to %lu ns before sleeping.\n", nanos);
+		} else if (pieces[1] == "sgl") {
+			if (context.diskMode != DiskMode::NVMe || !context.nvme) {
+				tprintf("No NVMe namespace selected.\n");
+			} else if (pieces.size() != 3 || (pieces[2] != "on" && pieces[2] != "off")) {
+				usage();
+			} else if (pieces[2] == "on" && !context.nvme->controller.sglSupported) {
+				tprintf("The controller doesn't support SGLs.\n");
+			} else {
+				context.nvme->controller.preferSGL = pieces[2] == "on";
+				tprintf("Describing data with %s.\n", pieces[2] == "on"? "SGLs" : "PRPs");
+			}
+		} else if (pieces[1] == "readahead") {
+			unsigned long kib;
+			if (pieces.size() != 3 || !Util::parseUlong(pieces[2], kib) || (SIZE_MAX >> 10) < kib) {
+				usage();
+			} else {
+				AHCIDevice::maxReadahead = kib << 10;
+				tprintf(kib == 0? "Readahead disabled.\n" : "Readahead windows can grow to %lu KiB.\n", kib);
+			}
+		} else if (pieces[1] == "dirty") {
+			unsigned long ratio, expire_ms;
+			if (pieces.size() != 4 || !Util::parseUlong(pieces[2], ratio) || !Util::parseUlong(pieces[3], expire_ms)
+			    || 100 < ratio) {
+				usage();
+			} else {
+				StorageDevice::dirtyRatio = ratio;
+				StorageDevice::dirtyExpireNanos = expire_ms * 1'000'000;
+				tprintf("Writing back once %lu%% of a cache is dirty or a block has been dirty for %lu ms.\n", ratio,
+					expire_ms);
+			}
 		} else {
 			usage();
 		}
@@ -969,26 +1098,85 @@ namespace Thorn {
 		}
 	}
 
+	/** Drops the selected device along with the partition and driver on top of it. */
+	static void releaseDisk(InputContext &context) {
+		if (context.driver)
+			delete context.driver;
+		context.driver = nullptr;
+		if (context.partition)
+			delete context.partition;
+		context.partition = nullptr;
+		if (context.device)
+			delete context.device;
+		context.device = nullptr;
+		context.stripe = nullptr;
+	}
+
+	/** Selects an array as the device, with the whole array as one partition. */
+	static void selectArray(InputContext &context, std::unique_ptr<StripeDevice> &&array) {
+		releaseDisk(context);
+		context.stripe = array.release();
+		context.device = context.stripe;
+		context.partition = new FS::Partition(context.device, 0, context.stripe->size);
+		context.path = "/";
+		tprintf("Selected %s: %lu MiB in %lu KiB chunks.\n", context.stripe->getName().c_str(),
+			context.stripe->size >> 20, context.stripe->chunkSize >> 10);
+	}
+
+	/** Looks for arrays on every AHCI port and selects the first complete one. */
+	static void assembleArrays(InputContext &context, bool quiet) {
+		// The candidates read their superblocks through their own queues, so no other device can be using the ports.
+		if (context.diskMode == DiskMode::AHCI)
+			releaseDisk(context);
+
+		StripeDevice::Members candidates;
+		for (AHCI::Controller &controller: AHCI::controllers)
+			for (AHCI::Port *port: controller.ports)
+				if (port && port->type == AHCI::DeviceType::SATA)
+					candidates.emplace_back(new AHCIDevice(port));
+
+		std::vector<std::unique_ptr<StripeDevice>> arrays = StripeDevice::assemble(candidates);
+		if (arrays.empty()) {
+			if (!quiet)
+				tprintf("No complete arrays found.\n");
+			return;
+		}
+
+		for (size_t i = 1; i < arrays.size(); ++i)
+			tprintf("Also found array %lx (%s); only one can be selected at a time.\n", arrays[i]->arrayID,
+				arrays[i]->getName().c_str());
+
+		releaseDisk(context);
+		context.diskMode = DiskMode::AHCI;
+		selectArray(context, std::move(arrays.front()));
+	}
+
 	void init(const std::vector<std::string> &pieces, InputContext &context) {
-		auto usage = [] { tprintf("Usage:\n- init ahci\n- init ide\n- init thornfat\n"); };
+		auto usage = [] {
+			tprintf("Usage:\n- init ahci\n- init ide\n- init virtio\n- init nvme\n- init thornfat\n");
+		};
 		if (pieces.size() < 2) {
 			usage();
 		} else if (pieces[1] == "ahci") {
 			context.controller = nullptr;
 			context.port = nullptr;
-			if (context.partition)
-				delete context.partition;
-			context.partition = nullptr;
-			if (context.device)
-				delete context.device;
-			context.device = nullptr;
-			if (context.driver)
-				delete context.driver;
-			context.driver = nullptr;
+			releaseDisk(context);
 			initAHCI();
+			// Arrays are put back together as soon as their members are visible.
+			assembleArrays(context, true);
 		} else if (pieces[1] == "ide") {
 			if (IDE::init() == 0)
 				tprintf("No IDE devices found.\n");
+		} else if (pieces[1] == "virtio") {
+			releaseDisk(context);
+			context.virtio = nullptr;
+			if (Virtio::initBlocks() == 0)
+				tprintf("No virtio block devices found.\n");
+		} else if (pieces[1] == "nvme") {
+			releaseDisk(context);
+			context.nvme = nullptr;
+			if (NVMe::init() == 0)
+				tprintf("No NVMe namespaces found.\n");
 		} else if (pieces[1] == "thornfat" || pieces[1] == "tfat" || pieces[1] == "driver") {
 			if (!context.device || !context.partition) {
 				tprintf("No partition is selected.\n");
@@ -1001,12 +1189,66 @@ namespace Thorn {
 		}
 	}
 
+	static bool diskSelected(const InputContext &context) {
+		switch (context.diskMode) {
+			case DiskMode::AHCI:   return context.port != nullptr;
+			case DiskMode::IDE:    return context.idePort != -1;
+			case DiskMode::Virtio: return context.virtio != nullptr;
+			case DiskMode::NVMe:   return context.nvme != nullptr;
+		}
+		return false;
+	}
+
+	/** Reads raw bytes from the selected disk, before there's a StorageDevice for it. */
+	static void readDisk(const InputContext &context, size_t size, size_t offset, void *buffer) {
+		switch (context.diskMode) {
+			case DiskMode::AHCI:
+				context.port->readBytes(size, offset, buffer);
+				break;
+			case DiskMode::IDE:
+				IDE::readBytes(context.idePort, size, offset, buffer);
+				break;
+			case DiskMode::Virtio: {
+				// Requests cover whole sectors.
+				const size_t first = offset / Virtio::BLK_SECTOR_SIZE;
+				const size_t last = (offset + size + Virtio::BLK_SECTOR_SIZE - 1) / Virtio::BLK_SECTOR_SIZE;
+				std::vector<uint8_t> sectors((last - first) * Virtio::BLK_SECTOR_SIZE);
+				if (context.virtio->access(Virtio::Block::Type::In, first, sectors.data(), sectors.size()) == 0)
+					memcpy(buffer, sectors.data() + offset % Virtio::BLK_SECTOR_SIZE, size);
+				else
+					memset(buffer, 0, size);
+				break;
+			}
+			case DiskMode::NVMe: {
+				const size_t block_size = context.nvme->blockSize;
+				const size_t first = offset / block_size;
+				const size_t last = (offset + size + block_size - 1) / block_size;
+				std::vector<uint8_t> blocks((last - first) * block_size);
+				if (context.nvme->access(false, first, last - first, blocks.data()) == 0)
+					memcpy(buffer, blocks.data() + offset % block_size, size);
+				else
+					memset(buffer, 0, size);
+				break;
+			}
+		}
+	}
+
+	static size_t diskBlockSize(const InputContext &context) {
+		switch (context.diskMode) {
+			case DiskMode::AHCI:   return context.port->blockSize();
+			case DiskMode::IDE:    return IDE::SECTOR_SIZE;
+			case DiskMode::Virtio: return context.virtio->blockSize;
+			case DiskMode::NVMe:   return context.nvme->blockSize;
+		}
+		return 512;
+	}
+
 	void select(const std::vector<std::string> &pieces, InputContext &context) {
 		auto usage = [] { tprintf("Usage:\n- select controller <#>\n- select port <#>\n- select partition <#>\n"); };
 
 		if (pieces.size() == 3) {
 			if (pieces[1] == "controller" || pieces[1] == "ahci" || pieces[1] == "cont") {
-				if (!context.ahci) {
+				if (context.diskMode != DiskMode::AHCI) {
 					tprintf("Can't select AHCI controller: not in AHCI mode.\n");
 					return;
 				}
@@ -1028,7 +1270,7 @@ namespace Thorn {
 					tprintf("Selected controller %lu.\n", controller_index);
 				}
 			} else if (pieces[1] == "port") {
-				if (context.ahci) {
+				if (context.diskMode == DiskMode::AHCI) {
 					if (!context.controller) {
 						tprintf("No controller is selected.\n");
 						return;
@@ -1046,7 +1288,7 @@ namespace Thorn {
 						context.port = controller.ports[port_index];
 						tprintf("Selected port %lu.\n", port_index);
 					}
-				} else {
+				} else if (context.diskMode == DiskMode::IDE) {
 					size_t port_index;
 					if (!Util::parseUlong(pieces[2], port_index)) {
 						usage();
@@ -1056,9 +1298,29 @@ namespace Thorn {
 						context.idePort = static_cast<int>(port_index);
 						tprintf("Selected port %d.\n", context.idePort);
 					}
+				} else if (context.diskMode == DiskMode::Virtio) {
+					size_t device_index;
+					if (!Util::parseUlong(pieces[2], device_index)) {
+						usage();
+					} else if (Virtio::blocks.size() <= device_index) {
+						tprintf("Device index out of range.\n");
+					} else {
+						context.virtio = Virtio::blocks[device_index];
+						tprintf("Selected virtio device %lu.\n", device_index);
+					}
+				} else {
+					size_t namespace_index;
+					if (!Util::parseUlong(pieces[2], namespace_index)) {
+						usage();
+					} else if (NVMe::namespaces.size() <= namespace_index) {
+						tprintf("Namespace index out of range.\n");
+					} else {
+						context.nvme = NVMe::namespaces[namespace_index];
+						tprintf("Selected NVMe namespace %u.\n", context.nvme->id);
+					}
 				}
 			} else if (pieces[1] == "part" || pieces[1] == "partition") {
-				if ((context.ahci && !context.port) || (!context.ahci && context.idePort == -1)) {
+				if (!diskSelected(context)) {
 					tprintf("No port selected.\n");
 				} else {
 					size_t partition_index;
@@ -1076,30 +1338,24 @@ namespace Thorn {
 	}
 
 	void selectPartition(size_t partition_index, InputContext &context) {
-		if ((context.ahci && !context.port) || (!context.ahci && context.idePort == -1)) {
+		if (!diskSelected(context)) {
 			tprintf("No port is selected.\n");
 			return;
 		}
 
 		MBR mbr;
-		if (context.ahci)
-			context.port->read(0, 512, &mbr);
-		else
-			IDE::readBytes(context.idePort, 512, 0, &mbr);
+		readDisk(context, 512, 0, &mbr);
 
 		if (!mbr.indicatesGPT()) {
 			tprintf("MBR doesn't indicate the presence of a GPT.\n");
 			return;
 		}
 
-		const size_t bs = context.ahci? AHCI::Port::BLOCKSIZE : IDE::SECTOR_SIZE;
+		const size_t bs = diskBlockSize(context);
 
 		GPT::Header gpt;
 
-		if (context.ahci)
-			context.port->readBytes(sizeof(GPT::Header), bs, &gpt);
-		else
-			IDE::readBytes(context.idePort, sizeof(GPT::Header), bs, &gpt);
+		readDisk(context, sizeof(GPT::Header), bs, &gpt);
 
 		if (gpt.partitionEntrySize != sizeof(GPT::PartitionEntry)) {
 			tprintf("Unsupported partition entry size.\n");
@@ -1108,10 +1364,7 @@ namespace Thorn {
 		size_t offset = bs * gpt.startLBA + gpt.partitionEntrySize * partition_index;
 		GPT::PartitionEntry entry;
 
-		if (context.ahci)
-			context.port->readBytes(gpt.partitionEntrySize, offset, &entry);
-		else
-			IDE::readBytes(context.idePort, gpt.partitionEntrySize, offset, &entry);
+		readDisk(context, gpt.partitionEntrySize, offset, &entry);
 
 		if (!entry.typeGUID) {
 			tprintf("Invalid partition.\n");
@@ -1120,11 +1373,16 @@ namespace Thorn {
 
 		if (context.device)
 			delete context.device;
+		context.stripe = nullptr;
 
-		if (context.ahci)
+		if (context.diskMode == DiskMode::AHCI)
 			context.device = new AHCIDevice(context.port);
-		else
+		else if (context.diskMode == DiskMode::IDE)
 			context.device = new IDEDevice(context.idePort);
+		else if (context.diskMode == DiskMode::Virtio)
+			context.device = new VirtioBlockDevice(context.virtio);
+		else
+			context.device = new NVMeDevice(context.nvme);
 
 		context.partition = new FS::Partition(context.device, entry.firstLBA * bs,
 				(entry.lastLBA - entry.firstLBA + 1) * bs);
@@ -1170,31 +1428,25 @@ namespace Thorn {
 	}
 
 	void listGPT(InputContext &context) {
-		if ((context.ahci && !context.port) || (!context.ahci && context.idePort == -1)) {
+		if (!diskSelected(context)) {
 			tprintf("No port is selected.\n");
 			return;
 		}
 
 		MBR mbr;
 
-		if (context.ahci)
-			context.port->read(0, 512, &mbr);
-		else
-			IDE::readBytes(context.idePort, 512, 0, &mbr);
+		readDisk(context, 512, 0, &mbr);
 
 		if (!mbr.indicatesGPT()) {
 			tprintf("MBR doesn't indicate the presence of a GPT.\n");
 			return;
 		}
 
-		const size_t bs = context.ahci? AHCI::Port::BLOCKSIZE : IDE::SECTOR_SIZE;
+		const size_t bs = diskBlockSize(context);
 
 		GPT::Header gpt;
 
-		if (context.ahci)
-			context.port->readBytes(sizeof(GPT::Header), bs, &gpt);
-		else
-			IDE::readBytes(context.idePort, sizeof(GPT::Header), bs, &gpt);
+		readDisk(context, sizeof(GPT::Header), bs, &gpt);
 
 		tprintf("Signature:   0x%lx\n", gpt.signature);
 		tprintf("Revision:    %d\n",    gpt.revision);
@@ -1215,10 +1467,7 @@ namespace Thorn {
 
 		for (unsigned i = 0; i < gpt.partitionCount; ++i) {
 			GPT::PartitionEntry entry;
-			if (context.ahci)
-				context.port->readBytes(gpt.partitionEntrySize, offset, &entry);
-			else
-				IDE::readBytes(context.idePort, gpt.partitionEntrySize, offset, &entry);
+			readDisk(context, gpt.partitionEntrySize, offset, &entry);
 			if (entry.typeGUID) {
 				tprintf("Partition %d: \"", i);
 				entry.printName(false);
@@ -1258,4 +1507,1329 @@ namespace Thorn {
 			tprintf("Initialized ThornFAT partition.\n");
 		}
 	}
+
+	void fstrim(const std::vector<std::string> &, InputContext &context) {
+		if (!context.driver) {
+			tprintf("Driver isn't ready. Try init driver.\n");
+			return;
+		}
+
+		const ssize_t discarded = context.driver->trim();
+		if (discarded < 0) {
+			tprintf("fstrim failed: %s\n", strerror(-discarded));
+		} else {
+			context.driver->sync();
+			tprintf("Discarded %ld bytes.\n", discarded);
+		}
+	}
+
+	void ramdisk(const std::vector<std::string> &pieces, InputContext &context) {
+		auto usage = [] { tprintf("Usage:\n- ramdisk create <size>[K|M|G]\n"); };
+		if (pieces.size() != 3 || pieces[1] != "create") {
+			usage();
+			return;
+		}
+
+		std::string number = pieces[2];
+		size_t shift = 0;
+		switch (number.empty()? '\0' : number.back()) {
+			case 'K': case 'k': shift = 10; break;
+			case 'M': case 'm': shift = 20; break;
+			case 'G': case 'g': shift = 30; break;
+		}
+		if (shift != 0)
+			number.pop_back();
+
+		size_t size;
+		if (!Util::parseUlong(number, size) || size == 0 || (SIZE_MAX >> shift) < size) {
+			usage();
+			return;
+		}
+
+		size <<= shift;
+		if (!RamDisk::fits(size)) {
+			tprintf("There isn't enough free memory for a %lu KiB RAM disk.\n", size / 1024);
+			return;
+		}
+
+		if (context.driver)
+			delete context.driver;
+		context.driver = nullptr;
+		if (context.partition)
+			delete context.partition;
+		context.partition = nullptr;
+		if (context.device)
+			delete context.device;
+
+		// The whole disk is one partition; there's no partition table to read.
+		RamDisk *disk = new RamDisk(size);
+		context.device = disk;
+		context.stripe = nullptr;
+		context.partition = new FS::Partition(disk, 0, disk->size);
+		context.path = "/";
+		tprintf("Created a %lu KiB RAM disk. Use \"init tfat\" and \"make\" to format it.\n", disk->size / 1024);
+	}
+
+	void raid(const std::vector<std::string> &pieces, InputContext &context) {
+		auto usage = [] { tprintf("Usage:\n- raid create <chunk KiB> <port> <port>...\n- raid assemble\n"); };
+		if (pieces.size() < 2) {
+			usage();
+		} else if (pieces[1] == "create") {
+			size_t chunk_kib;
+			if (pieces.size() < 5 || !Util::parseUlong(pieces[2], chunk_kib) || chunk_kib == 0) {
+				usage();
+				return;
+			}
+
+			if (context.diskMode != DiskMode::AHCI || !context.controller) {
+				tprintf("No AHCI controller is selected.\n");
+				return;
+			}
+
+			std::vector<AHCI::Port *> ports;
+			for (size_t i = 3; i < pieces.size(); ++i) {
+				size_t port_index;
+				if (!Util::parseUlong(pieces[i], port_index) || 32 <= port_index
+				    || !context.controller->ports[port_index]) {
+					tprintf("Invalid port: %s\n", pieces[i].c_str());
+					return;
+				}
+				AHCI::Port *port = context.controller->ports[port_index];
+				if (std::find(ports.begin(), ports.end(), port) != ports.end()) {
+					tprintf("Port %lu is listed twice.\n", port_index);
+					return;
+				}
+				ports.push_back(port);
+			}
+
+			// The array is as big as its smallest member allows.
+			uint64_t member_size = UINT64_MAX;
+			for (AHCI::Port *port: ports)
+				member_size = std::min<uint64_t>(member_size, port->getInfo().sectorCount() * port->blockSize());
+
+			releaseDisk(context);
+			StripeDevice::Members members;
+			for (AHCI::Port *port: ports)
+				members.emplace_back(new AHCIDevice(port));
+
+			std::unique_ptr<StripeDevice> array = StripeDevice::create(std::move(members), chunk_kib << 10, member_size);
+			if (!array) {
+				tprintf("Couldn't create the array.\n");
+				return;
+			}
+
+			tprintf("Created array %lx. Use \"init tfat\" and \"make\" to format it.\n", array->arrayID);
+			selectArray(context, std::move(array));
+		} else if (pieces[1] == "assemble" && pieces.size() == 2) {
+			assembleArrays(context, false);
+		} else {
+			usage();
+		}
+	}
+
+	void cache(const std::vector<std::string> &pieces, InputContext &context) {
+		auto usage = [] { tprintf("Usage:\n- cache [show]\n- cache reset\n- cache drop\n"); };
+		if (2 < pieces.size()) {
+			usage();
+			return;
+		}
+
+		if (!context.device) {
+			tprintf("No device selected.\n");
+			return;
+		}
+
+		StorageDeviceBase &device = *context.device;
+		CacheStats *stats = device.getCacheStats();
+		const std::string command = pieces.size() == 2? pieces[1] : "show";
+
+		if (command == "drop") {
+			// Dirty data goes out first so that everything can be dropped, leaving a cold cache.
+			if (const int status = device.sync())
+				tprintf("Sync failed: %d\n", status);
+			device.dropCache();
+			tprintf("Dropped the cache of %s.\n", device.getName().c_str());
+		} else if (command == "reset") {
+			if (stats)
+				*stats = {};
+			PageCache::get().stats = {};
+		} else if (command == "show") {
+			if (!stats) {
+				tprintf("%s doesn't use the page cache.\n", device.getName().c_str());
+				return;
+			}
+
+			auto format = [](uint64_t nanos) {
+				if (nanos < 10'000)
+					return std::to_string(nanos) + " ns";
+				if (nanos < 10'000'000)
+					return std::to_string(nanos / 1'000) + " us";
+				return std::to_string(nanos / 1'000'000) + " ms";
+			};
+
+			const uint64_t lookups = stats->hits + stats->misses;
+			const PageCache &page_cache = PageCache::get();
+			tprintf("%s\n", device.getName().c_str());
+			tprintf("Lookups: %lu hits, %lu misses (%lu%% hits)\n", stats->hits, stats->misses,
+				lookups? stats->hits * 100 / lookups : 0);
+			tprintf("Pages evicted: %lu, blocks written back: %lu\n", stats->evictions, stats->writebacks);
+			tprintf("Through the cache: %lu KiB read, %lu KiB written\n", stats->bytesRead >> 10,
+				stats->bytesWritten >> 10);
+			tprintf("Direct: %lu KiB read, %lu KiB written\n", stats->bytesReadDirect >> 10,
+				stats->bytesWrittenDirect >> 10);
+			tprintf("Page cache: %lu of %lu pages, %lu KiB of overhead, %lu evicted, %lu given back\n",
+				page_cache.size(), page_cache.capacity(), page_cache.overhead() >> 10, page_cache.stats.evictions,
+				page_cache.stats.shrunk);
+
+			tprintf("Read latency %10s %10s\n", "hits", "misses");
+			for (size_t i = 0; i < CacheStats::Histogram::BUCKETS; ++i) {
+				const uint64_t hits = stats->hitLatency.counts[i];
+				const uint64_t misses = stats->missLatency.counts[i];
+				if (hits != 0 || misses != 0)
+					tprintf("< %-10s %10lu %10lu\n", format(uint64_t(2) << i).c_str(), hits, misses);
+			}
+
+			for (const bool hit: {true, false}) {
+				const CacheStats::Histogram &histogram = hit? stats->hitLatency : stats->missLatency;
+				if (const uint64_t count = histogram.count())
+					tprintf("%-6s mean %s, p50 < %s, p99 < %s\n", hit? "Hits:" : "Misses:",
+						format(histogram.totalNanos / count).c_str(), format(histogram.percentile(50)).c_str(),
+						format(histogram.percentile(99)).c_str());
+			}
+		} else {
+			usage();
+		}
+	}
+
+	/** The seed for benchmarks' random offsets, so that runs can be compared. */
+	constexpr uint64_t BENCH_SEED = 0x9e3779b97f4a7c15ul;
+
+	/** Advances a xorshift64 state and returns it. */
+	static uint64_t nextRandom(uint64_t &seed) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		return seed;
+	}
+
+	/** Parses a subcommand's optional count or size argument over the default already in out. Returns false if it's
+	 *  malformed or zero or there are more arguments. */
+	static bool benchArgument(const std::vector<std::string> &pieces, size_t &out) {
+		return pieces.size() <= 3 && (pieces.size() < 3 || Util::parseUlong(pieces[2], out)) && out != 0;
+	}
+
+	/** Returns the nanoseconds since a Clock::cycles() reading, and at least 1 so that rates can be divided by it. */
+	static uint64_t nanosSince(uint64_t start) {
+		return std::max(1ul, x86_64::Clock::cyclesToNanos(x86_64::Clock::cycles() - start));
+	}
+
+	/** Creates an empty scratch file, replacing any left over from before. Says why if it can't. */
+	static bool createScratch(FS::ThornFAT::ThornFATDriver &driver, const char *path) {
+		if (driver.exists(path) == 0)
+			driver.unlink(path);
+		if (int status = driver.create(path, 0644); status != 0) {
+			tprintf("Couldn't create %s: %s\n", path, strerror(-status));
+			return false;
+		}
+		return true;
+	}
+
+	/** Counts asynchronous operations as their completions come in. */
+	struct Completions {
+		size_t completed = 0;
+		size_t failed = 0;
+
+		inline void add(bool ok) {
+			++completed;
+			if (!ok)
+				++failed;
+		}
+	};
+
+	/** Keeps up to depth operations in flight until count of them have completed. issue(i) starts the ith and returns
+	 *  false if there's no room for it yet, and wait() returns once something has finished or false on timeout.
+	 *  Returns whether everything completed, after saying so if it didn't. */
+	template <typename Outstanding, typename Issue, typename Wait>
+	static bool runQueued(size_t count, size_t depth, const Completions &completions, Outstanding outstanding,
+	                      Issue issue, Wait wait) {
+		size_t issued = 0;
+		while (completions.completed < count) {
+			while (issued < count && outstanding() < depth && issue(issued))
+				++issued;
+
+			if (!wait()) {
+				tprintf("Timed out with %lu of %lu completed.\n", completions.completed, count);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void bench(const std::vector<std::string> &pieces, InputContext &context) {
+		auto usage = [] {
+			tprintf("Usage:\n- bench iops [count]\n- bench ncq [count]\n- bench syscall [count]\n"
+				"- bench fatwrite [KiB]\n- bench fsync [count]\n- bench irq [count]\n- bench ide [MiB]\n"
+				"- bench disk [MiB]\n- bench nvme [count]\n- bench view [MiB]\n- bench raid [MiB]\n"
+				"- bench cache [count]\n- bench fatread [MiB]\n- bench pagecache [MiB]\n- bench scan [pages]\n"
+				"- bench direct [MiB]\n");
+		};
+
+		if (pieces.size() < 2) {
+			usage();
+		} else if (pieces[1] == "iops") {
+			size_t count = 1000;
+			if (!benchArgument(pieces, count)) {
+				usage();
+				return;
+			}
+
+			if (context.diskMode != DiskMode::AHCI || !context.port) {
+				tprintf("No AHCI port selected.\n");
+				return;
+			}
+
+			// Single-sector reads straight through the port, bypassing the cache, so this measures per-command
+			// overhead rather than bandwidth. Both completion modes are run if the controller has an interrupt vector.
+			AHCI::Port &port = *context.port;
+			const bool interrupt_driven = port.interruptDriven;
+			for (const bool use_interrupts: {false, true}) {
+				if (use_interrupts && (!port.parent || port.parent->irq == 0xff)) {
+					tprintf("Controller has no interrupt vector; skipping interrupt-driven run.\n");
+					break;
+				}
+
+				port.interruptDriven = use_interrupts;
+				port.idleCycles = 0;
+				const uint64_t start = x86_64::Clock::cycles();
+				for (size_t i = 0; i < count; ++i) {
+					if (port.access(i, 1, port.physicalBuffers[1], false) != AHCI::Port::AccessStatus::Success) {
+						tprintf("Read %lu failed.\n", i);
+						port.interruptDriven = interrupt_driven;
+						return;
+					}
+				}
+
+				const uint64_t cycles = x86_64::Clock::cycles() - start;
+				const uint64_t elapsed = x86_64::Clock::cyclesToNanos(cycles);
+				tprintf("%s: %lu reads in %lu us: %lu IOPS, %lu ns per read, CPU busy %lu%%\n",
+					use_interrupts? "interrupt" : "polled", count, elapsed / 1'000, count * 1'000'000'000 / elapsed,
+					elapsed / count, 100 - port.idleCycles * 100 / cycles);
+			}
+			port.interruptDriven = interrupt_driven;
+		} else if (pieces[1] == "ncq") {
+			size_t count = 10'000;
+			if (!benchArgument(pieces, count)) {
+				usage();
+				return;
+			}
+
+			if (context.diskMode != DiskMode::AHCI || !context.port) {
+				tprintf("No AHCI port selected.\n");
+				return;
+			}
+
+			AHCI::Port &port = *context.port;
+			const int max_depth = port.queueDepth();
+			if (max_depth == 0) {
+				tprintf("NCQ isn't supported by this port.\n");
+				return;
+			}
+
+			// Random single-sector reads, kept within the first 1 GiB so that a seek isn't the whole story.
+			uint64_t sectors = port.getInfo().sectorCount();
+			if (sectors == 0 || (1ul << 21) < sectors)
+				sectors = 1ul << 21;
+
+			const AHCI::Port::Completion on_complete = +[](void *data, AHCI::Port::AccessStatus status) {
+				static_cast<Completions *>(data)->add(status == AHCI::Port::AccessStatus::Success);
+			};
+
+			auto outstanding = [&] { return size_t(__builtin_popcount(port.outstanding())); };
+			auto wait = [&] { return port.waitQueued(); };
+
+			for (const int depth: {1, max_depth}) {
+				Completions state;
+				uint64_t seed = BENCH_SEED;
+				auto issue = [&](size_t) {
+					return port.issueQueued(nextRandom(seed) % sectors, 1, nullptr, false, on_complete, &state) != -1;
+				};
+
+				const uint64_t start = x86_64::Clock::cycles();
+				if (!runQueued(count, depth, state, outstanding, issue, wait))
+					return;
+
+				const uint64_t elapsed = nanosSince(start);
+				tprintf("QD%d: %lu reads in %lu us: %lu IOPS, %lu ns per read, %lu failed\n", depth, count,
+					elapsed / 1'000, count * 1'000'000'000 / elapsed, elapsed / count, state.failed);
+			}
+		} else if (pieces[1] == "irq") {
+			size_t count = 10'000;
+			if (!benchArgument(pieces, count)) {
+				usage();
+				return;
+			}
+
+			if (context.diskMode != DiskMode::AHCI || !context.port) {
+				tprintf("No AHCI port selected.\n");
+				return;
+			}
+
+			AHCI::Port &port = *context.port;
+			if (!port.parent || port.parent->irq == 0xff) {
+				tprintf("Controller has no interrupt vector.\n");
+				return;
+			}
+
+			const int depth = port.queueDepth();
+			if (depth == 0) {
+				tprintf("NCQ isn't supported by this port.\n");
+				return;
+			}
+
+			// Random 4 KiB reads at QD32 (or whatever the port allows), within the first 1 GiB.
+			const uint32_t per_read = port.blockSize() < 4096? 4096 / port.blockSize() : 1;
+			uint64_t reads = port.getInfo().sectorCount() / per_read;
+			if (reads == 0 || (1ul << 30) / 4096 < reads)
+				reads = (1ul << 30) / 4096;
+
+			struct State: Completions {
+				uint64_t latency = 0;
+			};
+
+			struct Request {
+				State *state;
+				uint64_t start;
+			};
+
+			const AHCI::Port::Completion on_complete = +[](void *data, AHCI::Port::AccessStatus status) {
+				Request &request = *static_cast<Request *>(data);
+				request.state->latency += x86_64::Clock::cycles() - request.start;
+				request.state->add(status == AHCI::Port::AccessStatus::Success);
+			};
+
+			auto outstanding = [&] { return size_t(__builtin_popcount(port.outstanding())); };
+			auto wait = [&] { return port.waitQueued(); };
+
+			// The knobs from "set coalesce" and "set hybridpoll" are used if they're set, and restored afterwards.
+			AHCI::Controller &controller = *port.parent;
+			const bool was_coalesced = controller.cccInterrupt != -1;
+			const uint32_t ccc_ctl = controller.abar->ccc_ctl;
+			const uint32_t ccc_pts = controller.abar->ccc_pts;
+			const uint8_t completions = was_coalesced? (ccc_ctl >> 8) & 0xff : 16;
+			const uint16_t timeout = was_coalesced? ccc_ctl >> 16 : 1;
+			const uint64_t hybrid_poll = port.hybridPollNanos;
+			const uint64_t poll_nanos = hybrid_poll? hybrid_poll : 20'000;
+
+			struct Mode {
+				const char *name;
+				bool coalesce;
+				bool poll;
+			};
+
+			std::vector<Request> requests(count);
+			for (const Mode &mode: {Mode{"interrupts", false, false}, Mode{"coalesced", true, false},
+			                        Mode{"hybrid poll", false, true}, Mode{"both", true, true}}) {
+				if (mode.coalesce && !controller.setCoalescing(controller.abar->pi, completions, timeout)) {
+					tprintf("%-11s unsupported by the controller\n", mode.name);
+					continue;
+				} else if (!mode.coalesce) {
+					controller.disableCoalescing();
+				}
+
+				port.hybridPollNanos = mode.poll? poll_nanos : 0;
+				port.averageWait = 0;
+				port.polledWaits = 0;
+				port.sleptWaits = 0;
+
+				State state;
+				uint64_t seed = BENCH_SEED;
+				auto issue = [&](size_t i) {
+					requests[i] = {&state, x86_64::Clock::cycles()};
+					const uint64_t lba = nextRandom(seed) % reads * per_read;
+					return port.issueQueued(lba, per_read, nullptr, false, on_complete, &requests[i]) != -1;
+				};
+
+				const uint64_t interrupts = controller.interrupts;
+				const uint64_t start = x86_64::Clock::cycles();
+				runQueued(count, depth, state, outstanding, issue, wait);
+
+				const uint64_t elapsed = nanosSince(start);
+				const uint64_t fired = controller.interrupts - interrupts;
+				tprintf("%-11s %lu IOPS, %lu ns average latency, %lu interrupts/s (%lu per 100 reads), "
+					"%lu polled and %lu slept waits, %lu failed\n", mode.name, count * 1'000'000'000 / elapsed,
+					x86_64::Clock::cyclesToNanos(state.latency) / count, fired * 1'000'000'000 / elapsed,
+					fired * 100 / count, port.polledWaits, port.sleptWaits, state.failed);
+				if (state.completed < count)
+					break;
+			}
+
+			port.hybridPollNanos = hybrid_poll;
+			if (was_coalesced)
+				controller.setCoalescing(ccc_pts, completions, timeout);
+			else
+				controller.disableCoalescing();
+		} else if (pieces[1] == "fatwrite") {
+			size_t kib = 1024;
+			if (!benchArgument(pieces, kib)) {
+				usage();
+				return;
+			}
+
+			if (!context.driver) {
+				tprintf("No ThornFAT partition mounted.\n");
+				return;
+			}
+
+			StorageDeviceBase &device = *context.driver->partition->parent;
+			RequestQueue *queue = device.getQueue();
+			if (!queue) {
+				tprintf("Device has no request queue.\n");
+				return;
+			}
+
+			const char *path = "/bench.tmp";
+			if (!createScratch(*context.driver, path))
+				return;
+
+			// Sequential 4 KiB writes, timed up to the point where the device has everything.
+			constexpr size_t chunk = 4096;
+			std::vector<char> data(chunk);
+			for (size_t i = 0; i < chunk; ++i)
+				data[i] = 'a' + i % 26;
+
+			queue->stats = {};
+			const uint64_t start = x86_64::Clock::cycles();
+			for (size_t offset = 0; offset < kib * 1024; offset += chunk) {
+				const int status = context.driver->write(path, data.data(), chunk, offset);
+				if (status < 0) {
+					tprintf("Write at %lu failed: %s\n", offset, strerror(-status));
+					context.driver->unlink(path);
+					return;
+				}
+			}
+			device.flush();
+			const uint64_t elapsed = nanosSince(start);
+
+			const RequestQueue::Stats &stats = queue->stats;
+			const uint64_t merges = stats.backMerges + stats.frontMerges + stats.absorbed;
+			tprintf("Wrote %lu KiB in %lu us: %lu KiB/s\n", kib, elapsed / 1'000, kib * 1'000'000'000 / elapsed);
+			tprintf("Submitted %lu, back merges %lu, front merges %lu, absorbed %lu, forwarded %lu (merge rate %lu%%)\n",
+				stats.submitted, stats.backMerges, stats.frontMerges, stats.absorbed, stats.forwarded,
+				stats.submitted? merges * 100 / stats.submitted : 0);
+			tprintf("Dispatched %lu (%lu blocks read, %lu written, %lu blocks per request), %lu errors\n",
+				stats.dispatched, stats.blocksRead, stats.blocksWritten,
+				stats.dispatched? (stats.blocksRead + stats.blocksWritten) / stats.dispatched : 0, stats.errors);
+
+			context.driver->unlink(path);
+		} else if (pieces[1] == "fatread") {
+			size_t mib = 16;
+			if (!benchArgument(pieces, mib)) {
+				usage();
+				return;
+			}
+
+			if (!context.driver) {
+				tprintf("No ThornFAT partition mounted.\n");
+				return;
+			}
+
+			StorageDeviceBase &device = *context.driver->partition->parent;
+			RequestQueue *queue = device.getQueue();
+			if (!queue) {
+				tprintf("Device has no request queue.\n");
+				return;
+			}
+
+			const char *path = "/bench.tmp";
+			if (!createScratch(*context.driver, path))
+				return;
+
+			constexpr size_t chunk = 4096;
+			const size_t bytes = mib << 20;
+			std::vector<char> data(64 << 10);
+			for (size_t i = 0; i < data.size(); ++i)
+				data[i] = 'a' + i % 26;
+
+			for (size_t offset = 0; offset < bytes; offset += data.size()) {
+				const int status = context.driver->write(path, data.data(), data.size(), offset);
+				if (status < 0) {
+					tprintf("Write at %lu failed: %s\n", offset, strerror(-status));
+					context.driver->unlink(path);
+					return;
+				}
+			}
+			device.sync();
+
+			// The file is read from a cold cache in 4 KiB pieces, first without readahead and then with it.
+			const size_t max_readahead = AHCIDevice::maxReadahead;
+			for (const bool readahead: {false, true}) {
+				AHCIDevice::maxReadahead = readahead? max_readahead : 0;
+				device.dropCache();
+				queue->stats = {};
+
+				const uint64_t start = x86_64::Clock::cycles();
+				for (size_t offset = 0; offset < bytes; offset += chunk) {
+					const int status = context.driver->read(path, data.data(), chunk, offset);
+					if (status < 0) {
+						tprintf("Read at %lu failed: %s\n", offset, strerror(-status));
+						AHCIDevice::maxReadahead = max_readahead;
+						context.driver->unlink(path);
+						return;
+					}
+				}
+				const uint64_t elapsed = nanosSince(start);
+
+				const RequestQueue::Stats &stats = queue->stats;
+				tprintf("Readahead %-3s: %lu MiB in %lu us: %lu KiB/s, %lu reads of %lu blocks on average\n",
+					readahead? "on" : "off", mib, elapsed / 1'000, (bytes >> 10) * 1'000'000'000 / elapsed,
+					stats.dispatched, stats.dispatched? stats.blocksRead / stats.dispatched : 0);
+			}
+
+			AHCIDevice::maxReadahead = max_readahead;
+			context.driver->unlink(path);
+		} else if (pieces[1] == "fsync") {
+			size_t count = 256;
+			if (!benchArgument(pieces, count)) {
+				usage();
+				return;
+			}
+
+			if (!context.driver) {
+				tprintf("No ThornFAT partition mounted.\n");
+				return;
+			}
+
+			const char *path = "/bench.tmp";
+			constexpr size_t chunk = 4096;
+			std::vector<char> data(chunk);
+			for (size_t i = 0; i < chunk; ++i)
+				data[i] = 'a' + i % 26;
+
+			// Appending 4 KiB writes, made durable after every write, after every 16 and only once at the end.
+			for (const size_t group: {size_t(1), size_t(16), count}) {
+				if (!createScratch(*context.driver, path))
+					return;
+				context.driver->sync();
+
+				size_t syncs = 0;
+				const uint64_t start = x86_64::Clock::cycles();
+				for (size_t i = 0; i < count; ++i) {
+					int status = context.driver->write(path, data.data(), chunk, i * chunk);
+					if (0 <= status && ((i + 1) % group == 0 || i + 1 == count)) {
+						status = context.driver->fsync(path);
+						++syncs;
+					}
+					if (status < 0) {
+						tprintf("Write %lu failed: %s\n", i, strerror(-status));
+						context.driver->unlink(path);
+						return;
+					}
+				}
+				const uint64_t elapsed = nanosSince(start);
+
+				tprintf("fsync every %lu: %lu writes, %lu syncs in %lu us: %lu ns per write\n", group, count, syncs,
+					elapsed / 1'000, elapsed / count);
+			}
+
+			context.driver->unlink(path);
+		} else if (pieces[1] == "syscall") {
+			size_t count = 100'000;
+			if (!benchArgument(pieces, count)) {
+				usage();
+				return;
+			}
+
+			using x86_64::Syscall::Number;
+
+			uint64_t start = x86_64::Clock::cycles();
+			for (size_t i = 0; i < count; ++i)
+				x86_64::Syscall::invoke(Number::Null);
+			const uint64_t fast = x86_64::Clock::cycles() - start;
+
+			start = x86_64::Clock::cycles();
+			for (size_t i = 0; i < count; ++i)
+				x86_64::Syscall::invokeInterrupt(Number::Null);
+			const uint64_t slow = x86_64::Clock::cycles() - start;
+
+			tprintf("syscall:   %lu cycles (%lu ns) per call\n", fast / count, x86_64::Clock::cyclesToNanos(fast) / count);
+			tprintf("int $0x80: %lu cycles (%lu ns) per call\n", slow / count, x86_64::Clock::cyclesToNanos(slow) / count);
+		} else if (pieces[1] == "ide") {
+			size_t mib = 16;
+			if (!benchArgument(pieces, mib)) {
+				usage();
+				return;
+			}
+
+			if (context.diskMode != DiskMode::IDE || context.idePort == -1) {
+				tprintf("No IDE drive selected.\n");
+				return;
+			}
+
+			// Sequential reads as large as one command allows, straight to the drive so the queue and cache stay out
+			// of it. Single-sector PIO, READ MULTIPLE and DMA each read the same range.
+			constexpr uint8_t SECTORS = 255;
+			IDE::Device &device = IDE::devices[context.idePort];
+			if (device.size <= SECTORS) {
+				tprintf("The drive is too small.\n");
+				return;
+			}
+
+			const size_t commands = std::max(1ul, mib * 1024 * 1024 / (SECTORS * IDE::SECTOR_SIZE));
+			const size_t bytes = commands * SECTORS * IDE::SECTOR_SIZE;
+			std::vector<char> buffer(SECTORS * IDE::SECTOR_SIZE);
+			const bool dma_enabled = IDE::dmaEnabled;
+			const uint8_t multiple = device.multiple;
+
+			enum class Mode {PIO, Multiple, DMA};
+			for (const Mode mode: {Mode::PIO, Mode::Multiple, Mode::DMA}) {
+				if ((mode == Mode::Multiple && multiple == 0) || (mode == Mode::DMA && !device.dma)) {
+					tprintf("%s isn't available; skipping.\n", mode == Mode::DMA? "DMA" : "READ MULTIPLE");
+					continue;
+				}
+
+				IDE::dmaEnabled = mode == Mode::DMA;
+				device.multiple = mode == Mode::Multiple? multiple : 0;
+				const uint64_t start = x86_64::Clock::cycles();
+				for (size_t i = 0; i < commands; ++i) {
+					const uint32_t lba = i * SECTORS % (device.size - SECTORS);
+					if (const int status = IDE::readSectors(context.idePort, SECTORS, lba, buffer.data())) {
+						tprintf("Read %lu failed: %d\n", i, status);
+						IDE::dmaEnabled = dma_enabled;
+						device.multiple = multiple;
+						return;
+					}
+				}
+
+				const uint64_t elapsed = nanosSince(start);
+				tprintf("%-9s %lu KiB in %lu us: %lu KiB/s\n", mode == Mode::PIO? "PIO:" : mode == Mode::Multiple?
+					"MULTIPLE:" : "DMA:", bytes / 1024, elapsed / 1'000, bytes / 1024 * 1'000'000 / (elapsed / 1'000));
+			}
+
+			IDE::dmaEnabled = dma_enabled;
+			device.multiple = multiple;
+		} else if (pieces[1] == "disk") {
+			size_t mib = 64;
+			if (!benchArgument(pieces, mib)) {
+				usage();
+				return;
+			}
+
+			RequestQueue *queue = context.partition? context.partition->parent->getQueue() : nullptr;
+			if (!queue) {
+				tprintf("No partition with a request queue is selected.\n");
+				return;
+			}
+
+			// Everything is submitted up front and the queue keeps the device as busy as it allows, so this compares
+			// the drivers underneath it (AHCI, virtio) rather than the cache. Only the selected partition is read.
+			const size_t block_size = queue->blockSize;
+			const uint64_t first = context.partition->offset / block_size;
+			const uint64_t blocks = context.partition->length / block_size;
+			const size_t chunk = std::max(1ul, (1ul << 20) / block_size);
+			const size_t per_random = std::max(1ul, 4096 / block_size);
+			if (blocks < chunk) {
+				tprintf("The partition is too small.\n");
+				return;
+			}
+
+			const RequestQueue::Completion on_complete = +[](void *data, int status) {
+				static_cast<Completions *>(data)->add(status == 0);
+			};
+
+			Virtio::Block *virtio = context.diskMode == DiskMode::Virtio? context.virtio : nullptr;
+			auto run = [&](const char *name, size_t count, size_t per_read, bool random) {
+				std::vector<uint8_t> buffer(per_read * block_size);
+				const Virtio::Block::Stats virtio_stats = virtio? virtio->stats : Virtio::Block::Stats();
+				const uint64_t notifications = virtio? virtio->queue.notifications : 0;
+				const uint64_t dispatched = queue->stats.dispatched;
+				Completions state;
+				uint64_t seed = BENCH_SEED;
+				const uint64_t start = x86_64::Clock::cycles();
+
+				for (size_t i = 0; i < count; ++i) {
+					const uint64_t block = random? nextRandom(seed) % (blocks / per_read) * per_read
+						: i * per_read % (blocks - per_read + 1);
+					queue->submitRead(first + block, per_read, buffer.data(), on_complete, &state);
+				}
+				queue->drain();
+
+				const uint64_t elapsed = nanosSince(start);
+				const uint64_t bytes = count * per_read * block_size;
+				tprintf("%-10s %lu reads, %lu KiB in %lu us: %lu IOPS, %lu KiB/s, %lu commands, %lu failed\n", name,
+					count, bytes / 1024, elapsed / 1'000, count * 1'000'000'000 / elapsed,
+					bytes / 1024 * 1'000'000 / std::max(1ul, elapsed / 1'000), queue->stats.dispatched - dispatched,
+					state.failed);
+				if (virtio)
+					tprintf("           %lu requests, %lu notifications, %lu interrupts, %lu polled, %lu slept\n",
+						virtio->stats.requests - virtio_stats.requests,
+						virtio->queue.notifications - notifications,
+						virtio->stats.interrupts - virtio_stats.interrupts,
+						virtio->stats.polledWaits - virtio_stats.polledWaits,
+						virtio->stats.sleptWaits - virtio_stats.sleptWaits);
+			};
+
+			tprintf("%s, %lu-byte blocks\n", context.partition->parent->getName().c_str(), block_size);
+			run("Sequential", mib * (1ul << 20) / (chunk * block_size), chunk, false);
+			run("Random", mib * (1ul << 20) / (per_random * block_size), per_random, true);
+		} else if (pieces[1] == "nvme") {
+			size_t count = 100'000;
+			if (!benchArgument(pieces, count)) {
+				usage();
+				return;
+			}
+
+			if (context.diskMode != DiskMode::NVMe || !context.nvme) {
+				tprintf("No NVMe namespace selected.\n");
+				return;
+			}
+
+			// Random 4 KiB reads within the first 1 GiB, straight to the current CPU's queue pair. Each round of
+			// submissions is followed by a single doorbell write.
+			NVMe::Namespace &ns = *context.nvme;
+			NVMe::Controller &controller = ns.controller;
+			NVMe::QueuePair &queue = ns.queue();
+			const uint32_t per_read = std::max(1ul, 4096 / ns.blockSize);
+			uint64_t reads = ns.blocks / per_read;
+			if ((1ul << 30) / 4096 < reads)
+				reads = (1ul << 30) / 4096;
+
+			const NVMe::QueuePair::Completion on_complete = +[](void *data, int status) {
+				static_cast<Completions *>(data)->add(status == 0);
+			};
+
+			const size_t max_depth = std::min<size_t>(32, queue.slots());
+			std::vector<uint8_t> buffer(max_depth * per_read * ns.blockSize);
+			const bool prefer_sgl = controller.preferSGL;
+
+			for (const bool sgl: {false, true}) {
+				if (sgl && !controller.sglSupported) {
+					tprintf("SGLs aren't supported by the controller; skipping.\n");
+					continue;
+				}
+
+				controller.preferSGL = sgl;
+				for (const size_t depth: {1ul, max_depth}) {
+					const NVMe::QueuePair::Stats before = queue.stats;
+					Completions state;
+					uint64_t seed = BENCH_SEED;
+					auto issue = [&](size_t i) {
+						uint8_t *target = &buffer[i % depth * per_read * ns.blockSize];
+						return ns.issue(false, nextRandom(seed) % reads * per_read, per_read, target, false, on_complete,
+							&state);
+					};
+
+					const uint64_t start = x86_64::Clock::cycles();
+					if (!runQueued(count, depth, state, [&] { return queue.outstanding(); }, issue,
+					               [&] { return queue.wait(); })) {
+						controller.preferSGL = prefer_sgl;
+						return;
+					}
+
+					const uint64_t elapsed = nanosSince(start);
+					const NVMe::QueuePair::Stats &after = queue.stats;
+					tprintf("%s QD%lu: %lu reads in %lu us: %lu IOPS, %lu ns per read, %lu failed\n",
+						sgl? "SGL" : "PRP", depth, count, elapsed / 1'000, count * 1'000'000'000 / elapsed,
+						elapsed / count, state.failed);
+					tprintf("  %lu doorbells, %lu interrupts, %lu polled, %lu slept\n",
+						after.doorbells - before.doorbells, after.interrupts - before.interrupts,
+						after.polledWaits - before.polledWaits, after.sleptWaits - before.sleptWaits);
+				}
+			}
+
+			controller.preferSGL = prefer_sgl;
+		} else if (pieces[1] == "view") {
+			size_t mib = 64;
+			if (!benchArgument(pieces, mib)) {
+				usage();
+				return;
+			}
+
+			if (!context.partition || !context.partition->view(0, 4096)) {
+				tprintf("The selected partition can't be read without copying.\n");
+				return;
+			}
+
+			// The same 4 KiB pieces are read into a buffer and viewed in place. Both are summed so that the data is
+			// actually touched either way.
+			FS::Partition &partition = *context.partition;
+			const size_t pieces_count = std::min(mib << 20, partition.length) / 4096;
+			std::vector<uint64_t> buffer(4096 / sizeof(uint64_t));
+
+			for (const bool copy: {true, false}) {
+				uint64_t sum = 0;
+				const uint64_t start = x86_64::Clock::cycles();
+				for (size_t i = 0; i < pieces_count; ++i) {
+					const uint64_t *data = buffer.data();
+					if (copy)
+						partition.read(buffer.data(), 4096, i * 4096);
+					else
+						data = static_cast<const uint64_t *>(partition.view(i * 4096, 4096));
+					for (size_t j = 0; j < 4096 / sizeof(uint64_t); ++j)
+						sum += data[j];
+				}
+
+				const uint64_t elapsed = nanosSince(start);
+				tprintf("%-5s %lu KiB in %lu us: %lu MiB/s (sum %lx)\n", copy? "read:" : "view:", pieces_count * 4,
+					elapsed / 1'000, (pieces_count * 4096 * 1'000'000'000 / elapsed) >> 20, sum);
+			}
+		} else if (pieces[1] == "raid") {
+			size_t mib = 256;
+			if (!benchArgument(pieces, mib)) {
+				usage();
+				return;
+			}
+
+			if (!context.stripe) {
+				tprintf("No RAID array is selected.\n");
+				return;
+			}
+
+			// The same amount is read sequentially from the first member on its own and then from the whole array,
+			// a few full stripes per call. With members on separate ports, the array should be about as many times
+			// faster as it has members.
+			StripeDevice &array = *context.stripe;
+			const size_t stripe = array.chunkSize * array.memberCount();
+			const size_t per_call = std::max(1ul, (4ul << 20) / stripe) * stripe;
+			const size_t calls = std::min(std::min(mib << 20, array.memberSize), array.size) / per_call;
+			if (calls == 0) {
+				tprintf("The array is too small.\n");
+				return;
+			}
+
+			std::vector<uint8_t> buffer(per_call);
+			StorageDevice &member = array.member(0);
+			for (const bool whole: {false, true}) {
+				int status = 0;
+				const uint64_t start = x86_64::Clock::cycles();
+				for (size_t i = 0; i < calls && status == 0; ++i)
+					status = whole? array.read(buffer.data(), per_call, i * per_call)
+						: member.queue.read(buffer.data(), per_call, StripeDevice::DATA_OFFSET + i * per_call);
+				const uint64_t elapsed = nanosSince(start);
+
+				if (status != 0) {
+					tprintf("%s: read failed: %d\n", whole? "array" : "member", status);
+					return;
+				}
+
+				tprintf("%-7s %lu MiB in %lu us: %lu MiB/s\n", whole? "array:" : "member:", calls * per_call >> 20,
+					elapsed / 1'000, (calls * per_call * 1'000'000'000 / elapsed) >> 20);
+			}
+		} else if (pieces[1] == "cache") {
+			size_t count = 1'000'000;
+			if (!benchArgument(pieces, count)) {
+				usage();
+				return;
+			}
+
+			// As many entries as the old per-device cache of 512-byte blocks had. The cache is filled first, so every
+			// lookup in the first run hits and three quarters of the second run's miss and evict something.
+			const size_t entries = 131072;
+			Cache<uint64_t, uint64_t> cache(entries);
+			for (uint64_t key = 0; key < entries; ++key)
+				cache[key].first.get() = key;
+
+			for (const size_t range: {entries, entries * 4}) {
+				uint64_t seed = BENCH_SEED;
+				uint64_t sum = 0;
+				size_t misses = 0;
+				const uint64_t start = x86_64::Clock::cycles();
+				for (size_t i = 0; i < count; ++i) {
+					auto [value, created] = cache[nextRandom(seed) % range];
+					if (created) {
+						value.get() = seed;
+						++misses;
+					}
+					sum += value.get();
+				}
+
+				const uint64_t elapsed = nanosSince(start);
+				tprintf("%lu lookups over %lu keys (%lu misses) in %lu us: %lu lookups/s, %lu ns each (sum %lx)\n",
+					count, range, misses, elapsed / 1'000, count * 1'000'000'000 / elapsed, elapsed / count, sum);
+			}
+		} else if (pieces[1] == "pagecache") {
+			size_t mib = 128;
+			if (!benchArgument(pieces, mib)) {
+				usage();
+				return;
+			}
+
+			// Only AHCI devices read through the page cache.
+			if (!context.partition || context.diskMode != DiskMode::AHCI || context.stripe) {
+				tprintf("No AHCI partition selected.\n");
+				return;
+			}
+
+			// Random 4 KiB reads over the working set, four times as many as it has pages. The same reads are played
+			// against a model of the cache this replaced: 131072 separately allocated 512-byte entries per device.
+			FS::Partition &partition = *context.partition;
+			constexpr size_t piece = PageCache::PAGE_SIZE;
+			const size_t pages = std::min(mib << 20, partition.length) / piece;
+			const size_t reads = pages * 4;
+			if (pages == 0) {
+				tprintf("The partition is too small.\n");
+				return;
+			}
+
+			struct OldEntry {
+				std::vector<uint8_t> data;
+				bool flushed = false;
+			};
+
+			constexpr size_t old_block = 512;
+			constexpr size_t old_entries = 131072;
+			const size_t old_allocation = (sizeof(Memory::BlockMeta) + old_block + MEMORY_ALIGN - 1)
+				/ MEMORY_ALIGN * MEMORY_ALIGN - old_block;
+			// Each node had a key, an entry and three links, and each had a bucket pointer.
+			const size_t old_per_entry = sizeof(uint64_t) + sizeof(OldEntry) + 4 * sizeof(void *) + old_allocation;
+			Cache<uint64_t, bool> old_cache(old_entries);
+
+			PageCache &page_cache = PageCache::get();
+			CacheStats &stats = *partition.parent->getCacheStats();
+			partition.parent->dropCache();
+			const PageCache::Stats before = page_cache.stats;
+			std::vector<uint8_t> buffer(piece);
+			size_t new_hits = 0;
+			size_t old_hits = 0;
+			uint64_t seed = BENCH_SEED;
+
+			const uint64_t start = x86_64::Clock::cycles();
+			for (size_t i = 0; i < reads; ++i) {
+				const size_t page = nextRandom(seed) % pages;
+
+				const uint64_t misses = stats.misses;
+				if (const int status = partition.read(buffer.data(), piece, page * piece)) {
+					tprintf("Read at %lu failed: %d\n", page * piece, status);
+					return;
+				}
+				if (stats.misses == misses)
+					++new_hits;
+
+				bool hit = true;
+				for (size_t block = page * piece / old_block; block < (page + 1) * piece / old_block; ++block)
+					if (old_cache[block].second)
+						hit = false;
+				if (hit)
+					++old_hits;
+			}
+			const uint64_t elapsed = nanosSince(start);
+
+			const size_t old_cached = old_cache.size() * old_block;
+			const size_t new_cached = page_cache.size() * piece;
+			tprintf("%lu reads over %lu KiB in %lu us\n", reads, pages * piece >> 10, elapsed / 1'000);
+			tprintf("Before: %lu%% hits, %lu KiB cached, %lu KiB of overhead (%lu bytes per KiB)\n",
+				old_hits * 100 / reads, old_cached >> 10, old_cache.size() * old_per_entry >> 10,
+				old_per_entry * 1024 / old_block);
+			tprintf("After:  %lu%% hits, %lu KiB cached, %lu KiB of overhead (%lu bytes per KiB)\n",
+				new_hits * 100 / reads, new_cached >> 10, page_cache.overhead() >> 10,
+				new_cached? page_cache.overhead() * 1024 / new_cached : 0);
+			tprintf("Page cache: %lu of %lu pages used, %lu evicted, %lu given back under memory pressure\n",
+				page_cache.size(), page_cache.capacity(), page_cache.stats.evictions - before.evictions,
+				page_cache.stats.shrunk - before.shrunk);
+		} else if (pieces[1] == "scan") {
+			size_t capacity = 4096;
+			if (!benchArgument(pieces, capacity) || capacity < 8) {
+				usage();
+				return;
+			}
+
+			// A quarter of the cache's worth of FAT and directory pages is used over and over, then a file four times
+			// the size of the cache is streamed through it in 512-byte reads with a metadata lookup after every eight
+			// pages, and then the metadata is used some more. Both policies see the same accesses.
+			const size_t metadata = capacity / 4;
+			const size_t per_page = PageCache::PAGE_SIZE / 512;
+
+			auto run = [&](auto &cache, const char *name) {
+				uint64_t seed = BENCH_SEED;
+				auto use_metadata = [&] { return !cache[nextRandom(seed) % metadata].second; };
+
+				size_t warm_hits = 0, scan_hits = 0, after_hits = 0, stream_misses = 0;
+				for (size_t i = 0; i < 8 * metadata; ++i)
+					warm_hits += use_metadata();
+
+				const size_t stream = 4 * capacity;
+				for (size_t page = 0; page < stream; ++page) {
+					for (size_t i = 0; i < per_page; ++i)
+						stream_misses += cache[metadata + page].second;
+					if (page % 8 == 7)
+						scan_hits += use_metadata();
+				}
+
+				for (size_t i = 0; i < metadata; ++i)
+					after_hits += use_metadata();
+
+				tprintf("%s: metadata hits %lu%% warm, %lu%% during the scan, %lu%% after; %lu stream misses; %lu "
+					"ghosts, recent target %lu\n", name, warm_hits * 100 / (8 * metadata),
+					scan_hits * 100 / (stream / 8), after_hits * 100 / metadata, stream_misses, cache.ghosts(),
+					cache.recentTarget());
+			};
+
+			Cache<uint64_t, bool, std::hash<uint64_t>, Replacement::LRU> lru(capacity);
+			Cache<uint64_t, bool, std::hash<uint64_t>, Replacement::ARC> arc(capacity);
+			run(lru, "LRU");
+			run(arc, "ARC");
+		} else if (pieces[1] == "direct") {
+			size_t mib = 64;
+			if (!benchArgument(pieces, mib)) {
+				usage();
+				return;
+			}
+
+			if (!context.driver) {
+				tprintf("No ThornFAT partition mounted.\n");
+				return;
+			}
+
+			StorageDeviceBase &device = *context.driver->partition->parent;
+			const char *path = "/bench.tmp";
+			const size_t bytes = mib << 20;
+			std::vector<char> data(1 << 20), check(data.size());
+
+			// A file is written and read back in 1 MiB pieces from a cold cache, first through the cache and then
+			// around it. Writes are timed up to the point where the device has everything.
+			for (const int flags: {0, int(FS::IO_DIRECT)}) {
+				if (!createScratch(*context.driver, path))
+					return;
+				context.driver->sync();
+				device.dropCache();
+				const size_t pages_before = PageCache::get().size();
+
+				const uint64_t write_start = x86_64::Clock::cycles();
+				for (size_t offset = 0; offset < bytes; offset += data.size()) {
+					for (size_t i = 0; i < data.size(); ++i)
+						data[i] = 'a' + (offset / data.size() + i) % 26;
+					const int status = context.driver->write(path, data.data(), data.size(), offset, flags);
+					if (status < 0) {
+						tprintf("Write at %lu failed: %s\n", offset, strerror(-status));
+						context.driver->unlink(path);
+						return;
+					}
+				}
+				context.driver->sync();
+				const uint64_t write_elapsed =
+					nanosSince(write_start);
+				device.dropCache();
+
+				size_t mismatches = 0;
+				const uint64_t read_start = x86_64::Clock::cycles();
+				for (size_t offset = 0; offset < bytes; offset += check.size()) {
+					const int status = context.driver->read(path, check.data(), check.size(), offset, flags);
+					if (status < 0) {
+						tprintf("Read at %lu failed: %s\n", offset, strerror(-status));
+						context.driver->unlink(path);
+						return;
+					}
+					for (size_t i = 0; i < check.size(); ++i)
+						mismatches += check[i] != char('a' + (offset / check.size() + i) % 26);
+				}
+				const uint64_t read_elapsed =
+					nanosSince(read_start);
+				const size_t pages_after = PageCache::get().size();
+
+				tprintf("%-6s: write %lu KiB/s, read %lu KiB/s, %lu page(s) left cached, %lu mismatched byte(s)\n",
+					flags? "Direct" : "Cached", (bytes >> 10) * 1'000'000'000 / write_elapsed,
+					(bytes >> 10) * 1'000'000'000 / read_elapsed,
+					pages_before < pages_after? pages_after - pages_before : 0, mismatches);
+			}
+
+			context.driver->unlink(path);
+		} else {
+			usage();
+		}
+	}
+
+	/** A backend that keeps its blocks in memory and finishes requests a few at a time in a scrambled order, so that
+	 *  the request queue is checked against the reordering real devices do. */
+	struct MemoryBackend: BlockBackend {
+		const size_t blockSize;
+		std::vector<uint8_t> blocks;
+		std::vector<BlockRequest *> inFlight;
+		uint64_t seed = BENCH_SEED;
+
+		MemoryBackend(size_t block_size, size_t count): blockSize(block_size), blocks(block_size * count) {}
+
+		void dispatch(RequestQueue &, BlockRequest &request) override {
+			inFlight.push_back(&request);
+		}
+
+		size_t maxBlocks() const override { return 16; }
+		size_t queueDepth() const override { return 4; }
+
+		void poll(RequestQueue &queue) override {
+			if (inFlight.empty())
+				return;
+
+			const size_t index = nextRandom(seed) % inFlight.size();
+			BlockRequest &request = *inFlight[index];
+			inFlight.erase(inFlight.begin() + index);
+			uint8_t *data = &blocks[request.block * blockSize];
+			if (request.write)
+				memcpy(data, request.buffer, request.blocks * blockSize);
+			else
+				memcpy(request.buffer, data, request.blocks * blockSize);
+			queue.complete(request, 0);
+		}
+	};
+
+	/** Runs random unaligned reads and writes through a request queue, some of them plugged so that they pile up,
+	 *  merge and get reordered, and checks every read against a model of what's been written. Then checks that
+	 *  adjacent writes are merged. */
+	static bool checkQueue() {
+		constexpr size_t BLOCK = 512;
+		constexpr size_t BLOCKS = 256;
+		MemoryBackend backend(BLOCK, BLOCKS);
+		RequestQueue queue(backend, BLOCK);
+		std::vector<uint8_t> model(BLOCK * BLOCKS, 0), buffer(BLOCK * 8);
+		uint64_t seed = BENCH_SEED;
+
+		for (size_t i = 0; i < 4096; ++i) {
+			if (i % 64 == 0)
+				queue.plug();
+
+			const size_t size = 1 + nextRandom(seed) % buffer.size();
+			const size_t offset = nextRandom(seed) % (model.size() - size);
+			if (nextRandom(seed) % 2) {
+				for (size_t j = 0; j < size; ++j)
+					buffer[j] = nextRandom(seed);
+				memcpy(&model[offset], buffer.data(), size);
+				if (const int status = queue.write(buffer.data(), size, offset)) {
+					tprintf("Queue: write %lu failed: %d\n", i, status);
+					return false;
+				}
+			} else {
+				if (const int status = queue.read(buffer.data(), size, offset)) {
+					tprintf("Queue: read %lu failed: %d\n", i, status);
+					return false;
+				}
+				if (memcmp(buffer.data(), &model[offset], size) != 0) {
+					tprintf("Queue: read %lu of %lu bytes at %lu doesn't match what was written\n", i, size, offset);
+					return false;
+				}
+			}
+
+			if (i % 64 == 63)
+				queue.unplug();
+		}
+
+		queue.drain();
+		if (backend.blocks != model) {
+			tprintf("Queue: the device doesn't hold what was written\n");
+			return false;
+		}
+
+		// Adjacent single-block writes made while plugged have to reach the device as one request.
+		const RequestQueue::Stats before = queue.stats;
+		queue.plug();
+		for (size_t block = 0; block < 8; ++block) {
+			memset(buffer.data(), 'a' + block, BLOCK);
+			memset(&model[(100 + block) * BLOCK], 'a' + block, BLOCK);
+			queue.submitWrite(100 + block, 1, buffer.data());
+		}
+		queue.unplug();
+		queue.drain();
+
+		const uint64_t dispatched = queue.stats.dispatched - before.dispatched;
+		const uint64_t merges = queue.stats.backMerges - before.backMerges + queue.stats.frontMerges
+			- before.frontMerges;
+		if (dispatched != 1 || merges != 7 || backend.blocks != model) {
+			tprintf("Queue: 8 adjacent writes went out as %lu request(s) with %lu merge(s)%s\n", dispatched, merges,
+				backend.blocks == model? "" : " and the wrong data");
+			return false;
+		}
+
+		tprintf("Queue: read-after-write and merging ok (%lu forwarded, %lu absorbed)\n", queue.stats.forwarded,
+			queue.stats.absorbed);
+		return true;
+	}
+
+	/** Checks read-after-write through the cache, around it and from the device, and that a discard leaves the bytes
+	 *  around its range alone. Works in a scratch area at the end of the partition whose contents are put back. */
+	static bool checkPartition(FS::Partition &partition) {
+		constexpr size_t SCRATCH = 64 << 10;
+		constexpr size_t EDGE = 777;
+		if (partition.length < SCRATCH) {
+			tprintf("Disk: the partition is too small\n");
+			return false;
+		}
+
+		const size_t area = partition.length - SCRATCH;
+		StorageDeviceBase &device = *partition.parent;
+		std::vector<uint8_t> original(SCRATCH), model(SCRATCH), buffer(SCRATCH);
+		if (const int status = partition.read(original.data(), SCRATCH, area)) {
+			tprintf("Disk: couldn't save the scratch area: %d\n", status);
+			return false;
+		}
+
+		auto compare = [&](const char *what, size_t from, size_t to) {
+			for (size_t i = from; i < to; ++i)
+				if (buffer[i] != model[i]) {
+					tprintf("Disk: %s: byte %lu is %u instead of %u\n", what, i, buffer[i], model[i]);
+					return false;
+				}
+			return true;
+		};
+
+		auto check = [&]() -> bool {
+			uint64_t seed = BENCH_SEED;
+			for (size_t i = 0; i < SCRATCH; ++i)
+				model[i] = nextRandom(seed);
+			if (partition.write(model.data(), SCRATCH, area) != 0)
+				return false;
+
+			// Unaligned pieces on top, read back before anything has necessarily reached the device.
+			for (size_t i = 0; i < 32; ++i) {
+				const size_t size = 1 + nextRandom(seed) % 3000;
+				const size_t offset = nextRandom(seed) % (SCRATCH - size);
+				for (size_t j = 0; j < size; ++j)
+					model[offset + j] = nextRandom(seed);
+				if (partition.write(&model[offset], size, area + offset) != 0)
+					return false;
+			}
+
+			if (partition.read(buffer.data(), SCRATCH, area) != 0 || !compare("cached read", 0, SCRATCH))
+				return false;
+			if (partition.read(buffer.data(), SCRATCH, area, FS::IO_DIRECT) != 0 || !compare("direct read", 0, SCRATCH))
+				return false;
+			if (partition.sync() != 0)
+				return false;
+			device.dropCache();
+			if (partition.read(buffer.data(), SCRATCH, area) != 0 || !compare("read from the device", 0, SCRATCH))
+				return false;
+
+			const int status = partition.discard(area + EDGE, SCRATCH - 2 * EDGE);
+			if (status == -EOPNOTSUPP) {
+				tprintf("Disk: discard isn't supported\n");
+				return true;
+			}
+			if (status != 0 || partition.sync() != 0)
+				return false;
+			device.dropCache();
+			return partition.read(buffer.data(), SCRATCH, area) == 0 && compare("before the discard", 0, EDGE)
+				&& compare("after the discard", SCRATCH - EDGE, SCRATCH);
+		};
+
+		const bool ok = check();
+		if (partition.write(original.data(), SCRATCH, area) != 0 || partition.sync() != 0)
+			tprintf("Disk: couldn't restore the scratch area\n");
+		tprintf("Disk: read-after-write and discard %s\n", ok? "ok" : "failed");
+		return ok;
+	}
+
+	void check(const std::vector<std::string> &pieces, InputContext &context) {
+		auto usage = [] {
+			tprintf("Usage:\n- check queue\n- check disk\n");
+		};
+
+		if (pieces.size() != 2) {
+			usage();
+		} else if (pieces[1] == "queue") {
+			checkQueue();
+		} else if (pieces[1] == "disk") {
+			if (!context.partition)
+				tprintf("No partition selected.\n");
+			else
+				checkPartition(*context.partition);
+		} else {
+			usage();
+		}
+	}
 }
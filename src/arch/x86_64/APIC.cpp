@@ -3,6 +3,7 @@
 #include "arch/x86_64/APIC.h"
 #include "arch/x86_64/CPU.h"
 #include "arch/x86_64/PIC.h"
+#include "arch/x86_64/Timer.h"
 #include "hardware/Ports.h"
 #include "lib/printf.h"
 #include "Kernel.h"
@@ -10,7 +11,6 @@
 volatile uint32_t *apic_base = nullptr;
 
 static bool timer_calibrated = false;
-static bool waiting = true;
 
 namespace x86_64::APIC {
 	uint32_t lastTPS = 0;
@@ -34,32 +34,41 @@ namespace x86_64::APIC {
 		PIC::disable();
 	}
 
-	void initTimer(uint32_t frequency) {
-		uint32_t ticks_per_second = lastTPS;
-
+	uint32_t ticksPerSecond() {
 		if (!timer_calibrated) {
-			uint32_t tick_collections[TIMER_NUM_CALIBRATIONS] = {0};
 			uint64_t tick_total = 0;
 			for (uint32_t i = 0; i < TIMER_NUM_CALIBRATIONS; i++)
-				tick_total += tick_collections[i] = calibrateTimer();
-			ticks_per_second = tick_total / TIMER_NUM_CALIBRATIONS;
+				tick_total += calibrateTimer();
+			lastTPS = tick_total / TIMER_NUM_CALIBRATIONS;
 			timer_calibrated = true;
-			lastTPS = ticks_per_second;
 		}
 
-		uint32_t timer_reload_value = ticks_per_second / frequency;
-
-		apic_base[REGISTER_LVT_TIMER] = BSP_VECTOR_APIC_TIMER | SELECT_TMR_PERIODIC;
-		apic_base[REGISTER_TIMER_DIV] = TIMER_SELECT_DIVIDER;
-		apic_base[REGISTER_TIMER_INITCNT] = timer_reload_value;
+		return lastTPS;
 	}
 
-	void reloadTimer(uint32_t initcnt) {
-		apic_base[REGISTER_LVT_TIMER] = BSP_VECTOR_APIC_TIMER | SELECT_TMR_PERIODIC;
+	void oneShot(uint32_t initcnt) {
+		apic_base[REGISTER_LVT_TIMER] = BSP_VECTOR_APIC_TIMER | SELECT_TMR_ONE_SHOT;
 		apic_base[REGISTER_TIMER_DIV] = TIMER_SELECT_DIVIDER;
 		apic_base[REGISTER_TIMER_INITCNT] = initcnt;
 	}
 
+	uint32_t currentCount() {
+		return apic_base[REGISTER_TIMER_CURRCNT];
+	}
+
+	bool hasTSCDeadline() {
+		uint32_t eax, ebx, ecx, edx;
+		cpuid(1, 0, eax, ebx, ecx, edx);
+		return ecx & (1 << 24);
+	}
+
+	void tscDeadline(uint64_t tsc) {
+		apic_base[REGISTER_LVT_TIMER] = BSP_VECTOR_APIC_TIMER | SELECT_TMR_TSC_DEADLINE;
+		// The SDM requires the LVT write to be ordered before the MSR write that arms the timer.
+		asm volatile("mfence" ::: "memory");
+		wrmsr(MSR_TSC_DEADLINE, tsc);
+	}
+
 	uint32_t calibrateTimer() {
 		using namespace Thorn::Ports;
 		apic_base[REGISTER_LVT_TIMER] = BSP_VECTOR_APIC_TIMER;
@@ -140,22 +149,19 @@ namespace x86_64::APIC {
 
 	void disableTimer() {
 		apic_base[REGISTER_LVT_TIMER] = DISABLE;
-		ticks = 0;
 	}
 
 	void wait(size_t num_ticks, uint32_t frequency) {
-		waiting = true;
-		ticks = 0;
-		timer_max = num_ticks;
-		timer_addr = +[] { waiting = false; };
-		x86_64::APIC::initTimer(frequency);
-		for (;;) {
-			if (waiting) {
-				asm("hlt");
-			} else {
-				x86_64::APIC::disableTimer();
-				break;
-			}
-		}
+		Timer::init();
+		const bool interrupts = checkInterrupts();
+		volatile bool waiting = true;
+		const uint64_t deadline = Timer::now() + num_ticks * 1'000'000 / frequency;
+		const auto callback = +[](void *flag) { *static_cast<volatile bool *>(flag) = false; };
+		if (Timer::addTimer(deadline, callback, const_cast<bool *>(&waiting)) == 0)
+			return;
+		while (waiting)
+			Timer::idle();
+		if (!interrupts)
+			disableInterrupts();
 	}
 }
@@ -1,7 +1,16 @@
 #include "arch/x86_64/CPU.h"
+#include "arch/x86_64/msr.h"
 #include <string.h>
 
 namespace x86_64 {
+	CPU bootProcessor;
+
+	void initCPULocal(CPU &cpu, uint64_t id) {
+		cpu.self = &cpu;
+		cpu.id = id;
+		wrmsr(MSR_KERNEL_GS_BASE, reinterpret_cast<uintptr_t>(&cpu));
+	}
+
 	void cpuid(unsigned value, unsigned leaf, unsigned &eax, unsigned &ebx, unsigned &ecx, unsigned &edx) {
 		asm volatile("cpuid" : "=a" (eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a" (value), "c" (leaf));
 	}
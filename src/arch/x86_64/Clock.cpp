@@ -0,0 +1,131 @@
+#include "arch/x86_64/APIC.h"
+#include "arch/x86_64/Clock.h"
+#include "arch/x86_64/CPU.h"
+#include "hardware/Ports.h"
+#include "hardware/RTC.h"
+#include "lib/printf.h"
+
+namespace x86_64::Clock {
+	static bool initialized = false;
+	static uint64_t frequency = 0;
+	static uint64_t toNanosMult = 0;
+	static uint64_t toCyclesMult = 0;
+	static uint64_t bootCycles = 0;
+	static uint64_t bootRealtime = 0;
+
+	static inline uint64_t scale(uint64_t value, uint64_t mult) {
+		return (static_cast<unsigned __int128>(value) * mult) >> SCALE_SHIFT;
+	}
+
+	/** Measures how many TSC cycles elapse while PIT channel 2 counts down 1/PIT_CALIBRATE_DIVIDER of a second. */
+	static uint64_t calibrate() {
+		using namespace Thorn::Ports;
+		using namespace x86_64::APIC;
+
+		uint8_t chan2_value = (inb(PIT_PORT_CHAN2_GATE) | PIT_CHAN2_TIMER_BIT) & ~PIT_CHAN2_SPEAKER_BIT;
+		outb(PIT_PORT_CHAN2_GATE, chan2_value);
+		outb(PIT_PORT_MCR, PIT_SELECT_CHAN2 | PIT_SELECT_ACCESS_LOHI | PIT_SELECT_ONE_SHOT_MODE | PIT_SELECT_BINARY_MODE);
+
+		const bool interrupts = checkInterrupts();
+		disableInterrupts();
+
+		uint32_t pit_ticks = PIT_CALIBRATE_TICKS;
+		outb(PIT_PORT_CHAN2, pit_ticks & 0xff);
+		outb(PIT_PORT_CHAN2, (pit_ticks >> 8) & 0xff);
+
+		// Restart the PIT by toggling the gate, then count cycles until it wraps.
+		chan2_value &= ~PIT_CHAN2_TIMER_BIT;
+		outb(PIT_PORT_CHAN2_GATE, chan2_value);
+		chan2_value |= PIT_CHAN2_TIMER_BIT;
+		outb(PIT_PORT_CHAN2_GATE, chan2_value);
+		const uint64_t start = cycles();
+
+		while (pit_ticks <= PIT_CALIBRATE_TICKS) {
+			outb(PIT_PORT_MCR, PIT_SELECT_CHAN2);
+			pit_ticks = inb(PIT_PORT_CHAN2);
+			pit_ticks |= inb(PIT_PORT_CHAN2) << 8;
+		}
+
+		const uint64_t elapsed = cycles() - start;
+
+		if (interrupts)
+			enableInterrupts();
+
+		return elapsed * PIT_CALIBRATE_DIVIDER;
+	}
+
+	bool invariantTSC() {
+		uint32_t eax, ebx, ecx, edx;
+		cpuid(0x80000000, 0, eax, ebx, ecx, edx);
+		if (eax < 0x80000007)
+			return false;
+		cpuid(0x80000007, 0, eax, ebx, ecx, edx);
+		return edx & (1 << 8);
+	}
+
+	void init() {
+		if (initialized)
+			return;
+
+		if (!invariantTSC())
+			printf("[Clock::init] Warning: TSC isn't invariant; timestamps may drift if the CPU changes frequency.\n");
+
+		// Take the smallest measurement: anything that interrupts the loop can only make a run look slower.
+		uint64_t best = UINT64_MAX;
+		for (uint32_t i = 0; i < CALIBRATIONS; ++i) {
+			const uint64_t measured = calibrate();
+			if (measured < best)
+				best = measured;
+		}
+
+		frequency = best;
+		toNanosMult = (1'000'000'000ul << SCALE_SHIFT) / frequency;
+		toCyclesMult = ((frequency / 1'000) << SCALE_SHIFT) / 1'000'000;
+		bootCycles = cycles();
+
+		const Thorn::RTC::DateTime date = Thorn::RTC::read();
+		bootRealtime = Thorn::RTC::toUnix(date) * 1'000'000'000ul;
+		initialized = true;
+
+		printf("TSC frequency: %lu Hz. Boot time: %04u-%02u-%02u %02u:%02u:%02u UTC\n", frequency, date.year, date.month,
+			date.day, date.hour, date.minute, date.second);
+	}
+
+	bool ready() {
+		return initialized;
+	}
+
+	uint64_t cyclesPerSecond() {
+		return frequency;
+	}
+
+	uint64_t cyclesToNanos(uint64_t count) {
+		return scale(count, toNanosMult);
+	}
+
+	uint64_t nanosToCycles(uint64_t nanos) {
+		return scale(nanos, toCyclesMult);
+	}
+
+	uint64_t monotonicNanos() {
+		return cyclesToNanos(cycles() - bootCycles);
+	}
+
+	uint64_t realtimeNanos() {
+		return bootRealtime + monotonicNanos();
+	}
+
+	int64_t realtime() {
+		return realtimeNanos() / 1'000'000'000;
+	}
+
+	void ndelay(uint64_t nanos) {
+		const uint64_t deadline = cycles() + nanosToCycles(nanos);
+		while (cycles() < deadline)
+			pause();
+	}
+
+	void udelay(uint64_t micros) {
+		ndelay(micros * 1'000);
+	}
+}
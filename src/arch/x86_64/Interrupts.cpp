@@ -3,6 +3,9 @@
 #include "arch/x86_64/CPU.h"
 #include "arch/x86_64/Interrupts.h"
 #include "arch/x86_64/PIC.h"
+#include "arch/x86_64/Syscall.h"
+#include "arch/x86_64/Timer.h"
+#include "hardware/IDE.h"
 #include "hardware/Ports.h"
 #include "hardware/PS2Keyboard.h"
 #include "lib/printf.h"
@@ -20,21 +23,19 @@
 #include "arch/x86_64/PageTableWrapper.h"
 #endif
 
-extern bool irqInvoked;
-
 bool abouttodie = false;
 
 extern uintptr_t addr8, addr14;
 
 namespace x86_64::IDT {
-	void add(int index, void (*fn)()) {
+	void add(int index, void (*fn)(), uint8_t type_attr) {
 		uintptr_t offset = (uintptr_t) fn;
 		Descriptor &descriptor = idt[index];
 		descriptor.offset_1 = offset & 0xffff;
 		descriptor.offset_2 = (offset >> 16) & 0xffff;
 		descriptor.offset_3 = (offset >> 32) & 0xffffffff;
 		descriptor.ist = 0;
-		descriptor.type_attr = 0x8e;
+		descriptor.type_attr = type_attr;
 		descriptor.selector = 0 | 0 | (1 << 3);
 		descriptor.zero = 0;
 	}
@@ -55,18 +56,36 @@ namespace x86_64::IDT {
 		add(46, &isr_46);
 		add(47, &isr_47);
 		add(0x69, &isr_0x69);
-		wrmsr(0xc0000082, (uintptr_t) &isr_0x69);
+		add(SYSCALL_VECTOR, &isr_0x80, 0xee);
 		asm volatile("lidt %0" :: "m"(idt_header));
 	}
 
+	static struct {
+		Handler handler;
+		void *data;
+	} handlers[SIZE];
+
+	static void unhandled(void *) {
+		printf("Invalid interrupt handler called!\n");
+	}
+
 	uint8_t reserveUnusedInterrupt() {
-		for (uint8_t i = 48; i < 255; ++i)
+		for (int i = FIRST_DYNAMIC_VECTOR; i < SIZE - 1; ++i)
 			if (idt[i].type_attr == 0) {
-				add(i, +[] { printf("Invalid interrupt handler called!\n"); });
+				handlers[i] = {unhandled, nullptr};
+				add(i, reinterpret_cast<void (*)()>(dynamic_isr_stubs + (i - FIRST_DYNAMIC_VECTOR) * DYNAMIC_STUB_SIZE));
 				return i;
 			}
 		return 0xff;
 	}
+
+	void setHandler(uint8_t vector, Handler handler, void *data) {
+		if (vector < FIRST_DYNAMIC_VECTOR) {
+			printf("[IDT::setHandler] Vector %d isn't dynamic\n", vector);
+			return;
+		}
+		handlers[vector] = {handler? handler : unhandled, data};
+	}
 }
 
 void div0() {
@@ -137,6 +156,18 @@ void spurious_interrupt() {
 	x86_64::PIC::sendEOI(7);
 }
 
+void timer_interrupt() {
+	++ticks;
+	x86_64::Timer::interrupt();
+	apic_base[x86_64::APIC::REGISTER_EOI] = x86_64::APIC::EOI_ACK;
+}
+
+void dynamic_interrupt(uint64_t vector) {
+	const auto &entry = x86_64::IDT::handlers[vector & 0xff];
+	entry.handler(entry.data);
+	apic_base[x86_64::APIC::REGISTER_EOI] = x86_64::APIC::EOI_ACK;
+}
+
 void irq1() {
 	uint8_t byte = Thorn::Ports::inb(0x60);
 	// Keyboard::InputKey key = static_cast<Keyboard::InputKey>(byte);
@@ -152,17 +183,13 @@ void irq11() {
 }
 
 void irq14() {
-	printf("IRQ14\n");
+	Thorn::IDE::handleIRQ(Thorn::IDE::ATA_PRIMARY);
 	x86_64::PIC::sendEOI(14);
-	for (;;) asm("hlt");
-	// irqInvoked = 1;
 }
 
 void irq15() {
-	printf("IRQ15\n");
+	Thorn::IDE::handleIRQ(Thorn::IDE::ATA_SECONDARY);
 	x86_64::PIC::sendEOI(15);
-	for (;;) asm("hlt");
-	// irqInvoked = 1;
 }
 
 extern "C" {
@@ -2,6 +2,7 @@
 #include "arch/x86_64/PageTableWrapper.h"
 #include "lib/printf.h"
 #include "memory/memset.h"
+#include "memory/Shrinker.h"
 #include "ThornUtil.h"
 #include "Kernel.h"
 
@@ -17,6 +18,9 @@ namespace x86_64 {
 
 		if (consecutive_count == 1) {
 			int free_index = findFree();
+			// Caches give back what they can before anyone is told there's no memory left.
+			if (free_index == -1 && Thorn::Shrinker::run(*this, Thorn::Shrinker::BATCH) != 0)
+				free_index = findFree();
 			if (free_index == -1)
 				return 0;
 			mark(free_index, true);
@@ -40,6 +44,15 @@ namespace x86_64 {
 		return reinterpret_cast<uintptr_t>(allocateFreePhysicalAddress(consecutive_count)) / THORN_PAGE_SIZE;
 	}
 
+	void PageMeta::freePhysicalAddress(uintptr_t address) {
+		const uintptr_t start = reinterpret_cast<uintptr_t>(physicalStart);
+		if (address < start || (address - start) / pageSize() >= pageCount()) {
+			printf("[PageMeta::freePhysicalAddress] 0x%lx isn't managed by this pager\n", address);
+			return;
+		}
+		mark((address - start) / pageSize(), false);
+	}
+
 	bool PageMeta::assignAddress(PageTableWrapper &wrapper, uintptr_t virtual_address, uintptr_t physical_address, uint64_t extra_meta) {
 		using PTW = PageTableWrapper;
 		uintptr_t out;
@@ -172,4 +172,32 @@ namespace x86_64 {
 	uint16_t PageTableWrapper::getPTMeta(uint16_t pml4_index, uint16_t pdpt_index, uint16_t pdt_index, uint16_t pt_index) const {
 		return getPTE(pml4_index, pdpt_index, pdt_index, pt_index) & 0xfff;
 	}
+
+	uintptr_t PageTableWrapper::translate(uintptr_t virtual_address) const {
+		const uintptr_t pmm_offset = Thorn::Kernel::instance? Thorn::Kernel::instance->physicalMemoryMap : 0;
+		auto table = [pmm_offset](uint64_t entry) {
+			return (volatile uint64_t *) ((entry & ADDRESS_MASK) + pmm_offset);
+		};
+
+		const uint64_t pml4e = entries[getPML4Index(virtual_address)];
+		if (!(pml4e & MMU_PRESENT))
+			return 0;
+
+		const uint64_t pdpe = table(pml4e)[getPDPTIndex(virtual_address)];
+		if (!(pdpe & MMU_PRESENT))
+			return 0;
+		if (pdpe & MMU_PDE_TWO_MB) // A 1 GiB page; the size bit is in the same place at every level.
+			return (pdpe & ADDRESS_MASK & ~0x3ffffffful) | (virtual_address & 0x3ffffffful);
+
+		const uint64_t pde = table(pdpe)[getPDTIndex(virtual_address)];
+		if (!(pde & MMU_PRESENT))
+			return 0;
+		if (pde & MMU_PDE_TWO_MB)
+			return (pde & ADDRESS_MASK & ~0x1ffffful) | (virtual_address & 0x1ffffful);
+
+		const uint64_t pte = table(pde)[getPTIndex(virtual_address)];
+		if (!(pte & MMU_PRESENT))
+			return 0;
+		return (pte & ADDRESS_MASK) | getOffset(virtual_address);
+	}
 }
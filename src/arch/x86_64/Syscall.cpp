@@ -0,0 +1,65 @@
+#include "arch/x86_64/CPU.h"
+#include "arch/x86_64/gdt.h"
+#include "arch/x86_64/msr.h"
+#include "arch/x86_64/Syscall.h"
+#include "lib/printf.h"
+
+#include <cerrno>
+#include <cstddef>
+
+static_assert(offsetof(x86_64::CPU, syscallStack) == CPU_SYSCALL_STACK);
+static_assert(offsetof(x86_64::CPU, userStack) == CPU_USER_STACK);
+
+namespace x86_64::Syscall {
+	static Handler handlers[MAX_SYSCALLS] = {};
+	alignas(16) static uint8_t stack[SYSCALL_STACK_SIZE];
+
+	/** Flags cleared on entry: IF, DF, TF and AC. Handlers run with interrupts off until there's a TSS to give
+	 *  interrupts from user mode a stack of their own. */
+	constexpr uint64_t FLAGS_MASK = (1 << 9) | (1 << 10) | (1 << 8) | (1 << 18);
+
+	static long nullCall(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t) {
+		return 0;
+	}
+
+	static long printCall(uint64_t text, uint64_t length, uint64_t, uint64_t, uint64_t, uint64_t) {
+		if (!text)
+			return -EFAULT;
+		printf("%.*s", static_cast<int>(length), reinterpret_cast<const char *>(text));
+		return length;
+	}
+
+	void init() {
+		CPU &cpu = *getCPULocal();
+		cpu.syscallStack = reinterpret_cast<uintptr_t>(stack + sizeof(stack));
+
+		wrmsr(MSR_EFER, rdmsr(MSR_EFER) | MSR_EFER_SCE);
+		// SYSCALL loads CS from STAR[47:32] and SS from the entry after it. SYSRET to 64-bit mode loads SS from
+		// STAR[63:48] + 8 and CS from STAR[63:48] + 16, both with RPL 3.
+		wrmsr(MSR_STAR, (static_cast<uint64_t>(GDT_KERNEL_DATA_SELECTOR | 3) << 48)
+			| (static_cast<uint64_t>(GDT_KERNEL_CODE_SELECTOR) << 32));
+		wrmsr(MSR_LSTAR, reinterpret_cast<uintptr_t>(&syscall_entry));
+		wrmsr(MSR_SFMASK, FLAGS_MASK);
+
+		set(Number::Null, nullCall);
+		set(Number::Print, printCall);
+	}
+
+	bool set(Number number, Handler handler) {
+		const uint64_t index = static_cast<uint64_t>(number);
+		if (MAX_SYSCALLS <= index) {
+			printf("[Syscall::set] Invalid syscall number: %lu\n", index);
+			return false;
+		}
+		handlers[index] = handler;
+		return true;
+	}
+}
+
+long syscall_dispatch(uint64_t number, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4,
+                      uint64_t arg5) {
+	using namespace x86_64::Syscall;
+	if (MAX_SYSCALLS <= number || !handlers[number])
+		return -ENOSYS;
+	return handlers[number](arg0, arg1, arg2, arg3, arg4, arg5);
+}
@@ -0,0 +1,299 @@
+#include "arch/x86_64/APIC.h"
+#include "arch/x86_64/Clock.h"
+#include "arch/x86_64/CPU.h"
+#include "arch/x86_64/Timer.h"
+#include "lib/printf.h"
+
+namespace x86_64::Timer {
+	constexpr uint64_t NONE = UINT64_MAX;
+	constexpr uint64_t MAX_COUNT = UINT32_MAX;
+
+	struct Node {
+		Node *prev = nullptr;
+		Node *next = nullptr;
+		uint64_t deadline = 0;
+		Callback callback = nullptr;
+		void *data = nullptr;
+		uint32_t generation = 1;
+		/** LEVELS means the node is on the overflow list. */
+		uint8_t level = 0;
+		uint8_t slot = 0;
+		bool pending = false;
+	};
+
+	static Node nodes[MAX_TIMERS];
+	static Node *freeNodes = nullptr;
+	static Node *wheel[LEVELS][SLOTS] = {};
+	static uint64_t occupied[LEVELS] = {};
+	static Node *overflow = nullptr;
+
+	/** The wheel's notion of the present. Always <= now(); advanced in jumps from one pending event to the next. */
+	static uint64_t current = 0;
+	static bool initialized = false;
+	static bool dispatching = false;
+
+	/** Whether the APIC timer can be armed with an absolute TSC deadline instead of a countdown. */
+	static bool deadlineMode = false;
+	static uint32_t tps = 1;
+
+	static uint64_t microsToTicks(uint64_t micros) {
+		return (micros / 1'000'000) * tps + (micros % 1'000'000) * tps / 1'000'000;
+	}
+
+	static inline unsigned shiftFor(unsigned level) {
+		return LEVEL_BITS * level;
+	}
+
+	static Node *& headFor(const Node &node) {
+		return node.level == LEVELS? overflow : wheel[node.level][node.slot];
+	}
+
+	static void link(Node &node) {
+		const uint64_t deadline = node.deadline < current? current : node.deadline;
+
+		// A timer belongs on the lowest level whose window (everything above its slot bits) matches the present.
+		node.level = LEVELS;
+		for (unsigned level = 0; level < LEVELS; ++level) {
+			if ((deadline >> shiftFor(level + 1)) == (current >> shiftFor(level + 1))) {
+				node.level = level;
+				node.slot = (deadline >> shiftFor(level)) & (SLOTS - 1);
+				occupied[level] |= 1ul << node.slot;
+				break;
+			}
+		}
+
+		Node *&head = headFor(node);
+		node.prev = nullptr;
+		node.next = head;
+		if (head)
+			head->prev = &node;
+		head = &node;
+	}
+
+	static void unlink(Node &node) {
+		Node *&head = headFor(node);
+		if (node.prev)
+			node.prev->next = node.next;
+		else
+			head = node.next;
+		if (node.next)
+			node.next->prev = node.prev;
+		if (node.level < LEVELS && !head)
+			occupied[node.level] &= ~(1ul << node.slot);
+		node.prev = node.next = nullptr;
+	}
+
+	static void release(Node &node) {
+		node.pending = false;
+		++node.generation;
+		node.next = freeNodes;
+		freeNodes = &node;
+	}
+
+	/** Returns the earliest time at which something in the wheel needs attention: either a slot on level 0 expiring
+	 *  or a slot on a higher level that needs to be cascaded. */
+	static uint64_t nextEvent() {
+		uint64_t out = NONE;
+
+		for (unsigned level = 0; level < LEVELS; ++level) {
+			const unsigned shift = shiftFor(level);
+			const unsigned index = (current >> shift) & (SLOTS - 1);
+			// The current slot on level 0 can contain timers that are already due. On higher levels it's always empty.
+			const unsigned first = level == 0? index : index + 1;
+			if (SLOTS <= first)
+				continue;
+			const uint64_t pending = occupied[level] & (~0ul << first);
+			if (!pending)
+				continue;
+			const uint64_t window = current & ~((1ul << shiftFor(level + 1)) - 1);
+			const uint64_t candidate = window | (static_cast<uint64_t>(__builtin_ctzl(pending)) << shift);
+			if (candidate < out)
+				out = candidate;
+		}
+
+		if (overflow) {
+			const uint64_t wrap = ((current >> shiftFor(LEVELS)) + 1) << shiftFor(LEVELS);
+			if (wrap < out)
+				out = wrap;
+		}
+
+		return out;
+	}
+
+	/** Redistributes the timers in every slot that begins at the current time. */
+	static void cascade() {
+		if ((current & ((1ul << shiftFor(LEVELS)) - 1)) == 0) {
+			Node *node = overflow;
+			overflow = nullptr;
+			while (node) {
+				Node *next = node->next;
+				link(*node);
+				node = next;
+			}
+		}
+
+		for (unsigned level = LEVELS - 1; 0 < level; --level) {
+			if ((current & ((1ul << shiftFor(level)) - 1)) != 0)
+				continue;
+			const unsigned slot = (current >> shiftFor(level)) & (SLOTS - 1);
+			Node *node = wheel[level][slot];
+			wheel[level][slot] = nullptr;
+			occupied[level] &= ~(1ul << slot);
+			while (node) {
+				Node *next = node->next;
+				link(*node);
+				node = next;
+			}
+		}
+	}
+
+	static void runDue() {
+		Node *&head = wheel[0][current & (SLOTS - 1)];
+		while (head) {
+			Node &node = *head;
+			unlink(node);
+			const Callback callback = node.callback;
+			void *data = node.data;
+			release(node);
+			callback(data);
+		}
+	}
+
+	static void advance(uint64_t target) {
+		dispatching = true;
+		for (;;) {
+			runDue();
+			const uint64_t next = nextEvent();
+			if (next == NONE || target < next) {
+				// Nothing is pending between here and the target, so the slots we skip over are all empty.
+				if (current < target)
+					current = target;
+				break;
+			}
+			current = next;
+			cascade();
+		}
+		dispatching = false;
+	}
+
+	/** Programs the APIC to fire at the next pending deadline, or turns it off if there's nothing pending. */
+	static void arm() {
+		const uint64_t next = nextEvent();
+		if (next == NONE) {
+			APIC::disableTimer();
+			return;
+		}
+
+		const uint64_t micros = now();
+		const uint64_t delta = next <= micros? 0 : next - micros;
+
+		if (deadlineMode) {
+			APIC::tscDeadline(Clock::cycles() + Clock::nanosToCycles(delta * 1'000));
+		} else {
+			// If the deadline is too far away for one countdown, the interrupt will simply find nothing due yet and
+			// rearm the timer.
+			uint64_t count = microsToTicks(delta);
+			if (count == 0)
+				count = 1;
+			else if (MAX_COUNT < count)
+				count = MAX_COUNT;
+			APIC::oneShot(count);
+		}
+	}
+
+	void init() {
+		if (initialized)
+			return;
+
+		Clock::init();
+
+		deadlineMode = APIC::hasTSCDeadline();
+		if (!deadlineMode) {
+			tps = APIC::ticksPerSecond();
+			if (tps == 0) {
+				printf("[Timer::init] APIC timer calibration failed\n");
+				tps = 1;
+			}
+		}
+
+		freeNodes = nullptr;
+		for (size_t i = MAX_TIMERS; 0 < i; --i) {
+			nodes[i - 1].next = freeNodes;
+			freeNodes = &nodes[i - 1];
+		}
+
+		current = now();
+		initialized = true;
+	}
+
+	bool ready() {
+		return initialized;
+	}
+
+	uint64_t now() {
+		return Clock::monotonicNanos() / 1'000;
+	}
+
+	ID addTimer(uint64_t deadline, Callback callback, void *data) {
+		if (!callback)
+			return 0;
+
+		const bool interrupts = checkInterrupts();
+		disableInterrupts();
+
+		Node *node = freeNodes;
+		if (!node) {
+			if (interrupts)
+				enableInterrupts();
+			printf("[Timer::addTimer] Out of timers\n");
+			return 0;
+		}
+
+		freeNodes = node->next;
+		node->deadline = deadline;
+		node->callback = callback;
+		node->data = data;
+		node->pending = true;
+		link(*node);
+
+		if (!dispatching)
+			arm();
+
+		const ID out = (static_cast<uint64_t>(node->generation) << 32) | (node - nodes + 1);
+		if (interrupts)
+			enableInterrupts();
+		return out;
+	}
+
+	bool cancel(ID id) {
+		const uint64_t index = (id & 0xffffffff) - 1;
+		if (MAX_TIMERS <= index)
+			return false;
+
+		const bool interrupts = checkInterrupts();
+		disableInterrupts();
+
+		Node &node = nodes[index];
+		const bool out = node.pending && node.generation == (id >> 32);
+		if (out) {
+			unlink(node);
+			release(node);
+		}
+
+		if (interrupts)
+			enableInterrupts();
+		return out;
+	}
+
+	void interrupt() {
+		if (!initialized)
+			return;
+		advance(now());
+		arm();
+	}
+
+	void idle() {
+		// sti only takes effect after the following instruction, so an interrupt can't slip in before the hlt.
+		asm volatile("sti; hlt");
+	}
+}
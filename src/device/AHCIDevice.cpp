@@ -1,34 +1,99 @@
+#include "arch/x86_64/Clock.h"
 #include "device/AHCIDevice.h"
 #include "memory/Memory.h"
 #include "Kernel.h"
 
 namespace Thorn {
+	/** Caches in physical blocks when that doesn't split any of them, and in logical blocks otherwise. */
+	static size_t cacheBlockSize(AHCI::Port &port) {
+		const size_t physical = port.physicalBlockSize();
+		if (port.getInfo().alignmentOffset() != 0 || AHCIDevice::MAX_BLOCKSIZE < physical)
+			return port.blockSize();
+		return physical;
+	}
+
+	/** Everything above the device expects 0 or a negative error code, not the port's own status values. */
+	static int toError(AHCI::Port::AccessStatus status) {
+		return status == AHCI::Port::AccessStatus::Success? 0 : -EIO;
+	}
+
+	AHCIDevice::AHCIDevice(AHCI::Port *port_):
+		StorageDevice(port_->blockSize(), cacheBlockSize(*port_)), port(port_) {}
+
 	int AHCIDevice::read(void *buffer, size_t size, size_t offset) {
-		// if (offset % AHCI::Port::BLOCKSIZE == 0 && size % AHCI::Port::BLOCKSIZE == 0)
-		// 	return static_cast<int>(port->read(offset / AHCI::Port::BLOCKSIZE, size, buffer));
+		// if (offset % sectorSize == 0 && size % sectorSize == 0)
+		// 	return static_cast<int>(port->read(offset / sectorSize, size, buffer));
 		// return static_cast<int>(port->readBytes(size, offset, buffer));
-		return readCache(buffer, size, offset);
+		const uint64_t start = x86_64::Clock::cycles();
+		const uint64_t misses = cacheStats.misses;
+		const int status = readCache(buffer, size, offset);
+		if (status == 0) {
+			cacheStats.bytesRead += size;
+			auto &latency = cacheStats.misses == misses? cacheStats.hitLatency : cacheStats.missLatency;
+			latency.add(x86_64::Clock::cyclesToNanos(x86_64::Clock::cycles() - start));
+		}
+		return status;
 	}
 
 	int AHCIDevice::write(const void *buffer, size_t size, size_t offset) {
-		// if (offset % AHCI::Port::BLOCKSIZE == 0 && size % AHCI::Port::BLOCKSIZE == 0)
-		// 	return static_cast<int>(port->write(offset / AHCI::Port::BLOCKSIZE, size, buffer));
+		// if (offset % sectorSize == 0 && size % sectorSize == 0)
+		// 	return static_cast<int>(port->write(offset / sectorSize, size, buffer));
 		// return static_cast<int>(port->writeBytes(size, offset, buffer));
-		return writeCache(buffer, size, offset);
+		const int status = writeCache(buffer, size, offset);
+		if (status == 0)
+			cacheStats.bytesWritten += size;
+		balanceDirty();
+		return status;
 	}
 
 	int AHCIDevice::clear(size_t offset, size_t size) {
 		int status{};
-		char zeroes[BlockSize];
+		const std::vector<char> zeroes(blockSize, 0);
 
-		while (size > BlockSize) {
-			if (0 != (status = write(zeroes, BlockSize, offset)))
+		while (size > blockSize) {
+			if (0 != (status = write(zeroes.data(), blockSize, offset)))
 				return status;
-			offset += BlockSize;
-			size -= BlockSize;
+			offset += blockSize;
+			size -= blockSize;
 		}
 
-		return write(zeroes, size, offset);
+		return write(zeroes.data(), size, offset);
+	}
+
+	int AHCIDevice::discard(size_t offset, size_t size) {
+		if (!port->getInfo().trim())
+			return -EOPNOTSUPP;
+
+		// Only blocks entirely inside the range can go.
+		const uint64_t first = (offset + blockSize - 1) / blockSize;
+		const uint64_t last = (offset + size) / blockSize;
+		if (last <= first)
+			return 0;
+
+		dropCached(first, last);
+
+		const uint64_t lba = first * sectorsPerBlock();
+		const uint64_t count = (last - first) * sectorsPerBlock();
+		if (!pendingTrims.empty() && pendingTrims.back().lba + pendingTrims.back().count == lba)
+			pendingTrims.back().count += count;
+		else
+			pendingTrims.push_back({lba, count});
+
+		if (TRIM_BATCH <= pendingTrims.size())
+			flushTrims();
+		return 0;
+	}
+
+	void AHCIDevice::flushTrims() {
+		if (pendingTrims.empty())
+			return;
+
+		std::vector<AHCI::Port::TrimRange> trims = std::move(pendingTrims);
+		pendingTrims.clear();
+
+		const auto status = port->trim(trims.data(), trims.size());
+		if (status != AHCI::Port::AccessStatus::Success)
+			printf("[AHCIDevice::flushTrims] Trimming %lu range(s) failed: %d\n", trims.size(), static_cast<int>(status));
 	}
 
 	std::string AHCIDevice::getName() const {
@@ -38,72 +103,296 @@ namespace Thorn {
 	}
 
 	void AHCIDevice::flush() {
-		for (auto &[block, pair]: cache) {
-			flush(pair.second, block);
+		flushTrims();
+		writeBack();
+	}
+
+	int AHCIDevice::sync() {
+		// Neither writeback nor plugged writes wait for their status, so this is the first chance to report one.
+		flush();
+		if (const int status = finishWrites())
+			return status;
+
+		// Without a volatile write cache, a completed write is already durable.
+		if (!port->getInfo().writeCache())
+			return 0;
+
+		return toError(port->flushCache());
+	}
+
+	int AHCIDevice::writeFUA(const void *buffer, size_t size, size_t offset) {
+		if (size == 0)
+			return 0;
+
+		int status = writeCache(buffer, size, offset);
+		if (status != 0)
+			return status;
+		cacheStats.bytesWritten += size;
+
+		if (!port->getInfo().fua() || !port->getInfo().writeCache())
+			return sync();
+
+		// The cache now holds the whole blocks around the range, so they can go out as one aligned write.
+		const uint64_t first = offset / blockSize;
+		const uint64_t last = (offset + size + blockSize - 1) / blockSize;
+		std::vector<uint8_t> blocks((last - first) * blockSize);
+		if (0 != (status = readCache(blocks.data(), blocks.size(), first * blockSize)))
+			return status;
+
+		// Queued writes and discards covering these blocks are older, so they have to land first.
+		flushTrims();
+		queue.drain();
+
+		const auto fua_status = port->write(first * sectorsPerBlock(), blocks.size(), blocks.data(), true);
+		if (0 != (status = toError(fua_status)))
+			return status;
+
+		for (uint64_t block = first; block < last; ++block) {
+			auto [data, created] = cacheEntry(block);
+			if (!data)
+				return -ENOMEM;
+			if (created)
+				std::memcpy(data, &blocks[(block - first) * blockSize], blockSize);
+			markClean(block);
 		}
+		return 0;
 	}
 
-	void AHCIDevice::flush(StorageCacheEntry<BlockSize> &entry, uint64_t block) {
-		if (entry.flushed)
-			return;
+	int AHCIDevice::readDirect(void *buffer, size_t size, size_t offset) {
+		// Partial blocks at either end are read on their own, so the whole blocks in between can go straight from the
+		// device into the buffer.
+		uint8_t *out = static_cast<uint8_t *>(buffer);
+		const size_t head = std::min(size, (blockSize - offset % blockSize) % blockSize);
+		const size_t middle = (size - head) / blockSize * blockSize;
+		const size_t tail = size - head - middle;
+		int status;
 
-		const auto status = static_cast<int>(port->write(block, BlockSize, entry.data));
+		if (head != 0 && 0 != (status = readEdge(out, head, offset)))
+			return status;
 
-		if (!status) {
-			printf("Failed to flush AHCI block %ld\n", block);
-			Kernel::perish();
+		if (middle != 0) {
+			// Dirty cached blocks are newer than the device, so their writes are queued first. The queue answers the
+			// read from a pending write that covers it, makes it wait for pending writes that overlap it, and holds it
+			// back until any overlapping write already in flight has finished.
+			const uint64_t first = (offset + head) / blockSize;
+			writeBack(first, first + middle / blockSize);
+			if (0 != (status = queue.read(out + head, middle, offset + head)))
+				return status;
 		}
 
-		entry.flushed = true;
+		if (tail != 0 && 0 != (status = readEdge(out + head + middle, tail, offset + head + middle)))
+			return status;
+
+		cacheStats.bytesReadDirect += size;
+		return 0;
 	}
 
-	int AHCIDevice::readCache(void *buffer, size_t size, size_t offset) {
-		int status{};
+	int AHCIDevice::writeDirect(const void *buffer, size_t size, size_t offset) {
+		const uint8_t *in = static_cast<const uint8_t *>(buffer);
+		const size_t head = std::min(size, (blockSize - offset % blockSize) % blockSize);
+		const size_t middle = (size - head) / blockSize * blockSize;
+		const size_t tail = size - head - middle;
+		int status;
 
-		auto advance = [&](size_t amount) {
-			offset += amount;
-			buffer = reinterpret_cast<char *>(buffer) + amount;
-			size -= amount;
-			return size == 0;
-		};
+		if (head != 0 && 0 != (status = writeEdge(in, head, offset)))
+			return status;
 
-		if (size_t rem = offset % BlockSize; rem != 0) {
-			auto [ref, created] = cache[offset / BlockSize];
-			StorageCacheEntry<BlockSize> &entry = ref.get();
+		if (middle != 0) {
+			// Cached copies of blocks that are about to be overwritten whole would go stale, and dirty ones would
+			// overwrite the new data when they're written back. Older writes of the same blocks, pending or in flight,
+			// land first, since the queue holds this one back until they're done. The write is waited for even if
+			// the queue is plugged, since nothing else would report its status.
+			const uint64_t first = (offset + head) / blockSize;
+			dropCached(first, first + middle / blockSize);
+			if (0 != (status = queue.writeAndWait(in + head, middle, offset + head)))
+				return status;
+		}
 
-			if (created) {
-				if (0 != (status = read(entry.data, BlockSize, offset - rem)))
-					return status;
-				entry.flushed = true;
+		if (tail != 0 && 0 != (status = writeEdge(in + head + middle, tail, offset + head + middle)))
+			return status;
+
+		cacheStats.bytesWrittenDirect += size;
+		return 0;
+	}
+
+	int AHCIDevice::readEdge(void *buffer, size_t size, size_t offset) {
+		if (const uint8_t *data = cachedBlock(offset / blockSize)) {
+			std::memcpy(buffer, data + offset % blockSize, size);
+			return 0;
+		}
+
+		return queue.read(buffer, size, offset);
+	}
+
+	int AHCIDevice::writeEdge(const void *buffer, size_t size, size_t offset) {
+		const uint64_t block = offset / blockSize;
+		uint8_t *data = cachedBlock(block);
+		if (!data)
+			return queue.writeAndWait(buffer, size, offset);
+
+		// Updating the cached copy and writing all of it saves reading the rest of the block back from the device. It
+		// stays dirty if the write fails.
+		std::memcpy(data + offset % blockSize, buffer, size);
+		markDirty(block);
+		const int status = queue.writeAndWait(data, blockSize, block * blockSize);
+		if (status == 0)
+			markClean(block);
+		return status;
+	}
+
+	void AHCIDevice::dispatch(RequestQueue &queue, BlockRequest &request) {
+		// A write to a block with a pending discard has to come after the discard.
+		if (request.write)
+			flushTrims();
+
+		if (1 < queueDepth() && dispatchQueued(request))
+			return;
+
+		const uint64_t lba = request.block * sectorsPerBlock();
+		const size_t bytes = request.blocks * blockSize;
+		const AHCI::Port::AccessStatus status = request.write?
+			port->write(lba, bytes, request.buffer) : port->read(lba, bytes, request.buffer);
+		queue.complete(request, toError(status));
+	}
+
+	bool AHCIDevice::dispatchQueued(BlockRequest &request) {
+		InFlight *slot = nullptr;
+		for (InFlight &entry: inFlight)
+			if (!entry.request) {
+				slot = &entry;
+				break;
 			}
 
-			size_t affected = std::min(size, BlockSize - rem);
-			std::memmove(buffer, &entry.data[rem], affected);
-			if (advance(affected))
-				return 0;
+		if (!slot)
+			return false;
+
+		slot->request = &request;
+		slot->done = false;
+		slot->status = AHCI::Port::AccessStatus::Success;
+
+		const uint64_t lba = request.block * sectorsPerBlock();
+		const uint32_t sectors = request.blocks * sectorsPerBlock();
+		while (port->issueQueued(lba, sectors, request.buffer, request.write, &finished, slot) == -1) {
+			// With nothing outstanding every tag is free, so it must have been the buffer that couldn't be used.
+			// Synchronous access falls back to a bounce buffer.
+			if (port->outstanding() == 0 || !port->waitQueued()) {
+				slot->request = nullptr;
+				return false;
+			}
 		}
 
-		while (size >= BlockSize) {
-			auto [ref, created] = cache[offset / BlockSize];
-			StorageCacheEntry<BlockSize> &entry = ref.get();
-			entry.flushed = false;
-			std::memmove(buffer, entry.data, BlockSize);
-			if (advance(BlockSize))
-				return 0;
+		return true;
+	}
+
+	void AHCIDevice::finished(void *data, AHCI::Port::AccessStatus status) {
+		InFlight &slot = *static_cast<InFlight *>(data);
+		slot.status = status;
+		slot.done = true;
+	}
+
+	void AHCIDevice::completeQueued(RequestQueue &queue) {
+		for (InFlight &slot: inFlight) {
+			if (!slot.request || !slot.done)
+				continue;
+			BlockRequest &request = *slot.request;
+			slot.request = nullptr;
+			slot.done = false;
+			queue.complete(request, toError(slot.status));
 		}
+	}
 
-		assert(size > 0);
+	void AHCIDevice::poll(RequestQueue &queue) {
+		port->waitQueued();
+		completeQueued(queue);
+	}
 
-		auto [ref, created] = cache[offset / BlockSize];
-		StorageCacheEntry<BlockSize> &entry = ref.get();
+	size_t AHCIDevice::maxBlocks() const {
+		const size_t blocks = port->maxSectors() / sectorsPerBlock();
+		return blocks == 0? 1 : blocks;
+	}
 
-		if (created) {
-			if (0 != (status = read(entry.data, size, offset)))
-				return status;
-			entry.flushed = true;
+	size_t AHCIDevice::queueDepth() const {
+		const int depth = port->queueDepth();
+		return depth < 1? 1 : depth;
+	}
+
+	size_t AHCIDevice::physicalBlockSize() const {
+		return port->physicalBlockSize();
+	}
+
+	void AHCIDevice::updateStream(uint64_t first, uint64_t last) {
+		// A sequential reader whose reads end partway through a block starts its next read in that same block.
+		if (maxReadahead < blockSize) {
+			readaheadWindow = 0;
+		} else if (first == streamNext || first + 1 == streamNext) {
+			const size_t max = maxReadahead / blockSize;
+			const size_t min = std::min(max, std::max<size_t>(1, MIN_READAHEAD / blockSize));
+			readaheadWindow = readaheadWindow == 0? min : std::min(max, readaheadWindow * 2);
+		} else {
+			readaheadWindow = 0;
+		}
+		streamNext = last;
+	}
+
+	int AHCIDevice::fill(uint64_t block, uint64_t needed) {
+		const uint64_t device_blocks = port->getInfo().sectorCount() / sectorsPerBlock();
+		// Keep the window well short of the cache's capacity so the blocks being read can't evict each other.
+		const size_t window = std::min(readaheadWindow, PageCache::get().capacity() * blocksPerPage() / 4);
+		const uint64_t end = std::min({needed + window, block + maxBlocks(), device_blocks});
+
+		// Already cached blocks may be newer than what's on the disk, so the run stops at the first one.
+		uint64_t stop = block + 1;
+		while (stop < end && !isCached(stop))
+			++stop;
+
+		std::vector<uint8_t> data((stop - block) * blockSize);
+		if (const int status = queue.read(data.data(), data.size(), block * blockSize))
+			return status;
+
+		for (uint64_t current = block; current < stop; ++current) {
+			auto [entry, created] = cacheEntry(current);
+			if (!entry)
+				return -ENOMEM;
+			std::memcpy(entry, &data[(current - block) * blockSize], blockSize);
+			markClean(current);
+		}
+
+		if (needed < stop)
+			readaheadBlocks += stop - needed;
+		return 0;
+	}
+
+	int AHCIDevice::readCache(void *buffer, size_t size, size_t offset) {
+		if (size == 0)
+			return 0;
+
+		const uint64_t first = offset / blockSize;
+		const uint64_t last = (offset + size - 1) / blockSize + 1;
+		updateStream(first, last);
+
+		uint8_t *out = static_cast<uint8_t *>(buffer);
+		size_t skip = offset % blockSize;
+		for (uint64_t block = first; block < last; ++block) {
+			uint8_t *data = cachedBlock(block);
+			if (data) {
+				++cacheStats.hits;
+			} else {
+				++cacheStats.misses;
+				// Everything up to the end of the request that isn't cached yet comes in with one command, along with
+				// the readahead window.
+				if (const int status = fill(block, last))
+					return status;
+				if (!(data = cachedBlock(block)))
+					return -ENOMEM;
+			}
+
+			const size_t affected = std::min(size, blockSize - skip);
+			std::memcpy(out, data + skip, affected);
+			out += affected;
+			size -= affected;
+			skip = 0;
 		}
 
-		std::memmove(buffer, entry.data, size);
 		return 0;
 	}
 
@@ -117,45 +406,42 @@ namespace Thorn {
 			return size == 0;
 		};
 
-		if (size_t rem = offset % BlockSize; rem != 0) {
-			auto [ref, created] = cache[offset / BlockSize];
-			StorageCacheEntry<BlockSize> &entry = ref.get();
+		if (size_t rem = offset % blockSize; rem != 0) {
+			auto [entry, created] = cacheEntry(offset / blockSize);
+			if (!entry)
+				return -ENOMEM;
 
-			if (created) {
-				if (0 != (status = read(entry.data, BlockSize, offset - rem)))
-					return status;
-			} else {
-				entry.flushed = false;
-			}
+			if (created && 0 != (status = queue.read(entry, blockSize, offset - rem)))
+				return status;
+			markDirty(offset / blockSize);
 
-			size_t affected = std::min(size, BlockSize - rem);
-			std::memmove(&entry.data[rem], buffer, affected);
+			size_t affected = std::min(size, blockSize - rem);
+			std::memmove(entry + rem, buffer, affected);
 			if (advance(affected))
 				return 0;
 		}
 
-		while (size >= BlockSize) {
-			auto [ref, created] = cache[offset / BlockSize];
-			StorageCacheEntry<BlockSize> &entry = ref.get();
-			entry.flushed = false;
-			std::memmove(entry.data, buffer, BlockSize);
-			if (advance(BlockSize))
+		while (size >= blockSize) {
+			auto [entry, created] = cacheEntry(offset / blockSize);
+			if (!entry)
+				return -ENOMEM;
+			markDirty(offset / blockSize);
+			std::memmove(entry, buffer, blockSize);
+			if (advance(blockSize))
 				return 0;
 		}
 
 		assert(size > 0);
 
-		auto [ref, created] = cache[offset / BlockSize];
-		StorageCacheEntry<BlockSize> &entry = ref.get();
+		auto [entry, created] = cacheEntry(offset / blockSize);
+		if (!entry)
+			return -ENOMEM;
 
-		if (created) {
-			if (0 != (status = read(entry.data, size, offset)))
-				return status;
-		} else {
-			entry.flushed = false;
-		}
+		if (created && 0 != (status = queue.read(entry, blockSize, offset)))
+			return status;
+		markDirty(offset / blockSize);
 
-		std::memmove(entry.data, buffer, size);
+		std::memmove(entry, buffer, size);
 		return 0;
 	}
 }
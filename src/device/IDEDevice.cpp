@@ -1,50 +1,36 @@
 #include "device/IDEDevice.h"
 #include "memory/Memory.h"
 
+#include <cerrno>
+
 namespace Thorn {
 	int IDEDevice::read(void *buffer, size_t size, size_t offset) {
-		if (offset % IDE::SECTOR_SIZE == 0 && size % IDE::SECTOR_SIZE == 0)
-			return IDE::readSectors(ideID, size / IDE::SECTOR_SIZE, offset / IDE::SECTOR_SIZE, (char *) buffer);
-		return IDE::readBytes(ideID, size, offset, buffer);
+		return queue.read(buffer, size, offset);
 	}
 
 	int IDEDevice::write(const void *buffer, size_t size, size_t offset) {
-		if (offset % IDE::SECTOR_SIZE == 0 && size % IDE::SECTOR_SIZE == 0)
-			return IDE::writeSectors(ideID, size / IDE::SECTOR_SIZE, offset / IDE::SECTOR_SIZE, buffer);
-		return IDE::writeBytes(ideID, size, offset, buffer);
+		return queue.write(buffer, size, offset);
 	}
 
-	int IDEDevice::clear(size_t offset, size_t size) {
-		if (offset % IDE::SECTOR_SIZE == 0 && size % IDE::SECTOR_SIZE == 0) {
-			char buffer[IDE::SECTOR_SIZE] = {0};
-			int status;
-			for (size_t i = 0, max = size / IDE::SECTOR_SIZE; i < max; ++i) {
-				status = IDE::writeSectors(ideID, 1, offset / IDE::SECTOR_SIZE + i, buffer);
-				if (status != 0)
-					return status;
-			}
+	int IDEDevice::sync() {
+		if (const int status = finishWrites())
 			return status;
-		}
-
-		size_t size_copy = size;
-		size_t chunk_size = 1;
-		while ((size_copy & 1) == 0 && chunk_size < IDE::SECTOR_SIZE) {
-			size_copy /= 2;
-			chunk_size *= 2;
-		}
-
-		char *buffer = new char[chunk_size];
-		for (size_t i = 0, max = size / chunk_size; i < max; ++i) {
-			int status = IDE::writeBytes(ideID, chunk_size, offset + chunk_size * i, buffer);
-			if (status != 0)
-				return status;
-		}
-		delete[] buffer;
-
-		return 0;
+		return IDE::flushCache(ideID);
 	}
 
 	std::string IDEDevice::getName() const {
 		return IDE::devices[ideID].model;
 	}
+
+	void IDEDevice::dispatch(RequestQueue &queue, BlockRequest &request) {
+		const int status = request.write?
+			IDE::writeSectors(ideID, request.blocks, request.block, request.buffer) :
+			IDE::readSectors(ideID, request.blocks, request.block, static_cast<char *>(request.buffer));
+		queue.complete(request, status);
+	}
+
+	size_t IDEDevice::maxBlocks() const {
+		// The sector count register is eight bits wide.
+		return 255;
+	}
 }
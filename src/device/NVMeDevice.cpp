@@ -0,0 +1,71 @@
+#include "device/NVMeDevice.h"
+#include "memory/Memory.h"
+
+#include <cerrno>
+
+namespace Thorn {
+	NVMeDevice::NVMeDevice(NVMe::Namespace *ns_): StorageDevice(ns_->blockSize, ns_->blockSize), ns(ns_) {}
+
+	int NVMeDevice::read(void *buffer, size_t size, size_t offset) {
+		return queue.read(buffer, size, offset);
+	}
+
+	int NVMeDevice::write(const void *buffer, size_t size, size_t offset) {
+		return queue.write(buffer, size, offset);
+	}
+
+	int NVMeDevice::discard(size_t offset, size_t size) {
+		if (!(ns->controller.oncs & NVMe::ONCS_DSM))
+			return -EOPNOTSUPP;
+
+		const auto [first, last] = discardRange(offset, size);
+		for (uint64_t block = first; block < last;) {
+			const uint32_t count = std::min<uint64_t>(last - block, UINT32_MAX);
+			if (const int status = ns->discard(block, count))
+				return status;
+			block += count;
+		}
+
+		return 0;
+	}
+
+	int NVMeDevice::sync() {
+		if (const int status = finishWrites())
+			return status;
+		return ns->flush();
+	}
+
+	std::string NVMeDevice::getName() const {
+		return ns->controller.model;
+	}
+
+	void NVMeDevice::dispatch(RequestQueue &queue, BlockRequest &request) {
+		InFlight *slot = claimInFlight(inFlight, std::size(inFlight), request);
+		if (!slot)
+			return;
+
+		// The doorbell is rung in commit(), once the queue is done dispatching.
+		while (!ns->issue(request.write, request.block, request.blocks, request.buffer, false, &finishInFlight, slot))
+			if (!ns->queue().wait()) {
+				*slot = {};
+				queue.complete(request, -ETIMEDOUT);
+				return;
+			}
+	}
+
+	size_t NVMeDevice::maxBlocks() const {
+		return std::max<size_t>(1, ns->maxBlocks());
+	}
+
+	size_t NVMeDevice::queueDepth() const {
+		return ns->queue().slots();
+	}
+
+	void NVMeDevice::poll(RequestQueue &) {
+		ns->queue().wait();
+	}
+
+	void NVMeDevice::commit(RequestQueue &) {
+		ns->queue().ring();
+	}
+}
@@ -0,0 +1,206 @@
+#include "device/PageCache.h"
+#include "device/Storage.h"
+#include "lib/printf.h"
+#include "Kernel.h"
+
+#include <algorithm>
+
+namespace Thorn {
+	PageCache::PageCache(size_t capacity): map(capacity) {
+		Shrinker::add(*this);
+	}
+
+	PageCache & PageCache::get() {
+		static PageCache *instance = nullptr;
+		if (!instance) {
+			size_t free_frames = 0;
+			{
+				Lock<Mutex> pager_lock;
+				auto &pager = Kernel::instance->getPager(pager_lock);
+				free_frames = pager.pageCount() - pager.pagesUsed();
+			}
+			instance = new PageCache(std::max<size_t>(1, free_frames * MEMORY_PERCENT / 100));
+		}
+		return *instance;
+	}
+
+	CachedPage * PageCache::find(const StorageDevice &device, uint64_t index) const {
+		Map::Node *node = map.find({const_cast<StorageDevice *>(&device), index});
+		return node? &node->value : nullptr;
+	}
+
+	CachedPage * PageCache::lookup(StorageDevice &device, uint64_t index) {
+		Map::Node *node = map.find({&device, index});
+		if (!node)
+			return nullptr;
+		map.touch(*node);
+		return &node->value;
+	}
+
+	CachedPage * PageCache::obtain(StorageDevice &device, uint64_t index) {
+		if (CachedPage *page = lookup(device, index))
+			return page;
+
+		// The frame has to be found before the map is touched, since finding one can shrink the cache.
+		uintptr_t frame = map.full()? 0 : allocateFrame();
+		if (frame == 0)
+			frame = reclaim();
+		if (frame == 0) {
+			printf("[PageCache::obtain] No memory for page %lu of %s\n", index, device.getName().c_str());
+			return nullptr;
+		}
+
+		busy = true;
+		CachedPage &page = map[{&device, index}].first.get();
+		busy = false;
+		page.frame = frame;
+		return &page;
+	}
+
+	bool PageCache::evictable(const Map::Node &node) {
+		// Each device keeps the page it last handed out, since it may still be using the data.
+		return node.value.dirty == 0 && node.key.device->pinned != node.key.index;
+	}
+
+	uintptr_t PageCache::reclaim() {
+		// Pinned pages are moved to the other end. Dirty ones have their writeback started and are moved to the other
+		// end too, so clean pages go first while the writes are in flight. A dirty page can only go once its writes
+		// have finished, so if nothing else could go, the second pass waits for them. Writing back allocates, which
+		// can shrink the cache, so the oldest page is looked up afresh every time.
+		for (const bool wait: {false, true}) {
+			for (size_t checked = 0, size = map.size(); checked < size; ++checked) {
+				Map::Node *node = map.leastRecent();
+				if (!node)
+					return 0;
+
+				StorageDevice &device = *node->key.device;
+				const uint64_t index = node->key.index;
+				if (device.pinned == index) {
+					map.refresh(*node);
+				} else if (node->value.dirty != 0) {
+					device.writeBackPage(index);
+					if (wait)
+						device.queue.drain();
+					// A page whose writes have finished is the oldest again and goes next time around.
+					if (Map::Node *again = map.find({&device, index}); again && again->value.dirty != 0)
+						map.refresh(*again);
+				} else {
+					const uintptr_t frame = node->value.frame;
+					++device.cacheStats.evictions;
+					busy = true;
+					map.evict(*node);
+					busy = false;
+					++stats.evictions;
+					return frame;
+				}
+			}
+		}
+
+		return 0;
+	}
+
+	template <typename P>
+	void PageCache::dropIf(P &&predicate) {
+		// Nothing in here allocates, so holding the pager's lock can't deadlock with the heap.
+		Lock<Mutex> pager_lock;
+		auto &pager = Kernel::instance->getPager(pager_lock);
+		busy = true;
+		for (auto iter = map.begin(); iter != map.end();) {
+			Map::Node &node = *iter;
+			++iter;
+			if (predicate(node)) {
+				pager.freeEntry(Kernel::instance->kernelPML4, node.value.frame);
+				pager.freePhysicalAddress(node.value.frame);
+				map.erase(node.key);
+			}
+		}
+		busy = false;
+	}
+
+	void PageCache::invalidate(StorageDevice &device, uint64_t first, uint64_t last) {
+		if (last <= first)
+			return;
+
+		const size_t per_page = device.blocksPerPage();
+		const uint64_t first_page = first / per_page;
+		const uint64_t last_page = (last + per_page - 1) / per_page;
+
+		auto clear = [&](Map::Node &node) {
+			if (node.key.device != &device || node.key.index < first_page || last_page <= node.key.index)
+				return false;
+			const uint64_t page_first = node.key.index * per_page;
+			const uint64_t from = std::max(first, page_first) - page_first;
+			const uint64_t to = std::min(last, page_first + per_page) - page_first;
+			const uint8_t mask = ((1u << to) - 1) & ~((1u << from) - 1);
+			node.value.valid &= ~mask;
+			node.value.dirty &= ~mask;
+			return node.value.valid == 0;
+		};
+
+		// Looking up every page in a huge range would take longer than checking every page.
+		if (map.size() < last_page - first_page) {
+			dropIf(clear);
+			return;
+		}
+
+		for (uint64_t index = first_page; index < last_page; ++index) {
+			Map::Node *node = map.find({&device, index});
+			if (node && clear(*node)) {
+				Lock<Mutex> pager_lock;
+				auto &pager = Kernel::instance->getPager(pager_lock);
+				busy = true;
+				pager.freeEntry(Kernel::instance->kernelPML4, node->value.frame);
+				pager.freePhysicalAddress(node->value.frame);
+				map.erase(node->key);
+				busy = false;
+			}
+		}
+	}
+
+	void PageCache::dropClean(StorageDevice &device) {
+		dropIf([&](const Map::Node &node) {
+			return node.key.device == &device && node.value.dirty == 0;
+		});
+	}
+
+	void PageCache::purge(StorageDevice &device) {
+		dropIf([&](const Map::Node &node) {
+			return node.key.device == &device;
+		});
+	}
+
+	size_t PageCache::shrink(x86_64::PageMeta &pager, size_t frames) {
+		if (busy)
+			return 0;
+
+		busy = true;
+		size_t freed = 0;
+		for (size_t checked = 0, size = map.size(); checked < size && freed < frames; ++checked) {
+			Map::Node &node = *map.leastRecent();
+			if (!evictable(node)) {
+				map.refresh(node);
+				continue;
+			}
+
+			const uintptr_t frame = node.value.frame;
+			++node.key.device->cacheStats.evictions;
+			map.evict(node);
+			pager.freeEntry(Kernel::instance->kernelPML4, frame);
+			pager.freePhysicalAddress(frame);
+			++freed;
+		}
+		busy = false;
+
+		stats.shrunk += freed;
+		return freed;
+	}
+
+	uintptr_t PageCache::allocateFrame() {
+		Lock<Mutex> pager_lock;
+		auto &pager = Kernel::instance->getPager(pager_lock);
+		const uintptr_t frame = pager.allocateFreePhysicalAddress();
+		if (frame != 0)
+			pager.identityMap(Kernel::instance->kernelPML4, frame);
+		return frame;
+	}
+}
@@ -0,0 +1,146 @@
+#include "device/RamDisk.h"
+#include "Kernel.h"
+#include "memory/Memory.h"
+
+#include <cerrno>
+
+namespace Thorn {
+	alignas(RamDisk::FRAME_SIZE) static const uint8_t zeroFrame[RamDisk::FRAME_SIZE] {};
+
+	RamDisk::RamDisk(size_t size_, size_t block_size):
+		size(size_ / block_size * block_size), blockSize(block_size), frames((size + FRAME_SIZE - 1) / FRAME_SIZE, 0) {}
+
+	RamDisk::~RamDisk() {
+		for (size_t i = 0; i < frames.size(); ++i)
+			release(i);
+	}
+
+	bool RamDisk::fits(size_t size) {
+		if (!Kernel::instance)
+			return false;
+		Lock<Mutex> pager_lock;
+		auto &pager = Kernel::instance->getPager(pager_lock);
+		return (size + FRAME_SIZE - 1) / FRAME_SIZE <= pager.pageCount() - pager.pagesUsed();
+	}
+
+	uintptr_t RamDisk::allocate(size_t index) {
+		if (frames[index] != 0)
+			return frames[index];
+
+		if (!Kernel::instance)
+			return 0;
+
+		Lock<Mutex> pager_lock;
+		auto &pager = Kernel::instance->getPager(pager_lock);
+		const uintptr_t frame = pager.allocateFreePhysicalAddress();
+		if (frame == 0)
+			return 0;
+
+		pager.identityMap(Kernel::instance->kernelPML4, frame);
+		memset(reinterpret_cast<void *>(frame), 0, FRAME_SIZE);
+		++used;
+		return frames[index] = frame;
+	}
+
+	void RamDisk::release(size_t index) {
+		const uintptr_t frame = frames[index];
+		if (frame == 0 || !Kernel::instance)
+			return;
+
+		Lock<Mutex> pager_lock;
+		auto &pager = Kernel::instance->getPager(pager_lock);
+		pager.freeEntry(Kernel::instance->kernelPML4, frame);
+		pager.freePhysicalAddress(frame);
+		frames[index] = 0;
+		--used;
+	}
+
+	int RamDisk::check(size_t size_, size_t offset) const {
+		return offset <= size && size_ <= size - offset? 0 : -EINVAL;
+	}
+
+	int RamDisk::read(void *buffer, size_t size_, size_t offset) {
+		if (const int status = check(size_, offset))
+			return status;
+
+		uint8_t *out = static_cast<uint8_t *>(buffer);
+		while (0 < size_) {
+			const size_t index = offset / FRAME_SIZE;
+			const size_t skip = offset % FRAME_SIZE;
+			const size_t chunk = std::min(size_, FRAME_SIZE - skip);
+			if (frames[index] == 0)
+				memset(out, 0, chunk);
+			else
+				memcpy(out, reinterpret_cast<const uint8_t *>(frames[index]) + skip, chunk);
+			out += chunk;
+			offset += chunk;
+			size_ -= chunk;
+		}
+
+		return 0;
+	}
+
+	int RamDisk::write(const void *buffer, size_t size_, size_t offset) {
+		if (const int status = check(size_, offset))
+			return status;
+
+		const uint8_t *in = static_cast<const uint8_t *>(buffer);
+		while (0 < size_) {
+			const size_t index = offset / FRAME_SIZE;
+			const size_t skip = offset % FRAME_SIZE;
+			const size_t chunk = std::min(size_, FRAME_SIZE - skip);
+			const uintptr_t frame = allocate(index);
+			if (frame == 0)
+				return -ENOSPC;
+			memcpy(reinterpret_cast<uint8_t *>(frame) + skip, in, chunk);
+			in += chunk;
+			offset += chunk;
+			size_ -= chunk;
+		}
+
+		return 0;
+	}
+
+	int RamDisk::clear(size_t offset, size_t size_) {
+		if (const int status = check(size_, offset))
+			return status;
+
+		// Whole frames become holes again; only the partial ones at the edges are zeroed in place.
+		while (0 < size_) {
+			const size_t index = offset / FRAME_SIZE;
+			const size_t skip = offset % FRAME_SIZE;
+			const size_t chunk = std::min(size_, FRAME_SIZE - skip);
+			if (chunk == FRAME_SIZE)
+				release(index);
+			else if (frames[index] != 0)
+				memset(reinterpret_cast<uint8_t *>(frames[index]) + skip, 0, chunk);
+			offset += chunk;
+			size_ -= chunk;
+		}
+
+		return 0;
+	}
+
+	int RamDisk::discard(size_t offset, size_t size_) {
+		if (const int status = check(size_, offset))
+			return status;
+
+		// Discarded data may read back as anything, so partial frames are simply left alone.
+		const size_t first = (offset + FRAME_SIZE - 1) / FRAME_SIZE;
+		const size_t last = (offset + size_) / FRAME_SIZE;
+		for (size_t index = first; index < last; ++index)
+			release(index);
+		return 0;
+	}
+
+	std::string RamDisk::getName() const {
+		return "RAM disk";
+	}
+
+	const void * RamDisk::view(size_t offset, size_t size_) const {
+		if (check(size_, offset) != 0 || FRAME_SIZE < offset % FRAME_SIZE + size_)
+			return nullptr;
+		const uintptr_t frame = frames[offset / FRAME_SIZE];
+		return (frame == 0? zeroFrame : reinterpret_cast<const uint8_t *>(frame)) + offset % FRAME_SIZE;
+	}
+}
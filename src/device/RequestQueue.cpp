@@ -0,0 +1,451 @@
+#include "arch/x86_64/Clock.h"
+#include "device/RequestQueue.h"
+#include "lib/printf.h"
+
+#include <cstring>
+
+namespace Thorn {
+	static void eraseEntry(std::multimap<uint64_t, BlockRequest *> &map, uint64_t key, BlockRequest *request) {
+		for (auto [iter, end] = map.equal_range(key); iter != end; ++iter)
+			if (iter->second == request) {
+				map.erase(iter);
+				return;
+			}
+	}
+
+	RequestQueue::RequestQueue(BlockBackend &backend_, size_t block_size): blockSize(block_size), backend(backend_) {}
+
+	RequestQueue::~RequestQueue() {
+		// The backend is usually the object this queue is a member of, so it can't be called on by now.
+		if (pending() != 0)
+			printf("[RequestQueue::~RequestQueue] Dropping %lu undispatched request(s)\n", pending());
+		for (std::list<BlockRequest *> &list: fifo)
+			for (BlockRequest *request: list)
+				delete request;
+	}
+
+	void RequestQueue::submitRead(uint64_t block, size_t count, void *buffer, Completion completion, void *data) {
+		submitSplit(false, block, count, nullptr, buffer, completion, data);
+	}
+
+	void RequestQueue::submitWrite(uint64_t block, size_t count, const void *buffer, Completion completion,
+	                               void *data) {
+		submitSplit(true, block, count, static_cast<const uint8_t *>(buffer), nullptr, completion, data);
+	}
+
+	void RequestQueue::submitSplit(bool write, uint64_t block, size_t count, const uint8_t *source, void *target,
+	                               Completion completion, void *data) {
+		if (count == 0) {
+			if (completion)
+				completion(data, 0);
+			return;
+		}
+
+		const size_t max = backend.maxBlocks();
+		const size_t pieces = (count + max - 1) / max;
+
+		BlockRequest::Waiter waiter {completion, data, target, 0, 0};
+
+		struct Join {
+			Completion completion;
+			void *data;
+			size_t remaining;
+			int status = 0;
+		};
+
+		if (1 < pieces) {
+			waiter.completion = +[](void *data, int status) {
+				Join *join = static_cast<Join *>(data);
+				if (status != 0 && join->status == 0)
+					join->status = status;
+				if (--join->remaining == 0) {
+					if (join->completion)
+						join->completion(join->data, join->status);
+					delete join;
+				}
+			};
+			waiter.data = new Join {completion, data, pieces};
+		}
+
+		for (size_t done = 0; done < count;) {
+			const size_t piece = count - done < max? count - done : max;
+			const size_t bytes = piece * blockSize;
+			std::vector<uint8_t> piece_data;
+			if (write)
+				piece_data.assign(source + done * blockSize, source + done * blockSize + bytes);
+			waiter.target = target? static_cast<uint8_t *>(target) + done * blockSize : nullptr;
+			waiter.size = bytes;
+			submit(write, block + done, piece, std::move(piece_data), waiter);
+			done += piece;
+		}
+	}
+
+	void RequestQueue::submit(bool write, uint64_t block, size_t count, std::vector<uint8_t> &&data,
+	                          const BlockRequest::Waiter &waiter) {
+		++stats.submitted;
+
+		if (BlockRequest *pending_write = findOverlap(true, block, count)) {
+			const bool contained = pending_write->block <= block && block + count <= pending_write->end();
+			const size_t skip = (block - pending_write->block) * blockSize;
+			if (contained && write) {
+				std::memcpy(pending_write->data.data() + skip, data.data(), count * blockSize);
+				pending_write->waiters.push_back({waiter.completion, waiter.data});
+				++stats.absorbed;
+				return;
+			}
+
+			if (contained) {
+				std::memcpy(waiter.target, pending_write->data.data() + skip + waiter.offset, waiter.size);
+				++stats.forwarded;
+				if (waiter.completion)
+					waiter.completion(waiter.data, 0);
+				return;
+			}
+
+			// Partly overlapping writes have to reach the disk in the order they were made.
+			drain();
+		} else if (write && findOverlap(false, block, count)) {
+			// Earlier reads of the range have to see the old data.
+			drain();
+		}
+
+		if (!tryMerge(write, block, count, data, waiter)) {
+			BlockRequest *request = new BlockRequest;
+			request->write = write;
+			request->block = block;
+			request->blocks = count;
+			request->data = std::move(data);
+			request->waiters.push_back(waiter);
+			request->deadline = x86_64::Clock::monotonicNanos() + (write? WRITE_EXPIRY : READ_EXPIRY);
+			insert(*request);
+		}
+
+		run();
+	}
+
+	bool RequestQueue::tryMerge(bool write, uint64_t block, size_t count, std::vector<uint8_t> &data,
+	                            const BlockRequest::Waiter &waiter) {
+		const size_t max = backend.maxBlocks();
+
+		// Back merge: a pending request that ends where this one starts.
+		for (auto [iter, end] = byEnd[write].equal_range(block); iter != end; ++iter) {
+			BlockRequest &request = *iter->second;
+			if (max < request.blocks + count)
+				continue;
+			byEnd[write].erase(iter);
+			if (write)
+				request.data.insert(request.data.end(), data.begin(), data.end());
+			BlockRequest::Waiter moved = waiter;
+			moved.offset += request.blocks * blockSize;
+			request.waiters.push_back(moved);
+			request.blocks += count;
+			byEnd[write].emplace(request.end(), &request);
+			++stats.backMerges;
+			mergeNext(request);
+			return true;
+		}
+
+		// Front merge: a pending request that starts where this one ends.
+		for (auto [iter, end] = sorted[write].equal_range(block + count); iter != end; ++iter) {
+			BlockRequest &request = *iter->second;
+			if (max < request.blocks + count)
+				continue;
+			sorted[write].erase(iter);
+			if (write)
+				request.data.insert(request.data.begin(), data.begin(), data.end());
+			for (BlockRequest::Waiter &existing: request.waiters)
+				existing.offset += count * blockSize;
+			request.waiters.push_back(waiter);
+			request.block = block;
+			request.blocks += count;
+			sorted[write].emplace(request.block, &request);
+			++stats.frontMerges;
+
+			// The gap this request filled may have been the only thing between it and the one before.
+			for (auto [prev, prev_end] = byEnd[write].equal_range(request.block); prev != prev_end; ++prev)
+				if (prev->second->blocks + request.blocks <= max) {
+					mergeNext(*prev->second);
+					break;
+				}
+
+			return true;
+		}
+
+		return false;
+	}
+
+	void RequestQueue::mergeNext(BlockRequest &request) {
+		const bool write = request.write;
+		for (auto [iter, end] = sorted[write].equal_range(request.end()); iter != end; ++iter) {
+			BlockRequest &next = *iter->second;
+			if (&next == &request || backend.maxBlocks() < request.blocks + next.blocks)
+				continue;
+
+			remove(next);
+			eraseEntry(byEnd[write], request.end(), &request);
+			if (write)
+				request.data.insert(request.data.end(), next.data.begin(), next.data.end());
+			for (BlockRequest::Waiter waiter: next.waiters) {
+				waiter.offset += request.blocks * blockSize;
+				request.waiters.push_back(waiter);
+			}
+			request.blocks += next.blocks;
+			if (next.deadline < request.deadline)
+				request.deadline = next.deadline;
+			byEnd[write].emplace(request.end(), &request);
+			delete &next;
+			++stats.backMerges;
+			return;
+		}
+	}
+
+	BlockRequest * RequestQueue::findOverlap(bool write, uint64_t block, size_t count) {
+		// No request is longer than the backend's limit, so nothing starting further back can reach this range.
+		const size_t max = backend.maxBlocks();
+		const uint64_t from = block < max? 0 : block - max + 1;
+		for (auto iter = sorted[write].lower_bound(from); iter != sorted[write].end() && iter->first < block + count;
+		     ++iter)
+			if (block < iter->second->end())
+				return iter->second;
+		return nullptr;
+	}
+
+	bool RequestQueue::conflictsInFlight(const BlockRequest &request) const {
+		const size_t max = backend.maxBlocks();
+		const uint64_t from = request.block < max? 0 : request.block - max + 1;
+		for (auto iter = active.lower_bound(from); iter != active.end() && iter->first < request.end(); ++iter)
+			if (request.block < iter->second->end() && (request.write || iter->second->write))
+				return true;
+		return false;
+	}
+
+	void RequestQueue::insert(BlockRequest &request) {
+		sorted[request.write].emplace(request.block, &request);
+		byEnd[request.write].emplace(request.end(), &request);
+		fifo[request.write].push_back(&request);
+		request.fifoPosition = --fifo[request.write].end();
+	}
+
+	void RequestQueue::remove(BlockRequest &request) {
+		eraseEntry(sorted[request.write], request.block, &request);
+		eraseEntry(byEnd[request.write], request.end(), &request);
+		fifo[request.write].erase(request.fifoPosition);
+	}
+
+	bool RequestQueue::dispatchNext() {
+		if (backend.queueDepth() <= inFlight)
+			return false;
+
+		const bool has_reads = !fifo[0].empty();
+		const bool has_writes = !fifo[1].empty();
+		if (!has_reads && !has_writes)
+			return false;
+
+		const bool write = !has_reads || (has_writes && WRITES_STARVED <= writesStarved);
+
+		// Expired requests go first. Otherwise the elevator carries on upwards from where it left off.
+		BlockRequest *request = fifo[write].front();
+		if (x86_64::Clock::monotonicNanos() < request->deadline) {
+			auto iter = sorted[write].lower_bound(nextBlock[write]);
+			if (iter == sorted[write].end())
+				iter = sorted[write].begin();
+			request = iter->second;
+		}
+
+		// Commands in flight together can be carried out in any order, so a request that overlaps one of them waits
+		// until it's done. Submission already keeps pending requests in order among themselves.
+		if (conflictsInFlight(*request))
+			return false;
+
+		if (write)
+			writesStarved = 0;
+		else if (has_writes)
+			++writesStarved;
+
+		remove(*request);
+		nextBlock[write] = request->end();
+
+		const size_t bytes = request->blocks * blockSize;
+		const BlockRequest::Waiter &first = request->waiters.front();
+		if (!write && request->waiters.size() == 1 && first.target && first.offset == 0 && first.size == bytes) {
+			request->buffer = first.target;
+		} else {
+			if (!write)
+				request->data.resize(bytes);
+			request->buffer = request->data.data();
+		}
+
+		++inFlight;
+		active.emplace(request->block, request);
+		++stats.dispatched;
+		(write? stats.blocksWritten : stats.blocksRead) += request->blocks;
+		backend.dispatch(*this, *request);
+		return true;
+	}
+
+	void RequestQueue::complete(BlockRequest &request, int status) {
+		--inFlight;
+		eraseEntry(active, request.block, &request);
+
+		if (status != 0) {
+			++stats.errors;
+			printf("[RequestQueue::complete] %s of %lu block(s) at %lu failed: %d\n", request.write? "Write" : "Read",
+				request.blocks, request.block, status);
+			if (request.write && writeError == 0)
+				for (const BlockRequest::Waiter &waiter: request.waiters)
+					if (!waiter.completion) {
+						writeError = status;
+						break;
+					}
+		}
+
+		for (const BlockRequest::Waiter &waiter: request.waiters) {
+			if (!request.write && status == 0 && waiter.target && waiter.target != request.buffer)
+				std::memcpy(waiter.target, static_cast<uint8_t *>(request.buffer) + waiter.offset, waiter.size);
+			if (waiter.completion)
+				waiter.completion(waiter.data, status);
+		}
+
+		delete &request;
+	}
+
+	int RequestQueue::takeWriteError() {
+		const int out = writeError;
+		writeError = 0;
+		return out;
+	}
+
+	void RequestQueue::run() {
+		if (plugDepth == 0) {
+			while (dispatchNext());
+			backend.commit(*this);
+		}
+	}
+
+	void RequestQueue::drain() {
+		while (pending() != 0 || inFlight != 0)
+			if (!dispatchNext())
+				idle();
+	}
+
+	void RequestQueue::step() {
+		if (!dispatchNext()) {
+			idle();
+			return;
+		}
+
+		while (dispatchNext());
+		backend.commit(*this);
+	}
+
+	void RequestQueue::waitFor(Waiting &waiting) {
+		while (waiting.remaining != 0)
+			if (!dispatchNext())
+				idle();
+	}
+
+	void RequestQueue::idle() {
+		if (inFlight != 0)
+			backend.poll(*this);
+		else
+			x86_64::Clock::pause();
+	}
+
+	void RequestQueue::finished(void *data, int status) {
+		Waiting &waiting = *static_cast<Waiting *>(data);
+		if (status != 0 && waiting.status == 0)
+			waiting.status = status;
+		waiting.remaining = waiting.remaining - 1;
+	}
+
+	void RequestQueue::plug() {
+		++plugDepth;
+	}
+
+	void RequestQueue::unplug() {
+		if (plugDepth != 0 && --plugDepth == 0)
+			run();
+	}
+
+	int RequestQueue::read(void *buffer, size_t size, size_t offset) {
+		if (size == 0)
+			return 0;
+
+		const size_t max = backend.maxBlocks();
+		const uint64_t first = offset / blockSize;
+		const uint64_t last = (offset + size - 1) / blockSize;
+		Waiting waiting;
+		waiting.remaining = (last - first + max) / max;
+
+		uint8_t *target = static_cast<uint8_t *>(buffer);
+		size_t skip = offset % blockSize;
+		for (uint64_t block = first; block <= last;) {
+			const size_t count = last - block + 1 < max? last - block + 1 : max;
+			const size_t piece = count * blockSize - skip < size? count * blockSize - skip : size;
+			submit(false, block, count, {}, {&finished, &waiting, target, skip, piece});
+			target += piece;
+			size -= piece;
+			block += count;
+			skip = 0;
+		}
+
+		waitFor(waiting);
+		return waiting.status;
+	}
+
+	int RequestQueue::write(const void *buffer, size_t size, size_t offset) {
+		return writeBytes(buffer, size, offset, plugDepth == 0);
+	}
+
+	int RequestQueue::writeAndWait(const void *buffer, size_t size, size_t offset) {
+		return writeBytes(buffer, size, offset, true);
+	}
+
+	int RequestQueue::writeBytes(const void *buffer, size_t size, size_t offset, bool wait) {
+		if (size == 0)
+			return 0;
+
+		const size_t max = backend.maxBlocks();
+		const uint64_t first = offset / blockSize;
+		const uint64_t last = (offset + size - 1) / blockSize;
+		const size_t count = last - first + 1;
+		const size_t head = offset % blockSize;
+		const size_t tail = (offset + size) % blockSize;
+
+		const uint8_t *source = static_cast<const uint8_t *>(buffer);
+		std::vector<uint8_t> blocks;
+
+		if (head != 0 || tail != 0) {
+			blocks.resize(count * blockSize);
+			int status;
+			if (head != 0 && (status = read(blocks.data(), blockSize, first * blockSize)) != 0)
+				return status;
+			if (tail != 0 && (last != first || head == 0)
+			    && (status = read(blocks.data() + (count - 1) * blockSize, blockSize, last * blockSize)) != 0)
+				return status;
+			std::memcpy(blocks.data() + head, buffer, size);
+			source = blocks.data();
+		}
+
+		Waiting waiting;
+		waiting.remaining = (count + max - 1) / max;
+		const BlockRequest::Waiter waiter = wait? BlockRequest::Waiter {&finished, &waiting} : BlockRequest::Waiter {};
+
+		if (count <= max && !blocks.empty()) {
+			submit(true, first, count, std::move(blocks), waiter);
+		} else {
+			for (size_t done = 0; done < count;) {
+				const size_t piece = count - done < max? count - done : max;
+				submit(true, first + done, piece, std::vector<uint8_t>(source + done * blockSize,
+					source + (done + piece) * blockSize), waiter);
+				done += piece;
+			}
+		}
+
+		if (!wait)
+			return 0;
+
+		waitFor(waiting);
+		return waiting.status;
+	}
+}
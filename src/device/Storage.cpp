@@ -0,0 +1,237 @@
+#include "arch/x86_64/Clock.h"
+#include "device/Storage.h"
+#include "Assert.h"
+
+namespace Thorn {
+	StorageDevice::StorageDevice(size_t sector_size, size_t block_size):
+		sectorSize(sector_size), blockSize(block_size), queue(*this, block_size) {
+		assert(block_size <= PageCache::PAGE_SIZE && PageCache::PAGE_SIZE / block_size <= PageCache::MAX_BLOCKS);
+	}
+
+	StorageDevice::~StorageDevice() {
+		// Pages are keyed by the device's address, so they can't outlive it.
+		PageCache::get().purge(*this);
+	}
+
+	uint8_t * StorageDevice::cachedBlock(uint64_t block) {
+		const uint64_t index = block / blocksPerPage();
+		const size_t slot = block % blocksPerPage();
+		CachedPage *page = PageCache::get().lookup(*this, index);
+		if (!page || (page->valid & (1u << slot)) == 0)
+			return nullptr;
+		pinned = index;
+		return page->data() + slot * blockSize;
+	}
+
+	bool StorageDevice::isCached(uint64_t block) const {
+		const CachedPage *page = PageCache::get().find(*this, block / blocksPerPage());
+		return page && (page->valid & (1u << block % blocksPerPage())) != 0;
+	}
+
+	std::pair<uint8_t *, bool> StorageDevice::cacheEntry(uint64_t block) {
+		const uint64_t index = block / blocksPerPage();
+		const size_t slot = block % blocksPerPage();
+		// Unpinned first, since the page cache may need the last page's frame.
+		pinned = UINT64_MAX;
+		CachedPage *page = PageCache::get().obtain(*this, index);
+		if (!page)
+			return {nullptr, false};
+
+		pinned = index;
+		return {page->data() + slot * blockSize, (page->valid & (1u << slot)) == 0};
+	}
+
+	int StorageDevice::clear(size_t offset, size_t size) {
+		std::vector<uint8_t> zeroes(blockSize, 0);
+		const uint64_t errors = queue.stats.errors;
+
+		queue.plug();
+		while (0 < size) {
+			const size_t chunk = std::min(size, blockSize - offset % blockSize);
+			int status = queue.write(zeroes.data(), chunk, offset);
+			if (status != 0) {
+				queue.unplug();
+				return status;
+			}
+			offset += chunk;
+			size -= chunk;
+		}
+		queue.unplug();
+
+		return queue.stats.errors == errors? 0 : -EIO;
+	}
+
+	void StorageDevice::markDirty(uint64_t block) {
+		if (CachedPage *page = PageCache::get().find(*this, block / blocksPerPage())) {
+			page->valid |= 1u << block % blocksPerPage();
+			page->dirty |= 1u << block % blocksPerPage();
+		}
+		if (dirty.empty())
+			oldestDirty = x86_64::Clock::monotonicNanos();
+		dirty.insert(block);
+	}
+
+	void StorageDevice::markClean(uint64_t block) {
+		if (CachedPage *page = PageCache::get().find(*this, block / blocksPerPage())) {
+			page->valid |= 1u << block % blocksPerPage();
+			if (writing.count(block) == 0)
+				page->dirty &= ~(1u << block % blocksPerPage());
+		}
+		dirty.erase(block);
+	}
+
+	void StorageDevice::dropCached(uint64_t first, uint64_t last) {
+		PageCache::get().invalidate(*this, first, last);
+		dirty.erase(dirty.lower_bound(first), dirty.lower_bound(last));
+	}
+
+	void StorageDevice::dropCache() {
+		PageCache::get().dropClean(*this);
+	}
+
+	std::set<uint64_t>::iterator StorageDevice::writeBackRun(std::set<uint64_t>::iterator iter) {
+		const uint64_t first = *iter;
+		const size_t max = maxBlocks();
+		std::vector<uint8_t> buffer;
+		uint64_t block = first;
+
+		while (iter != dirty.end() && *iter == block && block - first < max) {
+			// The page stays dirty until the write has finished, so growing the buffer can't shrink it away.
+			CachedPage *page = PageCache::get().find(*this, block / blocksPerPage());
+			// Dirty blocks are always cached, but a missing one would just end the run.
+			if (!page) {
+				iter = dirty.erase(iter);
+				break;
+			}
+			const uint8_t *data = page->data() + block % blocksPerPage() * blockSize;
+			buffer.insert(buffer.end(), data, data + blockSize);
+			++writing[block];
+			iter = dirty.erase(iter);
+			++block;
+		}
+
+		if (block != first) {
+			struct Run {
+				StorageDevice *device;
+				uint64_t first;
+				size_t count;
+			};
+
+			cacheStats.writebacks += block - first;
+			// The write can finish before submitWrite returns.
+			queue.submitWrite(first, block - first, buffer.data(), +[](void *data, int status) {
+				Run *run = static_cast<Run *>(data);
+				run->device->finishWriteBack(run->first, run->count, status);
+				delete run;
+			}, new Run {this, first, block - first});
+		}
+		return iter;
+	}
+
+	void StorageDevice::finishWriteBack(uint64_t first, size_t count, int status) {
+		if (status != 0 && writeBackError == 0)
+			writeBackError = status;
+
+		for (uint64_t block = first; block < first + count; ++block) {
+			auto iter = writing.find(block);
+			const bool last_write = iter == writing.end() || --iter->second == 0;
+			if (iter != writing.end() && last_write)
+				writing.erase(iter);
+
+			// The block may have been dropped while its write was in flight.
+			CachedPage *page = PageCache::get().find(*this, block / blocksPerPage());
+			const uint8_t bit = 1u << block % blocksPerPage();
+			if (!page || (page->valid & bit) == 0)
+				continue;
+
+			if (status != 0)
+				markDirty(block);
+			else if (last_write && dirty.count(block) == 0)
+				page->dirty &= ~bit;
+		}
+	}
+
+	void StorageDevice::writeBack() {
+		queue.plug();
+		for (auto iter = dirty.begin(); iter != dirty.end();)
+			iter = writeBackRun(iter);
+		queue.unplug();
+	}
+
+	void StorageDevice::writeBack(uint64_t first, uint64_t last) {
+		queue.plug();
+		for (auto iter = dirty.lower_bound(first); iter != dirty.end() && *iter < last;)
+			iter = writeBackRun(iter);
+		queue.unplug();
+	}
+
+	void StorageDevice::writeBackPage(uint64_t index) {
+		const uint64_t first = index * blocksPerPage();
+		const uint64_t last = first + blocksPerPage();
+		auto iter = dirty.lower_bound(first);
+		if (iter != dirty.end() && *iter < last) {
+			// Start from the beginning of the run so it goes out as one write.
+			while (iter != dirty.begin() && *std::prev(iter) == *iter - 1)
+				--iter;
+			// The data is copied into the queue, so the page can go as soon as the writes are queued.
+			while (iter != dirty.end() && *iter < last)
+				iter = writeBackRun(iter);
+		}
+
+		// Blocks dirty in the page but neither in the set nor being written would otherwise keep it cached forever.
+		if (CachedPage *page = PageCache::get().find(*this, index))
+			for (uint64_t block = first; block < last; ++block)
+				if (dirty.count(block) == 0 && writing.count(block) == 0)
+					page->dirty &= ~(1u << block % blocksPerPage());
+	}
+
+	int StorageDevice::takeWriteBackError() {
+		const int out = writeBackError;
+		writeBackError = 0;
+		return out;
+	}
+
+	int StorageDevice::finishWrites() {
+		queue.drain();
+		const int writeback_status = takeWriteBackError();
+		const int queued_status = queue.takeWriteError();
+		return writeback_status != 0? writeback_status : queued_status;
+	}
+
+	std::pair<uint64_t, uint64_t> StorageDevice::discardRange(size_t offset, size_t size) {
+		const uint64_t first = (offset + blockSize - 1) / blockSize;
+		const uint64_t last = (offset + size) / blockSize;
+		if (last <= first)
+			return {first, first};
+		queue.drain();
+		return {first, last};
+	}
+
+	StorageDevice::InFlight * StorageDevice::claimInFlight(InFlight *table, size_t count, BlockRequest &request) {
+		for (size_t i = 0; i < count; ++i)
+			if (!table[i].request) {
+				table[i] = {this, &request};
+				return &table[i];
+			}
+
+		queue.complete(request, -EBUSY);
+		return nullptr;
+	}
+
+	void StorageDevice::finishInFlight(void *data, int status) {
+		InFlight &slot = *static_cast<InFlight *>(data);
+		BlockRequest &request = *slot.request;
+		StorageDevice &device = *slot.device;
+		slot = {};
+		device.queue.complete(request, status);
+	}
+
+	void StorageDevice::balanceDirty() {
+		if (dirty.empty())
+			return;
+
+		if (PageCache::get().capacity() * blocksPerPage() * dirtyRatio / 100 < dirty.size()
+		    || oldestDirty + dirtyExpireNanos <= x86_64::Clock::monotonicNanos())
+			writeBack();
+	}
+}
@@ -0,0 +1,304 @@
+#include "arch/x86_64/Clock.h"
+#include "device/StripeDevice.h"
+#include "lib/printf.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <list>
+#include <map>
+
+namespace Thorn {
+	uint32_t StripeDevice::Superblock::computeChecksum() const {
+		const uint8_t *bytes = reinterpret_cast<const uint8_t *>(this);
+		uint32_t hash = 0x811c9dc5;
+		for (size_t i = 0; i < offsetof(Superblock, checksum); ++i)
+			hash = (hash ^ bytes[i]) * 0x01000193;
+		return hash;
+	}
+
+	bool StripeDevice::Superblock::valid() const {
+		return magic == MAGIC && version == VERSION && 2 <= memberCount && memberCount <= MAX_MEMBERS
+			&& chunkSize != 0 && checksum == computeChecksum();
+	}
+
+	StripeDevice::StripeDevice(Members &&members_, uint64_t array_id, size_t chunk_size, size_t member_size):
+		arrayID(array_id), chunkSize(chunk_size), memberSize(member_size), size(member_size * members_.size()),
+		members(std::move(members_)) {}
+
+	std::unique_ptr<StripeDevice> StripeDevice::create(Members &&members, size_t chunk_size, uint64_t member_size) {
+		if (members.size() < 2 || MAX_MEMBERS < members.size()) {
+			printf("[StripeDevice::create] An array needs between 2 and %lu members\n", MAX_MEMBERS);
+			return nullptr;
+		}
+
+		if (chunk_size == 0 || UINT32_MAX < chunk_size) {
+			printf("[StripeDevice::create] Invalid chunk size: %lu\n", chunk_size);
+			return nullptr;
+		}
+
+		for (const auto &member: members)
+			if (chunk_size % member->blockSize != 0) {
+				printf("[StripeDevice::create] Chunk size %lu isn't a multiple of %s's block size (%lu)\n", chunk_size,
+					member->getName().c_str(), member->blockSize);
+				return nullptr;
+			}
+
+		if (member_size < DATA_OFFSET + chunk_size) {
+			printf("[StripeDevice::create] Members are too small for a chunk\n");
+			return nullptr;
+		}
+
+		const uint64_t data_size = (member_size - DATA_OFFSET) / chunk_size * chunk_size;
+		// Only has to tell arrays apart, not resist guessing.
+		const uint64_t array_id = (x86_64::Clock::cycles() ^ x86_64::Clock::monotonicNanos()) * 0x9e3779b97f4a7c15ul;
+
+		for (size_t i = 0; i < members.size(); ++i) {
+			Superblock superblock {MAGIC, VERSION, static_cast<uint32_t>(members.size()), static_cast<uint32_t>(i),
+				static_cast<uint32_t>(chunk_size), array_id, data_size, 0};
+			superblock.checksum = superblock.computeChecksum();
+
+			int status = members[i]->queue.write(&superblock, sizeof(superblock), SUPERBLOCK_OFFSET);
+			if (status == 0)
+				status = members[i]->sync();
+			if (status != 0) {
+				printf("[StripeDevice::create] Writing member %lu's superblock failed: %d\n", i, status);
+				return nullptr;
+			}
+		}
+
+		return std::unique_ptr<StripeDevice>(new StripeDevice(std::move(members), array_id, chunk_size, data_size));
+	}
+
+	std::vector<std::unique_ptr<StripeDevice>> StripeDevice::assemble(Members &candidates) {
+		struct Found {
+			Superblock superblock;
+			size_t candidate;
+		};
+
+		std::map<uint64_t, std::vector<Found>> found;
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			if (!candidates[i])
+				continue;
+			Superblock superblock;
+			if (candidates[i]->queue.read(&superblock, sizeof(superblock), SUPERBLOCK_OFFSET) == 0
+			    && superblock.valid())
+				found[superblock.arrayID].push_back({superblock, i});
+		}
+
+		std::vector<std::unique_ptr<StripeDevice>> out;
+
+		for (const auto &[array_id, parts]: found) {
+			const Superblock &first = parts.front().superblock;
+			std::vector<size_t> slots(first.memberCount, SIZE_MAX);
+			bool consistent = true;
+
+			for (const Found &part: parts) {
+				const Superblock &superblock = part.superblock;
+				if (superblock.memberCount != first.memberCount || superblock.chunkSize != first.chunkSize
+				    || superblock.memberSize != first.memberSize || first.memberCount <= superblock.index
+				    || slots[superblock.index] != SIZE_MAX
+				    || superblock.chunkSize % candidates[part.candidate]->blockSize != 0) {
+					consistent = false;
+					break;
+				}
+				slots[superblock.index] = part.candidate;
+			}
+
+			if (!consistent) {
+				printf("[StripeDevice::assemble] Array %lx has conflicting superblocks\n", array_id);
+				continue;
+			}
+
+			const size_t missing = std::count(slots.begin(), slots.end(), SIZE_MAX);
+			if (missing != 0) {
+				printf("[StripeDevice::assemble] Array %lx is missing %lu of %u member(s)\n", array_id, missing,
+					first.memberCount);
+				continue;
+			}
+
+			Members members;
+			for (const size_t slot: slots)
+				members.push_back(std::move(candidates[slot]));
+			out.emplace_back(new StripeDevice(std::move(members), array_id, first.chunkSize, first.memberSize));
+		}
+
+		return out;
+	}
+
+	int StripeDevice::check(size_t size_, size_t offset) const {
+		return offset <= size && size_ <= size - offset? 0 : -EINVAL;
+	}
+
+	template <typename F>
+	void StripeDevice::forEachPiece(size_t offset, size_t size_, F &&function) {
+		for (size_t done = 0; done < size_;) {
+			const size_t chunk = offset / chunkSize;
+			const size_t skip = offset % chunkSize;
+			const size_t piece = std::min(size_ - done, chunkSize - skip);
+			StorageDevice &member = *members[chunk % members.size()];
+			function(member, DATA_OFFSET + chunk / members.size() * chunkSize + skip, piece, done);
+			offset += piece;
+			done += piece;
+		}
+	}
+
+	void StripeDevice::plug() {
+		for (const auto &member: members)
+			member->queue.plug();
+	}
+
+	void StripeDevice::unplug() {
+		for (const auto &member: members)
+			member->queue.unplug();
+	}
+
+	void StripeDevice::wait() {
+		for (bool busy = true; busy;) {
+			busy = false;
+			for (const auto &member: members)
+				if (member->queue.busy()) {
+					busy = true;
+					member->queue.step();
+				}
+		}
+	}
+
+	uint64_t StripeDevice::errors() const {
+		uint64_t out = 0;
+		for (const auto &member: members)
+			out += member->queue.stats.errors;
+		return out;
+	}
+
+	int StripeDevice::read(void *buffer, size_t size_, size_t offset) {
+		if (const int status = check(size_, offset))
+			return status;
+
+		/** Pieces that don't cover whole member blocks are read into one of these and copied out afterwards. */
+		struct Bounce {
+			std::vector<uint8_t> data;
+			uint8_t *target;
+			size_t skip;
+			size_t size;
+		};
+
+		std::list<Bounce> bounces;
+		int status = 0;
+		const RequestQueue::Completion on_complete = +[](void *data, int result) {
+			int &status = *static_cast<int *>(data);
+			if (result != 0 && status == 0)
+				status = result;
+		};
+
+		// Every piece is queued before anything is dispatched, so pieces that land next to each other on a member
+		// merge into one request and all the members start at once.
+		uint8_t *out = static_cast<uint8_t *>(buffer);
+		plug();
+		forEachPiece(offset, size_, [&](StorageDevice &member, size_t member_offset, size_t piece, size_t done) {
+			const size_t block_size = member.blockSize;
+			const uint64_t first = member_offset / block_size;
+			if (member_offset % block_size == 0 && piece % block_size == 0) {
+				member.queue.submitRead(first, piece / block_size, out + done, on_complete, &status);
+				return;
+			}
+
+			const uint64_t last = (member_offset + piece + block_size - 1) / block_size;
+			Bounce &bounce = bounces.emplace_back(Bounce {std::vector<uint8_t>((last - first) * block_size), out + done,
+				member_offset % block_size, piece});
+			member.queue.submitRead(first, last - first, bounce.data.data(), on_complete, &status);
+		});
+		unplug();
+		wait();
+
+		if (status == 0)
+			for (const Bounce &bounce: bounces)
+				std::memcpy(bounce.target, bounce.data.data() + bounce.skip, bounce.size);
+
+		return status;
+	}
+
+	int StripeDevice::write(const void *buffer, size_t size_, size_t offset) {
+		if (const int status = check(size_, offset))
+			return status;
+
+		// While the members are plugged, their queues hold on to the writes and only count errors.
+		const uint64_t errors_before = errors();
+		const uint8_t *in = static_cast<const uint8_t *>(buffer);
+		int status = 0;
+		plug();
+		forEachPiece(offset, size_, [&](StorageDevice &member, size_t member_offset, size_t piece, size_t done) {
+			if (status == 0)
+				status = member.queue.write(in + done, piece, member_offset);
+		});
+		unplug();
+		wait();
+
+		if (status != 0)
+			return status;
+		return errors() == errors_before? 0 : -EIO;
+	}
+
+	int StripeDevice::clear(size_t offset, size_t size_) {
+		if (const int status = check(size_, offset))
+			return status;
+
+		// A full stripe at a time keeps every member busy.
+		const std::vector<uint8_t> zeroes(std::min(size_, chunkSize * members.size()), 0);
+		while (0 < size_) {
+			const size_t piece = std::min(size_, zeroes.size());
+			if (const int status = write(zeroes.data(), piece, offset))
+				return status;
+			offset += piece;
+			size_ -= piece;
+		}
+
+		return 0;
+	}
+
+	int StripeDevice::discard(size_t offset, size_t size_) {
+		if (const int status = check(size_, offset))
+			return status;
+
+		int status = 0;
+		forEachPiece(offset, size_, [&](StorageDevice &member, size_t member_offset, size_t piece, size_t) {
+			if (status == 0)
+				status = member.discard(member_offset, piece);
+		});
+		return status;
+	}
+
+	void StripeDevice::flush() {
+		for (const auto &member: members)
+			member->flush();
+		wait();
+	}
+
+	int StripeDevice::sync() {
+		wait();
+		int status = 0;
+		for (const auto &member: members)
+			if (const int member_status = member->sync(); member_status != 0 && status == 0)
+				status = member_status;
+		return status;
+	}
+
+	std::string StripeDevice::getName() const {
+		return "RAID-0 of " + std::to_string(members.size()) + " x " + members.front()->getName();
+	}
+
+	size_t StripeDevice::logicalBlockSize() const {
+		size_t out = 0;
+		for (const auto &member: members)
+			out = std::max(out, member->blockSize);
+		return out;
+	}
+
+	size_t StripeDevice::physicalBlockSize() const {
+		size_t out = logicalBlockSize();
+		for (const auto &member: members)
+			out = std::max(out, member->physicalBlockSize());
+		return out;
+	}
+}
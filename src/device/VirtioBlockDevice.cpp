@@ -0,0 +1,70 @@
+#include "device/VirtioBlockDevice.h"
+#include "memory/Memory.h"
+
+#include <cerrno>
+
+namespace Thorn {
+	VirtioBlockDevice::VirtioBlockDevice(Virtio::Block *block_):
+		StorageDevice(block_->blockSize, block_->blockSize), block(block_) {}
+
+	int VirtioBlockDevice::read(void *buffer, size_t size, size_t offset) {
+		return queue.read(buffer, size, offset);
+	}
+
+	int VirtioBlockDevice::write(const void *buffer, size_t size, size_t offset) {
+		return queue.write(buffer, size, offset);
+	}
+
+	int VirtioBlockDevice::discard(size_t offset, size_t size) {
+		if (!block->hasFeature(Virtio::BLK_F_DISCARD))
+			return -EOPNOTSUPP;
+
+		const auto [first, last] = discardRange(offset, size);
+		if (last <= first)
+			return 0;
+
+		const uint64_t sectors_per_block = blockSize / Virtio::BLK_SECTOR_SIZE;
+		return block->discard(first * sectors_per_block, (last - first) * sectors_per_block);
+	}
+
+	int VirtioBlockDevice::sync() {
+		if (const int status = finishWrites())
+			return status;
+		return block->flush();
+	}
+
+	std::string VirtioBlockDevice::getName() const {
+		return block->serial.empty()? "virtio-blk" : block->serial;
+	}
+
+	size_t VirtioBlockDevice::physicalBlockSize() const {
+		return block->physicalBlockSize;
+	}
+
+	void VirtioBlockDevice::dispatch(RequestQueue &queue, BlockRequest &request) {
+		InFlight *slot = claimInFlight(inFlight, std::size(inFlight), request);
+		if (!slot)
+			return;
+
+		const auto type = request.write? Virtio::Block::Type::Out : Virtio::Block::Type::In;
+		const uint64_t sector = request.block * (blockSize / Virtio::BLK_SECTOR_SIZE);
+		while (!block->issue(type, sector, request.buffer, request.blocks * blockSize, &finishInFlight, slot))
+			if (!block->wait()) {
+				*slot = {};
+				queue.complete(request, -ETIMEDOUT);
+				return;
+			}
+	}
+
+	size_t VirtioBlockDevice::maxBlocks() const {
+		return std::max<size_t>(1, block->maxTransfer() / blockSize);
+	}
+
+	size_t VirtioBlockDevice::queueDepth() const {
+		return Virtio::Block::MAX_REQUESTS;
+	}
+
+	void VirtioBlockDevice::poll(RequestQueue &) {
+		block->wait();
+	}
+}
@@ -8,13 +8,19 @@
 // #define VERIFY_WRITES_QUIETLY
 
 namespace Thorn::FS {
-	int Partition::read(void *buffer, size_t size, size_t byte_offset) {
+	size_t Partition::blockSize() const {
+		return parent->logicalBlockSize();
+	}
+
+	int Partition::read(void *buffer, size_t size, size_t byte_offset, int flags) {
 		readRecords.emplace_back(size, offset);
 		// printf("\e[32m[read(buffer, %lu, %ld)]\e[0m\n", size, offset);
+		if ((flags & IO_DIRECT) != 0)
+			return parent->readDirect(buffer, size, offset + byte_offset);
 		return parent->read(buffer, size, offset + byte_offset);
 	}
 
-	int Partition::write(const void *buffer, size_t size, size_t byte_offset) {
+	int Partition::write(const void *buffer, size_t size, size_t byte_offset, int flags) {
 		writeRecords.emplace_back(size, byte_offset);
 #ifdef DEBUG_WRITES
 		printf("\e[32m[\e[31mwrite\e[32m(buffer, %lu, %ld)]\e[0m", size, byte_offset);
@@ -26,6 +32,8 @@ namespace Thorn::FS {
 		} else
 			printf("\n");
 #endif
+		if ((flags & IO_DIRECT) != 0)
+			return parent->writeDirect(buffer, size, offset + byte_offset);
 #ifndef VERIFY_WRITES
 		return parent->write(buffer, size, offset + byte_offset);
 #else
@@ -62,4 +70,31 @@ namespace Thorn::FS {
 	int Partition::clear() {
 		return parent->clear(offset, length);
 	}
+
+	int Partition::discard(size_t byte_offset, size_t size) {
+		return parent->discard(offset + byte_offset, size);
+	}
+
+	const void * Partition::view(size_t byte_offset, size_t size) const {
+		return parent->view(offset + byte_offset, size);
+	}
+
+	int Partition::sync() {
+		return parent->sync();
+	}
+
+	int Partition::writeFUA(const void *buffer, size_t size, size_t byte_offset) {
+		writeRecords.emplace_back(size, byte_offset);
+		return parent->writeFUA(buffer, size, offset + byte_offset);
+	}
+
+	void Partition::plug() {
+		if (RequestQueue *queue = parent->getQueue())
+			queue->plug();
+	}
+
+	void Partition::unplug() {
+		if (RequestQueue *queue = parent->getQueue())
+			queue->unplug();
+	}
 }
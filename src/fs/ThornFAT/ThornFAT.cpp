@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cerrno>
 #include <string>
 #include <string.h>
@@ -16,6 +17,7 @@ namespace Thorn::FS::ThornFAT {
 
 	ThornFATDriver::ThornFATDriver(Partition *partition_): Driver(partition_) {
 		root.startBlock = UNUSABLE;
+		canView = partition->view(0, 1) != nullptr;
 		readSuperblock(superblock);
 	}
 
@@ -180,11 +182,13 @@ namespace Thorn::FS::ThornFAT {
 			if (next == FINAL) {
 				DBGFE(FORGETH, "Freeing " BLR " (next == FINAL)", block);
 				writeFAT(0, block);
+				freed(block);
 				removed++;
 				break;
 			} else if (0 < next) {
 				DBGFE(FORGETH, "Freeing " BLR " (0 < next)", block);
 				writeFAT(0, block);
+				freed(block);
 				removed++;
 				block = next;
 			} else
@@ -463,6 +467,7 @@ namespace Thorn::FS::ThornFAT {
 							}
 
 							writeFAT(0, shrinkblock);
+							freed(shrinkblock);
 							++blocksFree;
 							shrinkblock = nextblock;
 						}
@@ -527,8 +532,8 @@ namespace Thorn::FS::ThornFAT {
 			return -ENAMETOOLONG;
 		}
 
-		// TODO: implement time.
-		DirEntry newfile(times == nullptr? Times(0, 0, 0) : *times, length, type);
+		const long time_now = Util::now();
+		DirEntry newfile(times == nullptr? Times(time_now, time_now, time_now) : *times, length, type);
 		block_t free_block = findFreeBlock();
 		if (noalloc) {
 			// We provide an option not to allocate space for the file. This is helpful for fat_rename, when we just
@@ -871,6 +876,7 @@ namespace Thorn::FS::ThornFAT {
 			for (size_t i = new_c; i < old_c; i++) {
 				DBGN(RESIZEH, ILS("Freeing") " a FAT block:", blocks[i]);
 				writeFAT(0, blocks[i]);
+				freed(blocks[i]);
 				++blocksFree;
 			}
 
@@ -976,6 +982,11 @@ namespace Thorn::FS::ThornFAT {
 		}
 
 		position += remaining;
+
+		// Only the rest of the new final block needs zeroing. Any blocks after it are freed and discarded instead.
+		if (bs - remaining < diff)
+			diff = bs - remaining;
+
 		static char empty[1024] = {0};
 		int status;
 		while (sizeof(empty) <= diff) {
@@ -1037,11 +1048,16 @@ namespace Thorn::FS::ThornFAT {
 	}
 
 	block_t ThornFATDriver::readFAT(size_t block_offset) {
+		const size_t offset = superblock.blockSize + block_offset * sizeof(block_t);
+		// Walking a chain reads one entry at a time, so a FAT the device can expose is read in place.
+		if (canView)
+			if (const void *entry = partition->view(offset, sizeof(block_t)))
+				return *static_cast<const block_t *>(entry);
+
 		block_t out;
-		int status = partition->read(&out, sizeof(block_t), superblock.blockSize + block_offset * sizeof(block_t));
+		int status = partition->read(&out, sizeof(block_t), offset);
 		SCHECK("readFAT", "Reading failed");
-		DBGFE("readFAT", "Adjusted offset: " BULR " " DARR " " BDR,
-			superblock.blockSize + block_offset * sizeof(block_t), out);
+		DBGFE("readFAT", "Adjusted offset: " BULR " " DARR " " BDR, offset, out);
 		return out;
 	}
 
@@ -1060,13 +1076,14 @@ namespace Thorn::FS::ThornFAT {
 			sizeof(DirEntry), sizeof(Superblock));
 
 		DBG("initFAT", "Zeroing out FAT.");
+		Partition::Plug plug(*partition);
 		size_t position = block_size;
 		size_t remaining = table_size * block_size;
-		static char zeros[512] = {};
-		while (512 <= remaining) {
-			partition->write(zeros, 512, position);
-			position += 512;
-			remaining -= 512;
+		static char zeros[4096] = {};
+		while (sizeof(zeros) <= remaining) {
+			partition->write(zeros, sizeof(zeros), position);
+			position += sizeof(zeros);
+			remaining -= sizeof(zeros);
 		}
 
 		partition->write(zeros, remaining, position);
@@ -1275,11 +1292,14 @@ namespace Thorn::FS::ThornFAT {
 		return 0;
 	}
 
-	int ThornFATDriver::write(const char *path, const char *buffer, size_t size, off_t offset) {
+	int ThornFATDriver::write(const char *path, const char *buffer, size_t size, off_t offset, int flags) {
 		HELLO(path);
 		DBGL;
 		DBGF(WRITEH, PMETHOD("write") BSTR DMS "offset " BLR DMS "size " BLR, path, offset, size);
 
+		// The data blocks are usually contiguous, so let them pile up and go out as large writes.
+		Partition::Plug plug(*partition);
+
 		const size_t bs = superblock.blockSize;
 
 		DirEntry file;
@@ -1320,7 +1340,7 @@ namespace Thorn::FS::ThornFAT {
 			// If the amount to write doesn't require us to move into other blocks, just finish everything here.
 			DBGF(WRITEH, "Performing " IPS("small write") " of size " BLR " to block " BDR " with " BLR
 				" remaining offset.", size, block, offset_left);
-			status = partition->write(buffer, size, position);
+			status = partition->write(buffer, size, position, flags);
 			position += size;
 			SCHECK(WRITEH, "Couldn't write from buffer");
 			size_left = 0;
@@ -1329,7 +1349,7 @@ namespace Thorn::FS::ThornFAT {
 			// We'll need to write multiple blocks and we're currently not block-aligned, so let's fix that.
 			to_write = bs - offset_left;
 			DBGF(WRITEH, "Writing " BLR " block%s to block-align.", PLURALS(to_write));
-			status = partition->write(buffer, to_write, position);
+			status = partition->write(buffer, to_write, position, flags);
 			CHECKS(WRITEH, "Couldn't write to block-align");
 			position += to_write;
 			DBGH(WRITEH, "Now at offset", block * bs + offset_left + to_write);
@@ -1350,18 +1370,25 @@ namespace Thorn::FS::ThornFAT {
 		}
 
 		while (0 < size_left) {
-			// Don't write more than one block at a time.
+			// A run of blocks that follow each other on the disk is written in one go, which lets direct writes reach
+			// the device whole.
 			to_write = static_cast<ssize_t>(bs) < size_left? bs : size_left;
+			block_t next = readFAT(block);
+			while (to_write < size_left && next == block + 1) {
+				block = next;
+				to_write += static_cast<ssize_t>(bs) < size_left - to_write? bs : size_left - to_write;
+				next = readFAT(block);
+			}
 
-			DBGF(WRITEH, "Writing to block " A_PINK BDR A_RESET " (to_write = " BLR DMS "position = " BULR ")",
+			DBGF(WRITEH, "Writing up to block " A_PINK BDR A_RESET " (to_write = " BLR DMS "position = " BULR ")",
 				block, to_write, position);
-			status = partition->write(buffer + bytes_written, to_write, position);
+			status = partition->write(buffer + bytes_written, to_write, position, flags);
 			SCHECK(WRITEH, "Couldn't read into buffer");
 			position += to_write;
 
 			bytes_written += to_write;
 			size_left  -= to_write;
-			block = readFAT(block);
+			block = next;
 			if (block == FINAL && size_left != 0) {
 				// We still have more to write, but this block was the last one.
 				WARNS(WRITEH, "There is still more to write, but there are no more blocks left!");
@@ -1373,8 +1400,7 @@ namespace Thorn::FS::ThornFAT {
 			}
 		}
 
-		// TODO: time syscall. Syscalls in general, really.
-		// file.times.modified = NOW;
+		file.times.modified = Util::now();
 
 		writeEntry(file, file_offset);
 		SUCC(WRITEH, "Wrote " BLR " byte%s", PLURALS(bytes_written));
@@ -1483,7 +1509,26 @@ namespace Thorn::FS::ThornFAT {
 		return 0;
 	}
 
-	int ThornFATDriver::read(const char *path, void *buffer, size_t size, off_t offset) {
+	int ThornFATDriver::fsync(const char *path) {
+		HELLO(path);
+		int status = find(-1, path);
+		SCHECK("fsync", "find failed");
+
+		// Nothing keeps track of which cached blocks belong to which file, so the whole partition goes out. The
+		// barrier is still the only one this costs, however many writes came before it.
+		return sync();
+	}
+
+	int ThornFATDriver::sync() {
+		// The FAT updates that free blocks have to reach the disk before the blocks are discarded. Otherwise, a crash
+		// in between could leave files pointing at discarded blocks.
+		const int status = partition->sync();
+		if (status == 0)
+			discardFreed();
+		return status;
+	}
+
+	int ThornFATDriver::read(const char *path, void *buffer, size_t size, off_t offset, int flags) {
 		HELLO(path);
 		const size_t bs = superblock.blockSize;
 
@@ -1537,7 +1582,7 @@ namespace Thorn::FS::ThornFAT {
 			DBGN(READH, "Performing \e[36msmall read\e[36m from block", block);
 			DBGN(READH, "Offset left:", offset_left);
 			DBGN(READH, "Size:", size);
-			status = partition->read(buffer, size, position);
+			status = partition->read(buffer, size, position, flags);
 			SCHECK(READH, "Couldn't read into buffer:");
 			position += size;
 			size_left = 0;
@@ -1545,20 +1590,36 @@ namespace Thorn::FS::ThornFAT {
 		} else if (0 < offset_left) {
 			// We'll need to read multiple blocks and we're currently not block-aligned, so let's fix that.
 			to_read = bs - offset_left;
-			status = partition->read(buffer, to_read, position);
+			status = partition->read(buffer, to_read, position, flags);
 			SCHECK(READH, "Couldn't read into buffer:");
-			position += to_read;
 			bytes_read += to_read;
 			size_left -= to_read;
+
+			// The rest starts at the beginning of the next block in the chain, which needn't be the next one on disk.
+			block = readFAT(block);
+			if (block == FINAL) {
+				WARNS(READH, "There is still more to read, but there are no more blocks left!");
+				size_left = 0;
+			} else {
+				CHECKBLOCK(READH, "Invalid block during block alignment");
+				position = block * bs;
+			}
 		}
 
 		while (0 < size_left) {
-			// Don't read more than one block at a time.
+			// A run of blocks that follow each other on the disk is read in one go, which lets direct reads reach the
+			// device whole.
 			to_read = bs < size_left? bs : size_left;
+			block_t next = readFAT(block);
+			while (to_read < size_left && next == block + 1) {
+				block = next;
+				to_read += bs < size_left - to_read? bs : size_left - to_read;
+				next = readFAT(block);
+			}
 
-			DBGN(READH, "Reading from block:\e[36m", block);
+			DBGN(READH, "Reading up to block:\e[36m", block);
 			// status = read(imgfd, buf + bytes_read, to_read);
-			status = partition->read(static_cast<char *>(buffer) + bytes_read, to_read, position);
+			status = partition->read(static_cast<char *>(buffer) + bytes_read, to_read, position, flags);
 			SCHECK(READH, "Couldn't read into buffer:");
 
 			position += to_read;
@@ -1568,7 +1629,7 @@ namespace Thorn::FS::ThornFAT {
 			if (size_left == 0)
 				break;
 
-			block = readFAT(block);
+			block = next;
 			if (block == -2 && size_left != 0) {
 				// We still have more to read, but this block was the last one. That's not good.
 				// Log a warning and break out of the loop. This won't happen unless the code is
@@ -1582,8 +1643,7 @@ namespace Thorn::FS::ThornFAT {
 				position = block * bs;
 		}
 
-		// TODO: time syscall.
-		// file.times.accessed = NOW;
+		file.times.accessed = Util::now();
 		DBGN(READH, "Writing new access time to entry:", file.times.accessed);
 		status = writeEntry(file, file_offset);
 		SCHECK(READH, "fat_write_entry (update accessed) status");
@@ -1698,10 +1758,15 @@ namespace Thorn::FS::ThornFAT {
 	}
 
 	bool ThornFATDriver::make(uint32_t block_size) {
-		int status = partition->clear();
+		// Discarding the whole partition is much cheaper than zeroing it. Only the FAT has to read back as zeroes,
+		// and initFAT writes that explicitly.
+		int status = partition->discard(0, partition->length);
 		if (status != 0) {
-			DBGF("make", "Clearing partition failed: %s", STRERR(status));
-			return false;
+			status = partition->clear();
+			if (status != 0) {
+				DBGF("make", "Clearing partition failed: %s", STRERR(status));
+				return false;
+			}
 		}
 
 		const size_t block_count = partition->length / block_size;
@@ -1743,13 +1808,117 @@ namespace Thorn::FS::ThornFAT {
 			.startBlock = static_cast<block_t>(table_size + 1)
 		};
 
-		writeOffset = 0;
-		write(superblock);
 		initFAT(table_size, block_size);
 		initData(block_count, table_size);
+
+		// The magic number is what makes the partition valid, so the superblock has to be durable only after the
+		// FAT and root directory are.
+		status = partition->sync();
+		if (status == 0)
+			status = partition->writeFUA(&superblock, sizeof(superblock), 0);
+		if (status != 0) {
+			DBGF("make", "Writing superblock failed: %d", status);
+			return false;
+		}
+
 		return true;
 	}
 
+	void ThornFATDriver::freed(block_t block) {
+		if (!canDiscard)
+			return;
+
+		if (!freedExtents.empty()) {
+			auto &[start, count] = freedExtents.back();
+			if (start + static_cast<block_t>(count) == block) {
+				++count;
+				return;
+			}
+		}
+
+		freedExtents.emplace_back(block, 1);
+	}
+
+	void ThornFATDriver::discardFreed() {
+		if (freedExtents.empty())
+			return;
+
+		// Chains aren't necessarily in order, so sort the extents and join up any that touch. Blocks that have been
+		// allocated again since they were freed are skipped.
+		std::sort(freedExtents.begin(), freedExtents.end());
+		const size_t bs = superblock.blockSize;
+		block_t start = -1;
+		block_t end = -1;
+
+		auto discard = [&] {
+			if (start != -1 && partition->discard(start * bs, (end - start) * bs) == -EOPNOTSUPP)
+				canDiscard = false;
+			start = -1;
+			return canDiscard;
+		};
+
+		for (const auto &[first, length]: freedExtents) {
+			for (block_t block = first; block < first + static_cast<block_t>(length); ++block) {
+				if (readFAT(block) != 0) {
+					if (!discard())
+						break;
+				} else if (start == -1 || block != end) {
+					if (!discard())
+						break;
+					start = block;
+					end = block + 1;
+				} else {
+					++end;
+				}
+			}
+
+			if (!canDiscard)
+				break;
+		}
+
+		if (canDiscard)
+			discard();
+
+		freedExtents.clear();
+	}
+
+	ssize_t ThornFATDriver::trim() {
+		const size_t bs = superblock.blockSize;
+		const block_t block_count = superblock.blockCount;
+		ssize_t discarded = 0;
+		block_t start = -1;
+
+		// Blocks freed since the last sync are only free in the cached FAT so far. Everything free is discarded
+		// below, so the blocks waiting for the next sync don't need to be.
+		if (const int status = partition->sync())
+			return status;
+		freedExtents.clear();
+
+		auto discard = [&](block_t end) {
+			const int status = partition->discard(start * bs, (end - start) * bs);
+			if (status == 0)
+				discarded += (end - start) * bs;
+			start = -1;
+			return status;
+		};
+
+		for (block_t block = superblock.startBlock; block < block_count; ++block) {
+			if (readFAT(block) == 0) {
+				if (start == -1)
+					start = block;
+			} else if (start != -1) {
+				if (int status = discard(block); status != 0)
+					return status;
+			}
+		}
+
+		if (start != -1)
+			if (int status = discard(block_count); status != 0)
+				return status;
+
+		return discarded;
+	}
+
 	bool ThornFATDriver::verify() {
 		return readSuperblock(superblock)? false : (superblock.magic == MAGIC);
 	}
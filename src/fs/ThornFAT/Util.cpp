@@ -1,3 +1,4 @@
+#include "arch/x86_64/Clock.h"
 #include "fs/ThornFAT/Util.h"
 
 int debug_enable = 1;
@@ -112,6 +113,14 @@ namespace Thorn::FS::ThornFAT::Util {
 		// Return a copy of the path up to the last slash.
 		return std::string(path, last_slash);
 	}
+
+	long now() {
+#ifdef CONSTANT_TIME
+		return CONSTANT_TIME;
+#else
+		return x86_64::Clock::realtime();
+#endif
+	}
 }
 
 /**
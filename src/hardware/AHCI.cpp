@@ -1,7 +1,10 @@
 // Some code is from https://github.com/fido2020/Lemon-OS
 // Some code is from Haiku (https://github.com/haiku/haiku)
 
+#include "arch/x86_64/Clock.h"
+#include "arch/x86_64/CPU.h"
 #include "arch/x86_64/Interrupts.h"
+#include "arch/x86_64/Timer.h"
 #include "hardware/AHCI.h"
 #include "Kernel.h"
 #include "lib/printf.h"
@@ -11,7 +14,18 @@ namespace Thorn::AHCI {
 
 	const char *deviceTypes[5] = {"Null", "SATA", "SEMB", "PortMultiplier", "SATAPI"};
 
-	constexpr static int SPIN_COUNT = 1'000;
+	/** How long to wait for the HBA or a device to respond before giving up, in microseconds. */
+	constexpr static uint64_t TIMEOUT = 1'000'000;
+
+	/** How many times a queued command aborted by another command's error is reissued before it's failed too. */
+	constexpr static uint8_t MAX_RETRIES = 3;
+
+	/** The general purpose log holding the tag of the last failed NCQ command. */
+	constexpr static uint8_t NCQ_ERROR_LOG = 0x10;
+
+	constexpr static uint32_t HBA_PxIS_ERRORS = HBA_PxIS_TFES | HBA_PxIS_HBFS | HBA_PxIS_HBDS | HBA_PxIS_IFS;
+
+	static_assert(offsetof(HBACommandTable, prdtEntry) == 0x80);
 
 	Controller::Controller(PCI::Device *device_): device(device_) {
 		memset(ports, 0, sizeof(ports));
@@ -41,33 +55,36 @@ namespace Thorn::AHCI {
 		printf(", vs=%x\n", abar->vs);
 
 		abar->ghc = abar->ghc | GHC_HR;
-		while (abar->ghc & GHC_HR) {
-			Kernel::wait(1, 1000);
-		}
+		if (!x86_64::Clock::pollUntil([this] { return !(abar->ghc & GHC_HR); }, TIMEOUT))
+			printf("[AHCI::Controller::init] HBA reset timed out\n");
 
-		uint8_t irq = device->allocateVector(PCI::Vector::Any);
+		// Legacy vectors would collide with the APIC timer, so anything other than MSI means polling.
+		irq = device->allocateVector(PCI::Vector::MSI);
 		if (irq == 0xff)
-			printf("[AHCI::Controller::init] Failed to allocate vector\n");
-		printf("[AHCI::Controller::init] Assigning IRQ %d\n", irq);
+			printf("[AHCI::Controller::init] Failed to allocate vector; ports will be polled\n");
+		else
+			printf("[AHCI::Controller::init] Assigning IRQ %d\n", irq);
 
 		uint32_t pi = abar->pi;
 
-		while (!(abar->ghc & GHC_ENABLE)) {
+		const bool enabled = x86_64::Clock::pollUntil([this] {
 			abar->ghc = abar->ghc | GHC_ENABLE;
-			// TODO: how to wait without interfering with preemption?
-			Kernel::wait(1, 1000);
-		}
+			return (abar->ghc & GHC_ENABLE) != 0;
+		}, TIMEOUT);
+		if (!enabled)
+			printf("[AHCI::Controller::init] Couldn't enable AHCI mode\n");
 
 		// abar->ghc = abar->ghc | GHC_ENABLE | GHC_HR;
 		// abar->ghc = abar->ghc | GHC_ENABLE;
 		// abar->ghc = abar->ghc | GHC_IE;
 
-		abar->ghc = abar->ghc | GHC_IE | GHC_ENABLE | GHC_HR;
+		if (irq != 0xff) {
+			x86_64::IDT::setHandler(irq, &Controller::interrupt, this);
+			abar->ghc = abar->ghc | GHC_IE | GHC_ENABLE;
+		}
 
 		printf("[AHCI::Controller::init] Enabled: %y (0x%x)\n", abar->ghc & GHC_ENABLE, abar->ghc);
 
-		x86_64::IDT::add(irq, +[] { printf("SATA IRQ triggered\n"); });
-
 		abar->is = 0xffffffff;
 
 		for (int i = 0; i < 32; ++i) {
@@ -106,6 +123,66 @@ namespace Thorn::AHCI {
 		}
 	}
 
+	bool Controller::setCoalescing(uint32_t port_mask, uint8_t completions, uint16_t timeout_ms) {
+		if (!(abar->cap & CAP_CCCS) || irq == 0xff || completions == 0 || timeout_ms == 0)
+			return false;
+
+		// The control register can only be reprogrammed while coalescing is off.
+		disableCoalescing();
+		port_mask &= abar->pi;
+		abar->ccc_pts = port_mask;
+		abar->ccc_ctl = (static_cast<uint32_t>(timeout_ms) << 16) | (static_cast<uint32_t>(completions) << 8);
+		abar->ccc_ctl = abar->ccc_ctl | CCC_CTL_EN;
+		cccInterrupt = (abar->ccc_ctl >> 3) & 0x1f;
+
+		for (int i = 0; i < 32; ++i)
+			if (ports[i] && ((port_mask >> i) & 1)) {
+				ports[i]->coalesced = true;
+				ports[i]->registers->ie = ports[i]->interruptEnables();
+			}
+
+		return true;
+	}
+
+	void Controller::disableCoalescing() {
+		if (cccInterrupt == -1)
+			return;
+
+		abar->ccc_ctl = abar->ccc_ctl & ~CCC_CTL_EN;
+		abar->ccc_pts = 0;
+		cccInterrupt = -1;
+
+		for (int i = 0; i < 32; ++i)
+			if (ports[i] && ports[i]->coalesced) {
+				ports[i]->coalesced = false;
+				ports[i]->registers->ie = ports[i]->interruptEnables();
+			}
+	}
+
+	void Controller::interrupt(void *data) {
+		Controller &controller = *static_cast<Controller *>(data);
+		const uint32_t pending = controller.abar->is;
+		controller.interrupts = controller.interrupts + 1;
+
+		// A coalesced interrupt stands for completions on every coalesced port. Their own IS bits stay clear,
+		// since only errors are enabled, so they have to be checked explicitly.
+		uint32_t check = pending;
+		if (controller.cccInterrupt != -1 && ((pending >> controller.cccInterrupt) & 1))
+			check |= controller.abar->ccc_pts;
+
+		for (int i = 0; i < 32; ++i) {
+			if (!((check >> i) & 1))
+				continue;
+			if (controller.ports[i])
+				controller.ports[i]->handleInterrupt();
+			else
+				controller.abar->ports[i].is = controller.abar->ports[i].is;
+		}
+
+		// HBA IS bits can only be cleared once the port-level bits behind them are.
+		controller.abar->is = pending;
+	}
+
 	void Port::init() {
 		type = identifyDevice();
 	}
@@ -130,10 +207,9 @@ namespace Thorn::AHCI {
 	}
 
 	void Port::identify(ATA::DeviceInfo &out) {
-		registers->ie = 0xffffffff;
+		registers->ie = interruptEnables();
 		registers->is = 0;
 		registers->tfd = 0;
-		int spin = 0;
 		int slot = getCommandSlot();
 		if (slot == -1) {
 			printf("[Port::identify] Couldn't find command slot\n");
@@ -146,6 +222,7 @@ namespace Thorn::AHCI {
 		header.write = false;
 		header.clearBusy = false;
 		header.prefetchable = false;
+		header.prdtl = 1;
 		header.prdbc = 0;
 		header.pmport = 0;
 
@@ -156,7 +233,7 @@ namespace Thorn::AHCI {
 
 		table->prdtEntry[0].dba = (uintptr_t) physicalBuffers[0] & 0xffffffff;
 		table->prdtEntry[0].dbaUpper = ((uintptr_t) physicalBuffers[0] >> 32) & 0xffffffff;
-		table->prdtEntry[0].dbc = BLOCKSIZE - 1;
+		table->prdtEntry[0].dbc = ATA_BLOCKSIZE - 1;
 		table->prdtEntry[0].interrupt = true;
 
 		volatile FISRegH2D *cfis = (volatile FISRegH2D *) table->cfis;
@@ -183,41 +260,26 @@ namespace Thorn::AHCI {
 		cfis->countHigh = 0;
 		cfis->control = 0;
 
-		spin = SPIN_COUNT;
-		while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin--)
-			Kernel::wait(1, 1000);
-
-		if (0 <= spin) {
+		if (!waitIdle()) {
 			printf("[Port::identify] Port hung\n");
 			return;
 		}
 
 		registers->is = 0xffffffff;
-		registers->ie = 0xffffffff;
-
-		start();
-		registers->sact = registers->sact | (1 << slot);
-		registers->ci = registers->ci | (1 << slot);
-
-		spin = SPIN_COUNT;
-		while ((registers->ci & (1 << slot)) && spin--) {
-			if (registers->is & HBA_PxIS_TFES) {  // Task file error
-				printf("[Port::identify] Disk error 1 (serr: %x)\n", registers->serr);
-				stop();
-				return;
-			}
-			Kernel::wait(1, 1000);
-		}
-
-		stop();
-
-		spin = SPIN_COUNT;
-		while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin--)
-			Kernel::wait(1, 1000);
-
-		if (registers->is & HBA_PxIS_TFES) {
-			printf("[Port::identify] Disk error 2 (serr: %x)\n", registers->serr);
-			stop();
+		registers->ie = interruptEnables();
+		pendingStatus = 0;
+
+		if (!running())
+			start();
+		registers->ci = 1 << slot;
+
+		const bool completed = waitForCompletion(1 << slot);
+		if (interruptStatus() & HBA_PxIS_ERRORS) {
+			printf("[Port::identify] Disk error (serr: %x)\n", registers->serr);
+			recover();
+		} else if (!completed) {
+			printf("[Port::identify] Port hung\n");
+			recover();
 		} else {
 			memcpy(&out, physicalBuffers[0], sizeof(out));
 		}
@@ -261,7 +323,7 @@ namespace Thorn::AHCI {
 		fis->rfis.type = FISType::RegD2H;
 		fis->sdbfis[0] = static_cast<uint8_t>(FISType::DevBits);
 
-		for (int i = 0; i < 8; ++i) {
+		for (size_t i = 0; i < MAX_SLOTS; ++i) {
 			commandList[i].prdtl = 1;
 
 			addr = pager.allocateFreePhysicalAddress();
@@ -280,7 +342,8 @@ namespace Thorn::AHCI {
 			registers->cmd = registers->cmd & ~HBA_PxCMD_ASP;
 
 		registers->is = 0;
-		registers->ie = 1;
+		registers->ie = interruptEnables();
+		interruptDriven = parent && parent->irq != 0xff;
 		registers->fbs = registers->fbs & ~0xfffff000U;
 
 		registers->cmd = registers->cmd | HBA_PxCMD_POD;
@@ -289,11 +352,7 @@ namespace Thorn::AHCI {
 		Kernel::wait(1, 100);
 
 		{
-			int spin = SPIN_COUNT;
-			while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin--)
-				Kernel::wait(1, 1000);
-
-			if (spin <= 0) {
+			if (!waitIdle()) {
 				printf("[Port::Port] Port hung (%d)\n", __LINE__);
 				// Reset the port.
 				registers->sctl = SCTL_PORT_DET_INIT | SCTL_PORT_IPM_NOPART | SCTL_PORT_IPM_NOSLUM | SCTL_PORT_IPM_NODSLP;
@@ -303,9 +362,9 @@ namespace Thorn::AHCI {
 			registers->sctl = registers->sctl & ~HBA_PxSSTS_DET;
 			Kernel::wait(1, 100);
 
-			spin = 200;
-			while (((registers->ssts & HBA_PxSSTS_DET_PRESENT) != HBA_PxSSTS_DET_PRESENT) && spin--)
-				Kernel::wait(1, 1000);
+			x86_64::Clock::pollUntil([this] {
+				return (registers->ssts & HBA_PxSSTS_DET_PRESENT) == HBA_PxSSTS_DET_PRESENT;
+			}, 200'000);
 
 			if ((registers->tfd & 0xff) == 0xff)
 				Kernel::wait(1, 2);
@@ -313,11 +372,7 @@ namespace Thorn::AHCI {
 			registers->serr = 0;
 			registers->is = 0;
 
-			spin = SPIN_COUNT;
-			while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin--)
-				Kernel::wait(1, 1000);
-
-			if (spin <= 0)
+			if (!waitIdle())
 				printf("[Port::Port] Port hung (%d)\n", __LINE__);
 		}
 
@@ -330,7 +385,7 @@ namespace Thorn::AHCI {
 
 		pager_lock.lock();
 
-		for (unsigned i = 0; i < 8; ++i) {
+		for (size_t i = 0; i < MAX_SLOTS; ++i) {
 			uintptr_t addr = pager.allocateFreePhysicalAddress();
 			physicalBuffers[i] = (void *) addr;
 			pager.identityMap(wrapper, addr);
@@ -338,12 +393,17 @@ namespace Thorn::AHCI {
 			// Memory::KernelMapVirtualMemory4K(physBuffers[i], (uintptr_t)buffers[i], 1);
 		}
 
+		pager_lock.unlock();
+
+		// The engine stays running from here on. Stopping it is reserved for error recovery.
+		start();
 		status = Status::Active;
 	}
 
 	int Port::getCommandSlot() {
-		int slots = registers->sact | registers->ci;
-		const int command_slots = (abar->cap & 0xf00) >> 8;
+		// Tags whose commands have finished but haven't been reaped yet are still spoken for.
+		uint32_t slots = registers->sact | registers->ci | activeTags;
+		const int command_slots = slotCount();
 		for (int i = 0; i < command_slots; ++i) {
 			if ((slots & 1) == 0)
 				return i;
@@ -434,26 +494,383 @@ namespace Thorn::AHCI {
 		printf("[%s:%d] tfd: %u / %b\n", __FILE__, __LINE__, registers->tfd, registers->tfd);
 	}
 
+	bool Port::waitIdle() {
+		return x86_64::Clock::pollUntil([this] { return !(registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)); }, TIMEOUT);
+	}
+
+	uint32_t Port::interruptEnables() const {
+		return coalesced? HBA_PxIS_ERRORS : HBA_PxIE_DEFAULT;
+	}
+
+	uint32_t Port::interruptStatus() const {
+		return registers->is | pendingStatus;
+	}
+
+	template <typename P>
+	bool Port::sleepUntil(P predicate) {
+		// Sleeping on hlt only works if the interrupt can actually arrive and a timer can end the wait.
+		if (!interruptDriven || !x86_64::checkInterrupts() || !x86_64::Timer::ready())
+			return x86_64::Clock::pollUntil(predicate, TIMEOUT);
+
+		const uint64_t start = x86_64::Clock::cycles();
+		auto finish = [&](bool out) {
+			const uint64_t elapsed = x86_64::Clock::cyclesToNanos(x86_64::Clock::cycles() - start);
+			averageWait = (averageWait * 7 + elapsed) / 8;
+			return out;
+		};
+
+		// Waking up from hlt costs more than the whole wait when the device is fast, so if recent waits were short,
+		// spin first and only halt if this one turns out to be slow.
+		if (hybridPollNanos != 0 && averageWait <= hybridPollNanos) {
+			const uint64_t deadline = start + x86_64::Clock::nanosToCycles(hybridPollNanos);
+			do {
+				if (predicate()) {
+					++polledWaits;
+					return finish(true);
+				}
+				x86_64::Clock::pause();
+			} while (x86_64::Clock::cycles() < deadline);
+		}
+
+		++sleptWaits;
+		return finish(x86_64::Timer::sleepUntil(predicate, TIMEOUT, &idleCycles));
+	}
+
+	bool Port::waitForCompletion(uint32_t mask) {
+		return sleepUntil([&] {
+			return !((registers->ci | registers->sact) & mask) || (interruptStatus() & HBA_PxIS_TFES);
+		});
+	}
+
+	void Port::handleInterrupt() {
+		const uint32_t status = registers->is;
+		registers->is = status;
+		pendingStatus = pendingStatus | status;
+		// Errors are left for reap() in thread context. The status wakes up whoever is waiting.
+		if (activeTags && !recovering && !(interruptStatus() & HBA_PxIS_ERRORS))
+			reap();
+	}
+
+	int Port::slotCount() const {
+		return ((abar->cap >> 8) & 0x1f) + 1;
+	}
+
+	int Port::queueDepth() {
+		if (!(abar->cap & CAP_NCQ) || !getInfo().ncq())
+			return 0;
+		const int device_depth = (info.queueDepth & 0x1f) + 1;
+		const int slots = slotCount() - 1;
+		return device_depth < slots? device_depth : slots;
+	}
+
+	void Port::prepare(int slot, uint64_t lba, uint32_t count, bool write, bool queued, bool fua) {
+		volatile HBACommandHeader &header = commandList[slot];
+		header.cfl = sizeof(FISRegH2D) / sizeof(uint32_t);
+		header.atapi = type == DeviceType::SATAPI;
+		header.write = write;
+		header.clearBusy = false;
+		header.prefetchable = false;
+		header.prdtl = 0;
+		header.prdbc = 0;
+		header.pmport = 0;
+
+		volatile auto memset_volatile = (void (* volatile)(volatile void *, int, size_t)) memset;
+
+		volatile FISRegH2D &fis = (volatile FISRegH2D &) commandTables[slot]->cfis;
+		memset_volatile(&fis, 0, sizeof(fis));
+
+		fis.type = FISType::RegH2D;
+		fis.c = true;
+		fis.pmport = 0;
+		fis.lba0 = lba & 0xff;
+		fis.lba1 = (lba >> 8) & 0xff;
+		fis.lba2 = (lba >> 16) & 0xff;
+		fis.device = 1 << 6;
+		fis.lba3 = (lba >> 24) & 0xff;
+		fis.lba4 = (lba >> 32) & 0xff;
+		fis.lba5 = (lba >> 40) & 0xff;
+		fis.control = 8;
+
+		if (queued) {
+			// FPDMA commands move the sector count into the feature registers and the tag into count bits 7:3.
+			fis.command = write? ATA::Command::WriteFPDMAQueued : ATA::Command::ReadFPDMAQueued;
+			fis.featureLow = count & 0xff;
+			fis.featureHigh = (count >> 8) & 0xff;
+			fis.countLow = slot << 3;
+			fis.countHigh = 0;
+			// Bit 7 of the device register is the FUA bit for FPDMA commands.
+			if (write && fua)
+				fis.device = (1 << 7) | (1 << 6);
+		} else {
+			if (write)
+				fis.command = fua? ATA::Command::WriteDMAFuaExt : ATA::Command::WriteDMAExt;
+			else
+				fis.command = ATA::Command::ReadDMAExt;
+			fis.countLow = count & 0xff;
+			fis.countHigh = (count >> 8) & 0xff;
+		}
+	}
+
+	bool Port::mapBuffer(int slot, const void *buffer, size_t bytes, std::vector<Fragment> *bounced) {
+		const uintptr_t start = reinterpret_cast<uintptr_t>(buffer);
+		if ((bytes & 1) || !Kernel::instance)
+			return false;
+
+		const x86_64::PageTableWrapper &wrapper = Kernel::instance->kernelPML4;
+		volatile HBACommandTable &table = *commandTables[slot];
+		size_t entries = 0;
+		uintptr_t run_start = 0;
+		size_t run_length = 0;
+		size_t bounce_used = 0;
+
+		auto flush = [&] {
+			if (run_length == 0)
+				return true;
+			if (PRDT_ENTRIES <= entries)
+				return false;
+			volatile HBAPRDTEntry &entry = table.prdtEntry[entries++];
+			entry.dba = run_start & 0xffffffff;
+			entry.dbaUpper = run_start >> 32;
+			entry.rsv0 = 0;
+			entry.dbc = run_length - 1;
+			entry.rsv1 = 0;
+			entry.interrupt = false;
+			return true;
+		};
+
+		for (uintptr_t address = start; address < start + bytes;) {
+			uintptr_t physical = wrapper.translate(address);
+			if (physical == 0)
+				return false;
+			const size_t page_remaining = 4096 - (address & 0xfff);
+			const size_t piece = start + bytes - address < page_remaining? start + bytes - address : page_remaining;
+
+			// Every PRDT entry has to start on a word and cover whole words, so once something has been bounced an
+			// odd number of bytes, the rest has to be bounced too.
+			if ((address & 1) || (piece & 1) || (bounce_used & 1)) {
+				if (!bounced || BOUNCE_SIZE < bounce_used + piece)
+					return false;
+				bounced->push_back({reinterpret_cast<char *>(address), bounce_used, piece});
+				physical = reinterpret_cast<uintptr_t>(physicalBuffers[slot]) + bounce_used;
+				bounce_used += piece;
+			}
+
+			if (run_length != 0 && run_start + run_length == physical && run_length + piece <= PRDT_MAX_BYTES) {
+				run_length += piece;
+			} else {
+				if (!flush())
+					return false;
+				run_start = physical;
+				run_length = piece;
+			}
+
+			address += piece;
+		}
+
+		if (!flush() || entries == 0)
+			return false;
+
+		table.prdtEntry[entries - 1].interrupt = true;
+		commandList[slot].prdtl = entries;
+		return true;
+	}
+
+	int Port::issueQueued(uint64_t lba, uint32_t count, void *buffer, bool write, Completion completion, void *data) {
+		// Nothing new can go out until an error the interrupt handler left behind has been recovered from.
+		if (activeTags && (interruptStatus() & HBA_PxIS_ERRORS))
+			reap();
+
+		// This may need to identify the device, so do it before anything is queued.
+		const int depth = queueDepth();
+
+		const bool interrupts = x86_64::checkInterrupts();
+		x86_64::disableInterrupts();
+
+		int tag = getCommandSlot();
+		if (tag != -1 && depth <= tag)
+			tag = -1;
+
+		if (tag != -1) {
+			prepare(tag, lba, count, write, true);
+			if (!mapBuffer(tag, buffer? buffer : physicalBuffers[tag], count * sectorSize)) {
+				printf("[Port::issueQueued] Buffer 0x%lx can't be used for DMA\n", buffer);
+				if (interrupts)
+					x86_64::enableInterrupts();
+				return -1;
+			}
+
+			queued[tag] = {completion, data};
+			activeTags = activeTags | (1u << tag);
+
+			if (!running())
+				start();
+
+			// SACT and CI are write-one-to-set. A read-modify-write could resurrect a bit that cleared in between.
+			registers->sact = 1u << tag;
+			registers->ci = 1u << tag;
+		}
+
+		if (interrupts)
+			x86_64::enableInterrupts();
+		return tag;
+	}
+
+	void Port::reap() {
+		// An NCQ error aborts every outstanding command. Recovery reissues the ones that weren't at fault, so only
+		// the failed ones come back with an error. It polls for up to a second at a time, so interrupts stay on, and
+		// the handler keeps out of the way until the failed tags have been reaped.
+		uint32_t failed = 0;
+		if (interruptStatus() & HBA_PxIS_ERRORS) {
+			printf("[Port::reap] Disk error (serr: %x, outstanding: %x)\n", registers->serr, registers->sact);
+			recovering = true;
+			failed = recover();
+		}
+
+		const bool interrupts = x86_64::checkInterrupts();
+		x86_64::disableInterrupts();
+
+		const uint32_t finished = activeTags & ~registers->sact;
+		activeTags = activeTags & ~finished;
+		for (int tag = 0; tag < 32; ++tag) {
+			if (!((finished >> tag) & 1))
+				continue;
+			const QueuedCommand command = queued[tag];
+			queued[tag] = {};
+			if (command.completion)
+				command.completion(command.data, (failed >> tag) & 1? AccessStatus::DiskError : AccessStatus::Success);
+		}
+
+		if (finished)
+			reaped = reaped + 1;
+
+		recovering = false;
+		if (interrupts)
+			x86_64::enableInterrupts();
+	}
+
+	bool Port::waitQueued() {
+		if (!activeTags)
+			return true;
+
+		const uint64_t before = reaped;
+		const bool out = sleepUntil([&] {
+			return reaped != before || (activeTags & ~registers->sact) || (interruptStatus() & HBA_PxIS_ERRORS);
+		});
+
+		reap();
+		return out;
+	}
+
+	uint32_t Port::recover() {
+		// Stopping the command list clears PxSACT and PxCI, so note what was still in flight first.
+		const uint32_t outstanding = activeTags & (registers->sact | registers->ci);
+
+		registers->cmd = registers->cmd & ~HBA_PxCMD_ST;
+		if (!x86_64::Clock::pollUntil([this] { return !(registers->cmd & HBA_PxCMD_CR); }, TIMEOUT)) {
+			printf("[Port::recover] Command list won't stop\n");
+			resetDevice();
+		}
+
+		registers->serr = registers->serr;
+		registers->is = registers->is;
+		pendingStatus = 0;
+
+		if (registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) {
+			bool cleared = false;
+			if (abar->cap & CAP_SCLO) {
+				registers->cmd = registers->cmd | HBA_PxCMD_CLO;
+				cleared = x86_64::Clock::pollUntil([this] { return !(registers->cmd & HBA_PxCMD_CLO); }, TIMEOUT)
+					&& !(registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ));
+			}
+
+			if (!cleared && !resetDevice())
+				printf("[Port::recover] Device didn't come back after COMRESET\n");
+		}
+
+		start();
+
+		if (!outstanding)
+			return 0;
+
+		// If the device can say which command failed, the others are innocent and are reissued without counting
+		// against them. Otherwise every outstanding command gets a few more tries.
+		const int bad_tag = readNCQError();
+		uint32_t failed = 0;
+		uint32_t retry = 0;
+		for (int tag = 0; tag < 32; ++tag) {
+			if (!((outstanding >> tag) & 1))
+				continue;
+			if (tag == bad_tag || (bad_tag == -1 && MAX_RETRIES <= queued[tag].retries++))
+				failed |= 1u << tag;
+			else
+				retry |= 1u << tag;
+		}
+
+		for (int tag = 0; tag < 32; ++tag)
+			if ((retry >> tag) & 1)
+				commandList[tag].prdbc = 0;
+
+		registers->sact = retry;
+		registers->ci = retry;
+		return failed;
+	}
+
+	int Port::readNCQError() {
+		const int slot = slotCount() - 1;
+		prepare(slot, NCQ_ERROR_LOG, 1, false, false);
+		((volatile FISRegH2D &) commandTables[slot]->cfis).command = ATA::Command::ReadLogDMAExt;
+		if (!mapBuffer(slot, physicalBuffers[slot], ATA_BLOCKSIZE))
+			return -1;
+
+		registers->ci = 1u << slot;
+		const bool completed = x86_64::Clock::pollUntil([this, slot] {
+			return !(registers->ci & (1u << slot)) || (registers->is & HBA_PxIS_ERRORS);
+		}, TIMEOUT);
+
+		const bool failed = !completed || (registers->is & HBA_PxIS_ERRORS);
+		registers->is = registers->is;
+		pendingStatus = 0;
+
+		if (failed) {
+			printf("[Port::readNCQError] Couldn't read the NCQ error log\n");
+			return -1;
+		}
+
+		// Bit 7 of the first byte is set if the error wasn't from a queued command; bits 4:0 hold the tag.
+		const uint8_t first = *static_cast<const uint8_t *>(physicalBuffers[slot]);
+		return (first & 0x80)? -1 : first & 0x1f;
+	}
+
+	bool Port::resetDevice() {
+		registers->sctl = (registers->sctl & ~HBA_PxSSTS_DET) | SCTL_PORT_DET_INIT;
+		// DET has to stay at 1 for at least 1 ms for the device to see the COMRESET.
+		x86_64::Clock::udelay(1'000);
+		registers->sctl = registers->sctl & ~HBA_PxSSTS_DET;
+
+		const bool present = x86_64::Clock::pollUntil([this] {
+			return (registers->ssts & HBA_PxSSTS_DET) == HBA_PxSSTS_DET_PRESENT;
+		}, TIMEOUT);
+
+		registers->serr = registers->serr;
+		return present && waitIdle();
+	}
+
 	void Port::start() {
+		// ST can't be set again until the engine has finished stopping.
+		if (!x86_64::Clock::pollUntil([this] { return !(registers->cmd & HBA_PxCMD_CR); }, TIMEOUT))
+			printf("[Port::start] Command list still running\n");
 		registers->cmd = registers->cmd | HBA_PxCMD_FRE;
 		registers->cmd = registers->cmd | HBA_PxCMD_ST;
-		registers->is = 0; // ?
 	}
 
 	void Port::stop() {
 		registers->cmd = registers->cmd & ~HBA_PxCMD_ST;
-		registers->cmd = registers->cmd & ~HBA_PxCMD_FRE;
-		int spin = SPIN_COUNT;
-		while (spin--) {
-			if (!(registers->cmd & HBA_PxCMD_FR) && !(registers->cmd & HBA_PxCMD_CR))
-				break;
-			Kernel::wait(1, 1000);
-		}
-
-		if (spin <= 0)
+		if (!x86_64::Clock::pollUntil([this] { return !(registers->cmd & HBA_PxCMD_CR); }, TIMEOUT))
 			printf("[Port::stop] Port hung\n");
 
 		registers->cmd = registers->cmd & ~HBA_PxCMD_FRE;
+		if (!x86_64::Clock::pollUntil([this] { return !(registers->cmd & HBA_PxCMD_FR); }, TIMEOUT))
+			printf("[Port::stop] FIS receive hung\n");
 	}
 
 	void Port::setCLB(uintptr_t address) {
@@ -474,8 +891,22 @@ namespace Thorn::AHCI {
 		return static_cast<uintptr_t>(registers->fb) | (static_cast<uintptr_t>(registers->fbu) << 32);
 	}
 
-	Port::AccessStatus Port::access(uint64_t lba, uint32_t count, void *buffer, bool write) {
-		registers->ie = 0xffffffff;
+	bool Port::drainQueued() {
+		while (activeTags)
+			if (!waitQueued())
+				return false;
+		return true;
+	}
+
+	Port::AccessStatus Port::access(uint64_t lba, uint32_t count, void *buffer, bool write, bool fua) {
+		const size_t bytes = count * blockSize();
+
+		if (!drainQueued()) {
+			printf("[Port::access] Queued commands hung\n");
+			return AccessStatus::Hung;
+		}
+
+		registers->ie = interruptEnables();
 		registers->is = 0;
 
 		int slot = getCommandSlot();
@@ -484,157 +915,171 @@ namespace Thorn::AHCI {
 			return AccessStatus::BadSlot;
 		}
 
-		registers->serr = 0;
-		registers->tfd = 0;
-
-		volatile HBACommandHeader &header = commandList[slot];
-		header.cfl = sizeof(FISRegH2D) / sizeof(uint32_t);
-
-		header.atapi = type == DeviceType::SATAPI;
-		header.write = write;
-		header.clearBusy = false;
-		header.prefetchable = false;
-		header.prdbc = 0;
-		header.pmport = 0;
-
-		volatile auto memset_volatile = (void (* volatile)(volatile void *, int, size_t)) memset;
-
-		volatile HBACommandTable &table = *commandTables[slot];
-		memset_volatile(&table, 0, sizeof(table));
-
-		table.prdtEntry[0].dba = reinterpret_cast<uintptr_t>(buffer) & 0xffffffff;
-		table.prdtEntry[0].dbaUpper = (reinterpret_cast<uintptr_t>(buffer) >> 32) & 0xffffffff;
-		table.prdtEntry[0].dbc = BLOCKSIZE * count - 1;
-		table.prdtEntry[0].interrupt = true;
+		prepare(slot, lba, count, write, false, fua);
+		std::vector<Fragment> bounced;
+		if (!mapBuffer(slot, buffer, bytes, &bounced))
+			return AccessStatus::BadBuffer;
+
+		// The slot's bounce buffer is only touched by the command in the slot.
+		char *bounce_buffer = static_cast<char *>(physicalBuffers[slot]);
+		if (write)
+			for (const Fragment &fragment: bounced)
+				memcpy(bounce_buffer + fragment.offset, fragment.data, fragment.bytes);
+
+		const AccessStatus status = issue(slot);
+		if (status == AccessStatus::Success && !write)
+			for (const Fragment &fragment: bounced)
+				memcpy(fragment.data, bounce_buffer + fragment.offset, fragment.bytes);
+		return status;
+	}
 
-		volatile FISRegH2D &fis = (volatile FISRegH2D &) table.cfis;
-		memset_volatile(&fis, 0, sizeof(fis));
+	Port::AccessStatus Port::flushCache() {
+		if (!drainQueued()) {
+			printf("[Port::flushCache] Queued commands hung\n");
+			return AccessStatus::Hung;
+		}
 
-		fis.type = FISType::RegH2D;
-		fis.c = true;
-		fis.pmport = 0;
-		fis.command = write? ATA::Command::WriteDMAExt : ATA::Command::ReadDMAExt;
-		fis.lba0 = lba & 0xff;
-		fis.lba1 = (lba >> 8) & 0xff;
-		fis.lba2 = (lba >> 16) & 0xff;
-		fis.device = 1 << 6;
-		fis.lba3 = (lba >> 24) & 0xff;
-		fis.lba4 = (lba >> 32) & 0xff;
-		fis.lba5 = (lba >> 40) & 0xff;
-		fis.countLow = count & 0xff;
-		fis.countHigh = (count >> 8) & 0xff;
-		fis.control = 8;
+		const int slot = getCommandSlot();
+		if (slot == -1) {
+			printf("[Port::flushCache] Invalid slot.\n");
+			return AccessStatus::BadSlot;
+		}
 
-		int spin = SPIN_COUNT;
-		while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin--)
-			Kernel::wait(1, 1000);
+		prepare(slot, 0, 0, false, false);
+		volatile FISRegH2D &fis = (volatile FISRegH2D &) commandTables[slot]->cfis;
+		fis.command = getInfo().flushCacheExt()? ATA::Command::FlushCacheExt : ATA::Command::FlushCache;
+		return issue(slot);
+	}
 
-		if (spin <= 0) {
-			printf("[Port::access] Port is hung\n");
+	Port::AccessStatus Port::issue(int slot) {
+		if (!waitIdle()) {
+			printf("[Port::issue] Port is hung\n");
+			recover();
 			return AccessStatus::Hung;
 		}
 
-		registers->ie = 0xffffffff;
 		registers->is = 0xffffffff;
+		pendingStatus = 0;
 
-		start();
-		registers->ci = registers->ci | (1 << slot);
+		if (!running())
+			start();
+		registers->ci = 1 << slot;
 
-		spin = SPIN_COUNT;
+		const bool completed = waitForCompletion(1 << slot);
 
-		while ((registers->ci & (1 << slot)) && spin--) {
-			if (registers->is & HBA_PxIS_TFES) {
-				printf("[Port::access] Disk error (serr: %x)\n", registers->serr);
-				stop();
-				return AccessStatus::DiskError;
-			}
-			Kernel::wait(1, 1000);
+		if (interruptStatus() & HBA_PxIS_ERRORS) {
+			printf("[Port::issue] Disk error (serr: %x)\n", registers->serr);
+			recover();
+			return AccessStatus::DiskError;
 		}
 
-		if (spin <= 0) {
-			printf("[Port::access] Port is hung\n");
+		if (!completed) {
+			printf("[Port::issue] Port is hung\n");
+			recover();
 			return AccessStatus::Hung;
 		}
 
-		spin = SPIN_COUNT;
-		while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin--)
-			Kernel::wait(1, 1000);
+		return AccessStatus::Success;
+	}
 
-		stop();
+	Port::AccessStatus Port::trim(const TrimRange *ranges, size_t count) {
+		if (!getInfo().trim())
+			return AccessStatus::Unsupported;
 
-		if (spin <= 0) {
-			printf("[Port::access] Port hung\n");
+		if (!drainQueued()) {
+			printf("[Port::trim] Queued commands hung\n");
 			return AccessStatus::Hung;
 		}
 
-		if (registers->is & HBA_PxIS_TFES) {
-			printf("[Port::access] Disk error 2 (serr: %x)\n", registers->serr);
-			return AccessStatus::DiskError;
+		const int slot = getCommandSlot();
+		if (slot == -1) {
+			printf("[Port::trim] Invalid slot.\n");
+			return AccessStatus::BadSlot;
 		}
 
-		return AccessStatus::Success;
+		// Each entry is a 48-bit LBA and a 16-bit sector count, 64 to a block. The slot's buffer holds eight blocks.
+		constexpr size_t ENTRIES_PER_BLOCK = ATA_BLOCKSIZE / sizeof(uint64_t);
+		constexpr size_t BUFFER_BLOCKS = BOUNCE_SIZE / ATA_BLOCKSIZE;
+		constexpr uint64_t MAX_RANGE = 0xffff;
+		const size_t max_blocks = getInfo().dsmBlocks() < BUFFER_BLOCKS? getInfo().dsmBlocks() : BUFFER_BLOCKS;
+		uint64_t *entries = static_cast<uint64_t *>(physicalBuffers[slot]);
+		size_t used = 0;
+
+		auto send = [&] {
+			const size_t blocks = (used + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
+			// Unused entries have to have a count of zero.
+			memset(entries + used, 0, blocks * ATA_BLOCKSIZE - used * sizeof(uint64_t));
+			prepare(slot, 0, blocks, true, false);
+			volatile FISRegH2D &fis = (volatile FISRegH2D &) commandTables[slot]->cfis;
+			fis.command = ATA::Command::DataSetManagement;
+			fis.featureLow = 1; // TRIM
+			used = 0;
+			if (!mapBuffer(slot, entries, blocks * ATA_BLOCKSIZE))
+				return AccessStatus::BadBuffer;
+			return issue(slot);
+		};
+
+		for (size_t i = 0; i < count; ++i) {
+			uint64_t lba = ranges[i].lba;
+			for (uint64_t left = ranges[i].count; left != 0;) {
+				const uint64_t piece = left < MAX_RANGE? left : MAX_RANGE;
+				entries[used++] = (lba & 0xffffffffffff) | (piece << 48);
+				lba += piece;
+				left -= piece;
+				if (used == max_blocks * ENTRIES_PER_BLOCK)
+					if (AccessStatus status = send(); status != AccessStatus::Success)
+						return status;
+			}
+		}
+
+		return used == 0? AccessStatus::Success : send();
 	}
 
 	Port::AccessStatus Port::read(uint64_t lba, uint32_t count, void *buffer) {
-		uint64_t block_count = (count + BLOCKSIZE - 1) / BLOCKSIZE;
+		const size_t block_size = blockSize();
 		char *cbuffer = reinterpret_cast<char *>(buffer);
-		// TODO: synchronization
-		unsigned buffer_index = 1;
-
-		while (8 <= block_count && count) {
-			unsigned size = BLOCKSIZE * 8;
-			if (count < size)
-				size = count;
-			if (access(lba, 8, physicalBuffers[buffer_index], false) != AccessStatus::Success)
-				return AccessStatus::DiskError;
-			memcpy(cbuffer, physicalBuffers[buffer_index], size);
-			cbuffer += size;
-			lba += 8;
-			block_count -= 8;
-			count -= size;
-		}
-
-		while (2 <= block_count && count) {
-			unsigned size = BLOCKSIZE * 2;
-			if (count < size)
-				size = count;
-			if (access(lba, 2, physicalBuffers[buffer_index], false) != AccessStatus::Success)
-				return AccessStatus::DiskError;
-			memcpy(cbuffer, physicalBuffers[buffer_index], size);
-			cbuffer += size;
-			lba += 2;
-			block_count -= 2;
-			count -= size;
-		}
-
-		while (block_count && count) {
-			unsigned size = BLOCKSIZE;
-			if (count < size)
-				size = count;
-			if (access(lba, 1, physicalBuffers[buffer_index], false) != AccessStatus::Success)
-				return AccessStatus::DiskError;
-			memcpy(cbuffer, physicalBuffers[buffer_index], size);
-			cbuffer += size;
-			++lba;
-			--block_count;
-			count -= size;
+		uint32_t sectors = count / block_size;
+		AccessStatus status;
+
+		// Whole sectors go straight into the caller's buffer. If too much of it has to be bounced, smaller chunks
+		// are tried.
+		while (sectors) {
+			uint32_t chunk = sectors < maxSectors()? sectors : maxSectors();
+			status = access(lba, chunk, cbuffer, false);
+			if (status == AccessStatus::BadBuffer && bounceSectors() < chunk) {
+				chunk = bounceSectors() < 1? 1 : bounceSectors();
+				status = access(lba, chunk, cbuffer, false);
+			}
+			if (status != AccessStatus::Success)
+				return status;
+			cbuffer += chunk * block_size;
+			lba += chunk;
+			sectors -= chunk;
+		}
+
+		if (const uint32_t remainder = count % block_size) {
+			std::vector<char> sector(block_size);
+			if ((status = access(lba, 1, sector.data(), false)) != AccessStatus::Success)
+				return status;
+			memcpy(cbuffer, sector.data(), remainder);
 		}
 
 		return AccessStatus::Success;
 	}
 
 	Port::AccessStatus Port::readBytes(size_t count, size_t offset, void *buffer) {
+		const size_t block_size = blockSize();
 		size_t total_bytes_read = 0;
-		uint64_t lba = offset / BLOCKSIZE;
-		offset %= BLOCKSIZE;
-		char read_buffer[BLOCKSIZE];
+		uint64_t lba = offset / block_size;
+		offset %= block_size;
+		std::vector<char> read_buffer(block_size);
 		AccessStatus status;
 
 		while (0 < count) {
-			if ((status = read(lba, BLOCKSIZE, read_buffer)) != AccessStatus::Success)
+			if ((status = read(lba, block_size, read_buffer.data())) != AccessStatus::Success)
 				return status;
-			const size_t to_copy = BLOCKSIZE - offset < count? BLOCKSIZE - offset : count;
-			memcpy(static_cast<char *>(buffer) + total_bytes_read, read_buffer + offset, to_copy);
+			const size_t to_copy = block_size - offset < count? block_size - offset : count;
+			memcpy(static_cast<char *>(buffer) + total_bytes_read, read_buffer.data() + offset, to_copy);
 			total_bytes_read += to_copy;
 			count -= to_copy;
 			offset = 0;
@@ -644,20 +1089,32 @@ namespace Thorn::AHCI {
 		return AccessStatus::Success;
 	}
 
-	Port::AccessStatus Port::write(uint64_t lba, uint32_t count, const void *buffer) {
-		uint64_t block_count = (count + BLOCKSIZE - 1) / BLOCKSIZE;
+	Port::AccessStatus Port::write(uint64_t lba, uint32_t count, const void *buffer, bool fua) {
+		const size_t block_size = blockSize();
 		const char *cbuffer = reinterpret_cast<const char *>(buffer);
-		// TODO: synchronization
-		unsigned buffer_index = 1;
-
-		while (block_count-- && count) {
-			size_t size = count < BLOCKSIZE? count : BLOCKSIZE;
-			memcpy(physicalBuffers[buffer_index], cbuffer, size);
-			AccessStatus status;
-			if ((status = access(lba, 1, physicalBuffers[buffer_index], true)) != AccessStatus::Success)
+		uint32_t sectors = count / block_size;
+		AccessStatus status;
+
+		while (sectors) {
+			uint32_t chunk = sectors < maxSectors()? sectors : maxSectors();
+			status = access(lba, chunk, const_cast<char *>(cbuffer), true, fua);
+			if (status == AccessStatus::BadBuffer && bounceSectors() < chunk) {
+				chunk = bounceSectors() < 1? 1 : bounceSectors();
+				status = access(lba, chunk, const_cast<char *>(cbuffer), true, fua);
+			}
+			if (status != AccessStatus::Success)
+				return status;
+			cbuffer += chunk * block_size;
+			lba += chunk;
+			sectors -= chunk;
+		}
+
+		// A trailing partial sector is padded with zeroes.
+		if (const uint32_t remainder = count % block_size) {
+			std::vector<char> sector(block_size, 0);
+			memcpy(sector.data(), cbuffer, remainder);
+			if ((status = access(lba, 1, sector.data(), true, fua)) != AccessStatus::Success)
 				return status;
-			cbuffer += size;
-			++lba;
 		}
 
 		return AccessStatus::Success;
@@ -665,22 +1122,23 @@ namespace Thorn::AHCI {
 
 	Port::AccessStatus Port::writeBytes(size_t count, size_t offset, const void *buffer) {
 		// const size_t original_count = count;
-		uint64_t lba = offset / BLOCKSIZE;
-		offset %= BLOCKSIZE;
+		const size_t block_size = blockSize();
+		uint64_t lba = offset / block_size;
+		offset %= block_size;
 
-		if (count % BLOCKSIZE == 0 && offset == 0)
+		if (count % block_size == 0 && offset == 0)
 			return write(lba, count, buffer);
 
 		AccessStatus status = AccessStatus::Success;
-		char write_buffer[BLOCKSIZE] = {0};
+		std::vector<char> write_buffer(block_size, 0);
 		const char *cbuffer = static_cast<const char *>(buffer);
 
 		if (offset != 0) {
-			if ((status = read(lba, BLOCKSIZE, write_buffer)) != AccessStatus::Success)
+			if ((status = read(lba, block_size, write_buffer.data())) != AccessStatus::Success)
 				return status;
-			const size_t to_write = (BLOCKSIZE - offset) < count? BLOCKSIZE - offset : count;
-			memcpy(write_buffer + offset, cbuffer, to_write);
-			if ((status = write(lba, BLOCKSIZE, write_buffer)) != AccessStatus::Success)
+			const size_t to_write = (block_size - offset) < count? block_size - offset : count;
+			memcpy(write_buffer.data() + offset, cbuffer, to_write);
+			if ((status = write(lba, block_size, write_buffer.data())) != AccessStatus::Success)
 				return status;
 			count -= to_write;
 			++lba;
@@ -688,18 +1146,18 @@ namespace Thorn::AHCI {
 		}
 
 		while (0 < count) {
-			if (count < BLOCKSIZE) {
-				if ((status = read(lba, BLOCKSIZE, write_buffer)) != AccessStatus::Success)
+			if (count < block_size) {
+				if ((status = read(lba, block_size, write_buffer.data())) != AccessStatus::Success)
 					return status;
-				memcpy(write_buffer, cbuffer, count);
-				if ((status = write(lba, BLOCKSIZE, write_buffer)) != AccessStatus::Success)
+				memcpy(write_buffer.data(), cbuffer, count);
+				if ((status = write(lba, block_size, write_buffer.data())) != AccessStatus::Success)
 					return status;
 				break;
 			} else {
-				if ((status = write(lba, BLOCKSIZE, write_buffer)) != AccessStatus::Success)
+				if ((status = write(lba, block_size, cbuffer)) != AccessStatus::Success)
 					return status;
-				count -= BLOCKSIZE;
-				cbuffer += BLOCKSIZE;
+				count -= block_size;
+				cbuffer += block_size;
 				++lba;
 			}
 		}
@@ -716,9 +1174,30 @@ namespace Thorn::AHCI {
 			return info;
 		identify(info);
 		identified = true;
+		sectorSize = info.logicalSectorSize();
+		if (sectorSize != ATA_BLOCKSIZE || info.physicalSectorSize() != ATA_BLOCKSIZE)
+			printf("[Port::getInfo] Logical sectors: %u bytes, physical sectors: %u bytes, alignment offset: %u\n",
+				sectorSize, info.physicalSectorSize(), info.alignmentOffset());
 		return info;
 	}
 
+	size_t Port::blockSize() {
+		getInfo();
+		return sectorSize;
+	}
+
+	size_t Port::physicalBlockSize() {
+		return getInfo().physicalSectorSize();
+	}
+
+	uint32_t Port::maxSectors() {
+		return MAX_TRANSFER / blockSize();
+	}
+
+	uint32_t Port::bounceSectors() {
+		return BOUNCE_SIZE / blockSize();
+	}
+
 	void HBACommandHeader::setCTBA(void *address) {
 		ctba  = (reinterpret_cast<uintptr_t>(address)) & 0xffffffff;
 		ctbau = (reinterpret_cast<uintptr_t>(address)) >> 32;
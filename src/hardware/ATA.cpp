@@ -19,4 +19,67 @@ namespace Thorn::ATA {
 		for (i = index - 1; i != SIZE_MAX && str[i] == ' '; --i)
 			str[i] = '\0';
 	}
+
+	uint64_t DeviceInfo::sectorCount() const {
+		const uint64_t out = static_cast<uint64_t>(sectors48[0]) | (static_cast<uint64_t>(sectors48[1]) << 16)
+			| (static_cast<uint64_t>(sectors48[2]) << 32) | (static_cast<uint64_t>(sectors48[3]) << 48);
+		if (out)
+			return out;
+		return static_cast<uint64_t>(sectors28[0]) | (static_cast<uint64_t>(sectors28[1]) << 16);
+	}
+
+	bool DeviceInfo::ncq() const {
+		// Word 76 is reserved (and may read as all ones) on devices that aren't SATA.
+		return sataCapabilities != 0 && sataCapabilities != 0xffff && (sataCapabilities & (1 << 8)) != 0;
+	}
+
+	bool DeviceInfo::trim() const {
+		return dataSetManagement != 0xffff && (dataSetManagement & 1) != 0;
+	}
+
+	uint16_t DeviceInfo::dsmBlocks() const {
+		// Zero means the device didn't say, in which case one block is all that's safe.
+		return maxDSMBlocks == 0 || maxDSMBlocks == 0xffff? 1 : maxDSMBlocks;
+	}
+
+	// Words 83 and 84 are only valid if bit 14 is set and bit 15 is clear.
+	static bool validFeatureWord(uint16_t word) {
+		return (word & 0xc000) == 0x4000;
+	}
+
+	bool DeviceInfo::fua() const {
+		return validFeatureWord(features[0]) && (features[0] & (1 << 6)) != 0;
+	}
+
+	bool DeviceInfo::flushCacheExt() const {
+		return validFeatureWord(commandSets[1]) && (commandSets[1] & (1 << 13)) != 0;
+	}
+
+	bool DeviceInfo::writeCache() const {
+		// Word 85 bit 5 is set when the write cache is enabled. Without a valid word 82, assume there might be one.
+		if (commandSets[0] == 0 || commandSets[0] == 0xffff)
+			return true;
+		return (features[1] & (1 << 5)) != 0;
+	}
+
+	uint32_t DeviceInfo::logicalSectorSize() const {
+		// Bit 12 of word 106 means that words 117-118 hold the logical sector size in words.
+		if (validFeatureWord(logSectsPerPhys) && (logSectsPerPhys & (1 << 12))) {
+			const uint32_t words = wordsPerSector[0] | (static_cast<uint32_t>(wordsPerSector[1]) << 16);
+			if (256 <= words)
+				return words * 2;
+		}
+		return 512;
+	}
+
+	uint32_t DeviceInfo::physicalSectorSize() const {
+		// Bit 13 of word 106 means that bits 3:0 are the log2 of the logical sectors per physical sector.
+		if (validFeatureWord(logSectsPerPhys) && (logSectsPerPhys & (1 << 13)))
+			return logicalSectorSize() << (logSectsPerPhys & 0xf);
+		return logicalSectorSize();
+	}
+
+	uint16_t DeviceInfo::alignmentOffset() const {
+		return validFeatureWord(logToPhysAlignment)? logToPhysAlignment & 0x3fff : 0;
+	}
 }
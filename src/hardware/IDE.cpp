@@ -3,19 +3,23 @@
 #include <cerrno>
 #include <string.h>
 
+#include "arch/x86_64/Clock.h"
+#include "arch/x86_64/Timer.h"
 #include "hardware/IDE.h"
+#include "hardware/PCI.h"
 #include "hardware/Ports.h"
 #include "lib/printf.h"
 #include "Kernel.h"
 
 using Thorn::Ports::inb;
 using Thorn::Ports::outb;
+using Thorn::Ports::outl;
 
-volatile bool irqInvoked = false;
 
 namespace Thorn::IDE {
 	Device devices[4];
 	ChannelRegisters channels[2];
+	bool dmaEnabled = true;
 	uint8_t ideBuffer[2048] = {0};
 	static uint8_t ideStatus = 0;
 	static uint8_t atapiPacket[12] = {0xa8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
@@ -25,6 +29,19 @@ namespace Thorn::IDE {
 	}
 
 	int init() {
+		// Bus-master DMA needs BAR4 of the PCI IDE controller. Channels in compatibility mode ignore BARs 0-3 and sit
+		// at the legacy ports, so those BARs are only used for channels in native mode.
+		for (const PCI::BDF &bdf: PCI::getDevices(1, 1)) {
+			PCI::Device device(bdf);
+			const uint8_t progif = PCI::getProgIF(bdf.bus, bdf.device, bdf.function);
+			device.setIOSpace();
+			device.setBusMastering();
+			const bool primary_native = progif & 1, secondary_native = progif & 4;
+			return init(primary_native? device.rawBAR(0) : 0x1f0, primary_native? device.rawBAR(1) : 0x3f6,
+			            secondary_native? device.rawBAR(2) : 0x170, secondary_native? device.rawBAR(3) : 0x376,
+			            (progif & 0x80)? device.rawBAR(4) : 0);
+		}
+
 		return init(0x1f0, 0x3f6, 0x170, 0x376, 0);
 	}
 
@@ -128,8 +145,133 @@ namespace Thorn::IDE {
 		return -ideStatus;
 	}
 
-	static void __delay(size_t ms) {
-		for (size_t i = 0; i < 10 * ms; i++);
+	static bool waitNotBusy(uint8_t channel) {
+		return x86_64::Clock::pollUntil([channel] { return !(read(channel, ATA_REG_STATUS) & ATA_SR_BSY); }, TIMEOUT);
+	}
+
+	int flushCache(uint8_t drive) {
+		if (drive > 3 || devices[drive].reserved == 0 || devices[drive].type != IDE_ATA)
+			return 0;
+
+		const uint8_t channel = devices[drive].channel;
+		if (!waitNotBusy(channel))
+			return -ETIMEDOUT;
+
+		write(channel, ATA_REG_HDDEVSEL, 0xe0 | (devices[drive].drive << 4));
+		// Bit 26 of the command sets is word 83 bit 10, the 48-bit address feature set.
+		const bool ext = devices[drive].commandSets & (1 << 26);
+		write(channel, ATA_REG_COMMAND, ext? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+
+		if (polling(channel, 0) != 0)
+			return -ETIMEDOUT;
+
+		if (read(channel, ATA_REG_STATUS) & (ATA_SR_DF | ATA_SR_ERR)) {
+			printf("[IDE::flushCache] Flushing drive %u failed\n", drive);
+			return -EIO;
+		}
+
+		return 0;
+	}
+
+	/** Sets up a channel's PRD table and bounce buffer. The table has to be below 4 GiB. */
+	static bool allocateDMA(uint8_t channel) {
+		ChannelRegisters &registers = channels[channel];
+		if (registers.prdt)
+			return true;
+
+		if (!Kernel::instance) {
+			printf("[IDE::allocateDMA] Kernel instance is null!\n");
+			return false;
+		}
+
+		Lock<Mutex> pager_lock;
+		auto &pager = Kernel::instance->getPager(pager_lock);
+		const uintptr_t table = pager.allocateFreePhysicalAddress();
+		if (table == 0 || 0xffffffff < table) {
+			printf("[IDE::allocateDMA] No page below 4 GiB for channel %u's PRD table\n", channel);
+			return false;
+		}
+		pager.identityMap(Kernel::instance->kernelPML4, table, MMU_CACHE_DISABLED);
+		pager_lock.unlock();
+
+		memset((void *) table, 0, 4096);
+		registers.prdt = reinterpret_cast<volatile PRDEntry *>(table);
+		registers.prdtPhysical = table;
+		registers.dmaBuffer = new char[DMA_BUFFER_SIZE];
+		return true;
+	}
+
+	/** Describes a buffer in the channel's PRD table. Fails if the buffer isn't word-aligned or isn't entirely mapped
+	 *  below 4 GiB. */
+	static bool mapBuffer(uint8_t channel, const void *buffer, size_t bytes) {
+		const uintptr_t start = reinterpret_cast<uintptr_t>(buffer);
+		if ((start & 1) || (bytes & 1) || bytes == 0 || !Kernel::instance)
+			return false;
+
+		const x86_64::PageTableWrapper &wrapper = Kernel::instance->kernelPML4;
+		volatile PRDEntry *prdt = channels[channel].prdt;
+		size_t entries = 0;
+
+		for (uintptr_t address = start; address < start + bytes;) {
+			const uintptr_t physical = wrapper.translate(address);
+			const size_t page_remaining = 4096 - (address & 0xfff);
+			const size_t piece = start + bytes - address < page_remaining? start + bytes - address : page_remaining;
+			// A piece of one page can't cross a 64 KiB boundary, so each gets its own entry.
+			if (physical == 0 || 0xffffffff < physical + piece - 1 || PRDT_ENTRIES <= entries)
+				return false;
+			prdt[entries].address = physical;
+			prdt[entries].bytes = piece;
+			prdt[entries].flags = 0;
+			++entries;
+			address += piece;
+		}
+
+		prdt[entries - 1].flags = PRD_EOT;
+		return true;
+	}
+
+	/** Waits for the channel's DMA transfer to end, then stops the bus master and checks how the transfer went. The
+	 *  CPU halts until the channel's IRQ arrives, so it's free for the rest of the transfer. The bus master's
+	 *  interrupt bit is checked too, in case the wait had to fall back to polling. */
+	static uint8_t finishDMA(uint8_t channel) {
+		const bool done = x86_64::Timer::sleepUntil([channel] {
+			return channels[channel].irq || (read(channel, ATA_REG_BMSTATUS) & BM_SR_IRQ);
+		}, TIMEOUT);
+
+		const uint8_t bm_status = read(channel, ATA_REG_BMSTATUS);
+		write(channel, ATA_REG_BMCOMMAND, read(channel, ATA_REG_BMCOMMAND) & ~BM_CMD_START);
+		// The interrupt and error bits are cleared by writing ones to them.
+		write(channel, ATA_REG_BMSTATUS, bm_status | BM_SR_IRQ | BM_SR_ERR);
+		const uint8_t status = read(channel, ATA_REG_STATUS);
+
+		if (!done)
+			return ETIMEDOUT;
+		if ((bm_status & BM_SR_ERR) || (status & (ATA_SR_DF | ATA_SR_ERR)))
+			return EIO;
+		return 0;
+	}
+
+	/** Enables READ/WRITE MULTIPLE with up to the given number of sectors per DRQ block. Returns the block size the
+	 *  drive accepted, or 0. */
+	static uint8_t setMultiple(uint8_t channel, uint8_t drive, uint8_t sectors) {
+		// Only powers of two are valid.
+		while (sectors & (sectors - 1))
+			sectors &= sectors - 1;
+		if (sectors <= 1)
+			return 0;
+
+		write(channel, ATA_REG_HDDEVSEL, 0xa0 | (drive << 4));
+		write(channel, ATA_REG_SECCOUNT0, sectors);
+		write(channel, ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+		if (polling(channel, 0) != 0 || (read(channel, ATA_REG_STATUS) & (ATA_SR_DF | ATA_SR_ERR)))
+			return 0;
+		return sectors;
+	}
+
+	void handleIRQ(uint8_t channel) {
+		// Reading the status register deasserts the drive's interrupt. finishDMA deals with the bus master status.
+		read(channel, ATA_REG_STATUS);
+		channels[channel].irq = true;
 	}
 
 	int init(uint32_t bar0, uint32_t bar1, uint32_t bar2, uint32_t bar3, uint32_t bar4) {
@@ -142,6 +284,9 @@ namespace Thorn::IDE {
 		channels[ATA_SECONDARY].ctrl  = (bar3 & 0xfffffffc) + 0x376 * (!bar3);
 		channels[ATA_PRIMARY].bmide	  = (bar4 & 0xfffffffc) + 0; // Bus Master IDE
 		channels[ATA_SECONDARY].bmide = (bar4 & 0xfffffffc) + 8; // Bus Master IDE
+		// Bus mastering needs BAR4 to be an I/O BAR.
+		const bool bus_master = (bar4 & 1) && (bar4 & 0xfffffffc) != 0
+			&& allocateDMA(ATA_PRIMARY) && allocateDMA(ATA_SECONDARY);
 		// Disable IRQs
 		write(ATA_PRIMARY, ATA_REG_CONTROL, 2);
 		write(ATA_SECONDARY, ATA_REG_CONTROL, 2);
@@ -154,11 +299,11 @@ namespace Thorn::IDE {
 
 				// Select drive
 				write(i, ATA_REG_HDDEVSEL, 0xA0 | (j << 4));
-				__delay(1); // Wait 1ms for drive select to work
+				x86_64::Clock::udelay(1'000); // Wait 1ms for drive select to work
 
 				// Send ATA identify command
 				write(i, ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
-				__delay(1);
+				x86_64::Clock::udelay(1'000);
 
 				if (read(i, ATA_REG_STATUS) == 0)
 					continue; // If status = 0, no device.
@@ -186,7 +331,7 @@ namespace Thorn::IDE {
 						continue; // Unknown type (may not be a device)
 
 					write(i, ATA_REG_COMMAND, ATA_CMD_IDENTIFY_PACKET);
-					__delay(1);
+					x86_64::Clock::udelay(1'000);
 				}
 
 				// Read identification space of the device
@@ -217,14 +362,23 @@ namespace Thorn::IDE {
 				}
 				devices[count].model[40] = '\0';
 
+				devices[count].dma = false;
+				devices[count].multiple = 0;
+				if (type == IDE_ATA) {
+					// Word 49 bit 8 says whether the drive can do DMA at all.
+					devices[count].dma = bus_master && (devices[count].capabilities & 0x100);
+					devices[count].multiple = setMultiple(i, j, ideBuffer[ATA_IDENT_MAX_MULTIPLE]);
+				}
+
 				count++;
 			}
 
 		int printed = 0;
 		for (int i = 0; i < 4; i++)
 			if (devices[i].reserved) {
-				printf("Slot %d: found %s drive (%d MB): %s\n",
-					i, devices[i].type == 0? "ATA" : "ATAPI", devices[i].size / 2048, devices[i].model);
+				printf("Slot %d: found %s drive (%d MB, %s, %u sectors per PIO block): %s\n",
+					i, devices[i].type == 0? "ATA" : "ATAPI", devices[i].size / 2048, devices[i].dma? "DMA" : "PIO",
+					devices[i].multiple? devices[i].multiple : 1, devices[i].model);
 				++printed;
 			}
 		return printed;
@@ -245,9 +399,10 @@ namespace Thorn::IDE {
 		uint32_t words = 256; // Almost every ATA drive has a sector size of 512 bytes.
 		uint16_t cyl, i;
 		uint8_t  head, sect, err;
-
-		irqInvoked = false;
-		write(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0x02);
+		const size_t bytes = numsects * SECTOR_SIZE;
+		// With READ/WRITE MULTIPLE, the drive only waits for the host once per block of sectors.
+		const uint8_t multiple = devices[drive].multiple;
+		const uint8_t block = multiple? multiple : 1;
 
 		// Select one from LBA28, LBA48 or CHS
 		if (lba >= 0x10000000) { // Sure drive should support LBA in this case, or you are giving a wrong LBA.
@@ -284,11 +439,28 @@ namespace Thorn::IDE {
 			head	  = (lba + 1 - sect) % (16 * 63) / (63); // Head number is written to HDDEVSEL lower 4 bits
 		}
 
-		// See whether drive supports DMA
-		dma = 0; // Drive doesn't support DMA
+		// See whether drive supports DMA. The transfer goes straight to the caller's buffer if the controller can
+		// reach it and through the channel's bounce buffer otherwise.
+		dma = 0;
+		bool bounced = false;
+		if (dmaEnabled && devices[drive].dma) {
+			if (mapBuffer(channel, buffer, bytes)) {
+				dma = 1;
+			} else if (bytes <= DMA_BUFFER_SIZE && mapBuffer(channel, channels[channel].dmaBuffer, bytes)) {
+				dma = 1;
+				bounced = true;
+				if (writing)
+					memcpy(channels[channel].dmaBuffer, buffer, bytes);
+			}
+		}
+
+		// Completion is signaled by the channel's IRQ for DMA, but PIO transfers are polled.
+		channels[channel].irq = false;
+		write(channel, ATA_REG_CONTROL, channels[channel].nIEN = dma? 0x00 : 0x02);
 
 		// Wait if the drive is busy
-		while (read(channel, ATA_REG_STATUS) & ATA_SR_BSY);
+		if (!waitNotBusy(channel))
+			return ETIMEDOUT;
 
 		// Select drive from the controller
 		if (lba_mode == 0)
@@ -308,9 +480,20 @@ namespace Thorn::IDE {
 		write(channel, ATA_REG_LBA1, lba_io[1]);
 		write(channel, ATA_REG_LBA2, lba_io[2]);
 
+		if (dma) {
+			outl(channels[channel].bmide + ATA_REG_BMPRDT - 0x0e, channels[channel].prdtPhysical);
+			write(channel, ATA_REG_BMCOMMAND, writing? 0 : BM_CMD_READ);
+			write(channel, ATA_REG_BMSTATUS, read(channel, ATA_REG_BMSTATUS) | BM_SR_IRQ | BM_SR_ERR);
+		}
+
 		// Select the command and send it
 		if (!writing) {
-			if (dma == 0) {
+			if (dma == 0 && multiple) {
+				if (lba_mode == 0 || lba_mode == 1)
+					cmd = ATA_CMD_READ_MULTIPLE;
+				else if (lba_mode == 2)
+					cmd = ATA_CMD_READ_MULTIPLE_EXT;
+			} else if (dma == 0) {
 				if (lba_mode == 0 || lba_mode == 1)
 					cmd = ATA_CMD_READ_PIO;
 				else if (lba_mode == 2)
@@ -322,7 +505,12 @@ namespace Thorn::IDE {
 					cmd = ATA_CMD_READ_DMA_EXT;
 			}
 		} else {
-			if (dma == 0) {
+			if (dma == 0 && multiple) {
+				if (lba_mode == 0 || lba_mode == 1)
+					cmd = ATA_CMD_WRITE_MULTIPLE;
+				else if (lba_mode == 2)
+					cmd = ATA_CMD_WRITE_MULTIPLE_EXT;
+			} else if (dma == 0) {
 				if (lba_mode == 0 || lba_mode == 1)
 					cmd = ATA_CMD_WRITE_PIO;
 				else if (lba_mode == 2)
@@ -342,32 +530,38 @@ namespace Thorn::IDE {
 		
 		write(channel, ATA_REG_COMMAND, cmd); // Send the command
 		if (dma) {
-			return -1; // No support
+			write(channel, ATA_REG_BMCOMMAND, read(channel, ATA_REG_BMCOMMAND) | BM_CMD_START);
+			if ((err = finishDMA(channel))) {
+				if (err == ETIMEDOUT) {
+					printf("[IDE::accessATA] DMA timed out; using PIO for drive %u from now on\n", drive);
+					devices[drive].dma = false;
+				}
+				return err;
+			}
+			if (bounced && !writing)
+				memcpy(buffer, channels[channel].dmaBuffer, bytes);
 		} else if (!writing) {
 			// PIO read
-			for (i = 0; i < numsects; i++) {
+			for (i = 0; i < numsects; i += block) {
 				if ((err = polling(channel, 1)))
 					return err;
-				// uint64_t es;
-				// asm volatile("mov %%es, %0" : "=r"(es));
-				// asm volatile("mov %%ax, %%es" :: "a"(selector));
-				asm volatile("rep insw" :: "c"(words), "d"(bus), "D"(buffer)); // Receive data.
-				// asm volatile("mov %0, %%es" :: "r"(es));
-				buffer += (words * 2);
+				uint64_t count = words * (numsects - i < block? numsects - i : block);
+				char *destination = buffer;
+				asm volatile("rep insw" : "+c"(count), "+D"(destination) : "d"(bus) : "memory"); // Receive data.
+				buffer = destination;
 			}
 		} else {
 			// PIO write
-			for (i = 0; i < numsects; i++) {
+			for (i = 0; i < numsects; i += block) {
 				polling(channel, 0);
-				// uint64_t ds;
-				// asm volatile("mov %%ds, %0" : "=r"(ds));
-				// asm volatile("mov %%ax, %%ds" :: "a"(selector));
-				asm volatile("rep outsw" :: "c"(words), "d"(bus), "S"(buffer)); // Send data.
-				// asm volatile("mov %0, %%ds" :: "r"(ds));
-				buffer += (words * 2);
+				uint64_t count = words * (numsects - i < block? numsects - i : block);
+				char *source = buffer;
+				asm volatile("rep outsw" : "+c"(count), "+S"(source) : "d"(bus) : "memory"); // Send data.
+				buffer = source;
 			}
-			write(channel, ATA_REG_COMMAND, ((int[]) {ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH_EXT})[lba_mode]);
-			polling(channel, 0);
+			// Wait for the last sector to be accepted. The drive's write cache is only flushed by flushCache().
+			if ((err = polling(channel, 0)))
+				return err;
 		}
 
 		return 0;
@@ -434,7 +628,8 @@ namespace Thorn::IDE {
 		for (uint8_t i = 0; i < 4; i++)
 			read(channel, ATA_REG_ALTSTATUS);
 
-		while (read(channel, ATA_REG_STATUS) & ATA_SR_BSY);
+		if (!waitNotBusy(channel))
+			return ETIMEDOUT;
 
 		if (advanced_check) {
 			uint8_t state = read(channel, ATA_REG_STATUS); // Read status register
@@ -502,13 +697,6 @@ namespace Thorn::IDE {
 			write(channel, ATA_REG_CONTROL, channels[channel].nIEN);
 	}
 
-	void waitIRQ() {
-		printf("irqInvoked: %d\n", irqInvoked);
-		while (!irqInvoked);
-		printf(": irqInvoked: %d 0x%lx\n", irqInvoked, &irqInvoked);
-		irqInvoked = false;
-	}
-
 	uint8_t readATAPI(uint8_t drive, uint32_t lba, char *buffer) {
 		uint32_t channel  = devices[drive].channel;
 		uint32_t slavebit = devices[drive].drive;
@@ -516,8 +704,7 @@ namespace Thorn::IDE {
 		uint32_t words    = 1024; // ATAPI drives have a sector size of 2048 bytes.
 		uint8_t err;
 
-		irqInvoked = false;
-		write(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0x0);
+		write(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0x02);
 
 		atapiPacket[ 0] = ATAPI_CMD_READ;
 		atapiPacket[ 1] = 0x0;
@@ -545,14 +732,16 @@ namespace Thorn::IDE {
 
 		asm("rep outsw" :: "c"(6), "d"(bus), "S"(atapiPacket));
 
-		waitIRQ();
+		// The drive is polled rather than waited on with IRQs, which aren't routed anywhere.
 		if ((err = polling(channel, 1)))
 			return err;
 		asm("rep insw" :: "c"(words), "d"(bus), "D"(buffer));
 		buffer += words * 2;
 
-		waitIRQ();
-		while (read(channel, ATA_REG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ));
+		if (!x86_64::Clock::pollUntil([channel] {
+			return !(read(channel, ATA_REG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ));
+		}, TIMEOUT))
+			return ETIMEDOUT;
 		return 0;
 	}
 }
@@ -0,0 +1,631 @@
+#include <cerrno>
+
+#include "arch/x86_64/Clock.h"
+#include "arch/x86_64/CPU.h"
+#include "arch/x86_64/Interrupts.h"
+#include "arch/x86_64/Timer.h"
+#include "hardware/NVMe.h"
+#include "Kernel.h"
+#include "lib/printf.h"
+
+namespace Thorn::NVMe {
+	std::vector<Controller *> controllers;
+	std::vector<Namespace *> namespaces;
+
+	static inline void fence() {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+
+	static uintptr_t translate(uintptr_t address) {
+		return Kernel::instance->kernelPML4.translate(address);
+	}
+
+	/** Copies a space-padded identify string, dropping the padding. */
+	static std::string identifyString(const uint8_t *data, size_t length) {
+		std::string out(reinterpret_cast<const char *>(data), length);
+		while (!out.empty() && (out.back() == ' ' || out.back() == '\0'))
+			out.pop_back();
+		return out;
+	}
+
+	size_t init() {
+		for (Controller *controller: controllers)
+			delete controller;
+		controllers.clear();
+		namespaces.clear();
+
+		for (const PCI::BDF &bdf: PCI::getDevices(1, PCI_SUBCLASS)) {
+			// Programming interface 2 is NVMe; the others are NVMHCI and vendor-specific interfaces.
+			if (PCI::getProgIF(bdf.bus, bdf.device, bdf.function) != 2)
+				continue;
+
+			Controller *controller = new Controller(PCI::initDevice(bdf));
+			if (!controller->init()) {
+				printf("[NVMe::init] Couldn't initialize controller at %x:%x:%x\n", bdf.bus, bdf.device, bdf.function);
+				delete controller;
+				continue;
+			}
+
+			printf("[NVMe::init] %x:%x:%x: \"%s\", %lu I/O queue%s, %lu namespace%s, %s\n", bdf.bus, bdf.device,
+				bdf.function, controller->model.c_str(), controller->ioQueues.size(),
+				controller->ioQueues.size() == 1? "" : "s", controller->namespaces.size(),
+				controller->namespaces.size() == 1? "" : "s", controller->sglSupported? "SGL" : "PRP");
+			for (Namespace *ns: controller->namespaces) {
+				printf("[NVMe::init]   Namespace %u: %lu MiB, %lu-byte blocks\n", ns->id,
+					ns->blocks * ns->blockSize >> 20, ns->blockSize);
+				namespaces.push_back(ns);
+			}
+			controllers.push_back(controller);
+		}
+
+		return namespaces.size();
+	}
+
+	QueuePair::QueuePair(Controller &controller_, uint16_t id_): controller(controller_), id(id_) {}
+
+	bool QueuePair::init(uint16_t size_) {
+		if (size_ < 2 || MAX_SIZE < size_)
+			return false;
+
+		if (!Kernel::instance) {
+			printf("[NVMe::QueuePair::init] Kernel instance is null!\n");
+			return false;
+		}
+
+		size = size_;
+		{
+			Lock<Mutex> pager_lock;
+			auto &pager = Kernel::instance->getPager(pager_lock);
+			auto &wrapper = Kernel::instance->kernelPML4;
+			auto allocate = [&] {
+				const uintptr_t page = pager.allocateFreePhysicalAddress();
+				if (page != 0) {
+					pager.identityMap(wrapper, page);
+					memset(reinterpret_cast<void *>(page), 0, PAGE_SIZE);
+				}
+				return page;
+			};
+
+			submissions = reinterpret_cast<volatile SubmissionEntry *>(allocate());
+			completions = reinterpret_cast<volatile CompletionEntry *>(allocate());
+			if (!submissions || !completions) {
+				printf("[NVMe::QueuePair::init] Out of memory\n");
+				return false;
+			}
+
+			for (size_t i = 0; i < slots(); ++i)
+				if ((lists[i] = allocate()) == 0) {
+					printf("[NVMe::QueuePair::init] Out of memory\n");
+					return false;
+				}
+		}
+
+		submissionDoorbell = controller.doorbell(id, false);
+		completionDoorbell = controller.doorbell(id, true);
+		tail = rungTail = head = 0;
+		phase = 1;
+		busy = 0;
+		return true;
+	}
+
+	void QueuePair::interrupt(void *data) {
+		// Completions are reaped by whoever is waiting; the interrupt only has to wake them from hlt.
+		++static_cast<QueuePair *>(data)->stats.interrupts;
+	}
+
+	bool QueuePair::mapPRP(SubmissionEntry &entry, uintptr_t list, uintptr_t buffer, size_t bytes) {
+		if (buffer & 3)
+			return false;
+
+		entry.dptr1 = translate(buffer);
+		entry.dptr2 = 0;
+		if (entry.dptr1 == 0)
+			return false;
+
+		const size_t first = std::min(bytes, PAGE_SIZE - (buffer & (PAGE_SIZE - 1)));
+		if (first == bytes)
+			return true;
+
+		// Past the first, every entry is a whole page.
+		const uintptr_t rest = buffer + first;
+		const size_t pages = (bytes - first + PAGE_SIZE - 1) / PAGE_SIZE;
+		if (pages == 1) {
+			entry.dptr2 = translate(rest);
+			return entry.dptr2 != 0;
+		}
+
+		if (PAGE_SIZE / sizeof(uint64_t) < pages)
+			return false;
+
+		uint64_t *prps = reinterpret_cast<uint64_t *>(list);
+		for (size_t i = 0; i < pages; ++i)
+			if ((prps[i] = translate(rest + i * PAGE_SIZE)) == 0)
+				return false;
+
+		entry.dptr2 = list;
+		return true;
+	}
+
+	bool QueuePair::mapSGL(SubmissionEntry &entry, uintptr_t list, uintptr_t buffer, size_t bytes) {
+		if ((buffer & 3) || (bytes & 3))
+			return false;
+
+		SGLDescriptor *descriptors = reinterpret_cast<SGLDescriptor *>(list);
+		constexpr size_t limit = PAGE_SIZE / sizeof(SGLDescriptor);
+		size_t count = 0;
+
+		// Physically contiguous pages become one descriptor, so a buffer that happens to be contiguous needs no list.
+		for (uintptr_t address = buffer; address < buffer + bytes;) {
+			const uintptr_t physical = translate(address);
+			if (physical == 0)
+				return false;
+
+			const size_t piece = std::min(buffer + bytes - address, PAGE_SIZE - (address & (PAGE_SIZE - 1)));
+			SGLDescriptor *last = count == 0? nullptr : &descriptors[count - 1];
+			if (last && last->address + last->length == physical) {
+				last->length += piece;
+			} else {
+				if (count == limit)
+					return false;
+				descriptors[count++] = {physical, static_cast<uint32_t>(piece), {}, SGL_DATA_BLOCK};
+			}
+
+			address += piece;
+		}
+
+		entry.cdw0 |= PSDT_SGL;
+		if (count == 1) {
+			entry.dptr1 = descriptors[0].address;
+			entry.dptr2 = descriptors[0].length | (static_cast<uint64_t>(SGL_DATA_BLOCK) << 56);
+		} else {
+			entry.dptr1 = list;
+			entry.dptr2 = (count * sizeof(SGLDescriptor)) | (static_cast<uint64_t>(SGL_LAST_SEGMENT) << 56);
+		}
+
+		return true;
+	}
+
+	bool QueuePair::mapData(SubmissionEntry &entry, uintptr_t list, void *buffer, size_t bytes) {
+		// Commands without data, such as queue creation, come with their data pointer already filled in.
+		if (bytes == 0)
+			return true;
+
+		const uintptr_t address = reinterpret_cast<uintptr_t>(buffer);
+		// The admin queue only takes PRPs.
+		if (id != 0 && controller.sglSupported && controller.preferSGL)
+			return mapSGL(entry, list, address, bytes);
+		return mapPRP(entry, list, address, bytes);
+	}
+
+	bool QueuePair::issue(SubmissionEntry &entry, void *buffer, size_t bytes, Completion completion, void *data,
+	                      uint32_t *result) {
+		const bool interrupts = x86_64::checkInterrupts();
+		x86_64::disableInterrupts();
+
+		if (slots() <= outstanding()) {
+			if (interrupts)
+				x86_64::enableInterrupts();
+			return false;
+		}
+
+		const uint16_t command_id = __builtin_ctzl(~busy);
+		entry.cdw0 = (entry.cdw0 & 0xffff) | (static_cast<uint32_t>(command_id) << 16);
+
+		if (!mapData(entry, lists[command_id], buffer, bytes)) {
+			printf("[NVMe::QueuePair::issue] Buffer 0x%lx (%lu bytes) can't be mapped\n", buffer, bytes);
+			if (interrupts)
+				x86_64::enableInterrupts();
+			completion(data, -EINVAL);
+			return true;
+		}
+
+		memcpy((void *) &submissions[tail], &entry, sizeof(entry));
+		tail = (tail + 1) % size;
+		busy |= 1ul << command_id;
+		pending[command_id] = {completion, data, result};
+		++stats.commands;
+
+		if (interrupts)
+			x86_64::enableInterrupts();
+		return true;
+	}
+
+	void QueuePair::ring() {
+		if (tail == rungTail)
+			return;
+		// The entries have to be visible before the controller hears about them.
+		fence();
+		*submissionDoorbell = tail;
+		rungTail = tail;
+		++stats.doorbells;
+	}
+
+	bool QueuePair::hasCompletion() const {
+		return (completions[head].status & 1) == phase;
+	}
+
+	void QueuePair::reap() {
+		const bool interrupts = x86_64::checkInterrupts();
+		x86_64::disableInterrupts();
+
+		struct Finished {
+			Pending request;
+			int status;
+		} finished[MAX_SIZE];
+		size_t count = 0;
+
+		while (hasCompletion()) {
+			fence();
+			volatile CompletionEntry &completion = completions[head];
+			const uint16_t command_id = completion.commandID;
+			const uint16_t status = completion.status >> 1;
+			if (++head == size) {
+				head = 0;
+				phase ^= 1;
+			}
+
+			if (slots() <= command_id || !(busy & (1ul << command_id))) {
+				printf("[NVMe::QueuePair::reap] Controller completed unknown command %u\n", command_id);
+				continue;
+			}
+
+			busy &= ~(1ul << command_id);
+			if (pending[command_id].result)
+				*pending[command_id].result = completion.result;
+			// Status code type 0, code 1 is Invalid Command Opcode.
+			finished[count++] = {pending[command_id], status == 0? 0 : status == 1? -EOPNOTSUPP : -EIO};
+			pending[command_id] = {};
+		}
+
+		// One head update covers the whole batch.
+		if (count != 0)
+			*completionDoorbell = head;
+
+		if (interrupts)
+			x86_64::enableInterrupts();
+
+		// Completions can issue new commands, so they run once the queue's bookkeeping is done.
+		for (size_t i = 0; i < count; ++i)
+			if (finished[i].request.completion)
+				finished[i].request.completion(finished[i].request.data, finished[i].status);
+	}
+
+	bool QueuePair::wait() {
+		ring();
+		if (outstanding() == 0)
+			return true;
+
+		// A fast drive finishes a small read in less time than it takes to take an interrupt and wake from hlt.
+		const uint64_t spin_until = x86_64::Clock::cycles() + x86_64::Clock::nanosToCycles(controller.spinNanos);
+		do {
+			if (hasCompletion()) {
+				++stats.polledWaits;
+				reap();
+				return true;
+			}
+			x86_64::Clock::pause();
+		} while (x86_64::Clock::cycles() < spin_until);
+
+		if (irq == 0xff) {
+			x86_64::Clock::pollUntil([this] { return hasCompletion(); }, TIMEOUT);
+		} else {
+			++stats.sleptWaits;
+			x86_64::Timer::sleepUntil([this] { return hasCompletion(); }, TIMEOUT);
+		}
+
+		const bool out = hasCompletion();
+		reap();
+		return out;
+	}
+
+	int QueuePair::access(SubmissionEntry &entry, void *buffer, size_t bytes, uint32_t *result_) {
+		struct Result {
+			volatile bool done = false;
+			int status = 0;
+		} result;
+
+		const Completion on_complete = +[](void *data, int status) {
+			Result &result = *static_cast<Result *>(data);
+			result.status = status;
+			result.done = true;
+		};
+
+		while (!issue(entry, buffer, bytes, on_complete, &result, result_))
+			if (!wait())
+				return -ETIMEDOUT;
+
+		while (!result.done)
+			if (!wait())
+				return -ETIMEDOUT;
+
+		return result.status;
+	}
+
+	Namespace::Namespace(Controller &controller_, uint32_t id_): controller(controller_), id(id_) {}
+
+	QueuePair & Namespace::queue() const {
+		return controller.queueForCPU();
+	}
+
+	bool Namespace::issue(bool write, uint64_t lba, uint32_t count, void *buffer, bool fua,
+	                      QueuePair::Completion completion, void *data) {
+		SubmissionEntry entry {};
+		entry.cdw0 = write? CMD_WRITE : CMD_READ;
+		entry.nsid = id;
+		entry.cdw10 = lba & 0xffffffff;
+		entry.cdw11 = lba >> 32;
+		entry.cdw12 = ((count - 1) & 0xffff) | (fua? RW_FUA : 0);
+		return queue().issue(entry, buffer, count * blockSize, completion, data);
+	}
+
+	int Namespace::access(bool write, uint64_t lba, uint32_t count, void *buffer, bool fua) {
+		SubmissionEntry entry {};
+		entry.cdw0 = write? CMD_WRITE : CMD_READ;
+		entry.nsid = id;
+		entry.cdw10 = lba & 0xffffffff;
+		entry.cdw11 = lba >> 32;
+		entry.cdw12 = ((count - 1) & 0xffff) | (fua? RW_FUA : 0);
+		return queue().access(entry, buffer, count * blockSize);
+	}
+
+	int Namespace::flush() {
+		// Without a volatile write cache, every completed write is already durable.
+		if (!controller.volatileWriteCache)
+			return 0;
+		SubmissionEntry entry {};
+		entry.cdw0 = CMD_FLUSH;
+		entry.nsid = id;
+		return queue().access(entry, nullptr, 0);
+	}
+
+	int Namespace::discard(uint64_t lba, uint32_t count) {
+		if (!(controller.oncs & ONCS_DSM))
+			return -EOPNOTSUPP;
+
+		DSMRange range {0, count, lba};
+		SubmissionEntry entry {};
+		entry.cdw0 = CMD_DATASET_MANAGEMENT;
+		entry.nsid = id;
+		entry.cdw10 = 0; // One range
+		entry.cdw11 = DSM_DEALLOCATE;
+		return queue().access(entry, &range, sizeof(range));
+	}
+
+	size_t Namespace::maxBlocks() const {
+		// The block count field is 16 bits wide.
+		return std::min<size_t>(0x10000, controller.maxTransfer / blockSize);
+	}
+
+	Controller::Controller(PCI::Device *pci_): pci(pci_), admin(*this, 0) {}
+
+	Controller::~Controller() {
+		for (Namespace *ns: namespaces)
+			delete ns;
+		for (QueuePair *queue: ioQueues)
+			delete queue;
+	}
+
+	volatile uint32_t * Controller::doorbell(uint16_t queue, bool completion) const {
+		return reinterpret_cast<volatile uint32_t *>(registers + REG_DOORBELLS +
+			(2 * queue + (completion? 1 : 0)) * doorbellStride);
+	}
+
+	QueuePair & Controller::queueForCPU() {
+		return *ioQueues[x86_64::getCPULocal()->id % ioQueues.size()];
+	}
+
+	bool Controller::waitReady(bool ready) {
+		// CAP.TO is the worst case in 500 ms units.
+		const uint64_t timeout = std::max(1ul, (cap >> 24) & 0xff) * 500'000;
+		return x86_64::Clock::pollUntil([this, ready] {
+			const uint32_t status = reg<uint32_t>(REG_CSTS);
+			return (status & CSTS_FATAL) || ((status & CSTS_READY) != 0) == ready;
+		}, timeout) && !(reg<uint32_t>(REG_CSTS) & CSTS_FATAL);
+	}
+
+	int Controller::adminCommand(SubmissionEntry &entry, void *buffer, size_t bytes, uint32_t *result) {
+		return admin.access(entry, buffer, bytes, result);
+	}
+
+	bool Controller::init() {
+		if (!Kernel::instance) {
+			printf("[NVMe::Controller::init] Kernel instance is null!\n");
+			return false;
+		}
+
+		pci->setMemorySpace(true);
+		pci->setBusMastering(true);
+		registers = reinterpret_cast<volatile uint8_t *>(pci->getBAR(0));
+
+		{
+			Lock<Mutex> pager_lock;
+			auto &pager = Kernel::instance->getPager(pager_lock);
+			pager.identityMap(Kernel::instance->kernelPML4, uintptr_t(registers), MMU_CACHE_DISABLED);
+			cap = reg<uint64_t>(REG_CAP);
+			doorbellStride = 4 << ((cap >> 32) & 0xf);
+			const uintptr_t end = uintptr_t(registers) + REG_DOORBELLS + 2 * (MAX_IO_QUEUES + 1) * doorbellStride;
+			for (uintptr_t page = uintptr_t(registers) + REG_DOORBELLS; page < end; page += PAGE_SIZE)
+				pager.identityMap(Kernel::instance->kernelPML4, page, MMU_CACHE_DISABLED);
+		}
+
+		if (!((cap >> 37) & 1)) {
+			printf("[NVMe::Controller::init] Controller doesn't support the NVM command set\n");
+			return false;
+		}
+
+		if (((cap >> 48) & 0xf) != 0) {
+			printf("[NVMe::Controller::init] Controller doesn't support 4 KiB pages\n");
+			return false;
+		}
+
+		reg<uint32_t>(REG_CC) = reg<uint32_t>(REG_CC) & ~CC_ENABLE;
+		if (!waitReady(false)) {
+			printf("[NVMe::Controller::init] Reset timed out\n");
+			return false;
+		}
+
+		// CAP.MQES is zero-based.
+		const uint16_t queue_size = std::min<uint32_t>(QueuePair::MAX_SIZE, (cap & 0xffff) + 1);
+		if (!admin.init(queue_size))
+			return false;
+
+		reg<uint32_t>(REG_AQA) = (queue_size - 1) << 16 | (queue_size - 1);
+		reg<uint64_t>(REG_ASQ) = admin.submissionAddress();
+		reg<uint64_t>(REG_ACQ) = admin.completionAddress();
+		reg<uint32_t>(REG_CC) = CC_ENABLE | CC_IOSQES | CC_IOCQES;
+		if (!waitReady(true)) {
+			printf("[NVMe::Controller::init] Controller didn't become ready (CSTS = 0x%x)\n",
+				reg<uint32_t>(REG_CSTS));
+			return false;
+		}
+
+		return identify() && createQueues();
+	}
+
+	bool Controller::identify() {
+		std::vector<uint8_t> data(PAGE_SIZE);
+		SubmissionEntry entry {};
+		entry.cdw0 = ADMIN_IDENTIFY;
+		entry.cdw10 = IDENTIFY_CONTROLLER;
+		if (const int status = adminCommand(entry, data.data(), data.size())) {
+			printf("[NVMe::Controller::identify] Identify Controller failed: %d\n", status);
+			return false;
+		}
+
+		serial = identifyString(&data[4], 20);
+		model = identifyString(&data[24], 40);
+		// MDTS is a power of two in units of the minimum page size, with 0 meaning no limit.
+		const uint8_t mdts = data[77];
+		maxTransfer = mdts == 0? MAX_TRANSFER : std::min(MAX_TRANSFER, PAGE_SIZE << mdts);
+		oncs = data[520] | (data[521] << 8);
+		volatileWriteCache = data[525] & 1;
+		sglSupported = (data[536] & 3) != 0;
+
+		std::vector<uint32_t> ids(PAGE_SIZE / sizeof(uint32_t));
+		entry = {};
+		entry.cdw0 = ADMIN_IDENTIFY;
+		entry.cdw10 = IDENTIFY_ACTIVE_NAMESPACES;
+		if (const int status = adminCommand(entry, ids.data(), PAGE_SIZE)) {
+			printf("[NVMe::Controller::identify] Identify Active Namespaces failed: %d\n", status);
+			return false;
+		}
+
+		for (const uint32_t id: ids) {
+			if (id == 0)
+				break;
+
+			entry = {};
+			entry.cdw0 = ADMIN_IDENTIFY;
+			entry.nsid = id;
+			entry.cdw10 = IDENTIFY_NAMESPACE;
+			if (const int status = adminCommand(entry, data.data(), data.size())) {
+				printf("[NVMe::Controller::identify] Identify Namespace %u failed: %d\n", id, status);
+				continue;
+			}
+
+			uint64_t size;
+			memcpy(&size, &data[0], sizeof(size));
+			const uint8_t format = data[26] & 0xf;
+			uint32_t lba_format;
+			memcpy(&lba_format, &data[128 + 4 * format], sizeof(lba_format));
+			const uint8_t block_shift = (lba_format >> 16) & 0xff;
+
+			// Metadata interleaved with the data would need buffers this driver doesn't provide.
+			if (size == 0 || (lba_format & 0xffff) != 0 || block_shift < 9 || 16 < block_shift) {
+				printf("[NVMe::Controller::identify] Skipping unsupported namespace %u\n", id);
+				continue;
+			}
+
+			Namespace *ns = new Namespace(*this, id);
+			ns->blocks = size;
+			ns->blockSize = 1ul << block_shift;
+			namespaces.push_back(ns);
+		}
+
+		return true;
+	}
+
+	uint16_t Controller::reserveInterrupt(QueuePair &queue) {
+		// MSI-X table entry 0 would belong to the admin queue, which is polled, so I/O queue n uses entry n.
+		queue.irq = pci->allocateMSIX(queue.id);
+		if (queue.irq != 0xff)
+			return queue.id;
+
+		if (sharedIRQ == 0xff && (sharedIRQ = pci->allocateVector(PCI::Vector::MSI)) == 0xff)
+			return NO_VECTOR;
+
+		queue.irq = sharedIRQ;
+		return 0;
+	}
+
+	bool Controller::createQueues() {
+		// Each CPU gets its own queue pair so that submissions never have to be serialized between them.
+		const uint16_t wanted = std::max(1, std::min<int>(MAX_IO_QUEUES, x86_64::coreCount()));
+
+		SubmissionEntry entry {};
+		entry.cdw0 = ADMIN_SET_FEATURES;
+		entry.cdw10 = FEATURE_NUMBER_OF_QUEUES;
+		entry.cdw11 = (wanted - 1u) << 16 | (wanted - 1u);
+		uint32_t allocated = 0;
+		if (const int status = adminCommand(entry, nullptr, 0, &allocated)) {
+			printf("[NVMe::Controller::createQueues] Set Features (Number of Queues) failed: %d\n", status);
+			return false;
+		}
+
+		// The controller may grant more or fewer than asked for, with zero-based counts in each half.
+		const uint16_t count = std::min<uint32_t>({wanted, (allocated & 0xffff) + 1u, (allocated >> 16) + 1u});
+
+		const uint16_t queue_size = std::min<uint32_t>(QueuePair::MAX_SIZE, (cap & 0xffff) + 1);
+		for (uint16_t id = 1; id <= count; ++id) {
+			QueuePair *queue = new QueuePair(*this, id);
+			if (!queue->init(queue_size)) {
+				delete queue;
+				break;
+			}
+
+			const uint16_t vector = reserveInterrupt(*queue);
+
+			entry = {};
+			entry.cdw0 = ADMIN_CREATE_CQ;
+			entry.dptr1 = queue->completionAddress();
+			entry.cdw10 = (queue_size - 1u) << 16 | id;
+			// Physically contiguous, with interrupts enabled if there's a vector for them.
+			entry.cdw11 = vector == NO_VECTOR? 1 : (static_cast<uint32_t>(vector) << 16 | 2 | 1);
+			if (const int status = adminCommand(entry)) {
+				printf("[NVMe::Controller::createQueues] Couldn't create completion queue %u: %d\n", id, status);
+				delete queue;
+				break;
+			}
+
+			entry = {};
+			entry.cdw0 = ADMIN_CREATE_SQ;
+			entry.dptr1 = queue->submissionAddress();
+			entry.cdw10 = (queue_size - 1u) << 16 | id;
+			entry.cdw11 = static_cast<uint32_t>(id) << 16 | 1;
+			if (const int status = adminCommand(entry)) {
+				printf("[NVMe::Controller::createQueues] Couldn't create submission queue %u: %d\n", id, status);
+				// The controller would otherwise keep posting to the completion queue's memory once it's freed.
+				entry = {};
+				entry.cdw0 = ADMIN_DELETE_CQ;
+				entry.cdw10 = id;
+				if (const int delete_status = adminCommand(entry))
+					printf("[NVMe::Controller::createQueues] Couldn't delete completion queue %u: %d\n", id,
+						delete_status);
+				delete queue;
+				break;
+			}
+
+			ioQueues.push_back(queue);
+			// A shared MSI vector wakes waiters on any queue, so its interrupts are all counted on the first one.
+			if (queue->irq != 0xff && (queue->irq != sharedIRQ || ioQueues.size() == 1))
+				x86_64::IDT::setHandler(queue->irq, &QueuePair::interrupt, queue);
+		}
+
+		if (ioQueues.empty()) {
+			printf("[NVMe::Controller::createQueues] No I/O queues\n");
+			return false;
+		}
+
+		return true;
+	}
+}
@@ -10,6 +10,7 @@
 #include "hardware/Ports.h"
 #include "hardware/Serial.h"
 #include "hardware/UHCI.h"
+#include "Kernel.h"
 #include "lib/printf.h"
 #include "memory/Memory.h"
 #include "ThornUtil.h"
@@ -207,7 +208,7 @@ namespace Thorn::PCI {
 	uintptr_t Device::getBAR(uint8_t index) {
 		uintptr_t bar = readInt(BAR0 + index * sizeof(uint32_t));
 		if (!(bar & 1) && (bar & 4) && index < 5)
-			bar |= static_cast<uintptr_t>(readInt(BAR0 + (bar + 1) * sizeof(uint32_t))) << 32;
+			bar |= static_cast<uintptr_t>(readInt(BAR0 + (index + 1) * sizeof(uint32_t))) << 32;
 		return bar & ((bar & 1)? 0xfffffffffffffffc : 0xfffffffffffffff0);
 	}
 
@@ -251,7 +252,7 @@ namespace Thorn::PCI {
 				msiCapability.msiControl |= 1; // Enable MSIs
 
 				msiCapability.setData((interrupt & 0xff) | x86_64::APIC::ICR_MESSAGE_TYPE_FIXED);
-				// msiCapability.setAddress(x86_64::getCPULocal()->id);
+				msiCapability.setAddress(x86_64::getCPULocal()->id);
 
 				if (msiCapability.msiControl & MSI_CONTROL_64)
 					writeInt(msiPointer + sizeof(uint32_t) * 3, msiCapability.register3);
@@ -280,6 +281,65 @@ namespace Thorn::PCI {
 		return 0xff;
 	}
 
+	uint8_t Device::allocateMSIX(uint16_t entry) {
+		const uint8_t pointer = findCapability(CAP_ID_MSIX);
+		if (pointer == 0) {
+			printf("[PCI::Device::allocateMSIX] Device isn't MSI-X capable.\n");
+			return 0xff;
+		}
+
+		const uint16_t control = readWord(pointer + sizeof(uint16_t));
+		if ((control & MSIX_CONTROL_TABLE_SIZE) < entry) {
+			printf("[PCI::Device::allocateMSIX] Entry %u is past the end of the table.\n", entry);
+			return 0xff;
+		}
+
+		if (!Kernel::instance) {
+			printf("[PCI::Device::allocateMSIX] Kernel instance is null!\n");
+			return 0xff;
+		}
+
+		// The low three bits of the table offset register select the BAR the table is in.
+		const uint32_t table_offset = readInt(pointer + sizeof(uint32_t));
+		const uintptr_t address = getBAR(table_offset & 7) + (table_offset & ~7u) + entry * 4 * sizeof(uint32_t);
+		{
+			Lock<Mutex> pager_lock;
+			auto &pager = Kernel::instance->getPager(pager_lock);
+			pager.identityMap(Kernel::instance->kernelPML4, address & ~0xffful, MMU_CACHE_DISABLED);
+		}
+
+		const uint8_t interrupt = x86_64::IDT::reserveUnusedInterrupt();
+		if (interrupt == 0xff) {
+			printf("[PCI::Device::allocateMSIX] No free vector.\n");
+			return interrupt;
+		}
+
+		// The whole function stays masked while the entry is rewritten.
+		writeWord(pointer + sizeof(uint16_t), control | MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASK);
+		volatile uint32_t *table_entry = reinterpret_cast<volatile uint32_t *>(address);
+		table_entry[0] = MSI_ADDRESS_BASE | (x86_64::getCPULocal()->id << 12);
+		table_entry[1] = 0;
+		table_entry[2] = interrupt | x86_64::APIC::ICR_MESSAGE_TYPE_FIXED;
+		table_entry[3] = table_entry[3] & ~MSIX_ENTRY_MASKED;
+		writeWord(pointer + sizeof(uint16_t), (control | MSIX_CONTROL_ENABLE) & ~MSIX_CONTROL_MASK);
+		return interrupt;
+	}
+
+	uint8_t Device::findCapability(uint8_t id, uint8_t after) {
+		if (!(readStatus() & STATUS_CAPABILITIES))
+			return 0;
+
+		// Capabilities can't live in the standard header, so 0 ends the list. The count guards against loops.
+		uint8_t pointer = after == 0? readByte(CAPABILITIES_PTR) & 0xfc : readByte(after + 1) & 0xfc;
+		for (int i = 0; pointer != 0 && i < 48; ++i) {
+			if (readByte(pointer) == id)
+				return pointer;
+			pointer = readByte(pointer + 1) & 0xfc;
+		}
+
+		return 0;
+	}
+
 
 	uint8_t  Device::readByte(uint32_t offset) {
 		return ::Thorn::PCI::readByte(bdf, offset);
@@ -0,0 +1,85 @@
+#include "hardware/Ports.h"
+#include "hardware/RTC.h"
+
+namespace Thorn::RTC {
+	static uint8_t readRegister(uint8_t reg) {
+		// Bit 7 of the address port masks NMIs for as long as it stays set, so it's left clear.
+		Ports::outb(CMOS_ADDRESS, reg);
+		return Ports::inb(CMOS_DATA);
+	}
+
+	static bool updating() {
+		return readRegister(REGISTER_STATUS_A) & STATUS_A_UPDATING;
+	}
+
+	static DateTime readRaw(uint8_t &century) {
+		while (updating());
+		DateTime out;
+		out.second = readRegister(REGISTER_SECONDS);
+		out.minute = readRegister(REGISTER_MINUTES);
+		out.hour   = readRegister(REGISTER_HOURS);
+		out.day    = readRegister(REGISTER_DAY);
+		out.month  = readRegister(REGISTER_MONTH);
+		out.year   = readRegister(REGISTER_YEAR);
+		century    = readRegister(REGISTER_CENTURY);
+		return out;
+	}
+
+	static bool operator==(const DateTime &left, const DateTime &right) {
+		return left.second == right.second && left.minute == right.minute && left.hour == right.hour &&
+		       left.day == right.day && left.month == right.month && left.year == right.year;
+	}
+
+	static inline unsigned fromBCD(unsigned value) {
+		return (value & 0x0f) + (value >> 4) * 10;
+	}
+
+	DateTime read() {
+		// The RTC can update between any two register reads, so keep reading until two consecutive reads agree.
+		uint8_t century, last_century;
+		DateTime out = readRaw(century), last;
+		do {
+			last = out;
+			last_century = century;
+			out = readRaw(century);
+		} while (!(out == last) || century != last_century);
+
+		const uint8_t status_b = readRegister(REGISTER_STATUS_B);
+		const bool pm = out.hour & HOURS_PM;
+		out.hour &= ~HOURS_PM;
+
+		if (!(status_b & STATUS_B_BINARY)) {
+			out.second = fromBCD(out.second);
+			out.minute = fromBCD(out.minute);
+			out.hour   = fromBCD(out.hour);
+			out.day    = fromBCD(out.day);
+			out.month  = fromBCD(out.month);
+			out.year   = fromBCD(out.year);
+			century    = fromBCD(century);
+		}
+
+		if (!(status_b & STATUS_B_24HOUR)) {
+			if (out.hour == 12)
+				out.hour = 0;
+			if (pm)
+				out.hour += 12;
+		}
+
+		// Not every machine has a century register. Assume the 21st century if it's missing or nonsensical.
+		if (century < 19 || 99 < century)
+			century = 20;
+		out.year += century * 100;
+		return out;
+	}
+
+	int64_t toUnix(const DateTime &date) {
+		// Howard Hinnant's days_from_civil algorithm.
+		const int64_t year = static_cast<int64_t>(date.year) - (date.month <= 2);
+		const int64_t era = (0 <= year? year : year - 399) / 400;
+		const unsigned year_of_era = static_cast<unsigned>(year - era * 400);
+		const unsigned day_of_year = (153 * (2 < date.month? date.month - 3 : date.month + 9) + 2) / 5 + date.day - 1;
+		const unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+		const int64_t days = era * 146097 + static_cast<int64_t>(day_of_era) - 719468;
+		return days * 86400 + date.hour * 3600 + date.minute * 60 + date.second;
+	}
+}
@@ -1,3 +1,4 @@
+#include "arch/x86_64/Clock.h"
 #include "hardware/UHCI.h"
 #include "hardware/Ports.h"
 #include "Kernel.h"
@@ -67,7 +68,7 @@ namespace Thorn::UHCI {
 
 		for (int i = 0; i < 5; ++i) {
 			outw(address + COMMAND, 0x0004);
-			Kernel::wait(11, 1000);
+			x86_64::Clock::udelay(11'000);
 			outw(address + COMMAND, 0x0004);
 		}
 
@@ -87,11 +88,10 @@ namespace Thorn::UHCI {
 			printf("SOF (0x%x) isn't 0x40!\n", sof);
 		}
 
+		// The host controller clears HCRESET once it's done resetting.
 		outw(address + COMMAND, 2);
-		Kernel::wait(42, 1000);
-		command = inw(address + COMMAND);
-		if (command & 2) {
-			printf("Command (0x%x) & 2 is true!\n", command);
+		if (!x86_64::Clock::pollUntil([this] { return !(inw(address + COMMAND) & 2); }, 42'000)) {
+			printf("Command (0x%x) & 2 is true!\n", inw(address + COMMAND));
 		}
 
 		printf("Finished resetting UHCI controller.\n");
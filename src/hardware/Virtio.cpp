@@ -0,0 +1,286 @@
+#include "arch/x86_64/Clock.h"
+#include "hardware/Virtio.h"
+#include "Kernel.h"
+#include "lib/printf.h"
+
+namespace Thorn::Virtio {
+	/** Virtio structures are in normal cacheable memory, so ordering against the device only needs a fence. */
+	static inline void fence() {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+
+	/** Returns true if moving an index from `old_index` to `new_index` passed `event`. See vring_need_event. */
+	static inline bool needEvent(uint16_t event, uint16_t new_index, uint16_t old_index) {
+		return static_cast<uint16_t>(new_index - event - 1) < static_cast<uint16_t>(new_index - old_index);
+	}
+
+	bool Queue::init(uint16_t index_, uint16_t size_, bool event_index, volatile uint16_t *notify_address) {
+		if (size_ == 0 || MAX_SIZE < size_)
+			return false;
+
+		if (!Kernel::instance) {
+			printf("[Virtio::Queue::init] Kernel instance is null!\n");
+			return false;
+		}
+
+		if (descriptors == nullptr) {
+			Lock<Mutex> pager_lock;
+			auto &pager = Kernel::instance->getPager(pager_lock);
+			auto &wrapper = Kernel::instance->kernelPML4;
+			uintptr_t pages[3];
+			for (uintptr_t &page: pages) {
+				page = pager.allocateFreePhysicalAddress();
+				if (page == 0) {
+					printf("[Virtio::Queue::init] Out of memory\n");
+					return false;
+				}
+				pager.identityMap(wrapper, page);
+			}
+
+			descriptors = reinterpret_cast<volatile Descriptor *>(pages[0]);
+			available = reinterpret_cast<volatile uint16_t *>(pages[1]);
+			used = reinterpret_cast<volatile uint16_t *>(pages[2]);
+		}
+
+		memset((void *) descriptors, 0, 4096);
+		memset((void *) available, 0, 4096);
+		memset((void *) used, 0, 4096);
+
+		index = index_;
+		size = size_;
+		eventIndex = event_index;
+		notifyAddress = notify_address;
+		lastUsed = 0;
+		lastKicked = 0;
+
+		for (uint16_t i = 0; i < size; ++i)
+			descriptors[i].next = i + 1;
+		freeHead = 0;
+		freeCount = size;
+
+		// Interrupts are only wanted while someone is waiting for one.
+		disableInterrupts();
+		return true;
+	}
+
+	int Queue::allocate(uint16_t count) {
+		if (count == 0 || freeCount < count)
+			return -1;
+
+		const uint16_t head = freeHead;
+		uint16_t tail = head;
+		for (uint16_t i = 1; i < count; ++i)
+			tail = descriptors[tail].next;
+		freeHead = descriptors[tail].next;
+		freeCount -= count;
+		return head;
+	}
+
+	void Queue::free(uint16_t head) {
+		uint16_t tail = head;
+		uint16_t count = 1;
+		while (descriptors[tail].flags & DESC_F_NEXT) {
+			tail = descriptors[tail].next;
+			++count;
+		}
+
+		descriptors[tail].next = freeHead;
+		freeHead = head;
+		freeCount += count;
+	}
+
+	void Queue::submit(uint16_t head) {
+		const uint16_t slot = availableIndex() % size;
+		available[2 + slot] = head;
+		// The device mustn't see the new index before the entry it covers.
+		fence();
+		availableIndex() = availableIndex() + 1;
+	}
+
+	void Queue::kick() {
+		const uint16_t new_index = availableIndex();
+		if (new_index == lastKicked)
+			return;
+
+		// The index has to be visible before the device's suppression state is read, or a notification could be
+		// skipped just as the device stops polling.
+		fence();
+		const bool notify = eventIndex? needEvent(availableEvent(), new_index, lastKicked) :
+			!(used[0] & USED_F_NO_NOTIFY);
+		lastKicked = new_index;
+
+		if (notify) {
+			*notifyAddress = index;
+			++notifications;
+		}
+	}
+
+	bool Queue::hasUsed() const {
+		return usedIndex() != lastUsed;
+	}
+
+	bool Queue::nextUsed(UsedElement &element) {
+		if (!hasUsed())
+			return false;
+
+		// The element mustn't be read before the index that says it's there.
+		fence();
+		volatile UsedElement &used_element = usedElement(lastUsed % size);
+		element.id = used_element.id;
+		element.length = used_element.length;
+		++lastUsed;
+		return true;
+	}
+
+	bool Queue::enableInterrupts() {
+		if (eventIndex)
+			usedEvent() = lastUsed;
+		else
+			available[0] = available[0] & ~AVAIL_F_NO_INTERRUPT;
+		// Check again now that the device can see the request, in case it finished something in between.
+		fence();
+		return !hasUsed();
+	}
+
+	void Queue::disableInterrupts() {
+		if (eventIndex) {
+			// With EVENT_IDX the flag is ignored. An event index just behind the used index only triggers after the
+			// index wraps all the way around, and it's always moved forward again long before that.
+			usedEvent() = lastUsed - 1;
+		} else {
+			available[0] = available[0] | AVAIL_F_NO_INTERRUPT;
+		}
+	}
+
+	Device::Device(PCI::Device *pci_): pci(pci_) {}
+
+	uintptr_t Device::mapCapability(uint8_t pointer, size_t &length) {
+		const uint8_t bar = pci->readByte(pointer + 4);
+		if (5 < bar || (pci->rawBAR(bar) & 1))
+			return 0;
+
+		const uintptr_t address = pci->getBAR(bar) + pci->readInt(pointer + 8);
+		length = pci->readInt(pointer + 12);
+
+		Lock<Mutex> pager_lock;
+		auto &pager = Kernel::instance->getPager(pager_lock);
+		for (uintptr_t page = address & ~0xffful; page < address + length; page += 4096)
+			pager.identityMap(Kernel::instance->kernelPML4, page, MMU_CACHE_DISABLED);
+
+		return address;
+	}
+
+	bool Device::init(uint64_t wanted) {
+		if (!Kernel::instance) {
+			printf("[Virtio::Device::init] Kernel instance is null!\n");
+			return false;
+		}
+
+		pci->setMemorySpace(true);
+		pci->setBusMastering(true);
+
+		// A device type can expose several capabilities of each kind; the first one the driver understands wins.
+		for (uint8_t pointer = pci->findCapability(PCI::CAP_ID_VENDSPEC); pointer != 0;
+		     pointer = pci->findCapability(PCI::CAP_ID_VENDSPEC, pointer)) {
+			const uint8_t type = pci->readByte(pointer + 3);
+			size_t length = 0;
+			if (type == PCI_CAP_COMMON_CFG && !common) {
+				common = reinterpret_cast<volatile CommonConfig *>(mapCapability(pointer, length));
+			} else if (type == PCI_CAP_NOTIFY_CFG && notifyBase == 0) {
+				notifyBase = mapCapability(pointer, length);
+				notifyMultiplier = pci->readInt(pointer + 16);
+			} else if (type == PCI_CAP_ISR_CFG && !isr) {
+				isr = reinterpret_cast<volatile uint8_t *>(mapCapability(pointer, length));
+			} else if (type == PCI_CAP_DEVICE_CFG && !deviceConfig) {
+				deviceConfig = reinterpret_cast<volatile uint8_t *>(mapCapability(pointer, length));
+			}
+		}
+
+		if (!common || notifyBase == 0 || !deviceConfig) {
+			printf("[Virtio::Device::init] Device doesn't support the modern PCI transport\n");
+			return false;
+		}
+
+		common->deviceStatus = 0;
+		if (!x86_64::Clock::pollUntil([this] { return common->deviceStatus == 0; }, TIMEOUT)) {
+			printf("[Virtio::Device::init] Reset timed out\n");
+			return false;
+		}
+
+		common->deviceStatus = STATUS_ACKNOWLEDGE;
+		common->deviceStatus = common->deviceStatus | STATUS_DRIVER;
+
+		uint64_t offered = 0;
+		for (uint32_t select = 0; select < 2; ++select) {
+			common->deviceFeatureSelect = select;
+			offered |= static_cast<uint64_t>(common->deviceFeature) << (32 * select);
+		}
+
+		if (!(offered & F_VERSION_1)) {
+			printf("[Virtio::Device::init] Device isn't virtio 1.0 compliant\n");
+			fail();
+			return false;
+		}
+
+		features = offered & (wanted | F_VERSION_1);
+		for (uint32_t select = 0; select < 2; ++select) {
+			common->driverFeatureSelect = select;
+			common->driverFeature = features >> (32 * select);
+		}
+
+		common->deviceStatus = common->deviceStatus | STATUS_FEATURES_OK;
+		if (!(common->deviceStatus & STATUS_FEATURES_OK)) {
+			printf("[Virtio::Device::init] Device rejected features 0x%lx\n", features);
+			fail();
+			return false;
+		}
+
+		return true;
+	}
+
+	bool Device::setupQueue(Queue &queue, uint16_t index, uint16_t size, uint16_t msix_entry) {
+		if (common->numQueues <= index) {
+			printf("[Virtio::Device::setupQueue] Device has no queue %u\n", index);
+			return false;
+		}
+
+		common->queueSelect = index;
+		const uint16_t max_size = common->queueSize;
+		if (max_size == 0) {
+			printf("[Virtio::Device::setupQueue] Queue %u isn't available\n", index);
+			return false;
+		}
+
+		if (max_size < size)
+			size = max_size;
+
+		auto notify_address = reinterpret_cast<volatile uint16_t *>(notifyBase + common->queueNotifyOff *
+			notifyMultiplier);
+		if (!queue.init(index, size, hasFeature(F_EVENT_IDX), notify_address))
+			return false;
+
+		common->queueSize = queue.size;
+		common->queueDesc = queue.descriptorAddress();
+		common->queueDriver = queue.availableAddress();
+		common->queueDevice = queue.usedAddress();
+
+		if (msix_entry != NO_VECTOR) {
+			common->queueMSIXVector = msix_entry;
+			// The device reads back NO_VECTOR if it couldn't use the entry.
+			if (common->queueMSIXVector != msix_entry)
+				printf("[Virtio::Device::setupQueue] Device refused MSI-X entry %u for queue %u\n", msix_entry, index);
+		}
+
+		common->queueEnable = 1;
+		return true;
+	}
+
+	void Device::ready() {
+		common->deviceStatus = common->deviceStatus | STATUS_DRIVER_OK;
+	}
+
+	void Device::fail() {
+		if (common)
+			common->deviceStatus = common->deviceStatus | STATUS_FAILED;
+	}
+}
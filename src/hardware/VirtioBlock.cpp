@@ -0,0 +1,364 @@
+#include <algorithm>
+#include <cerrno>
+
+#include "arch/x86_64/Clock.h"
+#include "arch/x86_64/CPU.h"
+#include "arch/x86_64/Interrupts.h"
+#include "arch/x86_64/Timer.h"
+#include "hardware/VirtioBlock.h"
+#include "Kernel.h"
+#include "lib/printf.h"
+
+namespace Thorn::Virtio {
+	std::vector<Block *> blocks;
+
+	constexpr static uint8_t STATUS_OK = 0;
+	constexpr static uint8_t STATUS_UNSUPPORTED = 2;
+	/** Written to the status byte before a request goes out, so a request the device never touched isn't a success. */
+	constexpr static uint8_t STATUS_PENDING = 0xff;
+
+	/** GET_ID returns a serial number of up to this many bytes, not necessarily terminated. */
+	constexpr static size_t ID_BYTES = 20;
+
+	size_t initBlocks() {
+		for (Block *block: blocks)
+			delete block;
+		blocks.clear();
+
+		for (uint32_t bus = 0; bus < 256; ++bus)
+			for (uint32_t device = 0; device < 32; ++device)
+				for (uint32_t function = 0; function < 8; ++function) {
+					if (PCI::getVendorID(bus, device, function) != VENDOR_ID)
+						continue;
+
+					const uint16_t device_id = PCI::getDeviceID(bus, device, function);
+					if (device_id != BLOCK_DEVICE_ID && device_id != BLOCK_DEVICE_ID_TRANSITIONAL)
+						continue;
+
+					Block *block = new Block(PCI::initDevice({bus, device, function}));
+					if (!block->init()) {
+						printf("[Virtio::initBlocks] Couldn't initialize block device at %x:%x:%x\n", bus, device,
+							function);
+						delete block;
+						continue;
+					}
+
+					printf("[Virtio::initBlocks] %x:%x:%x: %lu MiB, %lu-byte blocks, %lu segments, IRQ %d\n", bus,
+						device, function, block->capacity * BLK_SECTOR_SIZE >> 20, block->blockSize,
+						block->maxSegments, block->irq == 0xff? -1 : block->irq);
+					blocks.push_back(block);
+				}
+
+		return blocks.size();
+	}
+
+	Block::Block(PCI::Device *pci_): Device(pci_) {}
+
+	bool Block::init() {
+		const uint64_t wanted = F_INDIRECT_DESC | F_EVENT_IDX | BLK_F_SIZE_MAX | BLK_F_SEG_MAX | BLK_F_RO |
+			BLK_F_BLK_SIZE | BLK_F_FLUSH | BLK_F_TOPOLOGY | BLK_F_DISCARD;
+		if (!Device::init(wanted))
+			return false;
+
+		volatile BlockConfig &config = *reinterpret_cast<volatile BlockConfig *>(deviceConfig);
+		capacity = config.capacity;
+		if (hasFeature(BLK_F_BLK_SIZE))
+			blockSize = config.blkSize;
+		physicalBlockSize = blockSize;
+		if (hasFeature(BLK_F_TOPOLOGY) && config.alignmentOffset == 0)
+			physicalBlockSize = blockSize << config.physicalBlockExp;
+		if (hasFeature(BLK_F_SIZE_MAX) && config.sizeMax != 0)
+			maxSegmentSize = config.sizeMax;
+		if (hasFeature(BLK_F_DISCARD)) {
+			if (config.maxDiscardSectors != 0)
+				maxDiscardSectors = config.maxDiscardSectors;
+			if (config.discardSectorAlignment != 0)
+				discardAlignment = config.discardSectorAlignment;
+		}
+
+		// Legacy interrupts would collide with the APIC timer, so without MSI-X the queue is polled.
+		irq = pci->allocateMSIX(0);
+		const uint16_t msix_entry = irq == 0xff? NO_VECTOR : 0;
+		if (!setupQueue(queue, 0, QUEUE_SIZE, msix_entry)) {
+			fail();
+			return false;
+		}
+
+		maxSegments = INDIRECT_DESCRIPTORS - 2;
+		if (!hasFeature(F_INDIRECT_DESC) && queue.size - 2u < maxSegments)
+			maxSegments = queue.size - 2;
+		if (hasFeature(BLK_F_SEG_MAX) && config.segMax != 0 && config.segMax < maxSegments)
+			maxSegments = config.segMax;
+
+		{
+			Lock<Mutex> pager_lock;
+			auto &pager = Kernel::instance->getPager(pager_lock);
+			for (volatile Slot *&slot: slots) {
+				const uintptr_t page = pager.allocateFreePhysicalAddress();
+				if (page == 0) {
+					printf("[Virtio::Block::init] Out of memory\n");
+					fail();
+					return false;
+				}
+				pager.identityMap(Kernel::instance->kernelPML4, page);
+				slot = reinterpret_cast<volatile Slot *>(page);
+			}
+		}
+
+		if (irq != 0xff)
+			x86_64::IDT::setHandler(irq, &Block::interrupt, this);
+
+		ready();
+
+		char id[ID_BYTES + 1] {};
+		if (access(Type::GetID, 0, id, ID_BYTES) == 0)
+			serial = id;
+		return true;
+	}
+
+	void Block::interrupt(void *data) {
+		Block &block = *static_cast<Block *>(data);
+		++block.stats.interrupts;
+		// The waiter that asked for the interrupt does the reaping once it wakes up.
+		block.queue.disableInterrupts();
+	}
+
+	bool Block::deviceWrites(Type type) {
+		return type == Type::In || type == Type::GetID;
+	}
+
+	size_t Block::mapSegments(volatile Descriptor *descriptors, size_t limit, const void *buffer, size_t bytes,
+	                          bool device_writes) {
+		if (!Kernel::instance)
+			return 0;
+
+		const x86_64::PageTableWrapper &wrapper = Kernel::instance->kernelPML4;
+		const uintptr_t start = reinterpret_cast<uintptr_t>(buffer);
+		const uint16_t flags = device_writes? DESC_F_WRITE : 0;
+		size_t count = 0;
+
+		for (uintptr_t address = start; address < start + bytes;) {
+			const uintptr_t physical = wrapper.translate(address);
+			if (physical == 0)
+				return 0;
+
+			size_t piece = std::min(start + bytes - address, 4096 - (address & 0xfff));
+			piece = std::min(piece, maxSegmentSize);
+
+			volatile Descriptor *last = count == 0? nullptr : &descriptors[count - 1];
+			if (last && last->address + last->length == physical && last->length + piece <= maxSegmentSize) {
+				last->length = last->length + piece;
+			} else {
+				if (count == limit)
+					return 0;
+				descriptors[count].address = physical;
+				descriptors[count].length = piece;
+				descriptors[count].flags = flags;
+				++count;
+			}
+
+			address += piece;
+		}
+
+		return count;
+	}
+
+	size_t Block::maxTransfer() const {
+		// An unaligned buffer can start and end partway through a page.
+		return (maxSegments - 1) * std::min<size_t>(4096, maxSegmentSize);
+	}
+
+	bool Block::issue(Type type, uint64_t sector, void *buffer, size_t bytes, Completion completion, void *data) {
+		const bool interrupts = x86_64::checkInterrupts();
+		x86_64::disableInterrupts();
+
+		auto restore = [interrupts](bool out) {
+			if (interrupts)
+				x86_64::enableInterrupts();
+			return out;
+		};
+
+		if (busySlots == ~0ul >> (64 - MAX_REQUESTS))
+			return restore(false);
+
+		const int index = __builtin_ctzl(~busySlots);
+		volatile Slot &slot = *slots[index];
+		volatile Descriptor *table = slot.table;
+
+		slot.header.type = static_cast<uint32_t>(type);
+		slot.header.reserved = 0;
+		slot.header.sector = sector;
+		slot.status = STATUS_PENDING;
+
+		size_t count = 0;
+		table[count].address = reinterpret_cast<uintptr_t>(&slot.header);
+		table[count].length = sizeof(RequestHeader);
+		table[count++].flags = 0;
+
+		if (type == Type::Discard) {
+			slot.discard.sector = sector;
+			slot.discard.sectors = bytes / BLK_SECTOR_SIZE;
+			slot.discard.flags = 0;
+			table[count].address = reinterpret_cast<uintptr_t>(&slot.discard);
+			table[count].length = sizeof(DiscardSegment);
+			table[count++].flags = 0;
+		} else if (bytes != 0) {
+			const size_t segments = mapSegments(table + count, maxSegments, buffer, bytes, deviceWrites(type));
+			if (segments == 0) {
+				printf("[Virtio::Block::issue] Buffer 0x%lx (%lu bytes) can't be mapped\n", buffer, bytes);
+				if (interrupts)
+					x86_64::enableInterrupts();
+				completion(data, -EINVAL);
+				return true;
+			}
+			count += segments;
+		}
+
+		table[count].address = reinterpret_cast<uintptr_t>(&slot.status);
+		table[count].length = 1;
+		table[count++].flags = DESC_F_WRITE;
+
+		// With indirect descriptors, a request takes up a single entry in the queue however many segments it has.
+		const bool indirect = hasFeature(F_INDIRECT_DESC) && 1 < count;
+		const int head = queue.allocate(indirect? 1 : count);
+		if (head == -1)
+			return restore(false);
+
+		if (indirect) {
+			for (size_t i = 0; i + 1 < count; ++i) {
+				table[i].flags = table[i].flags | DESC_F_NEXT;
+				table[i].next = i + 1;
+			}
+			queue.descriptors[head].address = reinterpret_cast<uintptr_t>(table);
+			queue.descriptors[head].length = count * sizeof(Descriptor);
+			queue.descriptors[head].flags = DESC_F_INDIRECT;
+		} else {
+			uint16_t descriptor = head;
+			for (size_t i = 0; i < count; ++i) {
+				volatile Descriptor &entry = queue.descriptors[descriptor];
+				entry.address = table[i].address;
+				entry.length = table[i].length;
+				entry.flags = table[i].flags | (i + 1 < count? DESC_F_NEXT : 0);
+				descriptor = entry.next;
+			}
+		}
+
+		busySlots |= 1ul << index;
+		pending[index] = {completion, data, head};
+		slotForHead[head] = index;
+		++stats.requests;
+
+		queue.submit(head);
+		queue.kick();
+		return restore(true);
+	}
+
+	void Block::reap() {
+		const bool interrupts = x86_64::checkInterrupts();
+		x86_64::disableInterrupts();
+
+		// Completions can issue new requests, so they run after the bookkeeping for each one is done.
+		UsedElement element;
+		while (queue.nextUsed(element)) {
+			if (QUEUE_SIZE <= element.id) {
+				printf("[Virtio::Block::reap] Device returned invalid descriptor %u\n", element.id);
+				continue;
+			}
+
+			const uint8_t index = slotForHead[element.id];
+			const Pending request = pending[index];
+			const uint8_t status = slots[index]->status;
+			queue.free(element.id);
+			pending[index] = {};
+			busySlots &= ~(1ul << index);
+
+			if (request.completion)
+				request.completion(request.data, status == STATUS_OK? 0 :
+					status == STATUS_UNSUPPORTED? -EOPNOTSUPP : -EIO);
+		}
+
+		if (interrupts)
+			x86_64::enableInterrupts();
+	}
+
+	bool Block::wait() {
+		if (outstanding() == 0)
+			return true;
+
+		// Under a hypervisor, requests often finish within a few microseconds, which is less than it costs to take an
+		// interrupt and wake from hlt. Interrupts stay suppressed while spinning.
+		const uint64_t start = x86_64::Clock::cycles();
+		const uint64_t spin_until = start + x86_64::Clock::nanosToCycles(spinNanos);
+		do {
+			if (queue.hasUsed()) {
+				++stats.polledWaits;
+				reap();
+				return true;
+			}
+			x86_64::Clock::pause();
+		} while (x86_64::Clock::cycles() < spin_until);
+
+		if (irq == 0xff) {
+			const bool out = x86_64::Clock::pollUntil([this] { return queue.hasUsed(); }, TIMEOUT);
+			reap();
+			return out;
+		}
+
+		++stats.sleptWaits;
+		// Enabling the queue's interrupts also reports whether anything was used before they were on.
+		x86_64::Timer::sleepUntil([this] { return !queue.enableInterrupts(); }, TIMEOUT);
+		queue.disableInterrupts();
+
+		const bool out = queue.hasUsed();
+		reap();
+		return out;
+	}
+
+	int Block::access(Type type, uint64_t sector, void *buffer, size_t bytes) {
+		struct Result {
+			volatile bool done = false;
+			int status = 0;
+		} result;
+
+		const Completion on_complete = +[](void *data, int status) {
+			Result &result = *static_cast<Result *>(data);
+			result.status = status;
+			result.done = true;
+		};
+
+		while (!issue(type, sector, buffer, bytes, on_complete, &result))
+			if (!wait())
+				return -ETIMEDOUT;
+
+		while (!result.done)
+			if (!wait())
+				return -ETIMEDOUT;
+
+		return result.status;
+	}
+
+	int Block::flush() {
+		if (!hasFeature(BLK_F_FLUSH))
+			return 0;
+		return access(Type::Flush, 0, nullptr, 0);
+	}
+
+	int Block::discard(uint64_t sector, uint64_t count) {
+		if (!hasFeature(BLK_F_DISCARD))
+			return -EOPNOTSUPP;
+
+		// The device fails a discard bigger than its limit outright, so anything bigger is split. The ragged ends
+		// outside the alignment are left alone.
+		const uint64_t first = (sector + discardAlignment - 1) / discardAlignment * discardAlignment;
+		const uint64_t last = (sector + count) / discardAlignment * discardAlignment;
+		const uint64_t max = std::max<uint64_t>(maxDiscardSectors / discardAlignment, 1) * discardAlignment;
+		for (uint64_t piece_start = first; piece_start < last;) {
+			const uint64_t piece = std::min(last - piece_start, max);
+			if (const int status = access(Type::Discard, piece_start, nullptr, piece * BLK_SECTOR_SIZE))
+				return status;
+			piece_start += piece;
+		}
+
+		return 0;
+	}
+}
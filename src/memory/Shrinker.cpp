@@ -0,0 +1,34 @@
+#include "memory/Shrinker.h"
+
+namespace Thorn {
+	/** Registration doesn't allocate, since the list can be walked while the frame allocator has nothing left. */
+	static Shrinker *shrinkers = nullptr;
+	/** Frees made by a shrinker shouldn't need frames, but if they do, they mustn't start another round. */
+	static bool running = false;
+
+	void Shrinker::add(Shrinker &shrinker) {
+		shrinker.nextShrinker = shrinkers;
+		shrinkers = &shrinker;
+	}
+
+	void Shrinker::remove(Shrinker &shrinker) {
+		for (Shrinker **link = &shrinkers; *link; link = &(*link)->nextShrinker)
+			if (*link == &shrinker) {
+				*link = shrinker.nextShrinker;
+				shrinker.nextShrinker = nullptr;
+				return;
+			}
+	}
+
+	size_t Shrinker::run(x86_64::PageMeta &pager, size_t frames) {
+		if (running)
+			return 0;
+
+		running = true;
+		size_t freed = 0;
+		for (Shrinker *shrinker = shrinkers; shrinker && freed < frames; shrinker = shrinker->nextShrinker)
+			freed += shrinker->shrink(pager, frames - freed);
+		running = false;
+		return freed;
+	}
+}